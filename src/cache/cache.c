@@ -0,0 +1,336 @@
+#include "cache.h"
+#include "chunk/chunk.h"
+#include "object/object.h"
+#include "memory/memory.h"
+#include "vm/vm.h"
+// added for verify_function
+#include "optimizer/optimizer.h"
+// added for FILE operations
+#include <stdio.h>
+// added for getenv
+#include <stdlib.h>
+// added for strlen
+#include <string.h>
+// added for mkdir
+#include <sys/stat.h>
+// added for getpid
+#include <unistd.h>
+
+// "CLOX" in little endian, also used to detect endianness mismatch
+#define CACHE_MAGIC 0x584f4c43
+#define CACHE_PATH_MAX 4096
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef enum {
+    CACHE_NIL,
+    CACHE_FALSE,
+    CACHE_TRUE,
+    CACHE_NUMBER,
+    CACHE_STRING,
+    CACHE_FUNCTION,
+    CACHE_INT,
+} CacheTag;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    uint64_t length;
+    // fnv-1a of everything after header
+    uint64_t checksum;
+} CacheHeader;
+
+static bool cache_path(uint64_t hash, char *path);
+static bool cache_dir(char *dir);
+static bool make_dirs(char *dir);
+static uint64_t hash_source(const char *source, size_t length, CompileOptions *options);
+static uint64_t fnv_update(uint64_t hash, const void *data, size_t length);
+static bool checksum_payload(FILE *file, uint64_t *checksum);
+static bool fits(int count, size_t size, FILE *file);
+static bool write_function(FunctionObj *function, FILE *file);
+static bool write_value(Value value, FILE *file);
+static bool write_string(StringObj *string, FILE *file);
+static bool write_int(int value, FILE *file);
+static FunctionObj* read_function(FILE *file, VM *vm);
+static bool read_function_body(FunctionObj *function, FILE *file, VM *vm);
+static bool read_value(Value *value, FILE *file, VM *vm);
+static StringObj* read_string(int length, FILE *file, VM *vm);
+static bool read_int(int *value, FILE *file);
+
+FunctionObj* load_cache(const char *source, CompileOptions *options, VM *vm) {
+    size_t length = strlen(source);
+    uint64_t hash = hash_source(source, length, options);
+    char path[CACHE_PATH_MAX];
+    if (!cache_path(hash, path)) return NULL;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    // any mismatch is treated as a miss, the artifact will be overwritten after compile
+    CacheHeader header;
+    uint64_t checksum;
+    FunctionObj *function = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == CACHE_MAGIC &&
+        header.version == CLOX_BYTECODE_VERSION &&
+        header.hash == hash &&
+        header.length == length &&
+        checksum_payload(file, &checksum) && checksum == header.checksum &&
+        fseek(file, sizeof(header), SEEK_SET) == 0) {
+        function = read_function(file, vm);
+        // trailing garbage means the artifact is corrupted
+        if (function != NULL && fgetc(file) != EOF) function = NULL;
+    }
+    fclose(file);
+    // an artifact intact on disk may still be crafted, its bytecode is never run unchecked
+    if (function != NULL) {
+        push_gc(OBJ_VALUE(function), vm);
+        if (!verify_function(function, vm)) function = NULL;
+        pop_gc(vm);
+    }
+    return function;
+}
+
+void store_cache(const char *source, CompileOptions *options, FunctionObj *function) {
+    size_t length = strlen(source);
+    uint64_t hash = hash_source(source, length, options);
+    char path[CACHE_PATH_MAX];
+    if (!cache_path(hash, path)) return;
+
+    // write into a temporary file then rename, concurrent readers never see a partial artifact
+    // address of function tells apart writers running on threads of one process
+    char tmp_path[CACHE_PATH_MAX + 64];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%p.tmp", path, (long)getpid(), (void*)function);
+    FILE *file = fopen(tmp_path, "wb+");
+    if (file == NULL) return;
+
+    CacheHeader header = {
+        .magic = CACHE_MAGIC,
+        .version = CLOX_BYTECODE_VERSION,
+        .hash = hash,
+        .length = length,
+        .checksum = 0,
+    };
+    // checksum is known once payload is written, header is rewritten then
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && write_function(function, file) &&
+              fseek(file, sizeof(header), SEEK_SET) == 0 && checksum_payload(file, &header.checksum) &&
+              fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(tmp_path, path) != 0) remove(tmp_path);
+}
+
+/**
+ * cache artifact is named by hash of source, version lives in header
+ * set CLOX_NO_CACHE to disable cache
+ */
+static bool cache_path(uint64_t hash, char *path) {
+    if (getenv("CLOX_NO_CACHE") != NULL) return false;
+    char dir[CACHE_PATH_MAX];
+    if (!cache_dir(dir) || !make_dirs(dir)) return false;
+    int n = snprintf(path, CACHE_PATH_MAX, "%s/%016llx.cloxc", dir, (unsigned long long)hash);
+    return n > 0 && n < CACHE_PATH_MAX;
+}
+
+// lookup order: $CLOX_CACHE_DIR, $XDG_CACHE_HOME/clox, $HOME/.cache/clox
+static bool cache_dir(char *dir) {
+    const char *env = getenv("CLOX_CACHE_DIR");
+    int n = -1;
+    if (env != NULL && *env != '\0') n = snprintf(dir, CACHE_PATH_MAX, "%s", env);
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0') n = snprintf(dir, CACHE_PATH_MAX, "%s/clox", env);
+    else if ((env = getenv("HOME")) != NULL && *env != '\0') n = snprintf(dir, CACHE_PATH_MAX, "%s/.cache/clox", env);
+    return n > 0 && n < CACHE_PATH_MAX;
+}
+
+// mkdir -p
+static bool make_dirs(char *dir) {
+    for (char *c = dir + 1; *c != '\0'; c++) {
+        if (*c != '/') continue;
+        *c = '\0';
+        mkdir(dir, 0755);
+        *c = '/';
+    }
+    struct stat st;
+    if (mkdir(dir, 0755) != 0 && (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))) return false;
+    return true;
+}
+
+// bytecode differs between compile options, so they are part of the key
+static uint64_t hash_source(const char *source, size_t length, CompileOptions *options) {
+    uint64_t hash = fnv_update(FNV_OFFSET_BASIS, source, length);
+    uint8_t level = (uint8_t)options->optimize_level;
+    return fnv_update(hash, &level, 1);
+}
+
+static uint64_t fnv_update(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// hash of file from current position to its end
+static bool checksum_payload(FILE *file, uint64_t *checksum) {
+    uint8_t buffer[4096];
+    uint64_t hash = FNV_OFFSET_BASIS;
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) hash = fnv_update(hash, buffer, n);
+    if (ferror(file)) return false;
+    *checksum = hash;
+    return true;
+}
+
+// @param count items of @param size bytes are left in file, checked before a count read from it is allocated
+static bool fits(int count, size_t size, FILE *file) {
+    struct stat st;
+    long position = ftell(file);
+    if (count < 0 || position < 0 || fstat(fileno(file), &st) != 0) return false;
+    return (uint64_t)count * size <= (uint64_t)(st.st_size - position);
+}
+
+static bool write_function(FunctionObj *function, FILE *file) {
+    Chunk *chunk = &function->chunk;
+    if (function->name == NULL) {
+        if (!write_int(-1, file)) return false;
+    } else if (!write_string(function->name, file)) return false;
+    if (!write_int(function->arity, file) || !write_int(function->upvalue_cnt, file)) return false;
+    if (!write_int(function->capture_cnt, file)) return false;
+    if (!write_int(function->stack_size, file)) return false;
+
+    if (!write_int(chunk->count, file)) return false;
+    if (fwrite(chunk->code, sizeof(uint8_t), chunk->count, file) != (size_t)chunk->count) return false;
+    if (!write_int(chunk->line_count, file)) return false;
+    if (fwrite(chunk->lines, sizeof(LineRecord), chunk->line_count, file) != (size_t)chunk->line_count) return false;
+
+    if (!write_int(chunk->constant.count, file)) return false;
+    for (int i = 0; i < chunk->constant.count; i++) {
+        if (!write_value(chunk->constant.values[i], file)) return false;
+    }
+    return true;
+}
+
+static bool write_value(Value value, FILE *file) {
+    if (IS_NIL(value)) return fputc(CACHE_NIL, file) != EOF;
+    if (IS_BOOL(value)) return fputc(AS_BOOL(value) ? CACHE_TRUE : CACHE_FALSE, file) != EOF;
+    if (IS_INT(value)) return fputc(CACHE_INT, file) != EOF && write_int(AS_INT(value), file);
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        return fputc(CACHE_NUMBER, file) != EOF && fwrite(&number, sizeof(double), 1, file) == 1;
+    }
+    if (IS_STRING(value)) return fputc(CACHE_STRING, file) != EOF && write_string(AS_STRING(value), file);
+    if (IS_FUNCTION(value)) return fputc(CACHE_FUNCTION, file) != EOF && write_function(AS_FUNCTION(value), file);
+    // compiler never emits other constants
+    return false;
+}
+
+static bool write_string(StringObj *string, FILE *file) {
+    if (!write_int(string->length, file)) return false;
+    return fwrite(string->str, sizeof(char), string->length, file) == (size_t)string->length;
+}
+
+static bool write_int(int value, FILE *file) {
+    int32_t data = value;
+    return fwrite(&data, sizeof(int32_t), 1, file) == 1;
+}
+
+static FunctionObj* read_function(FILE *file, VM *vm) {
+    FunctionObj *function = new_function(vm);
+    // function is unreachable until it is appended into constant pool of its enclosing function
+    push_gc(OBJ_VALUE(function), vm);
+    bool ok = read_function_body(function, file, vm);
+    pop_gc(vm);
+    return ok ? function : NULL;
+}
+
+static bool read_function_body(FunctionObj *function, FILE *file, VM *vm) {
+    Chunk *chunk = &function->chunk;
+    int name_length, count;
+
+    if (!read_int(&name_length, file)) return false;
+    if (name_length >= 0 && (!fits(name_length, sizeof(char), file) || (function->name = read_string(name_length, file, vm)) == NULL)) return false;
+    if (!read_int(&function->arity, file) || function->arity < 0 || function->arity > UINT8_MAX) return false;
+    // each upvalue has a 3 bytes descriptor in enclosing chunk
+    if (!read_int(&function->upvalue_cnt, file) || !fits(function->upvalue_cnt, 3, file)) return false;
+    if (!read_int(&function->capture_cnt, file) || function->capture_cnt < 0 || function->capture_cnt > function->upvalue_cnt) return false;
+    if (!read_int(&function->stack_size, file) || function->stack_size <= function->arity) return false;
+
+    if (!read_int(&count, file) || !fits(count, sizeof(uint8_t), file)) return false;
+    chunk->code = ALLOCATE(uint8_t, count, vm);
+    chunk->capacity = count;
+    chunk->count = count;
+    if (fread(chunk->code, sizeof(uint8_t), count, file) != (size_t)count) return false;
+
+    if (!read_int(&count, file) || !fits(count, sizeof(LineRecord), file)) return false;
+    chunk->lines = ALLOCATE(LineRecord, count, vm);
+    chunk->line_capacity = count;
+    chunk->line_count = count;
+    if (fread(chunk->lines, sizeof(LineRecord), count, file) != (size_t)count) return false;
+    // restore encoder state
+    for (int i = 0; i < count; i++) {
+        chunk->last_offset += chunk->lines[i].offset;
+        chunk->last_line += chunk->lines[i].line;
+        chunk->last_column += chunk->lines[i].column;
+    }
+
+    // a constant takes one byte at least
+    if (!read_int(&count, file) || !fits(count, 1, file)) return false;
+    for (int i = 0; i < count; i++) {
+        Value value;
+        if (!read_value(&value, file, vm)) return false;
+        append_constant(chunk, value, vm);
+    }
+    return true;
+}
+
+static bool read_value(Value *value, FILE *file, VM *vm) {
+    int length;
+    switch (fgetc(file)) {
+        case CACHE_NIL: *value = NIL_VALUE; return true;
+        case CACHE_FALSE: *value = BOOL_VALUE(false); return true;
+        case CACHE_TRUE: *value = BOOL_VALUE(true); return true;
+        case CACHE_NUMBER: {
+            double number;
+            if (fread(&number, sizeof(double), 1, file) != 1) return false;
+            *value = NUMBER_VALUE(number);
+            return true;
+        }
+        case CACHE_INT: {
+            int number;
+            if (!read_int(&number, file)) return false;
+            *value = INT_VALUE(number);
+            return true;
+        }
+        case CACHE_STRING: {
+            if (!read_int(&length, file) || !fits(length, sizeof(char), file)) return false;
+            StringObj *string = read_string(length, file, vm);
+            if (string == NULL) return false;
+            *value = OBJ_VALUE(string);
+            return true;
+        }
+        case CACHE_FUNCTION: {
+            FunctionObj *function = read_function(file, vm);
+            if (function == NULL) return false;
+            *value = OBJ_VALUE(function);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static StringObj* read_string(int length, FILE *file, VM *vm) {
+    char *str = ALLOCATE(char, length + 1, vm);
+    bool ok = fread(str, sizeof(char), length, file) == (size_t)length;
+    // new_string interns a copy
+    StringObj *string = ok ? new_string(str, length, vm) : NULL;
+    FREE_ARRAY(char, str, length + 1, vm);
+    return string;
+}
+
+static bool read_int(int *value, FILE *file) {
+    int32_t data;
+    if (fread(&data, sizeof(int32_t), 1, file) != 1) return false;
+    *value = data;
+    return true;
+}
@@ -0,0 +1,12 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+#include "common.h"
+#include "value/value.h"
+#include "complier/compiler.h"
+
+// load script of @param source compiled with @param options from cache directory, returns NULL on cache miss
+FunctionObj* load_cache(const char *source, CompileOptions *options, VM *vm);
+// store script @param function compiled from @param source with @param options into cache directory
+void store_cache(const char *source, CompileOptions *options, FunctionObj *function);
+
+#endif // clox_cache_h
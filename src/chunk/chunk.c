@@ -2,41 +2,154 @@
 #include "memory/memory.h"
 #include "vm/vm.h"
 
+static void add_location(Chunk *chunk, int line, int column, VM *vm);
+static void append_record(Chunk *chunk, int offset, int line, int column, VM *vm);
+
 void init_chunk(Chunk *chunk) {
     chunk->capacity = 0;
     chunk->count = 0;
     chunk->code = NULL;
     init_value_array(&chunk->constant);
-    chunk->line_info = NULL;
-    chunk->column_info = NULL;
+    chunk->lines = NULL;
+    chunk->line_capacity = 0;
+    chunk->line_count = 0;
+    chunk->last_offset = 0;
+    chunk->last_line = 0;
+    chunk->last_column = 0;
 }
 
-void write_chunk(Chunk *chunk, uint8_t byte, int line, int column) {
+void write_chunk(Chunk *chunk, uint8_t byte, int line, int column, VM *vm) {
     if (chunk->count + 1 > chunk->capacity) {
         int new_capacity = GROW_CAPACITY(chunk->capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, new_capacity);
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, new_capacity, vm);
         chunk->capacity = new_capacity;
-        chunk->line_info = GROW_ARRAY(int, chunk->line_info, chunk->capacity, new_capacity);
-        chunk->column_info = GROW_ARRAY(int, chunk->column_info, chunk->capacity, new_capacity);
     }
+    // bytes of one instruction share location, only a change of location is recorded
+    if (chunk->line_count == 0 || line != chunk->last_line || column != chunk->last_column) add_location(chunk, line, column, vm);
     chunk->code[chunk->count] = byte;
-    chunk->line_info[chunk->count] = line;
-    chunk->column_info[chunk->count] = column;
     chunk->count++;
 }
 
-void free_chunk(Chunk *chunk) {
-    free_value_array(&chunk->constant);
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->line_info, chunk->capacity);
-    FREE_ARRAY(int, chunk->column_info, chunk->capacity);
+void free_chunk(Chunk *chunk, VM *vm) {
+    free_value_array(&chunk->constant, vm);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, vm);
+    FREE_ARRAY(LineRecord, chunk->lines, chunk->line_capacity, vm);
     init_chunk(chunk);
 }
 
-int append_constant(Chunk *chunk, Value value) {
+void truncate_chunk(Chunk *chunk, int count) {
+    if (count >= chunk->count) return;
+    chunk->count = count;
+    // drop records of removed bytes, location accumulated by remaining records is restored
+    while (chunk->line_count > 0 && chunk->last_offset >= count) {
+        LineRecord *record = &chunk->lines[--chunk->line_count];
+        chunk->last_offset -= record->offset;
+        chunk->last_line -= record->line;
+        chunk->last_column -= record->column;
+    }
+}
+
+void chunk_location(Chunk *chunk, int offset, int *line, int *column) {
+    int cur_offset = 0;
+    int cur_line = 0;
+    int cur_column = 0;
+    for (int i = 0; i < chunk->line_count; i++) {
+        LineRecord *record = &chunk->lines[i];
+        if (cur_offset + record->offset > offset) break;
+        cur_offset += record->offset;
+        cur_line += record->line;
+        cur_column += record->column;
+    }
+    *line = cur_line;
+    *column = cur_column;
+}
+
+int append_constant(Chunk *chunk, Value value, VM *vm) {
     // while append a constant may trigger reallocate constant pool
-    push_gc(value);
-    write_value_array(&chunk->constant, value);
-    pop_gc(value);
+    push_gc(value, vm);
+    write_value_array(&chunk->constant, value, vm);
+    pop_gc(vm);
     return chunk->constant.count - 1;
-}
\ No newline at end of file
+}
+
+void init_register_chunk(RegisterChunk *chunk) {
+    chunk->code = NULL;
+    chunk->origins = NULL;
+    chunk->capacity = 0;
+    chunk->count = 0;
+    chunk->register_cnt = 0;
+}
+
+void write_register_chunk(RegisterChunk *chunk, uint8_t byte, int origin, VM *vm) {
+    if (chunk->count + 1 > chunk->capacity) {
+        int new_capacity = GROW_CAPACITY(chunk->capacity);
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, new_capacity, vm);
+        chunk->origins = GROW_ARRAY(int, chunk->origins, chunk->capacity, new_capacity, vm);
+        chunk->capacity = new_capacity;
+    }
+    chunk->code[chunk->count] = byte;
+    chunk->origins[chunk->count] = origin;
+    chunk->count++;
+}
+
+void free_register_chunk(RegisterChunk *chunk, VM *vm) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, vm);
+    FREE_ARRAY(int, chunk->origins, chunk->capacity, vm);
+    init_register_chunk(chunk);
+}
+
+// generic form of a quickened instruction, other instructions are returned as is
+uint8_t generic_opcode(uint8_t instruction) {
+    switch (instruction) {
+        case CLOX_OP_ADD_NUM:            return CLOX_OP_ADD;
+        case CLOX_OP_SUBTRACT_NUM:       return CLOX_OP_SUBTRACT;
+        case CLOX_OP_MULTIPLY_NUM:       return CLOX_OP_MULTIPLY;
+        case CLOX_OP_DIVIDE_NUM:         return CLOX_OP_DIVIDE;
+        case CLOX_OP_GREATER_NUM:        return CLOX_OP_GREATER;
+        case CLOX_OP_LESS_NUM:           return CLOX_OP_LESS;
+        case CLOX_OP_JUMP_IF_FALSE_BOOL: return CLOX_OP_JUMP_IF_FALSE;
+        case CLOX_OP_ADD_INT:            return CLOX_OP_ADD;
+        case CLOX_OP_SUBTRACT_INT:       return CLOX_OP_SUBTRACT;
+        case CLOX_OP_MULTIPLY_INT:       return CLOX_OP_MULTIPLY;
+        case CLOX_OP_GREATER_INT:        return CLOX_OP_GREATER;
+        case CLOX_OP_LESS_INT:           return CLOX_OP_LESS;
+        default:                         return instruction;
+    }
+}
+
+/**
+ * encode location of byte at chunk->count
+ * offset delta is consumed first, so records splitted from a large offset keep previous location
+ */
+static void add_location(Chunk *chunk, int line, int column, VM *vm) {
+    int offset = chunk->count - chunk->last_offset;
+    int line_delta = line - chunk->last_line;
+    int column_delta = column - chunk->last_column;
+    while (offset > UINT8_MAX) {
+        append_record(chunk, UINT8_MAX, 0, 0, vm);
+        offset -= UINT8_MAX;
+    }
+    do {
+        int line_step = line_delta > INT8_MAX ? INT8_MAX : (line_delta < INT8_MIN ? INT8_MIN : line_delta);
+        int column_step = column_delta > INT8_MAX ? INT8_MAX : (column_delta < INT8_MIN ? INT8_MIN : column_delta);
+        append_record(chunk, offset, line_step, column_step, vm);
+        offset = 0;
+        line_delta -= line_step;
+        column_delta -= column_step;
+    } while (line_delta != 0 || column_delta != 0);
+}
+
+static void append_record(Chunk *chunk, int offset, int line, int column, VM *vm) {
+    if (chunk->line_count + 1 > chunk->line_capacity) {
+        int new_capacity = GROW_CAPACITY(chunk->line_capacity);
+        chunk->lines = GROW_ARRAY(LineRecord, chunk->lines, chunk->line_capacity, new_capacity, vm);
+        chunk->line_capacity = new_capacity;
+    }
+    LineRecord *record = &chunk->lines[chunk->line_count++];
+    record->offset = (uint8_t)offset;
+    record->line = (int8_t)line;
+    record->column = (int8_t)column;
+    chunk->last_offset += offset;
+    chunk->last_line += line;
+    chunk->last_column += column;
+}
@@ -3,6 +3,9 @@
 #include "common.h"
 #include "value/value.h"
 
+// bump whenever opcodes or chunk layout change, cached bytecode of other versions is discarded
+#define CLOX_BYTECODE_VERSION 14
+
 typedef enum {
     CLOX_OP_RETURN,
     CLOX_OP_CONSTANT,
@@ -38,6 +41,7 @@ typedef enum {
     CLOX_OP_JUMP,
     CLOX_OP_LOOP,
     CLOX_OP_CALL,
+    CLOX_OP_TAIL_CALL,
     CLOX_OP_CLOSURE,
     CLOX_OP_CLOSURE_16,
     CLOX_OP_GET_UPVALUE,
@@ -62,22 +66,164 @@ typedef enum {
     CLOX_OP_SUPER_INVOKE_16,
     CLOX_OP_INVOKE_SUPER,
     CLOX_OP_INVOKE_SUPER_16,
+    // list of as many elements as 1 byte operand, popped from stack
+    CLOX_OP_LIST,
+    // map of as many key and value pairs as 1 byte operand, popped from stack
+    CLOX_OP_MAP,
+    CLOX_OP_GET_INDEX,
+    CLOX_OP_SET_INDEX,
+    // 2 bytes slot of iterable, followed by iterator state and loop variable, 2 bytes backward offset
+    // stores next element into loop variable and jumps back to loop body, falls through once iterable is exhausted
+    CLOX_OP_FOR_ITER,
+    // bitwise operations on two's complement of integral numbers
+    CLOX_OP_BIT_AND,
+    CLOX_OP_BIT_OR,
+    CLOX_OP_BIT_XOR,
+    CLOX_OP_SHIFT_LEFT,
+    CLOX_OP_SHIFT_RIGHT,
+    CLOX_OP_BIT_NOT,
+    // in place updates have fixed layouts with a 2 bytes index, a signed 1 byte delta is added to the variable
+    CLOX_OP_INC_LOCAL,          // slot delta
+    CLOX_OP_ADD_LOCAL_CONST,    // slot, 2 bytes constant added to it
+    CLOX_OP_INC_UPVALUE,        // upvalue delta
+    CLOX_OP_INC_GLOBAL,         // name delta
+    // both leave a value in place of instance, which INC_PROPERTY pops, the old value or the new one
+    CLOX_OP_INC_PROPERTY,       // name delta
+    CLOX_OP_UPDATE_PROPERTY,    // name, 1 byte binary opcode applied to property and value popped from stack
+    // slot of frame below, a frame-bound closure is only ever called by frame of its enclosing function
+    CLOX_OP_GET_OUTER,
+    CLOX_OP_GET_OUTER_16,
+    CLOX_OP_SET_OUTER,
+    CLOX_OP_SET_OUTER_16,
+    CLOX_OP_INC_OUTER,          // slot delta
+    // value copied into closure
+    CLOX_OP_GET_CAPTURE,
+    CLOX_OP_GET_CAPTURE_16,
+    // invoke of `return this.m(...)` or `return super.m(...)`, a method callee reuses current frame as tail call does
+    CLOX_OP_TAIL_INVOKE,
+    CLOX_OP_TAIL_INVOKE_16,
+    CLOX_OP_TAIL_INVOKE_SUPER,
+    CLOX_OP_TAIL_INVOKE_SUPER_16,
+    // quickened forms are never emitted by compiler, vm rewrites a generic instruction in place
+    // once it observes operands of one type, and rewrites it back on a type miss
+    CLOX_OP_ADD_NUM,
+    CLOX_OP_SUBTRACT_NUM,
+    CLOX_OP_MULTIPLY_NUM,
+    CLOX_OP_DIVIDE_NUM,
+    CLOX_OP_GREATER_NUM,
+    CLOX_OP_LESS_NUM,
+    CLOX_OP_JUMP_IF_FALSE_BOOL,
+    // int forms stay on while operands and results are ints, a double number form is used otherwise
+    CLOX_OP_ADD_INT,
+    CLOX_OP_SUBTRACT_INT,
+    CLOX_OP_MULTIPLY_INT,
+    CLOX_OP_GREATER_INT,
+    CLOX_OP_LESS_INT,
 } OpCode;
 
+// kind byte of upvalue descriptors following closure instruction, each with a 2 bytes index
+typedef enum {
+    UPVALUE_ENCLOSING,  // upvalue of enclosing closure is shared
+    UPVALUE_LOCAL,      // local of enclosing frame is captured
+    UPVALUE_FRAME,      // local of enclosing frame is accessed in place by outer instructions, nothing is captured
+    // a variable never assigned is captured by value, copied into next capture of closure
+    UPVALUE_COPY_LOCAL,     // value of local of enclosing frame
+    UPVALUE_COPY_CAPTURE,   // capture of enclosing closure
+} UpvalueKind;
+
+// a record is appended only when location changes, all fields are deltas from previous record
+// deltas out of range are split into several records
+typedef struct {
+    uint8_t offset;     // bytecode offset delta
+    int8_t line;        // line delta
+    int8_t column;      // column delta
+} LineRecord;
+
 typedef struct {
     uint8_t *code;      // bytecode
     int capacity;       // size of memory allocated
     int count;          // size of memory used
     ValueArray constant;// constant pool in bytecode 
-    int *line_info;     // line info of bytecode
-    int *column_info;   // column info of bytecode
+    LineRecord *lines;  // location table of bytecode
+    int line_capacity;  // size of location table allocated
+    int line_count;     // size of location table used
+    // location accumulated by all records
+    int last_offset;
+    int last_line;
+    int last_column;
 } Chunk;
 
+/**
+ * register instructions are 3-address, operands are 1 byte
+ * a register is a frame slot, slot of a stack value is its depth in stack bytecode
+ * a source operand (RK) with REGISTER_CONSTANT bit set refers to constant pool of stack chunk
+ */
+#define REGISTER_CONSTANT 0x80
+#define REGISTER_MAX REGISTER_CONSTANT
+
+typedef enum {
+    REG_OP_MOVE,            // A RK      R[A] = RK
+    REG_OP_LOAD_CONSTANT,   // A K       R[A] = K (full constant index)
+    REG_OP_LOAD_NIL,        // A         R[A] = nil
+    REG_OP_LOAD_TRUE,       // A         R[A] = true
+    REG_OP_LOAD_FALSE,      // A         R[A] = false
+    REG_OP_GET_GLOBAL,      // A K       R[A] = globals[K]
+    REG_OP_SET_GLOBAL,      // RK K      globals[K] = RK
+    REG_OP_DEFINE_GLOBAL,   // RK K      define globals[K] = RK
+    REG_OP_NEGATE,          // A RK      R[A] = -RK
+    REG_OP_NOT,             // A RK      R[A] = !RK
+    REG_OP_ADD,             // A RK RK   R[A] = RK + RK
+    REG_OP_SUBTRACT,
+    REG_OP_MULTIPLY,
+    REG_OP_DIVIDE,
+    REG_OP_MODULO,
+    REG_OP_POWER,
+    REG_OP_EQUAL,
+    REG_OP_NOT_EQUAL,
+    REG_OP_GREATER,
+    REG_OP_GREATER_EQUAL,
+    REG_OP_LESS,
+    REG_OP_LESS_EQUAL,
+    REG_OP_BIT_AND,
+    REG_OP_BIT_OR,
+    REG_OP_BIT_XOR,
+    REG_OP_SHIFT_LEFT,
+    REG_OP_SHIFT_RIGHT,
+    REG_OP_BIT_NOT,         // A RK      R[A] = ~RK
+    REG_OP_INCREMENT,       // A D       R[A] = R[A] + D (signed byte)
+    REG_OP_PRINT,           // RK
+    REG_OP_JUMP,            // 2 bytes forward offset
+    REG_OP_LOOP,            // 2 bytes backward offset
+    REG_OP_JUMP_IF_FALSE,   // RK and 2 bytes forward offset
+    REG_OP_CALL,            // A N       R[A] = R[A](R[A + 1] ... R[A + N])
+    REG_OP_TAIL_CALL,       // A N       as call, a closure callee reuses current frame
+    REG_OP_CLOSURE,         // A K       R[A] = closure of function K without upvalues
+    REG_OP_RETURN,          // RK
+} RegisterOpCode;
+
+typedef struct RegisterChunk {
+    uint8_t *code;
+    int capacity;
+    int count;
+    int *origins;       // offset of stack instruction each byte is translated from, used to locate errors
+    int register_cnt;   // frame slots used by registers
+} RegisterChunk;
+
 void init_chunk(Chunk *chunk);
-void write_chunk(Chunk *chunk, uint8_t byte, int line, int column);
-void free_chunk(Chunk *chunk);
+void write_chunk(Chunk *chunk, uint8_t byte, int line, int column, VM *vm);
+void free_chunk(Chunk *chunk, VM *vm);
+// drop bytecode from @param count to the end
+void truncate_chunk(Chunk *chunk, int count);
+// decode location of bytecode at @param offset
+void chunk_location(Chunk *chunk, int offset, int *line, int *column);
 
 // append a constant into chunk, returns its index of constant pool
-int append_constant(Chunk *chunk, Value value);
+int append_constant(Chunk *chunk, Value value, VM *vm);
+
+void init_register_chunk(RegisterChunk *chunk);
+// @param origin is offset of stack instruction @param byte belongs to
+void write_register_chunk(RegisterChunk *chunk, uint8_t byte, int origin, VM *vm);
+void free_register_chunk(RegisterChunk *chunk, VM *vm);
+uint8_t generic_opcode(uint8_t instruction);
 
 #endif  // clox_chunk_h
\ No newline at end of file
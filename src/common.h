@@ -12,4 +12,7 @@
 
 #define NAN_BOXING                     // this macro will enable NaN-boxing
 
+// state of an interpreter instance, apis touching heap, stack or globals take the one they work on
+typedef struct VM VM;
+
 #endif // clox_common_h
\ No newline at end of file
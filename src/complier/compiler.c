@@ -3,6 +3,8 @@
 #include "chunk/chunk.h"
 #include "object/object.h"
 #include "memory/memory.h"
+#include "optimizer/optimizer.h"
+#include "vm/vm.h"
 #ifdef CLOX_DEBUG_DISASSEMBLE
 #include "disassemble/disassemble.h"
 #endif // CLOX_DEBUG_DISASSEMBLE
@@ -14,6 +16,8 @@
 #include <string.h>
 // added for strtod
 #include <stdlib.h>
+// added for constant folding
+#include <math.h>
 
 typedef enum {
     TYPE_SCRIPT,
@@ -30,9 +34,13 @@ typedef enum {
     PREC_AND,         // and
     PREC_EQUALITY,    // == !=
     PREC_COMPARISON,  // < > <= >=
+    PREC_BIT_OR,      // |
+    PREC_BIT_XOR,     // ^
+    PREC_BIT_AND,     // &
+    PREC_SHIFT,       // << >>
     PREC_TERM,        // + -
     PREC_FACTOR,      // * / %
-    PREC_UNARY,       // ! -
+    PREC_UNARY,       // ! - ~
     PREC_EXPONENT,    // **
     PREC_CALL,        // . ()
     PREC_PRIMARY      // literal
@@ -51,13 +59,44 @@ typedef struct {
     Token name;
     int depth;
     bool captured;
+    // holds a frame-bound function
+    bool frame_bound;
 } Local;
 
 typedef struct {
-    uint16_t idx;
-    bool is_local;
+    uint16_t idx;   // slot or index into upvalues or captures of enclosing closure, by kind
+    uint8_t kind;
+    int index;      // index into captures of closure for a copied value, into upvalues otherwise
 } UpValue;
 
+typedef struct {
+    uint64_t key;
+    Value value;
+    int idx;        // -1 for empty entry
+} ConstantEntry;
+
+// map from constant to its index in constant pool, used to deduplicate constants of a chunk
+typedef struct {
+    ConstantEntry *entries;
+    int count;
+    int capacity;
+} ConstantMap;
+
+// a constant load at the end of chunk, candidate operand of constant folding
+typedef struct {
+    int offset;     // start of load instruction, -1 for none
+    int end;        // end of load instruction
+    Value value;
+} ConstantLoad;
+
+// an in place update with loads around it, which produce value of the expression
+typedef struct {
+    int start;      // start of whole expression
+    int offset;     // start of update instruction
+    int length;     // length of update instruction
+    int end;        // end of whole expression, -1 for none
+} InPlaceUpdate;
+
 typedef struct Resolver {
     struct Resolver *enclose;
 
@@ -69,16 +108,82 @@ typedef struct Resolver {
     UpValue *upvalues;
     int upvalues_capacity;
 
+    ConstantMap constants;
+
+    // trailing constant load
+    ConstantLoad last_constant;
+    // trailing arithmetic instruction, its result must be a number
+    int number_offset;
+    int number_end;
+    // greatest offset a jump has been patched to, folding never crosses it
+    int jump_target;
+    // start and end of trailing call or invoke instruction, a return right after it makes a tail call
+    int call_start;
+    int call_end;
+    // end of trailing load of a frame-bound function, a call of it never reuses frame of caller
+    int bound_load_end;
+    // trailing in place update, a statement discarding its value keeps the update alone
+    InPlaceUpdate last_update;
+
     FunctionObj *function;
     FunctionType type;
+    // only ever called by frame of enclosing function, whose locals it accesses in place
+    bool frame_bound;
 } Resolver;
 
+// a name declared in source, scope facts of it are found by one pass over all tokens before compiling
+typedef struct {
+    const char *name;   // lexeme in source, a local finds its declaration by address of its name token
+    int length;
+    int braces;         // brace depth of its scope, which ends at a brace closing below it
+    int functions;      // function bodies around it
+    int shadowed;       // declaration open before it in same hash bucket, -1 for none
+    bool function;      // declared by fun
+    // referenced other than as callee of a direct call by its declaring function, or declared again in its scope
+    bool escapes;
+    // followed by an assignment operator where it is referenced
+    bool assigned;
+} Declaration;
+
+typedef struct {
+    Declaration *entries;   // in source order
+    int count;
+    int capacity;
+    // bounds of source names of declarations lie in
+    const char *source;
+    const char *source_end;
+} Declarations;
+
+// state of the pass finding declarations, open declarations are chained by hash of name
+typedef struct {
+    int *open;          // declarations in scope, innermost last
+    int open_cnt;
+    int open_capacity;
+    int *buckets;       // innermost open declaration of each bucket, -1 for none
+    int bucket_cnt;
+    uint8_t *braces;    // kind of each open brace
+    int brace_cnt;
+    int brace_capacity;
+    int functions;      // function bodies open
+} DeclarationPass;
+
 typedef struct ClassResolver {
     struct ClassResolver *enclose;
     bool has_super;
 } ClassResolver;
 
-typedef void (*parser_func)(bool);
+struct Compiler {
+    Parser *parser;
+    // innermost function being compiled, resolvers of enclosing functions are chained from it
+    Resolver *resolver;
+    ClassResolver *class_resolver;
+    CompileOptions *options;
+    Declarations declarations;
+    // objects created while compiling belong to it
+    VM *vm;
+};
+
+typedef void (*parser_func)(bool, Compiler*);
 
 typedef struct {
     parser_func prefix;
@@ -86,90 +191,121 @@ typedef struct {
     Precedence precedence;
 } ParserRule;
 
-// there is only one parser in the whole program
-Parser *parser;
-// however, there may be multiple resolvers
-Resolver *current_resolver = NULL;
-ClassResolver *current_class = NULL;
-
-static void init_parser(const char *source);
-static void free_parser(); 
-static void init_resolver(FunctionType type);
-static FunctionObj* free_resolver();
-static Chunk* current_chunk();
-static void advance();
-static bool match (TokenType type);
-static void consume(TokenType type, const char *message);
-static bool check(TokenType type);
-static void parse_precedence(Precedence precedence);
-static void declarations();
-static void var_declaration();
-static void local_declaration();
-static void global_declaration();
-static void declare_local();
+static void find_declarations(Compiler *compiler);
+static void declare_name(Token *name, bool function, int braces, int functions, DeclarationPass *pass, Compiler *compiler);
+static void close_declarations(int braces, DeclarationPass *pass, Compiler *compiler);
+static int open_declaration(Token *name, DeclarationPass *pass, Compiler *compiler);
+static void rehash_declarations(DeclarationPass *pass, Compiler *compiler);
+static uint32_t hash_name(Token *name);
+static Declaration* find_declaration(Token *name, Compiler *compiler);
+static void init_parser(const char *source, Compiler *compiler);
+static void free_parser(Compiler *compiler); 
+static void init_resolver(FunctionType type, Compiler *compiler);
+static FunctionObj* free_resolver(Compiler *compiler);
+static Chunk* current_chunk(Compiler *compiler);
+static void advance(Compiler *compiler);
+static bool match (TokenType type, Compiler *compiler);
+static void consume(TokenType type, const char *message, Compiler *compiler);
+static bool check(TokenType type, Compiler *compiler);
+static void parse_precedence(Precedence precedence, Compiler *compiler);
+static void declarations(Compiler *compiler);
+static void var_declaration(Compiler *compiler);
+static void local_declaration(Compiler *compiler);
+static void global_declaration(Compiler *compiler);
+static void declare_local(Compiler *compiler);
 static bool token_equal(Token *a, Token *b);
-static void add_local(Token *identifier);
-static uint16_t declare_global();
-static void variable_initializer();
-static void define_local();
-static void define_global(uint16_t idx);
-static void function_declaration();
-static void function();
-static void class_declaration();
-static void method();
-static void statement();
-static void print_statement();
-static void block();
-static void begin_scope();
-static void end_scope();
-static void if_statement();
-static void while_statement();
-static void for_statement();
-static void return_statement();
-static void expression_statement();
-static void expression();
-static void variable(bool assign);
-static void named_variable(Token *variable, bool assign);
-static int resolve_local(Token *token, Resolver *resolver);
-static int resolve_upvalue(Token *token, Resolver *resolver);
-static int add_upvalue(int local, bool is_local, Resolver *resolver);
-static void grouping(bool assign);
-static void call(bool assign);
-static void dot(bool assign);
-static uint8_t argument_list();
-static void number(bool assign);
-static void unary(bool assign);
-static void binary(bool assign);
-static void literal(bool assign);
-static void string(bool assign);
-static void and(bool assign);
-static void or(bool assign);
-static void xor(bool assign);
-static void this(bool assign);
-static void super(bool assign);
-static void emit_byte(uint8_t byte);
-static void emit_bytes(int cnt, ...);
-static void emit_nil_return();
-static void emit_return();
-static void emit_constant(Value value);
-static uint16_t make_constant(Value value);
-static uint16_t identifier_constant(Token* identifier);
-static int emit_jump(uint8_t instruction);
-static void emit_loop(int start);
-static void patch_jump(int offset);
-static void error_report(Token *token, const char *message);
-static void synchronize();
+static void add_local(Token *identifier, Compiler *compiler);
+static uint16_t declare_global(Compiler *compiler);
+static void variable_initializer(Compiler *compiler);
+static void define_local(Compiler *compiler);
+static void define_global(uint16_t idx, Compiler *compiler);
+static void function_declaration(Compiler *compiler);
+static void function(FunctionType type, bool frame_bound, Compiler *compiler);
+static void class_declaration(Compiler *compiler);
+static void method(Compiler *compiler);
+static void statement(Compiler *compiler);
+static void print_statement(Compiler *compiler);
+static void block(Compiler *compiler);
+static void begin_scope(Compiler *compiler);
+static void end_scope(Compiler *compiler);
+static void if_statement(Compiler *compiler);
+static void while_statement(Compiler *compiler);
+static void for_statement(Compiler *compiler);
+static bool for_in_ahead(Compiler *compiler);
+static void for_in_statement(Compiler *compiler);
+static void return_statement(Compiler *compiler);
+static void tail_call(uint8_t *code);
+static void expression_statement(Compiler *compiler);
+static void emit_discard(Compiler *compiler);
+static void expression(Compiler *compiler);
+static void variable(bool assign, Compiler *compiler);
+static void named_variable(Token *variable, bool assign, Compiler *compiler);
+static bool match_update(Compiler *compiler);
+static bool is_assignment(TokenType type);
+static bool immutable_local(Local *local, Compiler *compiler);
+static uint8_t update_operator(TokenType type);
+static void variable_update(uint8_t get, int idx, Compiler *compiler);
+static void property_update(uint16_t idx, Compiler *compiler);
+static void emit_variable(uint8_t instruction, int idx, Compiler *compiler);
+static int resolve_local(Token *token, Resolver *resolver, Compiler *compiler);
+static int resolve_outer(Token *token, Resolver *resolver, Compiler *compiler);
+static int resolve_upvalue(Token *token, Resolver *resolver, Compiler *compiler);
+static int add_upvalue(int local, uint8_t kind, Resolver *resolver, Compiler *compiler);
+static bool copied(UpValue *upvalue);
+static void grouping(bool assign, Compiler *compiler);
+static void call(bool assign, Compiler *compiler);
+static void dot(bool assign, Compiler *compiler);
+static uint8_t argument_list(Compiler *compiler);
+static void list(bool assign, Compiler *compiler);
+static void map(bool assign, Compiler *compiler);
+static void subscript(bool assign, Compiler *compiler);
+static void number(bool assign, Compiler *compiler);
+static void unary(bool assign, Compiler *compiler);
+static void binary(bool assign, Compiler *compiler);
+static void literal(bool assign, Compiler *compiler);
+static void string(bool assign, Compiler *compiler);
+static void and(bool assign, Compiler *compiler);
+static void or(bool assign, Compiler *compiler);
+static void xor(bool assign, Compiler *compiler);
+static void this(bool assign, Compiler *compiler);
+static void super(bool assign, Compiler *compiler);
+static void emit_byte(uint8_t byte, Compiler *compiler);
+static void emit_bytes(Compiler *compiler, int cnt, ...);
+static void emit_nil_return(Compiler *compiler);
+static void emit_return(Compiler *compiler);
+static void emit_constant(Value value, Compiler *compiler);
+static void emit_number_op(uint8_t instruction, Compiler *compiler);
+static bool trailing_constant(ConstantLoad *load, Compiler *compiler);
+static bool trailing_number(Compiler *compiler);
+static bool fold_binary(TokenType type, Value a, Value b, Value *rst, Compiler *compiler);
+static bool fold_identity(TokenType type, Value b);
+static uint16_t make_constant(Value value, Compiler *compiler);
+static uint16_t identifier_constant(Token* identifier, Compiler *compiler);
+static bool constant_key(Value value, uint64_t *key);
+static ConstantEntry* find_constant(ConstantEntry *entries, int capacity, uint64_t key, Value value);
+static void add_constant(uint64_t key, Value value, int idx, Compiler *compiler);
+static int emit_jump(uint8_t instruction, Compiler *compiler);
+static void emit_loop(int start, Compiler *compiler);
+static void patch_jump(int offset, Compiler *compiler);
+static void error_report(Token *token, const char *message, Compiler *compiler);
+static void synchronize(Compiler *compiler);
 
 const Token THIS_TOKEN = {.lexeme = "this", .length = 4};
 const Token SUPER_TOKEN = {.lexeme = "super", .length = 5};
+// hidden locals of for-in loop, no identifier can refer to them
+const Token ITERABLE_TOKEN = {.lexeme = "(iterable)", .length = 10};
+const Token ITERATOR_TOKEN = {.lexeme = "(iterator)", .length = 10};
 
 ParserRule rules[] = {
     [CLOX_TOKEN_ERROR]         = { NULL,     NULL,    PREC_NONE },
     [CLOX_TOKEN_LEFT_PAREN]    = { grouping, call,    PREC_CALL },
     [CLOX_TOKEN_RIGHT_PAREN]   = { NULL,     NULL,    PREC_NONE },
-    [CLOX_TOKEN_LEFT_BRACE]    = { NULL,     NULL,    PREC_NONE },
+    [CLOX_TOKEN_LEFT_BRACE]    = { map,      NULL,    PREC_NONE },
     [CLOX_TOKEN_RIGHT_BRACE]   = { NULL,     NULL,    PREC_NONE },
+    [CLOX_TOKEN_LEFT_BRACKET]  = { list,     subscript, PREC_CALL },
+    [CLOX_TOKEN_RIGHT_BRACKET] = { NULL,     NULL,    PREC_NONE },
     [CLOX_TOKEN_COMMA]         = { NULL,     NULL,    PREC_NONE },
+    [CLOX_TOKEN_COLON]         = { NULL,     NULL,    PREC_NONE },
     [CLOX_TOKEN_DOT]           = { NULL,     dot,     PREC_CALL },
     [CLOX_TOKEN_MINUS]         = { unary,    binary,  PREC_TERM },
     [CLOX_TOKEN_PLUS]          = { NULL,     binary,  PREC_TERM },
@@ -214,56 +350,255 @@ ParserRule rules[] = {
     [CLOX_TOKEN_SLASH_EQUAL]   = { NULL,     NULL,    PREC_NONE },
     [CLOX_TOKEN_PERCENT_EQUAL] = { NULL,     NULL,    PREC_NONE },
     [CLOX_TOKEN_XOR]           = { NULL,     xor,     PREC_XOR },
+    [CLOX_TOKEN_AMPERSAND]     = { NULL,     binary,  PREC_BIT_AND },
+    [CLOX_TOKEN_PIPE]          = { NULL,     binary,  PREC_BIT_OR },
+    [CLOX_TOKEN_CARET]         = { NULL,     binary,  PREC_BIT_XOR },
+    [CLOX_TOKEN_TILDE]         = { unary,    NULL,    PREC_NONE },
+    [CLOX_TOKEN_LESS_LESS]     = { NULL,     binary,  PREC_SHIFT },
+    [CLOX_TOKEN_GREATER_GREATER] = { NULL,   binary,  PREC_SHIFT },
 };
 
-FunctionObj* compile(const char *source) {
-    init_parser(source);
-    init_resolver(TYPE_SCRIPT);
-
-    advance();
-    while (!match(CLOX_TOKEN_EOF)) {
-        declarations();
+FunctionObj* compile(const char *source, CompileOptions *options, VM *vm) {
+    Compiler state = { .parser = NULL, .resolver = NULL, .class_resolver = NULL, .options = options, .vm = vm };
+    Compiler *compiler = &state;
+    vm->compiler = compiler;
+    init_parser(source, compiler);
+    find_declarations(compiler);
+    init_resolver(TYPE_SCRIPT, compiler);
+
+    advance(compiler);
+    while (!match(CLOX_TOKEN_EOF, compiler)) {
+        declarations(compiler);
     }
     
-    FunctionObj *rst = free_resolver(); 
-    free_parser();
+    FunctionObj *rst = free_resolver(compiler); 
+    free_parser(compiler);
+    FREE_ARRAY(Declaration, compiler->declarations.entries, compiler->declarations.capacity, vm);
+    vm->compiler = NULL;
     return rst;
 }
 
-void mark_compiler_roots() {
-    Resolver *resolver = current_resolver;
+void mark_compiler_roots(VM *vm) {
+    if (vm->compiler == NULL) return;
+    Resolver *resolver = vm->compiler->resolver;
     // functions are roots
     while (resolver != NULL) {
-        mark_obj((Obj*)resolver->function);
+        mark_obj((Obj*)resolver->function, vm);
         resolver = resolver->enclose;
     }
 }
 
-static void init_parser(const char *source) {
-    parser = ALLOCATE(Parser, 1);
+/**
+ * one pass over tokens of whole source records every declaration with the facts compiler needs ahead of
+ * code that follows it, names resolve to innermost open declaration of same name as compiler resolves them
+ * a brace opens a block, a class body, or a function body after fun or a method name
+ */
+static void find_declarations(Compiler *compiler) {
+    enum { BRACE_BLOCK, BRACE_FUNCTION, BRACE_CLASS };
+    DeclarationPass pass = { .open = NULL, .open_cnt = 0, .open_capacity = 0, .braces = NULL, .brace_cnt = 0, .brace_capacity = 0, .functions = 0 };
+    pass.bucket_cnt = 64;
+    pass.buckets = ALLOCATE(int, pass.bucket_cnt, compiler->vm);
+    for (int i = 0; i < pass.bucket_cnt; i++) pass.buckets[i] = -1;
+    Scanner scanner = *compiler->parser->scanner;
+    compiler->declarations.source = scanner.start;
+    compiler->declarations.source_end = scanner.start + strlen(scanner.start);
+    Declaration *entries;
+    bool function_ahead = false;
+    bool class_ahead = false;
+    bool params = false;
+    // declaration named by previous token, what it is used for depends on token after it
+    int referenced = -1;
+    // identifier right after 'for (' declares loop variable if 'in' follows
+    Token variable;
+    bool variable_ahead = false;
+    TokenType last = CLOX_TOKEN_EOF;
+    for (;;) {
+        Token *token = scan_token(&scanner);
+        TokenType type = token->type;
+        entries = compiler->declarations.entries;
+        if (referenced != -1 && type != CLOX_TOKEN_LEFT_PAREN) entries[referenced].escapes = true;
+        if (referenced != -1 && is_assignment(type)) entries[referenced].assigned = true;
+        referenced = -1;
+        bool class_body = pass.brace_cnt > 0 && pass.braces[pass.brace_cnt - 1] == BRACE_CLASS;
+        switch (type) {
+            case CLOX_TOKEN_FUN: function_ahead = true; break;
+            case CLOX_TOKEN_CLASS: class_ahead = true; break;
+            case CLOX_TOKEN_LEFT_PAREN:
+                // parameter list follows fun and its name, or a method name right in class body
+                if (function_ahead || class_body) params = function_ahead = true;
+                break;
+            case CLOX_TOKEN_RIGHT_PAREN: params = false; break;
+            case CLOX_TOKEN_LEFT_BRACE:
+                if (pass.brace_cnt + 1 > pass.brace_capacity) {
+                    int capacity = pass.brace_capacity;
+                    pass.brace_capacity = GROW_CAPACITY(capacity);
+                    pass.braces = GROW_ARRAY(uint8_t, pass.braces, capacity, pass.brace_capacity, compiler->vm);
+                }
+                if (function_ahead) {
+                    pass.braces[pass.brace_cnt++] = BRACE_FUNCTION;
+                    pass.functions++;
+                } else pass.braces[pass.brace_cnt++] = class_ahead ? BRACE_CLASS : BRACE_BLOCK;
+                function_ahead = class_ahead = false;
+                break;
+            case CLOX_TOKEN_RIGHT_BRACE:
+                if (pass.brace_cnt == 0) break;
+                if (pass.braces[--pass.brace_cnt] == BRACE_FUNCTION) pass.functions--;
+                close_declarations(pass.brace_cnt, &pass, compiler);
+                break;
+            case CLOX_TOKEN_IDENTIFIER:
+                if (last == CLOX_TOKEN_DOT) break;
+                if (params) declare_name(token, false, pass.brace_cnt + 1, pass.functions + 1, &pass, compiler);
+                else if (last == CLOX_TOKEN_VAR || last == CLOX_TOKEN_FUN || last == CLOX_TOKEN_CLASS) {
+                    declare_name(token, last == CLOX_TOKEN_FUN, pass.brace_cnt, pass.functions, &pass, compiler);
+                } else if (variable_ahead && token->length == 2 && memcmp(token->lexeme, "in", 2) == 0) {
+                    declare_name(&variable, false, pass.brace_cnt, pass.functions, &pass, compiler);
+                } else if (!class_body) {
+                    // a name right in class body names a method
+                    referenced = open_declaration(token, &pass, compiler);
+                    entries = compiler->declarations.entries;
+                    // a function referenced from a function nested in its declaring one may run above another frame
+                    if (referenced != -1 && entries[referenced].function && pass.functions > entries[referenced].functions) entries[referenced].escapes = true;
+                }
+                break;
+            default: break;
+        }
+        variable_ahead = type == CLOX_TOKEN_IDENTIFIER && last == CLOX_TOKEN_LEFT_PAREN && variable_ahead;
+        if (type == CLOX_TOKEN_LEFT_PAREN && last == CLOX_TOKEN_FOR) variable_ahead = true;
+        if (variable_ahead && type == CLOX_TOKEN_IDENTIFIER) variable = *token;
+        last = type;
+        FREE(Token, token, compiler->vm);
+        if (type == CLOX_TOKEN_EOF) break;
+    }
+    FREE_ARRAY(int, pass.open, pass.open_capacity, compiler->vm);
+    FREE_ARRAY(int, pass.buckets, pass.bucket_cnt, compiler->vm);
+    FREE_ARRAY(uint8_t, pass.braces, pass.brace_capacity, compiler->vm);
+}
+
+static void declare_name(Token *name, bool function, int braces, int functions, DeclarationPass *pass, Compiler *compiler) {
+    Declarations *declarations = &compiler->declarations;
+    // compiler may resolve a reference to either of two declarations of same name in scope
+    int shadowed = open_declaration(name, pass, compiler);
+    if (shadowed != -1) declarations->entries[shadowed].escapes = true;
+
+    if (declarations->count + 1 > declarations->capacity) {
+        int capacity = declarations->capacity;
+        declarations->capacity = GROW_CAPACITY(capacity);
+        declarations->entries = GROW_ARRAY(Declaration, declarations->entries, capacity, declarations->capacity, compiler->vm);
+    }
+    if (pass->open_cnt + 1 > pass->open_capacity) {
+        int capacity = pass->open_capacity;
+        pass->open_capacity = GROW_CAPACITY(capacity);
+        pass->open = GROW_ARRAY(int, pass->open, capacity, pass->open_capacity, compiler->vm);
+    }
+    if (pass->open_cnt + 1 > pass->bucket_cnt) rehash_declarations(pass, compiler);
+
+    int idx = declarations->count++;
+    Declaration *declaration = &declarations->entries[idx];
+    declaration->name = name->lexeme;
+    declaration->length = name->length;
+    declaration->braces = braces;
+    declaration->functions = functions;
+    declaration->function = function;
+    declaration->escapes = false;
+    declaration->assigned = false;
+    int *bucket = &pass->buckets[hash_name(name) & (pass->bucket_cnt - 1)];
+    declaration->shadowed = *bucket;
+    *bucket = idx;
+    pass->open[pass->open_cnt++] = idx;
+}
+
+/**
+ * declarations whose scope ends at a brace closing down to @param braces, innermost one heads its bucket
+ * scope of a for loop variable lasts to end of enclosing block here, so an assignment to the name may
+ * belong to declaration it shadows as well
+ */
+static void close_declarations(int braces, DeclarationPass *pass, Compiler *compiler) {
+    Declaration *entries = compiler->declarations.entries;
+    while (pass->open_cnt > 0 && entries[pass->open[pass->open_cnt - 1]].braces > braces) {
+        Declaration *declaration = &entries[pass->open[--pass->open_cnt]];
+        Token name = { .lexeme = declaration->name, .length = declaration->length };
+        pass->buckets[hash_name(&name) & (pass->bucket_cnt - 1)] = declaration->shadowed;
+        int shadowed = open_declaration(&name, pass, compiler);
+        if (declaration->assigned && shadowed != -1) entries[shadowed].assigned = true;
+    }
+}
+
+// innermost open declaration of @param name, -1 for none
+static int open_declaration(Token *name, DeclarationPass *pass, Compiler *compiler) {
+    Declaration *entries = compiler->declarations.entries;
+    int idx = pass->buckets[hash_name(name) & (pass->bucket_cnt - 1)];
+    while (idx != -1 && (entries[idx].length != name->length || memcmp(entries[idx].name, name->lexeme, name->length) != 0)) idx = entries[idx].shadowed;
+    return idx;
+}
+
+// buckets double as declarations open at once outnumber them, chains are rebuilt in declaration order
+static void rehash_declarations(DeclarationPass *pass, Compiler *compiler) {
+    Declaration *entries = compiler->declarations.entries;
+    FREE_ARRAY(int, pass->buckets, pass->bucket_cnt, compiler->vm);
+    pass->bucket_cnt *= 2;
+    pass->buckets = ALLOCATE(int, pass->bucket_cnt, compiler->vm);
+    for (int i = 0; i < pass->bucket_cnt; i++) pass->buckets[i] = -1;
+    for (int i = 0; i < pass->open_cnt; i++) {
+        Declaration *declaration = &entries[pass->open[i]];
+        Token name = { .lexeme = declaration->name, .length = declaration->length };
+        int *bucket = &pass->buckets[hash_name(&name) & (pass->bucket_cnt - 1)];
+        declaration->shadowed = *bucket;
+        *bucket = pass->open[i];
+    }
+}
+
+// fnv-1a
+static uint32_t hash_name(Token *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name->length; i++) {
+        hash ^= (uint8_t)name->lexeme[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// declaration @param name token of a local comes from, NULL for a name compiler makes up
+static Declaration* find_declaration(Token *name, Compiler *compiler) {
+    Declarations *declarations = &compiler->declarations;
+    int low = 0;
+    int high = declarations->count - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        uintptr_t at = (uintptr_t)declarations->entries[mid].name;
+        if (at == (uintptr_t)name->lexeme) return &declarations->entries[mid];
+        if (at < (uintptr_t)name->lexeme) low = mid + 1;
+        else high = mid - 1;
+    }
+    return NULL;
+}
+
+static void init_parser(const char *source, Compiler *compiler) {
+    Parser *parser = ALLOCATE(Parser, 1, compiler->vm);
     parser->previous = NULL;
     parser->current = NULL;
     parser->had_error = false;
     parser->panic_mode = false;
-    parser->scanner = init_scanner(source);
+    parser->scanner = init_scanner(source, compiler->vm);
+    compiler->parser = parser;
 }
 
-static void free_parser() {
-    FREE(Token, parser->previous);
-    FREE(Token, parser->current);
-    free_scanner(parser->scanner);
-    parser->scanner = NULL;
-    FREE(Parser, parser);
+static void free_parser(Compiler *compiler) {
+    FREE(Token, compiler->parser->previous, compiler->vm);
+    FREE(Token, compiler->parser->current, compiler->vm);
+    free_scanner(compiler->parser->scanner);
+    compiler->parser->scanner = NULL;
+    FREE(Parser, compiler->parser, compiler->vm);
+    compiler->parser = NULL;
 }
 
-static void init_resolver(FunctionType type) {
-    Resolver *resolver = ALLOCATE(Resolver, 1); 
+static void init_resolver(FunctionType type, Compiler *compiler) {
+    Resolver *resolver = ALLOCATE(Resolver, 1, compiler->vm); 
 
     resolver->scope_depth = 0;
 
     // first local is reserved for implicit function (self)
     resolver->local_capacity = GROW_CAPACITY(0);
-    resolver->locals = GROW_ARRAY(Local, NULL, 0, resolver->local_capacity);
+    resolver->locals = GROW_ARRAY(Local, NULL, 0, resolver->local_capacity, compiler->vm);
     resolver->local_cnt = 0;
     Local *local = &resolver->locals[resolver->local_cnt++];
     local->depth = 0;
@@ -277,122 +612,143 @@ static void init_resolver(FunctionType type) {
     }
     // slot 0 is reserved for implicit function (self) => not captured 
     local->captured = false;
+    local->frame_bound = false;
 
     resolver->upvalues = NULL;
     resolver->upvalues_capacity = 0;
 
-    resolver->function = new_function();
+    resolver->constants.entries = NULL;
+    resolver->constants.count = 0;
+    resolver->constants.capacity = 0;
+
+    resolver->last_constant.offset = -1;
+    resolver->number_offset = -1;
+    resolver->number_end = -1;
+    resolver->jump_target = 0;
+    resolver->call_start = -1;
+    resolver->call_end = -1;
+    resolver->bound_load_end = -1;
+    resolver->last_update.end = -1;
+
+    resolver->function = new_function(compiler->vm);
     // overwrite current resovler before new a function name
-    resolver->enclose = current_resolver;
-    current_resolver = resolver;
+    resolver->enclose = compiler->resolver;
+    compiler->resolver = resolver;
 
     if (type != TYPE_SCRIPT) {
         // function name
-        resolver->function->name = new_string(parser->previous->lexeme, parser->previous->length);
+        resolver->function->name = new_string(compiler->parser->previous->lexeme, compiler->parser->previous->length, compiler->vm);
     }
     resolver->type = type;
+    resolver->frame_bound = false;
 }
 
-static FunctionObj* free_resolver() {
-    emit_nil_return();
+static FunctionObj* free_resolver(Compiler *compiler) {
+    emit_nil_return(compiler);
     
-    Resolver *resolver = current_resolver;
-    current_resolver = current_resolver->enclose;
-
+    Resolver *resolver = compiler->resolver;
     FunctionObj *function = resolver->function;
+    bool error = compiler->parser->had_error;
+
+    // function is still reachable from current resolver during optimization
+    if (!error) {
+        optimize_function(function, compiler->options->optimize_level, compiler->vm);
+        function->stack_size = stack_size(function, compiler->vm);
+    }
+    compiler->resolver = compiler->resolver->enclose;
 
-    bool error = parser->had_error;
 #ifdef  CLOX_DEBUG_DISASSEMBLE 
     if (!error) disassemble_chunk(&function->chunk, function->name == NULL ? "clox script" : function->name->str);
 #endif  // CLOX_DEBUG_DISASSEMBLE
 
     // resolve upvalues
-    if (current_resolver != NULL) {
+    if (compiler->resolver != NULL) {
         // emit closure instruction
-        uint16_t idx = make_constant(OBJ_VALUE(function));
-        if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_CLOSURE_16, idx & 0xff, idx >> 8);
-        else emit_bytes(2, CLOX_OP_CLOSURE, idx);
+        uint16_t idx = make_constant(OBJ_VALUE(function), compiler);
+        if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_CLOSURE_16, idx & 0xff, idx >> 8);
+        else emit_bytes(compiler, 2, CLOX_OP_CLOSURE, idx);
 
         for (int i = 0; i < function->upvalue_cnt; i++) {
-            emit_byte(resolver->upvalues[i].is_local ? 1 : 0);
-            emit_bytes(2, resolver->upvalues[i].idx & 0xff, resolver->upvalues[i].idx >> 8);
+            emit_byte(resolver->upvalues[i].kind, compiler);
+            emit_bytes(compiler, 2, resolver->upvalues[i].idx & 0xff, resolver->upvalues[i].idx >> 8);
         }
     }
 
-    FREE(UpValue, resolver->upvalues);
-    FREE(Local, resolver->locals);
-    FREE(Resolver, resolver);
+    FREE_ARRAY(ConstantEntry, resolver->constants.entries, resolver->constants.capacity, compiler->vm);
+    FREE(UpValue, resolver->upvalues, compiler->vm);
+    FREE(Local, resolver->locals, compiler->vm);
+    FREE(Resolver, resolver, compiler->vm);
     return error ? NULL : function;
 }
 
-static Chunk* current_chunk() {
-    return &current_resolver->function->chunk;
+static Chunk* current_chunk(Compiler *compiler) {
+    return &compiler->resolver->function->chunk;
 }
 
-static void advance() {
-    FREE(Token, parser->previous);
-    parser->previous = parser->current;
+static void advance(Compiler *compiler) {
+    FREE(Token, compiler->parser->previous, compiler->vm);
+    compiler->parser->previous = compiler->parser->current;
     for (;;) {
-        parser->current = scan_token(parser->scanner);
-        if (!check(CLOX_TOKEN_ERROR)) break;
-        error_report(parser->current, parser->current->lexeme);
-        FREE(Token, parser->current);
+        compiler->parser->current = scan_token(compiler->parser->scanner);
+        if (!check(CLOX_TOKEN_ERROR, compiler)) break;
+        error_report(compiler->parser->current, compiler->parser->current->lexeme, compiler);
+        FREE(Token, compiler->parser->current, compiler->vm);
     }
 }
 
 // check current token type
-static bool match(TokenType type) {
-    if (check(type)) {
-        advance();
+static bool match(TokenType type, Compiler *compiler) {
+    if (check(type, compiler)) {
+        advance(compiler);
         return true;
     }
     return false;
 }
 
-static void consume(TokenType type, const char *message) {
-    if (!match(type)) error_report(parser->current, message); 
+static void consume(TokenType type, const char *message, Compiler *compiler) {
+    if (!match(type, compiler)) error_report(compiler->parser->current, message, compiler); 
 }
 
-static bool check(TokenType type) {
-    return parser->current->type == type;
+static bool check(TokenType type, Compiler *compiler) {
+    return compiler->parser->current->type == type;
 }
 
-static void declarations() {
-    if (match(CLOX_TOKEN_VAR)) var_declaration();
-    else if(match(CLOX_TOKEN_FUN)) function_declaration();
-    else if (match(CLOX_TOKEN_CLASS)) class_declaration();
-    else statement();
-    if (parser->panic_mode) synchronize();
+static void declarations(Compiler *compiler) {
+    if (match(CLOX_TOKEN_VAR, compiler)) var_declaration(compiler);
+    else if(match(CLOX_TOKEN_FUN, compiler)) function_declaration(compiler);
+    else if (match(CLOX_TOKEN_CLASS, compiler)) class_declaration(compiler);
+    else statement(compiler);
+    if (compiler->parser->panic_mode) synchronize(compiler);
 }
 
-static void var_declaration() {
-    consume(CLOX_TOKEN_IDENTIFIER, "Expect variable name.");
-    if (current_resolver->scope_depth > 0) local_declaration();
-    else global_declaration();
-    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+static void var_declaration(Compiler *compiler) {
+    consume(CLOX_TOKEN_IDENTIFIER, "Expect variable name.", compiler);
+    if (compiler->resolver->scope_depth > 0) local_declaration(compiler);
+    else global_declaration(compiler);
+    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after variable declaration.", compiler);
 }
 
-static void local_declaration() {
-    declare_local();
-    variable_initializer();
-    define_local();
+static void local_declaration(Compiler *compiler) {
+    declare_local(compiler);
+    variable_initializer(compiler);
+    define_local(compiler);
 }
 
-static void global_declaration() {
-    uint16_t global_idx = declare_global();
-    variable_initializer();
-    define_global(global_idx);
+static void global_declaration(Compiler *compiler) {
+    uint16_t global_idx = declare_global(compiler);
+    variable_initializer(compiler);
+    define_global(global_idx, compiler);
 }
 
-static void declare_local() {
-    Token *identifier = parser->previous;
-    for (int i = current_resolver->local_cnt - 1; i >= 0; i--) {
-        Local *local = &current_resolver->locals[i];
-        if (local->depth != -1 && local->depth < current_resolver->scope_depth) break;
-        if (token_equal(identifier, &local->name)) error_report(identifier, "Already variable with this name in this scope.");
+static void declare_local(Compiler *compiler) {
+    Token *identifier = compiler->parser->previous;
+    for (int i = compiler->resolver->local_cnt - 1; i >= 0; i--) {
+        Local *local = &compiler->resolver->locals[i];
+        if (local->depth != -1 && local->depth < compiler->resolver->scope_depth) break;
+        if (token_equal(identifier, &local->name)) error_report(identifier, "Already variable with this name in this scope.", compiler);
     }
 
-    add_local(identifier); 
+    add_local(identifier, compiler); 
 }
 
 static bool token_equal(Token *a, Token *b) {
@@ -400,343 +756,434 @@ static bool token_equal(Token *a, Token *b) {
     return memcmp(a->lexeme, b->lexeme, a->length) == 0;
 }
 
-static void add_local(Token *identifier) {
+static void add_local(Token *identifier, Compiler *compiler) {
     // dynamic allocate slot
-    if (current_resolver->local_cnt + 1 > current_resolver->local_capacity) {
-        int old_capcaity = current_resolver->local_capacity;
-        current_resolver->local_capacity = GROW_CAPACITY(old_capcaity);
-        current_resolver->locals = GROW_ARRAY(Local, current_resolver->locals, old_capcaity, current_resolver->local_capacity);
+    if (compiler->resolver->local_cnt + 1 > compiler->resolver->local_capacity) {
+        int old_capcaity = compiler->resolver->local_capacity;
+        compiler->resolver->local_capacity = GROW_CAPACITY(old_capcaity);
+        compiler->resolver->locals = GROW_ARRAY(Local, compiler->resolver->locals, old_capcaity, compiler->resolver->local_capacity, compiler->vm);
     }
 
-    Local *local = &current_resolver->locals[current_resolver->local_cnt++];
+    Local *local = &compiler->resolver->locals[compiler->resolver->local_cnt++];
     local->name = *identifier;
-    local->depth = current_resolver->scope_depth;
+    local->depth = compiler->resolver->scope_depth;
     // by default all variables are not captured
     local->captured = false;
+    local->frame_bound = false;
 }
 
-static uint16_t declare_global() {
-    return identifier_constant(parser->previous);
+static uint16_t declare_global(Compiler *compiler) {
+    return identifier_constant(compiler->parser->previous, compiler);
 }
 
-static void variable_initializer() {
+static void variable_initializer(Compiler *compiler) {
     // initializer
-    if (match(CLOX_TOKEN_EQUAL)) expression();
-    else emit_byte(CLOX_OP_NIL);
+    if (match(CLOX_TOKEN_EQUAL, compiler)) expression(compiler);
+    else emit_byte(CLOX_OP_NIL, compiler);
 }
 
-static void define_local() {
-    current_resolver->locals[current_resolver->local_cnt - 1].depth = current_resolver->scope_depth;
+static void define_local(Compiler *compiler) {
+    compiler->resolver->locals[compiler->resolver->local_cnt - 1].depth = compiler->resolver->scope_depth;
 }
 
-static void define_global(uint16_t idx) {
-    if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_DEFINE_GLOBAL_16, idx & 0xff, idx >> 8);
-    else emit_bytes(2, CLOX_OP_DEFINE_GLOBAL, idx);
+static void define_global(uint16_t idx, Compiler *compiler) {
+    if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_DEFINE_GLOBAL_16, idx & 0xff, idx >> 8);
+    else emit_bytes(compiler, 2, CLOX_OP_DEFINE_GLOBAL, idx);
 }
 
-static void function_declaration() {
-    consume(CLOX_TOKEN_IDENTIFIER, "Expect function name.");
+static void function_declaration(Compiler *compiler) {
+    consume(CLOX_TOKEN_IDENTIFIER, "Expect function name.", compiler);
     // declare and define function before compile body
-    if (current_resolver->scope_depth > 0) {
-        declare_local();
-        define_local();
-        function(TYPE_FUNCTION);
+    if (compiler->resolver->scope_depth > 0) {
+        declare_local(compiler);
+        define_local(compiler);
+        // a local function whose name is only ever called by its declaring function, never stored or captured,
+        // runs right above frame of that function, so its locals are accessed in place with no upvalue
+        Declaration *declaration = find_declaration(compiler->parser->previous, compiler);
+        bool bound = declaration != NULL && !declaration->escapes;
+        compiler->resolver->locals[compiler->resolver->local_cnt - 1].frame_bound = bound;
+        function(TYPE_FUNCTION, bound, compiler);
     } else {
-        uint16_t idx = declare_global();
-        function(TYPE_FUNCTION);
-        define_global(idx);
+        uint16_t idx = declare_global(compiler);
+        function(TYPE_FUNCTION, false, compiler);
+        define_global(idx, compiler);
     }
 }
 
-static void function(FunctionType type) {
-    init_resolver(type);
-    begin_scope();
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(CLOX_TOKEN_RIGHT_PAREN)) {
+static void function(FunctionType type, bool frame_bound, Compiler *compiler) {
+    init_resolver(type, compiler);
+    compiler->resolver->frame_bound = frame_bound;
+    begin_scope(compiler);
+    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after function name.", compiler);
+    if (!check(CLOX_TOKEN_RIGHT_PAREN, compiler)) {
         do {
-            current_resolver->function->arity++;
+            compiler->resolver->function->arity++;
             // limit function paratemer count
-            if (current_resolver->function->arity == 256) error_report(parser->current, "Can't have more than 255 parameters.");
-            consume(CLOX_TOKEN_IDENTIFIER, "Expect parameter name.");
-            declare_local();
-            define_local();
-        } while (match(CLOX_TOKEN_COMMA));
+            if (compiler->resolver->function->arity == 256) error_report(compiler->parser->current, "Can't have more than 255 parameters.", compiler);
+            consume(CLOX_TOKEN_IDENTIFIER, "Expect parameter name.", compiler);
+            declare_local(compiler);
+            define_local(compiler);
+        } while (match(CLOX_TOKEN_COMMA, compiler));
     }
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after function parameters list.");
-    consume(CLOX_TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after function parameters list.", compiler);
+    consume(CLOX_TOKEN_LEFT_BRACE, "Expect '{' before function body.", compiler);
 
-    block();
+    block(compiler);
     // optional
-    end_scope();
+    end_scope(compiler);
 
-    free_resolver(); 
+    free_resolver(compiler); 
 }
 
-static void class_declaration() {
-    consume(CLOX_TOKEN_IDENTIFIER, "Expect class name.");
-    Token class_name = *parser->previous;
+static void class_declaration(Compiler *compiler) {
+    consume(CLOX_TOKEN_IDENTIFIER, "Expect class name.", compiler);
+    Token class_name = *compiler->parser->previous;
     // append class name into constant pool (no matter it is local or global)
-    uint16_t idx = identifier_constant(&class_name);
+    uint16_t idx = identifier_constant(&class_name, compiler);
     // class name
-    if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_CLASS_16, idx & 0xff, idx >> 8);
-    else emit_bytes(2, CLOX_OP_CLASS, idx);
+    if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_CLASS_16, idx & 0xff, idx >> 8);
+    else emit_bytes(compiler, 2, CLOX_OP_CLASS, idx);
     
     // if class is local -> klass remain in stack (referenced as local variable)
     // if class is global -> klass poped by define_global
-    if (current_resolver->scope_depth) {
-        declare_local();
-        define_local();
+    if (compiler->resolver->scope_depth) {
+        declare_local(compiler);
+        define_local(compiler);
     } else {
         // define class as global
-        define_global(idx);
+        define_global(idx, compiler);
     }
 
     ClassResolver class;
-    class.enclose = current_class;
+    class.enclose = compiler->class_resolver;
     class.has_super = false;
-    current_class = &class;
+    compiler->class_resolver = &class;
 
-    if (match(CLOX_TOKEN_LESS)) {
-        consume(CLOX_TOKEN_IDENTIFIER, "Expect superclass name.");
-        if (token_equal(&class_name, parser->previous)) error_report(parser->previous, "A class can't inherit from itself.");
+    if (match(CLOX_TOKEN_LESS, compiler)) {
+        consume(CLOX_TOKEN_IDENTIFIER, "Expect superclass name.", compiler);
+        if (token_equal(&class_name, compiler->parser->previous)) error_report(compiler->parser->previous, "A class can't inherit from itself.", compiler);
 
         // load superclass from local/upvalue/global to stack
-        variable(false);
+        variable(false, compiler);
         // leave supclass on stack and use "super" to reference
-        begin_scope();
-        add_local(&SUPER_TOKEN);
-        define_local();
+        begin_scope(compiler);
+        add_local(&SUPER_TOKEN, compiler);
+        define_local(compiler);
         
         // load current class from local/upvalue/global to stack
-        named_variable(&class_name, false);
+        named_variable(&class_name, false, compiler);
 
-        emit_byte(CLOX_OP_INHERIT);
-        current_class->has_super = true;
+        emit_byte(CLOX_OP_INHERIT, compiler);
+        compiler->class_resolver->has_super = true;
     }
 
-    consume(CLOX_TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    consume(CLOX_TOKEN_LEFT_BRACE, "Expect '{' before class body.", compiler);
 
     // reload klass to bind method
-    named_variable(&class_name, false);
+    named_variable(&class_name, false, compiler);
 
     // methods
-    while (!check(CLOX_TOKEN_EOF) && !check(CLOX_TOKEN_RIGHT_BRACE)) method();
+    while (!check(CLOX_TOKEN_EOF, compiler) && !check(CLOX_TOKEN_RIGHT_BRACE, compiler)) method(compiler);
 
-    consume(CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    consume(CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after class body.", compiler);
 
     // pop klass out of stack
-    emit_byte(CLOX_OP_POP);
+    emit_byte(CLOX_OP_POP, compiler);
 
-    if (current_class->has_super) end_scope();
-    current_class = current_class->enclose;
+    if (compiler->class_resolver->has_super) end_scope(compiler);
+    compiler->class_resolver = compiler->class_resolver->enclose;
 }
 
-static void method() {
+static void method(Compiler *compiler) {
     // method name
-    consume(CLOX_TOKEN_IDENTIFIER, "Expect method name.");
-    uint16_t identifier = make_constant(OBJ_VALUE(new_string(parser->previous->lexeme, parser->previous->length)));
+    consume(CLOX_TOKEN_IDENTIFIER, "Expect method name.", compiler);
+    uint16_t identifier = make_constant(OBJ_VALUE(new_string(compiler->parser->previous->lexeme, compiler->parser->previous->length, compiler->vm)), compiler);
 
     // initializer
-    if (parser->previous->length == 4 && memcmp("init", parser->previous->lexeme, parser->previous->length) == 0) function(TYPE_INITIALIZER);
+    if (compiler->parser->previous->length == 4 && memcmp("init", compiler->parser->previous->lexeme, compiler->parser->previous->length) == 0) function(TYPE_INITIALIZER, false, compiler);
     // normal body
-    else function(TYPE_METHOD);
+    else function(TYPE_METHOD, false, compiler);
     
-    if (identifier > UINT8_MAX) emit_bytes(3, CLOX_OP_METHOD_16, identifier & 0xff, identifier >> 8);
-    else emit_bytes(2, CLOX_OP_METHOD, identifier);
+    if (identifier > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_METHOD_16, identifier & 0xff, identifier >> 8);
+    else emit_bytes(compiler, 2, CLOX_OP_METHOD, identifier);
 }
 
-static void statement() {
-    if (match(CLOX_TOKEN_PRINT)) print_statement();
-    else if (match(CLOX_TOKEN_LEFT_BRACE)) {
-        begin_scope(current_resolver);
-        block();
-        end_scope();
-    } else if (match(CLOX_TOKEN_IF)) if_statement();
-    else if (match(CLOX_TOKEN_WHILE)) while_statement(); 
-    else if (match(CLOX_TOKEN_FOR)) for_statement();
-    else if (match(CLOX_TOKEN_RETURN)) return_statement();
-    else expression_statement();
+static void statement(Compiler *compiler) {
+    if (match(CLOX_TOKEN_PRINT, compiler)) print_statement(compiler);
+    else if (match(CLOX_TOKEN_LEFT_BRACE, compiler)) {
+        begin_scope(compiler);
+        block(compiler);
+        end_scope(compiler);
+    } else if (match(CLOX_TOKEN_IF, compiler)) if_statement(compiler);
+    else if (match(CLOX_TOKEN_WHILE, compiler)) while_statement(compiler); 
+    else if (match(CLOX_TOKEN_FOR, compiler)) for_statement(compiler);
+    else if (match(CLOX_TOKEN_RETURN, compiler)) return_statement(compiler);
+    else expression_statement(compiler);
 }
 
-static void print_statement() {
-    expression();
-    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(CLOX_OP_PRINT);
+static void print_statement(Compiler *compiler) {
+    expression(compiler);
+    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after value.", compiler);
+    emit_byte(CLOX_OP_PRINT, compiler);
 }
 
-static void block() {
-    while (!check(CLOX_TOKEN_RIGHT_BRACE) && !check(CLOX_TOKEN_EOF)) declarations();
-    consume(CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+static void block(Compiler *compiler) {
+    while (!check(CLOX_TOKEN_RIGHT_BRACE, compiler) && !check(CLOX_TOKEN_EOF, compiler)) declarations(compiler);
+    consume(CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after block.", compiler);
 }
 
-static void begin_scope() {
-    current_resolver->scope_depth++;
+static void begin_scope(Compiler *compiler) {
+    compiler->resolver->scope_depth++;
 }
 
-static void end_scope() {
-    current_resolver->scope_depth--;
-    int i = current_resolver->local_cnt - 1;
-    for (int i = current_resolver->local_cnt - 1; i >= 0; i--) {
-        Local *local = &current_resolver->locals[i];
-        if (local->depth <= current_resolver->scope_depth) break;
+static void end_scope(Compiler *compiler) {
+    compiler->resolver->scope_depth--;
+    int i = compiler->resolver->local_cnt - 1;
+    for (; i >= 0; i--) {
+        Local *local = &compiler->resolver->locals[i];
+        if (local->depth <= compiler->resolver->scope_depth) break;
         // pop upvalue
-        if (local->captured) emit_byte(CLOX_OP_CLOSE_UPVALUE);
+        if (local->captured) emit_byte(CLOX_OP_CLOSE_UPVALUE, compiler);
         // pop local variable
-        else emit_byte(CLOX_OP_POP);
+        else emit_byte(CLOX_OP_POP, compiler);
     }
-    current_resolver->local_cnt = i + 1;
+    compiler->resolver->local_cnt = i + 1;
 }
 
-static void if_statement() {
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+static void if_statement(Compiler *compiler) {
+    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'if'.", compiler);
     // if condition 
-    expression(); 
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    expression(compiler); 
+    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.", compiler);
 
-    int if_offset = emit_jump(CLOX_OP_JUMP_IF_FALSE);
+    int if_offset = emit_jump(CLOX_OP_JUMP_IF_FALSE, compiler);
     // pop condition expression on true
-    emit_byte(CLOX_OP_POP);
+    emit_byte(CLOX_OP_POP, compiler);
     
-    statement();
-    int else_offset = emit_jump(CLOX_OP_JUMP);
-    patch_jump(if_offset);
+    statement(compiler);
+    int else_offset = emit_jump(CLOX_OP_JUMP, compiler);
+    patch_jump(if_offset, compiler);
     // pop condition expression on false
-    emit_byte(CLOX_OP_POP);
+    emit_byte(CLOX_OP_POP, compiler);
     
-    if (match(CLOX_TOKEN_ELSE)) statement();
+    if (match(CLOX_TOKEN_ELSE, compiler)) statement(compiler);
 
-    patch_jump(else_offset);
+    patch_jump(else_offset, compiler);
 }
 
-static void while_statement() {
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    int start = current_chunk()->count;
-    expression();
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-    int end_while = emit_jump(CLOX_OP_JUMP_IF_FALSE);
+static void while_statement(Compiler *compiler) {
+    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'while'.", compiler);
+    int start = current_chunk(compiler)->count;
+    expression(compiler);
+    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.", compiler);
+    int end_while = emit_jump(CLOX_OP_JUMP_IF_FALSE, compiler);
     // pop condition expression on true
-    emit_byte(CLOX_OP_POP);
-    statement();
-    emit_loop(start);
-    patch_jump(end_while);
+    emit_byte(CLOX_OP_POP, compiler);
+    statement(compiler);
+    emit_loop(start, compiler);
+    patch_jump(end_while, compiler);
     // pop condition expression on false
-    emit_byte(CLOX_OP_POP);
+    emit_byte(CLOX_OP_POP, compiler);
 }
 
-static void for_statement() {
+static void for_statement(Compiler *compiler) {
     // desugar 'for' into 'while', add a scope for initializer
-    begin_scope();
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    
-    // initializer
-    if (!match(CLOX_TOKEN_SEMICOLON)) {
-        // variable declaration or expression (use statement to pop temporary value and consume ';')
-        if (match(CLOX_TOKEN_VAR)) var_declaration();
-        else expression_statement();
+    begin_scope(compiler);
+    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'for'.", compiler);
+    bool declaration = match(CLOX_TOKEN_VAR, compiler);
+    if (for_in_ahead(compiler)) {
+        for_in_statement(compiler);
+        end_scope(compiler);
+        return;
     }
+    
+    // initializer, variable declaration or expression (use statement to pop temporary value and consume ';')
+    if (declaration) var_declaration(compiler);
+    else if (!match(CLOX_TOKEN_SEMICOLON, compiler)) expression_statement(compiler);
 
     // condition
-    int start = current_chunk()->count;
+    int start = current_chunk(compiler)->count;
     int end_for = -1;
-    if (!match(CLOX_TOKEN_SEMICOLON)) {
-        expression();
-        consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-        end_for = emit_jump(CLOX_OP_JUMP_IF_FALSE);
+    if (!match(CLOX_TOKEN_SEMICOLON, compiler)) {
+        expression(compiler);
+        consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after loop condition.", compiler);
+        end_for = emit_jump(CLOX_OP_JUMP_IF_FALSE, compiler);
         // pop condition expression on true
-        emit_byte(CLOX_OP_POP);
+        emit_byte(CLOX_OP_POP, compiler);
     }
 
     // increment
-    if (!match(CLOX_TOKEN_RIGHT_PAREN)) {
-        int body = emit_jump(CLOX_OP_JUMP);
-        int increment = current_chunk()->count;
-        expression();
-        consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-        emit_byte(CLOX_OP_POP);
-        emit_loop(start);
+    if (!match(CLOX_TOKEN_RIGHT_PAREN, compiler)) {
+        int body = emit_jump(CLOX_OP_JUMP, compiler);
+        int increment = current_chunk(compiler)->count;
+        expression(compiler);
+        consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.", compiler);
+        emit_discard(compiler);
+        emit_loop(start, compiler);
         start = increment;
-        patch_jump(body);
+        patch_jump(body, compiler);
     }
 
     // body
-    statement();
-    emit_loop(start);
+    statement(compiler);
+    emit_loop(start, compiler);
     
     if (end_for != -1) {
-        patch_jump(end_for);
+        patch_jump(end_for, compiler);
         // pop condition expression on false
-        emit_byte(CLOX_OP_POP);
+        emit_byte(CLOX_OP_POP, compiler);
     }
 
-    end_scope();
+    end_scope(compiler);
 }
 
-static void return_statement() {
-    if (current_resolver->type == TYPE_SCRIPT) error_report(parser->previous, "Can't return from top-level code.");
+// 'in' is a keyword only after loop variable, so it is told by looking one token ahead
+static bool for_in_ahead(Compiler *compiler) {
+    if (!check(CLOX_TOKEN_IDENTIFIER, compiler)) return false;
+    Token *next = peek_token(compiler->parser->scanner);
+    bool in = next->type == CLOX_TOKEN_IDENTIFIER && next->length == 2 && memcmp(next->lexeme, "in", 2) == 0;
+    FREE(Token, next, compiler->vm);
+    return in;
+}
+
+/**
+ * iterable, iterator state and loop variable take 3 consecutive slots, for-iter at loop end
+ * advances iterator and jumps back to body, so each element costs one dispatch besides body
+ */
+static void for_in_statement(Compiler *compiler) {
+    advance(compiler);
+    Token variable = *compiler->parser->previous;
+    advance(compiler);
+    // loop variable is not in scope of iterable expression
+    expression(compiler);
+    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after for-in clauses.", compiler);
+    add_local(&ITERABLE_TOKEN, compiler);
+    emit_byte(CLOX_OP_NIL, compiler);
+    add_local(&ITERATOR_TOKEN, compiler);
+    emit_byte(CLOX_OP_NIL, compiler);
+    add_local(&variable, compiler);
+    int slot = compiler->resolver->local_cnt - 3;
+    if (slot > UINT16_MAX) error_report(&variable, "Too many local variables.", compiler);
+
+    int check = emit_jump(CLOX_OP_JUMP, compiler);
+    int body = current_chunk(compiler)->count;
+    compiler->resolver->jump_target = body;
+    statement(compiler);
+    // a closure of this iteration keeps its own loop variable
+    if (compiler->resolver->locals[slot + 2].captured) emit_bytes(compiler, 2, CLOX_OP_CLOSE_UPVALUE, CLOX_OP_NIL);
+    patch_jump(check, compiler);
+    int jump = current_chunk(compiler)->count - body + 5;
+    if (jump > UINT16_MAX) error_report(compiler->parser->previous, "Loop body too large.", compiler);
+    emit_bytes(compiler, 5, CLOX_OP_FOR_ITER, slot & 0xff, (slot >> 8) & 0xff, jump & 0xff, (jump >> 8) & 0xff);
+}
+
+static void return_statement(Compiler *compiler) {
+    if (compiler->resolver->type == TYPE_SCRIPT) error_report(compiler->parser->previous, "Can't return from top-level code.", compiler);
     else {
-        if (match(CLOX_TOKEN_SEMICOLON)) emit_nil_return();
+        if (match(CLOX_TOKEN_SEMICOLON, compiler)) emit_nil_return(compiler);
         else {
-            if (current_resolver->type == TYPE_INITIALIZER) error_report(parser->previous, "Can't return a value from an initializer.");
+            if (compiler->resolver->type == TYPE_INITIALIZER) error_report(compiler->parser->previous, "Can't return a value from an initializer.", compiler);
             else {
-                expression();        
-                consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after return statement");
-                emit_return();
+                expression(compiler);        
+                consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after return statement", compiler);
+                // return stays after tail call for callees that can not reuse the frame
+                Chunk *chunk = current_chunk(compiler);
+                if (compiler->resolver->call_end == chunk->count) tail_call(&chunk->code[compiler->resolver->call_start]);
+                emit_return(compiler);
             }
         }
     }
 }
 
-static void expression_statement() {
-    expression();
-    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(CLOX_OP_POP);
+// turn call or invoke at @param code into its tail form
+static void tail_call(uint8_t *code) {
+    switch (*code) {
+        case CLOX_OP_CALL:             *code = CLOX_OP_TAIL_CALL; break;
+        case CLOX_OP_INVOKE:           *code = CLOX_OP_TAIL_INVOKE; break;
+        case CLOX_OP_INVOKE_16:        *code = CLOX_OP_TAIL_INVOKE_16; break;
+        case CLOX_OP_INVOKE_SUPER:     *code = CLOX_OP_TAIL_INVOKE_SUPER; break;
+        case CLOX_OP_INVOKE_SUPER_16:  *code = CLOX_OP_TAIL_INVOKE_SUPER_16; break;
+        default: break;
+    }
 }
 
-static void expression() {
-    parse_precedence(PREC_ASSIGNMENT);
+static void expression_statement(Compiler *compiler) {
+    expression(compiler);
+    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after expression.", compiler);
+    emit_discard(compiler);
 }
 
-static void parse_precedence(Precedence precedence) {
-    advance();
-    ParserRule *rule = &rules[parser->previous->type];
+// pop value of an expression statement, loads around a trailing in place update are dropped instead
+static void emit_discard(Compiler *compiler) {
+    Chunk *chunk = current_chunk(compiler);
+    InPlaceUpdate *update = &compiler->resolver->last_update;
+    if (update->end != chunk->count || compiler->resolver->jump_target > update->start) {
+        emit_byte(CLOX_OP_POP, compiler);
+        return;
+    }
+    uint8_t code[5];
+    int length = update->length;
+    memcpy(code, chunk->code + update->offset, length);
+    truncate_chunk(chunk, update->start);
+    for (int i = 0; i < length; i++) emit_byte(code[i], compiler);
+    update->end = -1;
+}
+
+static void expression(Compiler *compiler) {
+    parse_precedence(PREC_ASSIGNMENT, compiler);
+}
+
+static void parse_precedence(Precedence precedence, Compiler *compiler) {
+    advance(compiler);
+    ParserRule *rule = &rules[compiler->parser->previous->type];
     parser_func prefix = rule->prefix;
     if (prefix == NULL) {
-        error_report(parser->previous, "Expect expression.");
+        error_report(compiler->parser->previous, "Expect expression.", compiler);
         return;
     }
     bool assign = precedence <= PREC_ASSIGNMENT; 
-    prefix(assign);
-    while (precedence <= rules[parser->current->type].precedence) {
-        advance();
-        parser_func infix = rules[parser->previous->type].infix;
-        infix(assign);
+    prefix(assign, compiler);
+    while (precedence <= rules[compiler->parser->current->type].precedence) {
+        advance(compiler);
+        parser_func infix = rules[compiler->parser->previous->type].infix;
+        infix(assign, compiler);
     }
-    if (assign && match(CLOX_TOKEN_EQUAL)) error_report(parser->previous, "Invalid assignment target.");
+    if (assign && (match(CLOX_TOKEN_EQUAL, compiler) || match_update(compiler))) error_report(compiler->parser->previous, "Invalid assignment target.", compiler);
 }
 
-static void variable(bool assign) {
-    named_variable(parser->previous, assign);
+static void variable(bool assign, Compiler *compiler) {
+    named_variable(compiler->parser->previous, assign, compiler);
 }
 
-static void named_variable(Token *variable, bool assign) {
+static void named_variable(Token *variable, bool assign, Compiler *compiler) {
 #define PARSE_VARIABLE(operation, idx, scope) do {\
-        if ((idx) > UINT8_MAX) emit_bytes(3, CLOX_OP_##operation##_##scope##_16, (idx) & 0xff, (idx) >> 8);\
-        else emit_bytes(2, CLOX_OP_##operation##_##scope, (idx));\
+        if ((idx) > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_##operation##_##scope##_16, (idx) & 0xff, (idx) >> 8);\
+        else emit_bytes(compiler, 2, CLOX_OP_##operation##_##scope, (idx));\
     } while(0);
     
-    int local_idx = resolve_local(variable, current_resolver);
+    int local_idx = resolve_local(variable, compiler->resolver, compiler);
+    int outer_idx = -1;
     int upvalue_idx = -1;
     int global_idx = -1;
-    if (local_idx == -1) {
-        upvalue_idx = resolve_upvalue(variable, current_resolver);
-        if (upvalue_idx == -1) global_idx = make_constant(OBJ_VALUE(new_string(variable->lexeme, variable->length)));
+    if (local_idx == -1) outer_idx = resolve_outer(variable, compiler->resolver, compiler);
+    if (local_idx == -1 && outer_idx == -1) {
+        upvalue_idx = resolve_upvalue(variable, compiler->resolver, compiler);
+        // a copied value is only ever read
+        if (upvalue_idx != -1 && copied(&compiler->resolver->upvalues[upvalue_idx])) {
+            emit_variable(CLOX_OP_GET_CAPTURE, compiler->resolver->upvalues[upvalue_idx].index, compiler);
+            return;
+        }
+        if (upvalue_idx == -1) global_idx = make_constant(OBJ_VALUE(new_string(variable->lexeme, variable->length, compiler->vm)), compiler);
     }
-    if (assign && match(CLOX_TOKEN_EQUAL)) {
-        expression();
+    if (assign && match(CLOX_TOKEN_EQUAL, compiler)) {
+        expression(compiler);
         // set variables
         if (local_idx != -1) {
             // local set
             PARSE_VARIABLE(SET, local_idx, LOCAL);
+        } else if (outer_idx != -1) {
+            // local of enclosing frame set
+            PARSE_VARIABLE(SET, outer_idx, OUTER);
         } else if (upvalue_idx != -1) {
             // upvalue set
             PARSE_VARIABLE(SET, upvalue_idx, UPVALUE);
@@ -744,11 +1191,20 @@ static void named_variable(Token *variable, bool assign) {
             // global set
             PARSE_VARIABLE(SET, global_idx, GLOBAL);
         }
+    } else if (assign && match_update(compiler)) {
+        if (local_idx != -1) variable_update(CLOX_OP_GET_LOCAL, local_idx, compiler);
+        else if (outer_idx != -1) variable_update(CLOX_OP_GET_OUTER, outer_idx, compiler);
+        else if (upvalue_idx != -1) variable_update(CLOX_OP_GET_UPVALUE, upvalue_idx, compiler);
+        else variable_update(CLOX_OP_GET_GLOBAL, global_idx, compiler);
     } else {
         // local get 
         if (local_idx != -1) {
             // local get
             PARSE_VARIABLE(GET, local_idx, LOCAL);
+            if (compiler->resolver->locals[local_idx].frame_bound) compiler->resolver->bound_load_end = current_chunk(compiler)->count;
+        } else if (outer_idx != -1) {
+            // local of enclosing frame get
+            PARSE_VARIABLE(GET, outer_idx, OUTER);
         } else if (upvalue_idx != -1) {
             // upvalue get
             PARSE_VARIABLE(GET, upvalue_idx, UPVALUE);
@@ -760,114 +1216,338 @@ static void named_variable(Token *variable, bool assign) {
 #undef PARSE_VARIABLE
 }
 
-static int resolve_local(Token *token, Resolver *resolver) {
+static bool is_assignment(TokenType type) {
+    switch (type) {
+        case CLOX_TOKEN_EQUAL:
+        case CLOX_TOKEN_PLUS_EQUAL:
+        case CLOX_TOKEN_MINUS_EQUAL:
+        case CLOX_TOKEN_STAR_EQUAL:
+        case CLOX_TOKEN_SLASH_EQUAL:
+        case CLOX_TOKEN_PERCENT_EQUAL:
+        case CLOX_TOKEN_PLUS_PLUS:
+        case CLOX_TOKEN_MINUS_MINUS:
+            return true;
+        default: return false;
+    }
+}
+
+/**
+ * a local never assigned after declaration can be copied into closures capturing it
+ * a name compiler makes up, as this, is never assigned, one in source is looked up in declarations found ahead
+ */
+static bool immutable_local(Local *local, Compiler *compiler) {
+    Declarations *declarations = &compiler->declarations;
+    uintptr_t name = (uintptr_t)local->name.lexeme;
+    if (name < (uintptr_t)declarations->source || name >= (uintptr_t)declarations->source_end) return true;
+    Declaration *declaration = find_declaration(&local->name, compiler);
+    return declaration != NULL && !declaration->assigned;
+}
+
+// compound assignment, postfix '++' or '--' following an assignment target
+static bool match_update(Compiler *compiler) {
+    switch (compiler->parser->current->type) {
+        case CLOX_TOKEN_PLUS_EQUAL:
+        case CLOX_TOKEN_MINUS_EQUAL:
+        case CLOX_TOKEN_STAR_EQUAL:
+        case CLOX_TOKEN_SLASH_EQUAL:
+        case CLOX_TOKEN_PERCENT_EQUAL:
+        case CLOX_TOKEN_PLUS_PLUS:
+        case CLOX_TOKEN_MINUS_MINUS:
+            advance(compiler);
+            return true;
+        default: return false;
+    }
+}
+
+static uint8_t update_operator(TokenType type) {
+    switch (type) {
+        case CLOX_TOKEN_PLUS_EQUAL:
+        case CLOX_TOKEN_PLUS_PLUS:    return CLOX_OP_ADD;
+        case CLOX_TOKEN_STAR_EQUAL:   return CLOX_OP_MULTIPLY;
+        case CLOX_TOKEN_SLASH_EQUAL:  return CLOX_OP_DIVIDE;
+        case CLOX_TOKEN_PERCENT_EQUAL: return CLOX_OP_MODULO;
+        default:                      return CLOX_OP_SUBTRACT;
+    }
+}
+
+/**
+ * update of a variable loaded by @param get (8-bit variant) from @param idx, operator is previous token
+ * x++ loads x then increments it in place, x += k with a constant k increments x in place then loads it
+ * any other update is desugared into x = x op value
+ */
+static void variable_update(uint8_t get, int idx, Compiler *compiler) {
+    TokenType type = compiler->parser->previous->type;
+    Chunk *chunk = current_chunk(compiler);
+    uint8_t increment;
+    switch (get) {
+        case CLOX_OP_GET_LOCAL:   increment = CLOX_OP_INC_LOCAL; break;
+        case CLOX_OP_GET_OUTER:   increment = CLOX_OP_INC_OUTER; break;
+        case CLOX_OP_GET_UPVALUE: increment = CLOX_OP_INC_UPVALUE; break;
+        default:                  increment = CLOX_OP_INC_GLOBAL; break;
+    }
+    InPlaceUpdate *update = &compiler->resolver->last_update;
+    update->start = chunk->count;
+    if (type == CLOX_TOKEN_PLUS_PLUS || type == CLOX_TOKEN_MINUS_MINUS) {
+        emit_variable(get, idx, compiler);
+        update->offset = chunk->count;
+        update->length = 4;
+        emit_bytes(compiler, 4, increment, idx & 0xff, idx >> 8, type == CLOX_TOKEN_PLUS_PLUS ? 1 : 0xff);
+        update->end = chunk->count;
+        return;
+    }
+
+    emit_variable(get, idx, compiler);
+    int operand = chunk->count;
+    expression(compiler);
+    ConstantLoad load;
+    Value delta = NIL_VALUE;
+    bool constant = (type == CLOX_TOKEN_PLUS_EQUAL || type == CLOX_TOKEN_MINUS_EQUAL) &&
+                    trailing_constant(&load, compiler) && load.offset == operand;
+    if (constant && type == CLOX_TOKEN_PLUS_EQUAL) delta = load.value;
+    // x - k is x + (-k), except for k = 0 as -0 + 0 is 0
+    else if (constant && IS_NUMBER(load.value) && AS_NUMBER(load.value) != 0) {
+        if (!negate_int(load.value, &delta)) delta = NUMBER_VALUE(-AS_NUMBER(load.value));
+    }
+
+    if (IS_INT(delta) && AS_INT(delta) >= INT8_MIN && AS_INT(delta) <= INT8_MAX) {
+        truncate_chunk(chunk, update->start);
+        update->offset = chunk->count;
+        update->length = 4;
+        emit_bytes(compiler, 4, increment, idx & 0xff, idx >> 8, AS_INT(delta) & 0xff);
+    } else if (get == CLOX_OP_GET_LOCAL && (IS_NUMBER(delta) || IS_STRING(delta))) {
+        truncate_chunk(chunk, update->start);
+        uint16_t constant_idx = make_constant(delta, compiler);
+        update->offset = chunk->count;
+        update->length = 5;
+        emit_bytes(compiler, 5, CLOX_OP_ADD_LOCAL_CONST, idx & 0xff, idx >> 8, constant_idx & 0xff, constant_idx >> 8);
+    } else {
+        uint8_t operator = update_operator(type);
+        if (operator == CLOX_OP_ADD) emit_byte(operator, compiler);
+        else emit_number_op(operator, compiler);
+        emit_variable(get + 2, idx, compiler);
+        update->end = -1;
+        return;
+    }
+    // loaded value of update is the new one
+    emit_variable(get, idx, compiler);
+    update->end = chunk->count;
+    compiler->resolver->last_constant.offset = -1;
+}
+
+// x.y++ leaves old value of property, compound assignment leaves the new one
+static void property_update(uint16_t idx, Compiler *compiler) {
+    TokenType type = compiler->parser->previous->type;
+    if (type == CLOX_TOKEN_PLUS_PLUS || type == CLOX_TOKEN_MINUS_MINUS) {
+        emit_bytes(compiler, 4, CLOX_OP_INC_PROPERTY, idx & 0xff, idx >> 8, type == CLOX_TOKEN_PLUS_PLUS ? 1 : 0xff);
+        return;
+    }
+    expression(compiler);
+    emit_bytes(compiler, 4, CLOX_OP_UPDATE_PROPERTY, idx & 0xff, idx >> 8, update_operator(type));
+}
+
+// emit variable @param instruction (8-bit variant), its 16-bit variant follows it
+static void emit_variable(uint8_t instruction, int idx, Compiler *compiler) {
+    if (idx > UINT8_MAX) emit_bytes(compiler, 3, instruction + 1, idx & 0xff, idx >> 8);
+    else emit_bytes(compiler, 2, instruction, idx);
+}
+
+static int resolve_local(Token *token, Resolver *resolver, Compiler *compiler) {
     for (int i = resolver->local_cnt - 1; i >= 0; i--) {
         Local *local = &resolver->locals[i];
         if (token_equal(token, &local->name)) {
-            if (local->depth == -1) error_report(token, "Can't read local variable in its own initializer.");
+            if (local->depth == -1) error_report(token, "Can't read local variable in its own initializer.", compiler);
             return i;
         }
     }
     return -1;
 }
 
-static int resolve_upvalue(Token *token, Resolver *resolver) {
+// slot of a local of enclosing function, which a frame-bound function accesses in place
+static int resolve_outer(Token *token, Resolver *resolver, Compiler *compiler) {
+    if (!resolver->frame_bound) return -1;
+    int local = resolve_local(token, resolver->enclose, compiler);
+    // nothing is captured, descriptor only tells enclosing function the slot may be written by closure
+    if (local != -1) add_upvalue(local, UPVALUE_FRAME, resolver, compiler);
+    return local;
+}
+
+static int resolve_upvalue(Token *token, Resolver *resolver, Compiler *compiler) {
     if (resolver->enclose == NULL) return -1;
 
-    int local = resolve_local(token, resolver->enclose);
+    int local = resolve_local(token, resolver->enclose, compiler);
     if (local != -1) {
+        Local *captured = &resolver->enclose->locals[local];
+        if (immutable_local(captured, compiler)) return add_upvalue(local, UPVALUE_COPY_LOCAL, resolver, compiler);
         // inner function upvalue a local variable => capture it
-        resolver->enclose->locals[local].captured = true;
-        return add_upvalue(local, true, resolver);
+        captured->captured = true;
+        return add_upvalue(local, UPVALUE_LOCAL, resolver, compiler);
     } 
     
-    int upvalue = resolve_upvalue(token, resolver->enclose);
-    if (upvalue != -1) return add_upvalue(upvalue, false, resolver);
-    
-    return -1;
+    int upvalue = resolve_upvalue(token, resolver->enclose, compiler);
+    if (upvalue == -1) return -1;
+    UpValue *enclosing = &resolver->enclose->upvalues[upvalue];
+    if (copied(enclosing)) return add_upvalue(enclosing->index, UPVALUE_COPY_CAPTURE, resolver, compiler);
+    return add_upvalue(upvalue, UPVALUE_ENCLOSING, resolver, compiler);
 }
 
-static int add_upvalue(int local, bool is_local, Resolver *resolver) {
+static int add_upvalue(int local, uint8_t kind, Resolver *resolver, Compiler *compiler) {
     int upvalue_cnt = resolver->function->upvalue_cnt;
     for (int i = 0; i < upvalue_cnt; i++) {
         UpValue *upvalue = &resolver->upvalues[i];
-        if (upvalue->idx == local && upvalue->is_local == is_local) return i;
+        if (upvalue->idx == local && upvalue->kind == kind) return i;
     }
 
     if (upvalue_cnt + 1 > resolver->upvalues_capacity) {
         int old_capacity = resolver->upvalues_capacity;
         resolver->upvalues_capacity = GROW_CAPACITY(old_capacity);
-        resolver->upvalues = GROW_ARRAY(UpValue, resolver->upvalues, old_capacity, resolver->upvalues_capacity);
+        resolver->upvalues = GROW_ARRAY(UpValue, resolver->upvalues, old_capacity, resolver->upvalues_capacity, compiler->vm);
     }
 
     UpValue *upvalue = &resolver->upvalues[upvalue_cnt];
     upvalue->idx = local;
-    upvalue->is_local = is_local;
+    upvalue->kind = kind;
+    upvalue->index = copied(upvalue) ? resolver->function->capture_cnt++ : upvalue_cnt;
     return resolver->function->upvalue_cnt++;
 }
 
-static void grouping(bool assign) {
-    expression();
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static bool copied(UpValue *upvalue) {
+    return upvalue->kind == UPVALUE_COPY_LOCAL || upvalue->kind == UPVALUE_COPY_CAPTURE;
 }
 
-static void call(bool assign) {
-    uint8_t arg_cnt = argument_list();
-    emit_bytes(2, CLOX_OP_CALL, arg_cnt);
+static void grouping(bool assign, Compiler *compiler) {
+    expression(compiler);
+    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after expression.", compiler);
 }
 
-static void dot(bool assign) {
-    consume(CLOX_TOKEN_IDENTIFIER, "Expect property name after '.'.");
+static void call(bool assign, Compiler *compiler) {
+    // a frame-bound callee must find frame of its enclosing function below its own, so it is no tail call
+    bool bound = compiler->resolver->bound_load_end == current_chunk(compiler)->count;
+    uint8_t arg_cnt = argument_list(compiler);
+    compiler->resolver->call_start = current_chunk(compiler)->count;
+    emit_bytes(compiler, 2, CLOX_OP_CALL, arg_cnt);
+    compiler->resolver->call_end = bound ? -1 : current_chunk(compiler)->count;
+}
+
+static void dot(bool assign, Compiler *compiler) {
+    consume(CLOX_TOKEN_IDENTIFIER, "Expect property name after '.'.", compiler);
     // append previous token into constant pool
-    uint16_t idx = identifier_constant(parser->previous); 
-    if (assign && match(CLOX_TOKEN_EQUAL)) {
-        expression();
+    uint16_t idx = identifier_constant(compiler->parser->previous, compiler); 
+    if (assign && match(CLOX_TOKEN_EQUAL, compiler)) {
+        expression(compiler);
         // set property
-        if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_SET_PROPERTY_16, idx & 0xff, idx >> 8);
-        else emit_bytes(2, CLOX_OP_SET_PROPERTY, idx);
+        if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_SET_PROPERTY_16, idx & 0xff, idx >> 8);
+        else emit_bytes(compiler, 2, CLOX_OP_SET_PROPERTY, idx);
+    } else if (assign && match_update(compiler)) {
+        property_update(idx, compiler);
     } else {
-        if (match(CLOX_TOKEN_LEFT_PAREN)) {
+        if (match(CLOX_TOKEN_LEFT_PAREN, compiler)) {
             // method call
-            uint8_t arg_cnt = argument_list();
-            if (idx > UINT8_MAX) emit_bytes(4, CLOX_OP_INVOKE_16, idx & 0xff, idx >> 8, arg_cnt);
-            else emit_bytes(3, CLOX_OP_INVOKE, idx, arg_cnt);
+            uint8_t arg_cnt = argument_list(compiler);
+            compiler->resolver->call_start = current_chunk(compiler)->count;
+            if (idx > UINT8_MAX) emit_bytes(compiler, 4, CLOX_OP_INVOKE_16, idx & 0xff, idx >> 8, arg_cnt);
+            else emit_bytes(compiler, 3, CLOX_OP_INVOKE, idx, arg_cnt);
+            compiler->resolver->call_end = current_chunk(compiler)->count;
         } else {
             // get property
-            if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_GET_PROPERTY_16, idx & 0xff, idx >> 8);
-            else emit_bytes(2, CLOX_OP_GET_PROPERTY, idx);
+            if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_GET_PROPERTY_16, idx & 0xff, idx >> 8);
+            else emit_bytes(compiler, 2, CLOX_OP_GET_PROPERTY, idx);
         }
     }
 }
 
-static uint8_t argument_list() {
+static uint8_t argument_list(Compiler *compiler) {
     int arg_cnt = 0;
-    if (!check(CLOX_TOKEN_RIGHT_PAREN)) {
+    if (!check(CLOX_TOKEN_RIGHT_PAREN, compiler)) {
         do {
             // add an argument into stack
-            expression();
-            if (arg_cnt == 256) error_report(parser->current, "Can't have more than 255 arguments.");
+            expression(compiler);
+            if (arg_cnt == 256) error_report(compiler->parser->current, "Can't have more than 255 arguments.", compiler);
             arg_cnt++;
-        } while (match(CLOX_TOKEN_COMMA));
+        } while (match(CLOX_TOKEN_COMMA, compiler));
     }
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after arguments.", compiler);
     return (uint8_t)arg_cnt;
 }
 
-static void number(bool assign) {
-    Value value = NUMBER_VALUE(strtod(parser->previous->lexeme, NULL));
-    emit_constant(value);
+static void list(bool assign, Compiler *compiler) {
+    int item_cnt = 0;
+    if (!check(CLOX_TOKEN_RIGHT_BRACKET, compiler)) {
+        do {
+            // allow a trailing comma
+            if (check(CLOX_TOKEN_RIGHT_BRACKET, compiler)) break;
+            expression(compiler);
+            if (item_cnt == 255) error_report(compiler->parser->previous, "Can't have more than 255 elements in a list literal.", compiler);
+            item_cnt++;
+        } while (match(CLOX_TOKEN_COMMA, compiler));
+    }
+    consume(CLOX_TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.", compiler);
+    emit_bytes(compiler, 2, CLOX_OP_LIST, item_cnt);
+}
+
+// '{' starts a block where a statement is expected, so a map literal is only parsed inside expressions
+static void map(bool assign, Compiler *compiler) {
+    int pair_cnt = 0;
+    if (!check(CLOX_TOKEN_RIGHT_BRACE, compiler)) {
+        do {
+            // allow a trailing comma
+            if (check(CLOX_TOKEN_RIGHT_BRACE, compiler)) break;
+            expression(compiler);
+            consume(CLOX_TOKEN_COLON, "Expect ':' after map key.", compiler);
+            expression(compiler);
+            if (pair_cnt == 255) error_report(compiler->parser->previous, "Can't have more than 255 entries in a map literal.", compiler);
+            pair_cnt++;
+        } while (match(CLOX_TOKEN_COMMA, compiler));
+    }
+    consume(CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after map entries.", compiler);
+    emit_bytes(compiler, 2, CLOX_OP_MAP, pair_cnt);
 }
 
-static void unary(bool assign) {
-    TokenType type = parser->previous->type;
+static void subscript(bool assign, Compiler *compiler) {
+    expression(compiler);
+    consume(CLOX_TOKEN_RIGHT_BRACKET, "Expect ']' after index.", compiler);
+    if (assign && match(CLOX_TOKEN_EQUAL, compiler)) {
+        expression(compiler);
+        emit_byte(CLOX_OP_SET_INDEX, compiler);
+    } else emit_byte(CLOX_OP_GET_INDEX, compiler);
+}
+
+static void number(bool assign, Compiler *compiler) {
+    Value value = canonical_number(strtod(compiler->parser->previous->lexeme, NULL));
+    emit_constant(value, compiler);
+}
+
+static void unary(bool assign, Compiler *compiler) {
+    TokenType type = compiler->parser->previous->type;
+    int start = current_chunk(compiler)->count;
     // right associate unary => precedence
-    parse_precedence(PREC_UNARY);
+    parse_precedence(PREC_UNARY, compiler);
+
+    // fold unary operation on a literal operand
+    ConstantLoad operand;
+    if (trailing_constant(&operand, compiler) && operand.offset == start) {
+        Value rst;
+        bool folded = true;
+        if (type == CLOX_TOKEN_BANG) rst = BOOL_VALUE(is_false(operand.value));
+        // an operand that is not an integer is left to report its error at runtime
+        else if (type == CLOX_TOKEN_TILDE) folded = bitwise(CLOX_OP_BIT_NOT, operand.value, NIL_VALUE, &rst) == NULL;
+        else if (!IS_NUMBER(operand.value)) folded = false;
+        else if (!negate_int(operand.value, &rst)) rst = NUMBER_VALUE(-AS_NUMBER(operand.value));
+        if (folded) {
+            truncate_chunk(current_chunk(compiler), operand.offset);
+            emit_constant(rst, compiler);
+            return;
+        }
+    }
+
     switch (type) {
         case CLOX_TOKEN_MINUS:
-            emit_byte(CLOX_OP_NEGATE);
+            emit_number_op(CLOX_OP_NEGATE, compiler);
+            break;
+        case CLOX_TOKEN_TILDE:
+            emit_number_op(CLOX_OP_BIT_NOT, compiler);
             break;
         case CLOX_TOKEN_BANG:
-            emit_byte(CLOX_OP_NOT);
+            emit_byte(CLOX_OP_NOT, compiler);
             break;
         default:
             // never reach here
@@ -875,47 +1555,83 @@ static void unary(bool assign) {
     }
 }
 
-static void binary(bool assign) {
-    TokenType type = parser->previous->type;
+static void binary(bool assign, Compiler *compiler) {
+    TokenType type = compiler->parser->previous->type;
     ParserRule *rule = &rules[type];
+    ConstantLoad left;
+    bool left_constant = trailing_constant(&left, compiler);
+    bool left_number = trailing_number(compiler);
+    int start = current_chunk(compiler)->count;
     // left associate binary => precedence + 1 
-    parse_precedence((Precedence)(rule->precedence + 1));
+    parse_precedence((Precedence)(rule->precedence + 1), compiler);
+
+    ConstantLoad right;
+    if (trailing_constant(&right, compiler) && right.offset == start) {
+        Value rst;
+        // both operands are literals
+        if (left_constant && fold_binary(type, left.value, right.value, &rst, compiler)) {
+            truncate_chunk(current_chunk(compiler), left.offset);
+            emit_constant(rst, compiler);
+            return;
+        }
+        // operation leaves a number operand unchanged
+        if (left_number && fold_identity(type, right.value)) {
+            truncate_chunk(current_chunk(compiler), right.offset);
+            return;
+        }
+    }
+
     switch (type) {
         case CLOX_TOKEN_PLUS:
-            emit_byte(CLOX_OP_ADD);
+            emit_byte(CLOX_OP_ADD, compiler);
             break;
         case CLOX_TOKEN_MINUS:
-            emit_byte(CLOX_OP_SUBTRACT);
+            emit_number_op(CLOX_OP_SUBTRACT, compiler);
             break;
         case CLOX_TOKEN_STAR:
-            emit_byte(CLOX_OP_MULTIPLY);
+            emit_number_op(CLOX_OP_MULTIPLY, compiler);
             break;
         case CLOX_TOKEN_SLASH:
-            emit_byte(CLOX_OP_DIVIDE);
+            emit_number_op(CLOX_OP_DIVIDE, compiler);
             break;
         case CLOX_TOKEN_PERCENT:
-            emit_byte(CLOX_OP_MODULO);
+            emit_number_op(CLOX_OP_MODULO, compiler);
             break;
         case CLOX_TOKEN_STAR_STAR:
-            emit_byte(CLOX_OP_POWER);
+            emit_number_op(CLOX_OP_POWER, compiler);
+            break;
+        case CLOX_TOKEN_AMPERSAND:
+            emit_number_op(CLOX_OP_BIT_AND, compiler);
+            break;
+        case CLOX_TOKEN_PIPE:
+            emit_number_op(CLOX_OP_BIT_OR, compiler);
+            break;
+        case CLOX_TOKEN_CARET:
+            emit_number_op(CLOX_OP_BIT_XOR, compiler);
+            break;
+        case CLOX_TOKEN_LESS_LESS:
+            emit_number_op(CLOX_OP_SHIFT_LEFT, compiler);
+            break;
+        case CLOX_TOKEN_GREATER_GREATER:
+            emit_number_op(CLOX_OP_SHIFT_RIGHT, compiler);
             break;
         case CLOX_TOKEN_EQUAL_EQUAL:
-            emit_byte(CLOX_OP_EQUAL);
+            emit_byte(CLOX_OP_EQUAL, compiler);
             break;
         case CLOX_TOKEN_BANG_EQUAL:
-            emit_bytes(2, CLOX_OP_EQUAL, CLOX_OP_NOT);
+            emit_bytes(compiler, 2, CLOX_OP_EQUAL, CLOX_OP_NOT);
             break;
         case CLOX_TOKEN_GREATER:
-            emit_byte(CLOX_OP_GREATER);
+            emit_byte(CLOX_OP_GREATER, compiler);
             break;
         case CLOX_TOKEN_GREATER_EQUAL:
-            emit_bytes(2, CLOX_OP_LESS, CLOX_OP_NOT);
+            emit_bytes(compiler, 2, CLOX_OP_LESS, CLOX_OP_NOT);
             break;
         case CLOX_TOKEN_LESS:
-            emit_byte(CLOX_OP_LESS);
+            emit_byte(CLOX_OP_LESS, compiler);
             break;
         case CLOX_TOKEN_LESS_EQUAL:
-            emit_bytes(2, CLOX_OP_GREATER, CLOX_OP_NOT);
+            emit_bytes(compiler, 2, CLOX_OP_GREATER, CLOX_OP_NOT);
             break;
         default:
             // never reach
@@ -923,17 +1639,17 @@ static void binary(bool assign) {
     }
 }
 
-static void literal(bool assign) {
-    TokenType type = parser->previous->type;
+static void literal(bool assign, Compiler *compiler) {
+    TokenType type = compiler->parser->previous->type;
     switch (type) {
         case CLOX_TOKEN_NIL:
-            emit_byte(CLOX_OP_NIL);
+            emit_constant(NIL_VALUE, compiler);
             break;
         case CLOX_TOKEN_TRUE:
-            emit_byte(CLOX_OP_TRUE);
+            emit_constant(BOOL_VALUE(true), compiler);
             break;
         case CLOX_TOKEN_FALSE:
-            emit_byte(CLOX_OP_FALSE);
+            emit_constant(BOOL_VALUE(false), compiler);
             break;
         default:
             // never reach
@@ -941,127 +1657,303 @@ static void literal(bool assign) {
     }
 }
 
-static void string(bool assign) {
+static void string(bool assign, Compiler *compiler) {
     // remove double quote
-    int length = parser->previous->length - 2;
-    Value value = OBJ_VALUE(new_string(parser->previous->lexeme + 1, length));
-    emit_constant(value);
+    int length = compiler->parser->previous->length - 2;
+    Value value = OBJ_VALUE(new_string(compiler->parser->previous->lexeme + 1, length, compiler->vm));
+    emit_constant(value, compiler);
 }
 
-static void and(bool assign) {
-    int if_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
+static void and(bool assign, Compiler *compiler) {
+    int if_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE, compiler);
     // pop on left operand is true
-    emit_byte(CLOX_OP_POP);
-    parse_precedence(PREC_AND);
-    patch_jump(if_jump);
+    emit_byte(CLOX_OP_POP, compiler);
+    parse_precedence(PREC_AND, compiler);
+    patch_jump(if_jump, compiler);
 }
 
-static void or(bool assign) {
-    int else_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
-    int end_jump = emit_jump(CLOX_OP_JUMP);
-    patch_jump(else_jump);
+static void or(bool assign, Compiler *compiler) {
+    int else_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE, compiler);
+    int end_jump = emit_jump(CLOX_OP_JUMP, compiler);
+    patch_jump(else_jump, compiler);
     // pop on left operand is false
-    emit_byte(CLOX_OP_POP);
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
-}
-
-static void xor(bool assign) {
-    parse_precedence(PREC_XOR);
-    int if_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
+    emit_byte(CLOX_OP_POP, compiler);
+    parse_precedence(PREC_OR, compiler);
+    patch_jump(end_jump, compiler);
+}
+
+static void xor(bool assign, Compiler *compiler) {
+    ConstantLoad left, right;
+    bool left_constant = trailing_constant(&left, compiler);
+    int start = current_chunk(compiler)->count;
+    parse_precedence(PREC_XOR, compiler);
+    if (left_constant && trailing_constant(&right, compiler) && right.offset == start) {
+        // falsey right operand keeps left operand, otherwise left operand is negated
+        Value rst = is_false(right.value) ? left.value : BOOL_VALUE(is_false(left.value));
+        truncate_chunk(current_chunk(compiler), left.offset);
+        emit_constant(rst, compiler);
+        return;
+    }
+    int if_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE, compiler);
     // pop on right operand is true
-    emit_byte(CLOX_OP_POP);
-    emit_byte(CLOX_OP_NOT);
-    int pop_jump = emit_jump(CLOX_OP_JUMP);
-    patch_jump(if_jump);
+    emit_byte(CLOX_OP_POP, compiler);
+    emit_byte(CLOX_OP_NOT, compiler);
+    int pop_jump = emit_jump(CLOX_OP_JUMP, compiler);
+    patch_jump(if_jump, compiler);
     // pop on right operand is false
-    emit_byte(CLOX_OP_POP);
-    patch_jump(pop_jump);
+    emit_byte(CLOX_OP_POP, compiler);
+    patch_jump(pop_jump, compiler);
 }
 
 // just treat this as a variable, let @function: variable handles all parsing
-static void this(bool assign) {
-    if (current_class == NULL) {
-        error_report(parser->previous, "Can't use 'this' outside of a class.");
+static void this(bool assign, Compiler *compiler) {
+    if (compiler->class_resolver == NULL) {
+        error_report(compiler->parser->previous, "Can't use 'this' outside of a class.", compiler);
         return;
     }
     // this cannot be reassigned to any other values
-    variable(false);
+    variable(false, compiler);
 }
 
-static void super(bool assign) {
-    if (current_class == NULL) {
-        error_report(parser->previous, "Can't use 'super' outside of a class.");
+static void super(bool assign, Compiler *compiler) {
+    if (compiler->class_resolver == NULL) {
+        error_report(compiler->parser->previous, "Can't use 'super' outside of a class.", compiler);
         return;
-    } else if (!current_class->has_super) {
-        error_report(parser->previous, "Can't use 'super' in a class with no superclass.");
+    } else if (!compiler->class_resolver->has_super) {
+        error_report(compiler->parser->previous, "Can't use 'super' in a class with no superclass.", compiler);
         return;
     }
-    consume(CLOX_TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(CLOX_TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint16_t idx = identifier_constant(parser->previous);
+    consume(CLOX_TOKEN_DOT, "Expect '.' after 'super'.", compiler);
+    consume(CLOX_TOKEN_IDENTIFIER, "Expect superclass method name.", compiler);
+    uint16_t idx = identifier_constant(compiler->parser->previous, compiler);
     // load current instance
-    named_variable(&THIS_TOKEN, false);
+    named_variable(&THIS_TOKEN, false, compiler);
     
-    if (match(CLOX_TOKEN_LEFT_PAREN)) {
-        uint8_t arg_cnt = argument_list();
+    if (match(CLOX_TOKEN_LEFT_PAREN, compiler)) {
+        uint8_t arg_cnt = argument_list(compiler);
         // load super klass
-        named_variable(&SUPER_TOKEN, false);
-        if (idx > UINT8_MAX) emit_bytes(4, CLOX_OP_INVOKE_SUPER_16, idx & 0xff, idx >> 8, arg_cnt);
-        else emit_bytes(3, CLOX_OP_INVOKE_SUPER, idx, arg_cnt);
+        named_variable(&SUPER_TOKEN, false, compiler);
+        compiler->resolver->call_start = current_chunk(compiler)->count;
+        if (idx > UINT8_MAX) emit_bytes(compiler, 4, CLOX_OP_INVOKE_SUPER_16, idx & 0xff, idx >> 8, arg_cnt);
+        else emit_bytes(compiler, 3, CLOX_OP_INVOKE_SUPER, idx, arg_cnt);
+        compiler->resolver->call_end = current_chunk(compiler)->count;
     } else {
         // load super klass
-        named_variable(&SUPER_TOKEN, false);
-        if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_GET_SUPER_16, idx & 0xff, idx >> 8);
-        else emit_bytes(2, CLOX_OP_GET_SUPER, idx);
+        named_variable(&SUPER_TOKEN, false, compiler);
+        if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_GET_SUPER_16, idx & 0xff, idx >> 8);
+        else emit_bytes(compiler, 2, CLOX_OP_GET_SUPER, idx);
     }
 }
 
-static void emit_byte(uint8_t byte) {
-    write_chunk(current_chunk(), byte, parser->previous->location.line, parser->previous->location.column);
+static void emit_byte(uint8_t byte, Compiler *compiler) {
+    write_chunk(current_chunk(compiler), byte, compiler->parser->previous->location.line, compiler->parser->previous->location.column, compiler->vm);
 }
 
-static void emit_bytes(int cnt, ...) {
+static void emit_bytes(Compiler *compiler, int cnt, ...) {
     va_list args;
     va_start(args, cnt);
-    for (int i = 0; i < cnt; i++) emit_byte(va_arg(args, int));
+    for (int i = 0; i < cnt; i++) emit_byte(va_arg(args, int), compiler);
     va_end(args);
 }
 
-static void emit_nil_return() {
+static void emit_nil_return(Compiler *compiler) {
     // for initializer, slot 0 is instance
-    if (current_resolver->type == TYPE_INITIALIZER) emit_bytes(2, CLOX_OP_GET_LOCAL, 0);
-    else emit_byte(CLOX_OP_NIL);
-    emit_return();
+    if (compiler->resolver->type == TYPE_INITIALIZER) emit_bytes(compiler, 2, CLOX_OP_GET_LOCAL, 0);
+    else emit_byte(CLOX_OP_NIL, compiler);
+    emit_return(compiler);
+}
+
+static void emit_return(Compiler *compiler) {
+    emit_byte(CLOX_OP_RETURN, compiler);
 }
 
-static void emit_return() {
-    emit_byte(CLOX_OP_RETURN);
+static void emit_constant(Value value, Compiler *compiler) {
+    int offset = current_chunk(compiler)->count;
+    if (IS_NIL(value)) emit_byte(CLOX_OP_NIL, compiler);
+    else if (IS_BOOL(value)) emit_byte(AS_BOOL(value) ? CLOX_OP_TRUE : CLOX_OP_FALSE, compiler);
+    else {
+        uint16_t idx = make_constant(value, compiler);
+        if (idx > UINT8_MAX) emit_bytes(compiler, 3, CLOX_OP_CONSTANT_16, idx & 0xff, idx >> 8);
+        else emit_bytes(compiler, 2, CLOX_OP_CONSTANT, idx);
+    }
+    compiler->resolver->last_constant.offset = offset;
+    compiler->resolver->last_constant.end = current_chunk(compiler)->count;
+    compiler->resolver->last_constant.value = value;
+}
+
+// emit an arithmetic instruction, which either produces a number or raises runtime error
+static void emit_number_op(uint8_t instruction, Compiler *compiler) {
+    compiler->resolver->number_offset = current_chunk(compiler)->count;
+    emit_byte(instruction, compiler);
+    compiler->resolver->number_end = current_chunk(compiler)->count;
 }
 
-static void emit_constant(Value value) {
-    uint16_t idx = make_constant(value);
-    if (idx > UINT8_MAX) emit_bytes(3, CLOX_OP_CONSTANT_16, idx & 0xff, idx >> 8);
-    else emit_bytes(2, CLOX_OP_CONSTANT, idx);
+/**
+ * check if chunk ends with a constant load, which no jump lands inside
+ * a jump may land at start of the load, the folded load starts at the same offset
+ */
+static bool trailing_constant(ConstantLoad *load, Compiler *compiler) {
+    Resolver *resolver = compiler->resolver;
+    if (resolver->last_constant.offset == -1) return false;
+    if (resolver->last_constant.end != current_chunk(compiler)->count) return false;
+    if (resolver->jump_target > resolver->last_constant.offset) return false;
+    *load = resolver->last_constant;
+    return true;
+}
+
+static bool trailing_number(Compiler *compiler) {
+    Resolver *resolver = compiler->resolver;
+    if (resolver->number_offset == -1 || resolver->number_end != current_chunk(compiler)->count) return false;
+    return resolver->jump_target <= resolver->number_offset;
+}
+
+// evaluate binary operation on literals as vm does, returns false if it must be left to runtime
+static bool fold_binary(TokenType type, Value a, Value b, Value *rst, Compiler *compiler) {
+    switch (type) {
+        case CLOX_TOKEN_EQUAL_EQUAL:
+            *rst = BOOL_VALUE(values_equal(a, b));
+            return true;
+        case CLOX_TOKEN_BANG_EQUAL:
+            *rst = BOOL_VALUE(!values_equal(a, b));
+            return true;
+        case CLOX_TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                // both operands are in constant pool, which is reachable by gc
+                *rst = append_string(a, b, compiler->vm);
+                return true;
+            }
+            break;
+        default: break;
+    }
+
+    // the rest operations are on numbers, type errors are reported at runtime
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    switch (type) {
+        case CLOX_TOKEN_AMPERSAND:       return bitwise(CLOX_OP_BIT_AND, a, b, rst) == NULL;
+        case CLOX_TOKEN_PIPE:            return bitwise(CLOX_OP_BIT_OR, a, b, rst) == NULL;
+        case CLOX_TOKEN_CARET:           return bitwise(CLOX_OP_BIT_XOR, a, b, rst) == NULL;
+        case CLOX_TOKEN_LESS_LESS:       return bitwise(CLOX_OP_SHIFT_LEFT, a, b, rst) == NULL;
+        case CLOX_TOKEN_GREATER_GREATER: return bitwise(CLOX_OP_SHIFT_RIGHT, a, b, rst) == NULL;
+        default: break;
+    }
+    // ints fold to an int just as vm computes them
+    if (type == CLOX_TOKEN_PLUS && add_ints(a, b, rst)) return true;
+    if (type == CLOX_TOKEN_MINUS && subtract_ints(a, b, rst)) return true;
+    if (type == CLOX_TOKEN_STAR && multiply_ints(a, b, rst)) return true;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (type) {
+        case CLOX_TOKEN_PLUS:          *rst = NUMBER_VALUE(x + y); return true;
+        case CLOX_TOKEN_MINUS:         *rst = NUMBER_VALUE(x - y); return true;
+        case CLOX_TOKEN_STAR:          *rst = NUMBER_VALUE(x * y); return true;
+        case CLOX_TOKEN_SLASH:         *rst = NUMBER_VALUE(x / y); return true;
+        case CLOX_TOKEN_STAR_STAR:     *rst = NUMBER_VALUE(pow(x, y)); return true;
+        case CLOX_TOKEN_GREATER:       *rst = BOOL_VALUE(x > y); return true;
+        case CLOX_TOKEN_GREATER_EQUAL: *rst = BOOL_VALUE(x >= y); return true;
+        case CLOX_TOKEN_LESS:          *rst = BOOL_VALUE(x < y); return true;
+        case CLOX_TOKEN_LESS_EQUAL:    *rst = BOOL_VALUE(x <= y); return true;
+        // modulo by zero is left to runtime to report
+        case CLOX_TOKEN_PERCENT:       return modulo_numbers(a, b, rst);
+        default: return false;
+    }
+}
+
+// x - 0, x * 1, x / 1 and x ** 1 equal to x for any number x (including -0 and nan)
+static bool fold_identity(TokenType type, Value b) {
+    if (!IS_NUMBER(b)) return false;
+    double y = AS_NUMBER(b);
+    uint64_t bits;
+    memcpy(&bits, &y, sizeof(uint64_t));
+    switch (type) {
+        // x - (-0) turns -0 into 0, only positive zero is an identity
+        case CLOX_TOKEN_MINUS:     return bits == 0;
+        case CLOX_TOKEN_STAR:
+        case CLOX_TOKEN_SLASH:
+        case CLOX_TOKEN_STAR_STAR: return y == 1;
+        default: return false;
+    }
 }
 
 /** 
  * max size of constant pool is 65536 (0 ~ 65535)
+ * numbers and strings already in constant pool are reused
  */
-static uint16_t make_constant(Value value) {
-    int idx = append_constant(current_chunk(), value);
-    if (idx > UINT16_MAX) error_report(parser->previous, "Too many constants in one chunk.");
+static uint16_t make_constant(Value value, Compiler *compiler) {
+    uint64_t key;
+    bool dedup = constant_key(value, &key);
+    if (dedup) {
+        ConstantMap *constants = &compiler->resolver->constants;
+        ConstantEntry *entry = find_constant(constants->entries, constants->capacity, key, value);
+        if (entry != NULL && entry->idx != -1) return (uint16_t)entry->idx;
+    }
+    // append before add into map, constant pool keeps value reachable while map grows
+    int idx = append_constant(current_chunk(compiler), value, compiler->vm);
+    if (idx > UINT16_MAX) error_report(compiler->parser->previous, "Too many constants in one chunk.", compiler);
+    else if (dedup) add_constant(key, value, idx, compiler);
     return (uint16_t)idx;
 }
 
-static uint16_t identifier_constant(Token* identifier) {
-    StringObj *identifier_string = new_string(identifier->lexeme, identifier->length);
-    return make_constant(OBJ_VALUE(identifier_string));
+static uint16_t identifier_constant(Token* identifier, Compiler *compiler) {
+    StringObj *identifier_string = new_string(identifier->lexeme, identifier->length, compiler->vm);
+    return make_constant(OBJ_VALUE(identifier_string), compiler);
+}
+
+// numbers are compared by boxed bits (keep 0 and -0 apart, and an int apart from a double of same value)
+// strings are compared by address (interned)
+static bool constant_key(Value value, uint64_t *key) {
+    if (IS_NUMBER(value)) {
+#ifdef NAN_BOXING
+        *key = value;
+#else
+        double number = AS_NUMBER(value);
+        memcpy(key, &number, sizeof(uint64_t));
+#endif // NAN_BOXING
+        return true;
+    }
+    if (IS_STRING(value)) {
+        *key = (uint64_t)(uintptr_t)AS_OBJ(value);
+        return true;
+    }
+    return false;
+}
+
+static ConstantEntry* find_constant(ConstantEntry *entries, int capacity, uint64_t key, Value value) {
+    if (capacity == 0) return NULL;
+    uint64_t hash = key ^ (key >> 32);
+    hash *= 0x9e3779b97f4a7c15;
+    for (int i = 0; i < capacity; i++) {
+        ConstantEntry *entry = &entries[((hash >> 32) + i) & (capacity - 1)];
+        if (entry->idx == -1) return entry;
+        if (entry->key == key && IS_NUMBER(entry->value) == IS_NUMBER(value)) return entry;
+    }
+    return NULL;
+}
+
+static void add_constant(uint64_t key, Value value, int idx, Compiler *compiler) {
+    ConstantMap *constants = &compiler->resolver->constants;
+    if (constants->count + 1 > constants->capacity * 0.75) {
+        int new_capacity = GROW_CAPACITY(constants->capacity);
+        ConstantEntry *entries = ALLOCATE(ConstantEntry, new_capacity, compiler->vm);
+        for (int i = 0; i < new_capacity; i++) entries[i].idx = -1;
+        for (int i = 0; i < constants->capacity; i++) {
+            ConstantEntry *entry = &constants->entries[i];
+            if (entry->idx == -1) continue;
+            *find_constant(entries, new_capacity, entry->key, entry->value) = *entry;
+        }
+        FREE_ARRAY(ConstantEntry, constants->entries, constants->capacity, compiler->vm);
+        constants->entries = entries;
+        constants->capacity = new_capacity;
+    }
+    ConstantEntry *entry = find_constant(constants->entries, constants->capacity, key, value);
+    entry->key = key;
+    entry->value = value;
+    entry->idx = idx;
+    constants->count++;
 }
 
-static int emit_jump(uint8_t instruction) {
-    emit_bytes(3, instruction, 0xff, 0xff);
-    return current_chunk()->count - 2;
+static int emit_jump(uint8_t instruction, Compiler *compiler) {
+    emit_bytes(compiler, 3, instruction, 0xff, 0xff);
+    return current_chunk(compiler)->count - 2;
 }
 
 // patch distance from current to @param: offset to @param:offset
@@ -1071,10 +1963,11 @@ static int emit_jump(uint8_t instruction) {
 //     ...         | ---- 
 //     ...         |    | -> @return: jump (caled by current function)
 // -> current      | ----
-static void patch_jump(int offset) {
-    Chunk *chunk = current_chunk();
+static void patch_jump(int offset, Compiler *compiler) {
+    Chunk *chunk = current_chunk(compiler);
+    compiler->resolver->jump_target = chunk->count;
     int jump = chunk->count - offset - 2;
-    if (jump > UINT16_MAX) error_report(parser->previous, "Too much code to jump over.");
+    if (jump > UINT16_MAX) error_report(compiler->parser->previous, "Too much code to jump over.", compiler);
     chunk->code[offset] = jump & 0xff;
     chunk->code[offset + 1] = (jump >> 8) & 0xff;
 }
@@ -1086,14 +1979,14 @@ static void patch_jump(int offset) {
 // -> current (CLOX_OP_LOOP) |    | 
 // -> low bits               |    |
 // -> high bits              | ----
-static void emit_loop(int start) {
-    int jump = current_chunk()->count - start + 3;
-    emit_bytes(3, CLOX_OP_LOOP, jump & 0xff, (jump >> 8) & 0xff);
+static void emit_loop(int start, Compiler *compiler) {
+    int jump = current_chunk(compiler)->count - start + 3;
+    emit_bytes(compiler, 3, CLOX_OP_LOOP, jump & 0xff, (jump >> 8) & 0xff);
 }
 
-static void error_report(Token *token, const char *message) {
-    if (parser->panic_mode) return;
-    parser->panic_mode = true;
+static void error_report(Token *token, const char *message, Compiler *compiler) {
+    if (compiler->parser->panic_mode) return;
+    compiler->parser->panic_mode = true;
     fprintf(stderr, "[line %2d column %2d Error]", token->location.line, token->location.column);
     switch (token->type) {
         case CLOX_TOKEN_EOF:
@@ -1107,15 +2000,15 @@ static void error_report(Token *token, const char *message) {
             break;
     }
     fprintf(stderr, " : %s\n", message);
-    parser->had_error = true;
+    compiler->parser->had_error = true;
 }
 
-static void synchronize() {
-    parser->panic_mode = false;
+static void synchronize(Compiler *compiler) {
+    compiler->parser->panic_mode = false;
 
-    while (!check(CLOX_TOKEN_EOF)) {
-        if (parser->previous->type == CLOX_TOKEN_SEMICOLON) return;
-        switch (parser->current->type) {
+    while (!check(CLOX_TOKEN_EOF, compiler)) {
+        if (compiler->parser->previous->type == CLOX_TOKEN_SEMICOLON) return;
+        switch (compiler->parser->current->type) {
             case CLOX_TOKEN_CLASS:
             case CLOX_TOKEN_FUN:
             case CLOX_TOKEN_VAR:
@@ -1126,6 +2019,6 @@ static void synchronize() {
             case CLOX_TOKEN_RETURN: return;
             default: break;
         }
-        advance();
+        advance(compiler);
     }
 }
\ No newline at end of file
@@ -6,7 +6,21 @@
 
 #define UINT16_COUNT (UINT16_MAX + 1) 
 
-FunctionObj* compile(const char *source);
-void mark_compiler_roots();
+typedef struct {
+    // 0 emits bytecode as parsed, higher levels run more passes of optimizer
+    int optimize_level;
+    // run functions on register vm where possible
+    bool register_vm;
+    // compile hot functions into machine code
+    bool jit;
+    // limit of call depth
+    int max_depth;
+} CompileOptions;
+
+// state of one compilation, a vm refers to it while compiling so functions under construction are gc roots
+typedef struct Compiler Compiler;
+
+FunctionObj* compile(const char *source, CompileOptions *options, VM *vm);
+void mark_compiler_roots(VM *vm);
 
 #endif
\ No newline at end of file
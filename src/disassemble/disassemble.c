@@ -5,6 +5,10 @@
 static void print_prelude(Chunk *chunk, int offset);
 static int invoke(const char *name, Chunk *chunk, int offset);
 static int invoke_16(const char *name, Chunk *chunk, int offset);
+static int for_iter(const char *name, Chunk *chunk, int offset);
+static int increment(const char *name, Chunk *chunk, int offset, bool named);
+static int add_local_constant(const char *name, Chunk *chunk, int offset);
+static int update_property(const char *name, Chunk *chunk, int offset);
 static int non_operand(const char *name, int offset);
 static int single_operand(const char *name, Chunk *chunk, int offset);
 static int double_operand(const char *name, Chunk *chunk, int offset);
@@ -42,6 +46,12 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         case CLOX_OP_MULTIPLY:         return non_operand("CLOX_OP_MULTIPLY", offset);
         case CLOX_OP_DIVIDE:           return non_operand("CLOX_OP_DIVIDE", offset);
         case CLOX_OP_MODULO:           return non_operand("CLOX_OP_MODULO", offset);
+        case CLOX_OP_BIT_AND:          return non_operand("CLOX_OP_BIT_AND", offset);
+        case CLOX_OP_BIT_OR:           return non_operand("CLOX_OP_BIT_OR", offset);
+        case CLOX_OP_BIT_XOR:          return non_operand("CLOX_OP_BIT_XOR", offset);
+        case CLOX_OP_SHIFT_LEFT:       return non_operand("CLOX_OP_SHIFT_LEFT", offset);
+        case CLOX_OP_SHIFT_RIGHT:      return non_operand("CLOX_OP_SHIFT_RIGHT", offset);
+        case CLOX_OP_BIT_NOT:          return non_operand("CLOX_OP_BIT_NOT", offset);
         case CLOX_OP_NOT:              return non_operand("CLOX_OP_NOT", offset);
         case CLOX_OP_GREATER:          return non_operand("CLOX_OP_GREATER", offset);
         case CLOX_OP_LESS:             return non_operand("CLOX_OP_LESS", offset);
@@ -62,6 +72,7 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         case CLOX_OP_JUMP:             return double_operand("CLOX_OP_JUMP", chunk, offset);
         case CLOX_OP_LOOP:             return double_operand("CLOX_OP_LOOP", chunk, offset);
         case CLOX_OP_CALL:             return single_operand("CLOX_OP_CALL", chunk, offset);
+        case CLOX_OP_TAIL_CALL:        return single_operand("CLOX_OP_TAIL_CALL", chunk, offset);
         case CLOX_OP_CLOSURE:          return function("CLOX_OP_CLOSURE", chunk, offset);
         case CLOX_OP_CLOSURE_16:       return function_16("CLOX_OP_CLOSURE_16", chunk, offset);
         case CLOX_OP_GET_UPVALUE:      return single_operand("CLOX_OP_GET_UPVALUE", chunk, offset);
@@ -84,6 +95,40 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         case CLOX_OP_GET_SUPER_16:     return constant("CLOX_OP_GET_SUPER_16", chunk, offset);
         case CLOX_OP_INVOKE_SUPER:     return invoke("CLOX_OP_INVOKE_SUPER", chunk, offset);
         case CLOX_OP_INVOKE_SUPER_16:  return invoke_16("CLOX_OP_INVOKE_SUPER_16", chunk, offset);
+        case CLOX_OP_TAIL_INVOKE:      return invoke("CLOX_OP_TAIL_INVOKE", chunk, offset);
+        case CLOX_OP_TAIL_INVOKE_16:   return invoke_16("CLOX_OP_TAIL_INVOKE_16", chunk, offset);
+        case CLOX_OP_TAIL_INVOKE_SUPER:    return invoke("CLOX_OP_TAIL_INVOKE_SUPER", chunk, offset);
+        case CLOX_OP_TAIL_INVOKE_SUPER_16: return invoke_16("CLOX_OP_TAIL_INVOKE_SUPER_16", chunk, offset);
+        case CLOX_OP_LIST:             return single_operand("CLOX_OP_LIST", chunk, offset);
+        case CLOX_OP_MAP:              return single_operand("CLOX_OP_MAP", chunk, offset);
+        case CLOX_OP_GET_INDEX:        return non_operand("CLOX_OP_GET_INDEX", offset);
+        case CLOX_OP_SET_INDEX:        return non_operand("CLOX_OP_SET_INDEX", offset);
+        case CLOX_OP_FOR_ITER:         return for_iter("CLOX_OP_FOR_ITER", chunk, offset);
+        case CLOX_OP_INC_LOCAL:        return increment("CLOX_OP_INC_LOCAL", chunk, offset, false);
+        case CLOX_OP_ADD_LOCAL_CONST:  return add_local_constant("CLOX_OP_ADD_LOCAL_CONST", chunk, offset);
+        case CLOX_OP_INC_UPVALUE:      return increment("CLOX_OP_INC_UPVALUE", chunk, offset, false);
+        case CLOX_OP_INC_GLOBAL:       return increment("CLOX_OP_INC_GLOBAL", chunk, offset, true);
+        case CLOX_OP_INC_PROPERTY:     return increment("CLOX_OP_INC_PROPERTY", chunk, offset, true);
+        case CLOX_OP_UPDATE_PROPERTY:  return update_property("CLOX_OP_UPDATE_PROPERTY", chunk, offset);
+        case CLOX_OP_GET_OUTER:        return single_operand("CLOX_OP_GET_OUTER", chunk, offset);
+        case CLOX_OP_GET_OUTER_16:     return double_operand("CLOX_OP_GET_OUTER_16", chunk, offset);
+        case CLOX_OP_SET_OUTER:        return single_operand("CLOX_OP_SET_OUTER", chunk, offset);
+        case CLOX_OP_SET_OUTER_16:     return double_operand("CLOX_OP_SET_OUTER_16", chunk, offset);
+        case CLOX_OP_INC_OUTER:        return increment("CLOX_OP_INC_OUTER", chunk, offset, false);
+        case CLOX_OP_GET_CAPTURE:      return single_operand("CLOX_OP_GET_CAPTURE", chunk, offset);
+        case CLOX_OP_GET_CAPTURE_16:   return double_operand("CLOX_OP_GET_CAPTURE_16", chunk, offset);
+        case CLOX_OP_ADD_NUM:          return non_operand("CLOX_OP_ADD_NUM", offset);
+        case CLOX_OP_SUBTRACT_NUM:     return non_operand("CLOX_OP_SUBTRACT_NUM", offset);
+        case CLOX_OP_MULTIPLY_NUM:     return non_operand("CLOX_OP_MULTIPLY_NUM", offset);
+        case CLOX_OP_DIVIDE_NUM:       return non_operand("CLOX_OP_DIVIDE_NUM", offset);
+        case CLOX_OP_GREATER_NUM:      return non_operand("CLOX_OP_GREATER_NUM", offset);
+        case CLOX_OP_LESS_NUM:         return non_operand("CLOX_OP_LESS_NUM", offset);
+        case CLOX_OP_JUMP_IF_FALSE_BOOL: return double_operand("CLOX_OP_JUMP_IF_FALSE_BOOL", chunk, offset);
+        case CLOX_OP_ADD_INT:          return non_operand("CLOX_OP_ADD_INT", offset);
+        case CLOX_OP_SUBTRACT_INT:     return non_operand("CLOX_OP_SUBTRACT_INT", offset);
+        case CLOX_OP_MULTIPLY_INT:     return non_operand("CLOX_OP_MULTIPLY_INT", offset);
+        case CLOX_OP_GREATER_INT:      return non_operand("CLOX_OP_GREATER_INT", offset);
+        case CLOX_OP_LESS_INT:         return non_operand("CLOX_OP_LESS_INT", offset);
         default: break;
     }
     return chunk->count;
@@ -93,8 +138,11 @@ static void print_prelude(Chunk *chunk, int offset) {
     // 0 is used for padding (at least 4 characters width), default is right-justified
     printf("%04d ", offset);
     // line info with 4 characters width
-    if (offset > 0 && chunk->line_info[offset] == chunk->line_info[offset - 1]) printf("   | ");
-    else printf("%4d ",chunk->line_info[offset]);
+    int line, column, prev_line = -1;
+    chunk_location(chunk, offset, &line, &column);
+    if (offset > 0) chunk_location(chunk, offset - 1, &prev_line, &column);
+    if (line == prev_line) printf("   | ");
+    else printf("%4d ", line);
 }
 
 static int invoke(const char *name, Chunk *chunk, int offset) {
@@ -113,6 +161,35 @@ static int invoke_16(const char *name, Chunk *chunk, int offset) {
     return offset + 1;
 }
 
+static int for_iter(const char *name, Chunk *chunk, int offset) {
+    offset = double_operand(name, chunk, offset);
+    print_prelude(chunk, offset);
+    print_idx(" ~ jump back", double_bytes(chunk, offset));
+    return offset + 2;
+}
+
+// @param named tells index is a constant of variable or property name
+static int increment(const char *name, Chunk *chunk, int offset, bool named) {
+    offset = named ? constant_16(name, chunk, offset) : double_operand(name, chunk, offset);
+    print_prelude(chunk, offset);
+    print_idx(" ~ delta", (int8_t)single_byte(chunk, offset));
+    return offset + 1;
+}
+
+static int add_local_constant(const char *name, Chunk *chunk, int offset) {
+    offset = double_operand(name, chunk, offset);
+    print_prelude(chunk, offset);
+    print_constant(" ~ constant", chunk, double_bytes(chunk, offset));
+    return offset + 2;
+}
+
+static int update_property(const char *name, Chunk *chunk, int offset) {
+    offset = constant_16(name, chunk, offset);
+    print_prelude(chunk, offset);
+    print_idx(" ~ opcode", single_byte(chunk, offset));
+    return offset + 1;
+}
+
 static int non_operand(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -176,10 +253,11 @@ static int print_function(const char *name, Chunk *chunk, int offset, int idx) {
     printf("\n");
 
     for (int i = 0; i < function->upvalue_cnt; i++, offset += 3) {
-        uint8_t is_local = single_byte(chunk, offset);
+        uint8_t kind = single_byte(chunk, offset);
         uint16_t idx = double_bytes(chunk, offset + 1);
         printf("%04d      | ", offset);
-        printf("%27s '%d\n", is_local ? "local" : "upvalue", idx);
+        const char *kinds[] = { "upvalue", "local", "frame", "copy local", "copy capture" };
+        printf("%27s '%d\n", kind < sizeof(kinds) / sizeof(kinds[0]) ? kinds[kind] : "?", idx);
     }
 
     return offset;
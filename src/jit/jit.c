@@ -0,0 +1,711 @@
+#include "jit.h"
+#include "chunk/chunk.h"
+#include "memory/memory.h"
+// added for memcpy
+#include <string.h>
+// added for offsetof
+#include <stddef.h>
+// added for va_list
+#include <stdarg.h>
+#if defined(__x86_64__) && defined(NAN_BOXING)
+// added for mmap
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) && defined(NAN_BOXING)
+
+/**
+ * baseline jit copies a machine code template per instruction, there is no dispatch between instructions
+ * values live in vm->stack exactly as in interpreter, so gc roots and stack traces are unchanged
+ * loads, stores, jumps and arithmetic on ints and doubles are inlined, everything else calls back into vm
+ *
+ * registers of compiled code:
+ *   r12 = frame->slots
+ *   r13 = frame index
+ *   r14 = frame
+ *   r15 = &vm->sp
+ * machine code belongs to the vm owning the function, addresses of that vm are embedded
+ * vm may move frames and stack during a call, so r14 and r12 are reloaded after every call back into vm
+ */
+
+// a forward jump waiting for native offset of its target
+typedef struct {
+    int offset;     // offset of rel32 in machine code
+    int target;     // offset of target in bytecode, -1 for error exit
+} JitPatch;
+
+typedef struct {
+    FunctionObj *function;
+    uint8_t *code;
+    int count;
+    int capacity;
+    int *offsets;   // bytecode offset -> machine code offset, -1 for not compiled yet
+    JitPatch *patches;
+    int patch_cnt;
+    int patch_capacity;
+    int error_exit; // machine code offset of exit with runtime error
+    VM *vm;
+} Assembler;
+
+static bool assemble(Assembler *as);
+static bool assemble_instruction(Assembler *as, int offset, int length, bool negated);
+static int instruction_length(Chunk *chunk, int offset);
+static void emit_byte(Assembler *as, uint8_t byte);
+static void emit_bytes(Assembler *as, int cnt, ...);
+static void emit_u32(Assembler *as, uint32_t value);
+static void emit_u64(Assembler *as, uint64_t value);
+static void emit_push(Assembler *as, Value value);
+static void emit_jump(Assembler *as, int target, bool conditional);
+static void emit_int_check(Assembler *as, int *misses);
+static void emit_number_check(Assembler *as, int *slow);
+static void emit_helper(Assembler *as, int pc_offset, void *helper, uint64_t arg1, uint64_t arg2, bool checked);
+static void emit_epilogue(Assembler *as, InterpreterResult rst);
+static void emit_load_frame(Assembler *as);
+static void add_patch(Assembler *as, int target);
+static void patch_rel8(Assembler *as, int at);
+static void patch_rel32(Assembler *as, int at);
+
+bool jit_supported() {
+    return true;
+}
+
+bool jit_compile(FunctionObj *function, VM *vm) {
+    Assembler as;
+    as.function = function;
+    as.vm = vm;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.patches = NULL;
+    as.patch_cnt = 0;
+    as.patch_capacity = 0;
+    as.offsets = ALLOCATE(int, function->chunk.count + 1, vm);
+    for (int i = 0; i <= function->chunk.count; i++) as.offsets[i] = -1;
+
+    bool ok = assemble(&as);
+    if (ok) {
+        // map writable, copy, then flip to executable, memory is never writable and executable at once
+        void *memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) ok = false;
+        else {
+            memcpy(memory, as.code, as.count);
+            if (mprotect(memory, as.count, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, as.count);
+                ok = false;
+            } else {
+                function->jit = memory;
+                function->jit_size = as.count;
+            }
+        }
+    }
+
+    FREE_ARRAY(JitPatch, as.patches, as.patch_capacity, vm);
+    FREE_ARRAY(int, as.offsets, function->chunk.count + 1, vm);
+    FREE_ARRAY(uint8_t, as.code, as.capacity, vm);
+    return ok;
+}
+
+void jit_free(FunctionObj *function) {
+    munmap(function->jit, function->jit_size);
+    function->jit = NULL;
+    function->jit_size = 0;
+}
+
+static bool assemble(Assembler *as) {
+    Chunk *chunk = &as->function->chunk;
+
+    // jump targets stop fusion of comparison and not
+    bool *targets = ALLOCATE(bool, chunk->count + 1, as->vm);
+    bool ok = true;
+    for (int i = 0; i <= chunk->count; i++) targets[i] = false;
+    for (int offset = 0; ok && offset < chunk->count;) {
+        int length = instruction_length(chunk, offset);
+        if (length <= 0 || offset + length > chunk->count) {
+            ok = false;
+            break;
+        }
+        uint8_t *code = chunk->code + offset;
+        uint8_t op = generic_opcode(*code);
+        if (op == CLOX_OP_JUMP || op == CLOX_OP_JUMP_IF_FALSE || op == CLOX_OP_LOOP) {
+            int distance = code[1] | (code[2] << 8);
+            int target = op == CLOX_OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+            if (target < 0 || target > chunk->count) ok = false;
+            else targets[target] = true;
+        }
+        offset += length;
+    }
+
+    if (ok) {
+        // prologue: push rbp; mov rbp, rsp; push r12; push r13; push r14; push r15 (keeps rsp 16-byte aligned)
+        emit_bytes(as, 12, 0x55, 0x48, 0x89, 0xe5, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+        // movsxd r13, edi
+        emit_bytes(as, 3, 0x4c, 0x63, 0xef);
+        emit_load_frame(as);
+        // mov r15, &vm->sp
+        emit_bytes(as, 2, 0x49, 0xbf);
+        emit_u64(as, (uint64_t)(uintptr_t)&as->vm->sp);
+    }
+
+    for (int offset = 0; ok && offset < chunk->count;) {
+        as->offsets[offset] = as->count;
+        int length = instruction_length(chunk, offset);
+        uint8_t op = generic_opcode(chunk->code[offset]);
+        bool negated = offset + length < chunk->count && chunk->code[offset + length] == CLOX_OP_NOT &&
+                       !targets[offset + length] && (op == CLOX_OP_EQUAL || op == CLOX_OP_GREATER || op == CLOX_OP_LESS);
+        if (negated) length++;
+        ok = assemble_instruction(as, offset, length, negated);
+        offset += length;
+    }
+    as->offsets[chunk->count] = as->count;
+
+    if (ok) {
+        // falling off the end never happens as compiler always ends function with return
+        as->error_exit = as->count;
+        emit_epilogue(as, INTERPRET_RUNTIME_ERROR);
+        for (int i = 0; i < as->patch_cnt; i++) {
+            JitPatch *patch = &as->patches[i];
+            int target = patch->target == -1 ? as->error_exit : as->offsets[patch->target];
+            if (target == -1) {
+                ok = false;
+                break;
+            }
+            int32_t rel = target - (patch->offset + 4);
+            memcpy(as->code + patch->offset, &rel, sizeof(int32_t));
+        }
+    }
+
+    FREE_ARRAY(bool, targets, chunk->count + 1, as->vm);
+    return ok;
+}
+
+static bool assemble_instruction(Assembler *as, int offset, int length, bool negated) {
+    Chunk *chunk = &as->function->chunk;
+    uint8_t *code = chunk->code + offset;
+    Value *constants = chunk->constant.values;
+    int next = offset + length;
+    // quickened instructions are compiled as generic ones, templates have their own type checks
+    uint8_t op = generic_opcode(code[0]);
+    switch (op) {
+        case CLOX_OP_CONSTANT:    emit_push(as, constants[code[1]]); break;
+        case CLOX_OP_CONSTANT_16: emit_push(as, constants[code[1] | (code[2] << 8)]); break;
+        case CLOX_OP_TRUE:        emit_push(as, BOOL_VALUE(true)); break;
+        case CLOX_OP_FALSE:       emit_push(as, BOOL_VALUE(false)); break;
+        case CLOX_OP_NIL:         emit_push(as, NIL_VALUE); break;
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_GET_LOCAL_16: {
+            int slot = op == CLOX_OP_GET_LOCAL ? code[1] : code[1] | (code[2] << 8);
+            // mov rcx, [r12 + slot * 8]; mov rax, [r15]; mov [rax], rcx; add qword [r15], 8
+            emit_bytes(as, 4, 0x49, 0x8b, 0x8c, 0x24);
+            emit_u32(as, slot * sizeof(Value));
+            emit_bytes(as, 10, 0x49, 0x8b, 0x07, 0x48, 0x89, 0x08, 0x49, 0x83, 0x07, 0x08);
+            break;
+        }
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_SET_LOCAL_16: {
+            int slot = op == CLOX_OP_SET_LOCAL ? code[1] : code[1] | (code[2] << 8);
+            // mov rax, [r15]; mov rcx, [rax - 8]; mov [r12 + slot * 8], rcx
+            emit_bytes(as, 11, 0x49, 0x8b, 0x07, 0x48, 0x8b, 0x48, 0xf8, 0x49, 0x89, 0x8c, 0x24);
+            emit_u32(as, slot * sizeof(Value));
+            break;
+        }
+        case CLOX_OP_GET_CAPTURE:
+        case CLOX_OP_GET_CAPTURE_16: {
+            int idx = op == CLOX_OP_GET_CAPTURE ? code[1] : code[1] | (code[2] << 8);
+            // mov rax, [r14 + closure]; mov rax, [rax + captures]; mov rcx, [rax + idx * 8], then push rcx
+            emit_bytes(as, 8, 0x49, 0x8b, 0x46, (uint8_t)offsetof(CallFrame, closure), 0x48, 0x8b, 0x40, (uint8_t)offsetof(ClosureObj, captures));
+            emit_bytes(as, 3, 0x48, 0x8b, 0x88);
+            emit_u32(as, idx * sizeof(Value));
+            emit_bytes(as, 10, 0x49, 0x8b, 0x07, 0x48, 0x89, 0x08, 0x49, 0x83, 0x07, 0x08);
+            break;
+        }
+        case CLOX_OP_POP:
+            // sub qword [r15], 8
+            emit_bytes(as, 4, 0x49, 0x83, 0x2f, 0x08);
+            break;
+        case CLOX_OP_JUMP:
+            emit_jump(as, next + (code[1] | (code[2] << 8)), false);
+            break;
+        case CLOX_OP_LOOP:
+            emit_jump(as, next - (code[1] | (code[2] << 8)), false);
+            break;
+        case CLOX_OP_JUMP_IF_FALSE: {
+            int target = next + (code[1] | (code[2] << 8));
+            // mov rax, [r15]; mov rcx, [rax - 8]
+            emit_bytes(as, 7, 0x49, 0x8b, 0x07, 0x48, 0x8b, 0x48, 0xf8);
+            // nil and false are the only falsy values: mov rdx, imm64; cmp rcx, rdx; je target
+            emit_bytes(as, 2, 0x48, 0xba);
+            emit_u64(as, NIL_VALUE);
+            emit_bytes(as, 3, 0x48, 0x39, 0xd1);
+            emit_jump(as, target, true);
+            emit_bytes(as, 2, 0x48, 0xba);
+            emit_u64(as, FALSE_VALUE);
+            emit_bytes(as, 3, 0x48, 0x39, 0xd1);
+            emit_jump(as, target, true);
+            break;
+        }
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DIVIDE: {
+            int done = -1;
+            if (op != CLOX_OP_DIVIDE) {
+                int misses[4] = {-1, -1, -1, -1};
+                emit_int_check(as, misses);
+                // mov edi, ecx; <op> edi, edx; jo miss
+                emit_bytes(as, 2, 0x89, 0xcf);
+                if (op == CLOX_OP_ADD) emit_bytes(as, 2, 0x01, 0xd7);
+                else if (op == CLOX_OP_SUBTRACT) emit_bytes(as, 2, 0x29, 0xd7);
+                else emit_bytes(as, 3, 0x0f, 0xaf, 0xfa);
+                emit_bytes(as, 2, 0x70, 0x00);
+                misses[2] = as->count - 1;
+                // a zero product may be -0, which only a double keeps: test edi, edi; jz miss
+                if (op == CLOX_OP_MULTIPLY) {
+                    emit_bytes(as, 4, 0x85, 0xff, 0x74, 0x00);
+                    misses[3] = as->count - 1;
+                }
+                // mov rsi, INT_TAG; or rdi, rsi; mov [rax - 16], rdi; sub qword [r15], 8; jmp done
+                emit_bytes(as, 2, 0x48, 0xbe);
+                emit_u64(as, INT_TAG);
+                emit_bytes(as, 7, 0x48, 0x09, 0xf7, 0x48, 0x89, 0x78, 0xf0);
+                emit_bytes(as, 5, 0x49, 0x83, 0x2f, 0x08, 0xe9);
+                done = as->count;
+                emit_u32(as, 0);
+                for (int i = 0; i < 4; i++) {
+                    if (misses[i] != -1) patch_rel8(as, misses[i]);
+                }
+            }
+            int slow;
+            emit_number_check(as, &slow);
+            // movq xmm0, rcx; movq xmm1, rdx; <op>sd xmm0, xmm1; movq [rax - 16], xmm0
+            emit_bytes(as, 10, 0x66, 0x48, 0x0f, 0x6e, 0xc1, 0x66, 0x48, 0x0f, 0x6e, 0xca);
+            uint8_t sse = op == CLOX_OP_ADD ? 0x58 : op == CLOX_OP_SUBTRACT ? 0x5c : op == CLOX_OP_MULTIPLY ? 0x59 : 0x5e;
+            emit_bytes(as, 4, 0xf2, 0x0f, sse, 0xc1);
+            emit_bytes(as, 5, 0x66, 0x0f, 0xd6, 0x40, 0xf0);
+            // sub qword [r15], 8; jmp end
+            emit_bytes(as, 6, 0x49, 0x83, 0x2f, 0x08, 0xeb, 0x00);
+            int end = as->count - 1;
+            patch_rel8(as, slow);
+            // strings, mixed ints and doubles, int overflow and type errors are left to vm
+            emit_helper(as, next, jit_binary, op, false, true);
+            patch_rel8(as, end);
+            if (done != -1) patch_rel32(as, done);
+            break;
+        }
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS: {
+            int misses[2];
+            emit_int_check(as, misses);
+            // cmp ecx, edx; setg / setle / setl / setge cl
+            bool less = op == CLOX_OP_LESS;
+            emit_bytes(as, 5, 0x39, 0xd1, 0x0f, less ? (negated ? 0x9d : 0x9c) : (negated ? 0x9e : 0x9f), 0xc1);
+            // movzx rcx, cl; mov rdx, false; add rdx, rcx; mov [rax - 16], rdx; sub qword [r15], 8; jmp done
+            emit_bytes(as, 6, 0x48, 0x0f, 0xb6, 0xc9, 0x48, 0xba);
+            emit_u64(as, FALSE_VALUE);
+            emit_bytes(as, 7, 0x48, 0x01, 0xca, 0x48, 0x89, 0x50, 0xf0);
+            emit_bytes(as, 5, 0x49, 0x83, 0x2f, 0x08, 0xe9);
+            int done = as->count;
+            emit_u32(as, 0);
+            patch_rel8(as, misses[0]);
+            patch_rel8(as, misses[1]);
+            int slow;
+            emit_number_check(as, &slow);
+            emit_bytes(as, 10, 0x66, 0x48, 0x0f, 0x6e, 0xc1, 0x66, 0x48, 0x0f, 0x6e, 0xca);
+            // unordered compare sets carry, so a nan operand makes every comparison false
+            //   a > b: ucomisd xmm0, xmm1; seta     a < b: ucomisd xmm1, xmm0; seta
+            //   a <= b: ucomisd xmm1, xmm0; setae   a >= b: ucomisd xmm0, xmm1; setae
+            bool swap = (op == CLOX_OP_LESS) != negated;
+            emit_bytes(as, 4, 0x66, 0x0f, 0x2e, swap ? 0xc8 : 0xc1);
+            emit_bytes(as, 3, 0x0f, negated ? 0x93 : 0x97, 0xc1);
+            // movzx rcx, cl; mov rdx, false; add rdx, rcx (true is false + 1); mov [rax - 16], rdx
+            emit_bytes(as, 6, 0x48, 0x0f, 0xb6, 0xc9, 0x48, 0xba);
+            emit_u64(as, FALSE_VALUE);
+            emit_bytes(as, 7, 0x48, 0x01, 0xca, 0x48, 0x89, 0x50, 0xf0);
+            emit_bytes(as, 6, 0x49, 0x83, 0x2f, 0x08, 0xeb, 0x00);
+            int end = as->count - 1;
+            patch_rel8(as, slow);
+            emit_helper(as, next, jit_binary, op, negated, true);
+            patch_rel8(as, end);
+            patch_rel32(as, done);
+            break;
+        }
+        case CLOX_OP_BIT_AND:
+        case CLOX_OP_BIT_OR:
+        case CLOX_OP_BIT_XOR: {
+            int misses[2];
+            emit_int_check(as, misses);
+            // and / or of two ints keep int tag: and rcx, rdx / or rcx, rdx
+            // xor clears it: xor ecx, edx; mov rsi, INT_TAG; or rcx, rsi
+            if (op == CLOX_OP_BIT_AND) emit_bytes(as, 3, 0x48, 0x21, 0xd1);
+            else if (op == CLOX_OP_BIT_OR) emit_bytes(as, 3, 0x48, 0x09, 0xd1);
+            else {
+                emit_bytes(as, 4, 0x31, 0xd1, 0x48, 0xbe);
+                emit_u64(as, INT_TAG);
+                emit_bytes(as, 3, 0x48, 0x09, 0xf1);
+            }
+            // mov [rax - 16], rcx; sub qword [r15], 8; jmp done
+            emit_bytes(as, 9, 0x48, 0x89, 0x48, 0xf0, 0x49, 0x83, 0x2f, 0x08, 0xe9);
+            int done = as->count;
+            emit_u32(as, 0);
+            patch_rel8(as, misses[0]);
+            patch_rel8(as, misses[1]);
+            // wider integers and errors are left to vm
+            emit_helper(as, next, jit_binary, op, false, true);
+            patch_rel32(as, done);
+            break;
+        }
+        case CLOX_OP_SHIFT_RIGHT: {
+            int misses[3];
+            emit_int_check(as, misses);
+            // a count below 32 shifts the int payload: cmp edx, 31; ja miss
+            emit_bytes(as, 5, 0x83, 0xfa, 0x1f, 0x77, 0x00);
+            misses[2] = as->count - 1;
+            // mov edi, ecx; mov ecx, edx; sar edi, cl; mov rsi, INT_TAG; or rdi, rsi
+            emit_bytes(as, 8, 0x89, 0xcf, 0x89, 0xd1, 0xd3, 0xff, 0x48, 0xbe);
+            emit_u64(as, INT_TAG);
+            emit_bytes(as, 3, 0x48, 0x09, 0xf7);
+            // mov [rax - 16], rdi; sub qword [r15], 8; jmp done
+            emit_bytes(as, 9, 0x48, 0x89, 0x78, 0xf0, 0x49, 0x83, 0x2f, 0x08, 0xe9);
+            int done = as->count;
+            emit_u32(as, 0);
+            for (int i = 0; i < 3; i++) patch_rel8(as, misses[i]);
+            emit_helper(as, next, jit_binary, op, false, true);
+            patch_rel32(as, done);
+            break;
+        }
+        case CLOX_OP_EQUAL:
+        case CLOX_OP_MODULO:
+        case CLOX_OP_POWER:
+        case CLOX_OP_SHIFT_LEFT:
+            emit_helper(as, next, jit_binary, op, negated, true);
+            break;
+        case CLOX_OP_NEGATE:
+        case CLOX_OP_NOT:
+        case CLOX_OP_BIT_NOT:
+            emit_helper(as, next, jit_unary, op, 0, true);
+            break;
+        case CLOX_OP_PRINT:
+            emit_helper(as, next, jit_print, 0, 0, false);
+            break;
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_SET_GLOBAL:
+            emit_helper(as, next, jit_global, op, (uintptr_t)AS_STRING(constants[code[1]]), true);
+            break;
+        case CLOX_OP_DEFINE_GLOBAL_16:
+        case CLOX_OP_GET_GLOBAL_16:
+        case CLOX_OP_SET_GLOBAL_16:
+            // helper takes 8-bit variant, identifier is resolved here
+            emit_helper(as, next, jit_global, op - 1, (uintptr_t)AS_STRING(constants[code[1] | (code[2] << 8)]), true);
+            break;
+        case CLOX_OP_GET_UPVALUE:
+        case CLOX_OP_SET_UPVALUE:
+        case CLOX_OP_GET_OUTER:
+        case CLOX_OP_SET_OUTER:
+            emit_helper(as, next, jit_upvalue, op, code[1], false);
+            break;
+        case CLOX_OP_GET_UPVALUE_16:
+        case CLOX_OP_SET_UPVALUE_16:
+        case CLOX_OP_GET_OUTER_16:
+        case CLOX_OP_SET_OUTER_16:
+            emit_helper(as, next, jit_upvalue, op - 1, code[1] | (code[2] << 8), false);
+            break;
+        case CLOX_OP_CLOSE_UPVALUE:
+            emit_helper(as, next, jit_upvalue, op, 0, false);
+            break;
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_ADD_LOCAL_CONST: {
+            int slot = code[1] | (code[2] << 8);
+            Value constant = op == CLOX_OP_INC_LOCAL ? INT_VALUE((int8_t)code[3]) : constants[code[3] | (code[4] << 8)];
+            int done = -1;
+            if (IS_INT(constant)) {
+                // mov rcx, [r12 + slot * 8]; mov rdi, rcx; shr rdi, 32; cmp edi, INT_TAG >> 32; jne miss
+                emit_bytes(as, 4, 0x49, 0x8b, 0x8c, 0x24);
+                emit_u32(as, slot * sizeof(Value));
+                emit_bytes(as, 9, 0x48, 0x89, 0xcf, 0x48, 0xc1, 0xef, 0x20, 0x81, 0xff);
+                emit_u32(as, (uint32_t)(INT_TAG >> 32));
+                emit_bytes(as, 2, 0x75, 0x00);
+                int miss = as->count - 1;
+                // add ecx, imm32; jo overflow
+                emit_bytes(as, 2, 0x81, 0xc1);
+                emit_u32(as, (uint32_t)AS_INT(constant));
+                emit_bytes(as, 2, 0x70, 0x00);
+                int overflow = as->count - 1;
+                // mov rsi, INT_TAG; or rcx, rsi; mov [r12 + slot * 8], rcx; jmp done
+                emit_bytes(as, 2, 0x48, 0xbe);
+                emit_u64(as, INT_TAG);
+                emit_bytes(as, 7, 0x48, 0x09, 0xf1, 0x49, 0x89, 0x8c, 0x24);
+                emit_u32(as, slot * sizeof(Value));
+                emit_byte(as, 0xe9);
+                done = as->count;
+                emit_u32(as, 0);
+                patch_rel8(as, miss);
+                patch_rel8(as, overflow);
+            }
+            // doubles, strings, int overflow and type errors are left to vm
+            emit_helper(as, next, update_variable, (uintptr_t)code, 0, true);
+            if (done != -1) patch_rel32(as, done);
+            break;
+        }
+        case CLOX_OP_INC_OUTER:
+        case CLOX_OP_INC_UPVALUE:
+        case CLOX_OP_INC_GLOBAL:
+        case CLOX_OP_INC_PROPERTY:
+        case CLOX_OP_UPDATE_PROPERTY:
+            emit_helper(as, next, update_variable, (uintptr_t)code, 0, true);
+            break;
+        case CLOX_OP_CALL:
+            emit_helper(as, next, jit_call, code[1], 0, true);
+            break;
+        case CLOX_OP_TAIL_CALL:
+            // frame is replaced or returned from by helper, compiled code only exits
+            emit_helper(as, next, jit_tail_call, code[1], 0, true);
+            emit_epilogue(as, INTERPRET_OK);
+            break;
+        case CLOX_OP_RETURN:
+            emit_helper(as, next, jit_return, 0, 0, false);
+            emit_epilogue(as, INTERPRET_OK);
+            break;
+        default: return false;
+    }
+    return true;
+}
+
+// length of instruction at @param offset, -1 for instructions jit does not support
+static int instruction_length(Chunk *chunk, int offset) {
+    switch (generic_opcode(chunk->code[offset])) {
+        case CLOX_OP_RETURN:
+        case CLOX_OP_TRUE:
+        case CLOX_OP_FALSE:
+        case CLOX_OP_NIL:
+        case CLOX_OP_NEGATE:
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DIVIDE:
+        case CLOX_OP_MODULO:
+        case CLOX_OP_POWER:
+        case CLOX_OP_BIT_AND:
+        case CLOX_OP_BIT_OR:
+        case CLOX_OP_BIT_XOR:
+        case CLOX_OP_SHIFT_LEFT:
+        case CLOX_OP_SHIFT_RIGHT:
+        case CLOX_OP_BIT_NOT:
+        case CLOX_OP_NOT:
+        case CLOX_OP_EQUAL:
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS:
+        case CLOX_OP_PRINT:
+        case CLOX_OP_POP:
+        case CLOX_OP_CLOSE_UPVALUE:
+            return 1;
+        case CLOX_OP_CONSTANT:
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_SET_GLOBAL:
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_GET_UPVALUE:
+        case CLOX_OP_SET_UPVALUE:
+        case CLOX_OP_GET_OUTER:
+        case CLOX_OP_SET_OUTER:
+        case CLOX_OP_GET_CAPTURE:
+        case CLOX_OP_CALL:
+        case CLOX_OP_TAIL_CALL:
+            return 2;
+        case CLOX_OP_CONSTANT_16:
+        case CLOX_OP_DEFINE_GLOBAL_16:
+        case CLOX_OP_GET_GLOBAL_16:
+        case CLOX_OP_SET_GLOBAL_16:
+        case CLOX_OP_GET_LOCAL_16:
+        case CLOX_OP_SET_LOCAL_16:
+        case CLOX_OP_GET_UPVALUE_16:
+        case CLOX_OP_SET_UPVALUE_16:
+        case CLOX_OP_GET_OUTER_16:
+        case CLOX_OP_SET_OUTER_16:
+        case CLOX_OP_GET_CAPTURE_16:
+        case CLOX_OP_JUMP:
+        case CLOX_OP_JUMP_IF_FALSE:
+        case CLOX_OP_LOOP:
+            return 3;
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_INC_OUTER:
+        case CLOX_OP_INC_UPVALUE:
+        case CLOX_OP_INC_GLOBAL:
+        case CLOX_OP_INC_PROPERTY:
+        case CLOX_OP_UPDATE_PROPERTY:
+            return 4;
+        case CLOX_OP_ADD_LOCAL_CONST:
+            return 5;
+        default: return -1;
+    }
+}
+
+static void emit_byte(Assembler *as, uint8_t byte) {
+    if (as->count + 1 > as->capacity) {
+        int new_capacity = GROW_CAPACITY(as->capacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, as->capacity, new_capacity, as->vm);
+        as->capacity = new_capacity;
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit_bytes(Assembler *as, int cnt, ...) {
+    va_list args;
+    va_start(args, cnt);
+    for (int i = 0; i < cnt; i++) emit_byte(as, (uint8_t)va_arg(args, int));
+    va_end(args);
+}
+
+static void emit_u32(Assembler *as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit_byte(as, (value >> (i * 8)) & 0xff);
+}
+
+static void emit_u64(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit_byte(as, (value >> (i * 8)) & 0xff);
+}
+
+// constants are never moved by gc and stay reachable from constant pool, so they are embedded
+static void emit_push(Assembler *as, Value value) {
+    // mov rcx, imm64; mov rax, [r15]; mov [rax], rcx; add qword [r15], 8
+    emit_bytes(as, 2, 0x48, 0xb9);
+    emit_u64(as, value);
+    emit_bytes(as, 10, 0x49, 0x8b, 0x07, 0x48, 0x89, 0x08, 0x49, 0x83, 0x07, 0x08);
+}
+
+static void emit_jump(Assembler *as, int target, bool conditional) {
+    // je rel32 or jmp rel32
+    if (conditional) emit_bytes(as, 2, 0x0f, 0x84);
+    else emit_byte(as, 0xe9);
+    add_patch(as, target);
+    emit_u32(as, 0);
+}
+
+/**
+ * load two operands on top of stack, rax = vm->sp, rcx = second top, rdx = top
+ * jump to either of @param misses (rel8s to be patched) unless both are ints
+ */
+static void emit_int_check(Assembler *as, int *misses) {
+    // mov rax, [r15]; mov rcx, [rax - 16]; mov rdx, [rax - 8]
+    emit_bytes(as, 11, 0x49, 0x8b, 0x07, 0x48, 0x8b, 0x48, 0xf0, 0x48, 0x8b, 0x50, 0xf8);
+    // mov rdi, rcx; shr rdi, 32; cmp edi, INT_TAG >> 32; jne miss
+    emit_bytes(as, 9, 0x48, 0x89, 0xcf, 0x48, 0xc1, 0xef, 0x20, 0x81, 0xff);
+    emit_u32(as, (uint32_t)(INT_TAG >> 32));
+    emit_bytes(as, 2, 0x75, 0x00);
+    misses[0] = as->count - 1;
+    // mov rdi, rdx; shr rdi, 32; cmp edi, INT_TAG >> 32; jne miss
+    emit_bytes(as, 9, 0x48, 0x89, 0xd7, 0x48, 0xc1, 0xef, 0x20, 0x81, 0xff);
+    emit_u32(as, (uint32_t)(INT_TAG >> 32));
+    emit_bytes(as, 2, 0x75, 0x00);
+    misses[1] = as->count - 1;
+}
+
+/**
+ * load two operands on top of stack, rax = vm->sp, rcx = second top, rdx = top
+ * jump to @param slow (a rel8 to be patched) unless both are numbers
+ */
+static void emit_number_check(Assembler *as, int *slow) {
+    // mov rax, [r15]; mov rcx, [rax - 16]; mov rdx, [rax - 8]; mov rsi, QNAN
+    emit_bytes(as, 13, 0x49, 0x8b, 0x07, 0x48, 0x8b, 0x48, 0xf0, 0x48, 0x8b, 0x50, 0xf8, 0x48, 0xbe);
+    emit_u64(as, QNAN);
+    // mov rdi, rcx; and rdi, rsi; cmp rdi, rsi; je slow
+    emit_bytes(as, 9, 0x48, 0x89, 0xcf, 0x48, 0x21, 0xf7, 0x48, 0x39, 0xf7);
+    emit_bytes(as, 2, 0x74, 0x00);
+    int first = as->count - 1;
+    // mov rdi, rdx; and rdi, rsi; cmp rdi, rsi; jne fast
+    emit_bytes(as, 9, 0x48, 0x89, 0xd7, 0x48, 0x21, 0xf7, 0x48, 0x39, 0xf7);
+    emit_bytes(as, 2, 0x75, 0x02);
+    // first operand is not a number: jmp slow
+    patch_rel8(as, first);
+    emit_bytes(as, 2, 0xeb, 0x00);
+    *slow = as->count - 1;
+}
+
+/**
+ * call @param helper(vm, @param arg1, @param arg2) with frame->pc after current instruction, as interpreter does
+ * a @param checked helper returns false on runtime error, which exits compiled code
+ */
+static void emit_helper(Assembler *as, int pc_offset, void *helper, uint64_t arg1, uint64_t arg2, bool checked) {
+    // mov rax, pc; mov [r14 + pc], rax
+    emit_bytes(as, 2, 0x48, 0xb8);
+    emit_u64(as, (uint64_t)(uintptr_t)(as->function->chunk.code + pc_offset));
+    emit_bytes(as, 4, 0x49, 0x89, 0x46, (uint8_t)offsetof(CallFrame, pc));
+    // mov rdi, vm; mov rsi, arg1; mov rdx, arg2; mov rax, helper; call rax
+    emit_bytes(as, 2, 0x48, 0xbf);
+    emit_u64(as, (uint64_t)(uintptr_t)as->vm);
+    emit_bytes(as, 2, 0x48, 0xbe);
+    emit_u64(as, arg1);
+    emit_bytes(as, 2, 0x48, 0xba);
+    emit_u64(as, arg2);
+    emit_bytes(as, 2, 0x48, 0xb8);
+    emit_u64(as, (uint64_t)(uintptr_t)helper);
+    emit_bytes(as, 2, 0xff, 0xd0);
+    if (checked) {
+        // test al, al; je error_exit
+        emit_bytes(as, 2, 0x84, 0xc0);
+        emit_bytes(as, 2, 0x0f, 0x84);
+        add_patch(as, -1);
+        emit_u32(as, 0);
+    }
+    emit_load_frame(as);
+}
+
+static void emit_epilogue(Assembler *as, InterpreterResult rst) {
+    // mov eax, rst; pop r15; pop r14; pop r13; pop r12; pop rbp; ret
+    emit_byte(as, 0xb8);
+    emit_u32(as, rst);
+    emit_bytes(as, 10, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0xc3);
+}
+
+// r14 = vm->frames + r13, r12 = r14->slots
+static void emit_load_frame(Assembler *as) {
+    // mov rax, &vm->frames; mov r14, [rax]
+    emit_bytes(as, 2, 0x48, 0xb8);
+    emit_u64(as, (uint64_t)(uintptr_t)&as->vm->frames);
+    emit_bytes(as, 3, 0x4c, 0x8b, 0x30);
+    // imul rcx, r13, sizeof(CallFrame); add r14, rcx
+    emit_bytes(as, 3, 0x49, 0x69, 0xcd);
+    emit_u32(as, sizeof(CallFrame));
+    emit_bytes(as, 3, 0x49, 0x01, 0xce);
+    // mov r12, [r14 + slots]
+    emit_bytes(as, 4, 0x4d, 0x8b, 0x66, (uint8_t)offsetof(CallFrame, slots));
+}
+
+static void add_patch(Assembler *as, int target) {
+    if (as->patch_cnt + 1 > as->patch_capacity) {
+        int new_capacity = GROW_CAPACITY(as->patch_capacity);
+        as->patches = GROW_ARRAY(JitPatch, as->patches, as->patch_capacity, new_capacity, as->vm);
+        as->patch_capacity = new_capacity;
+    }
+    JitPatch *patch = &as->patches[as->patch_cnt++];
+    patch->offset = as->count;
+    patch->target = target;
+}
+
+// point rel8 at @param at to current position
+static void patch_rel8(Assembler *as, int at) {
+    as->code[at] = (uint8_t)(as->count - (at + 1));
+}
+
+static void patch_rel32(Assembler *as, int at) {
+    uint32_t rel = (uint32_t)(as->count - (at + 4));
+    memcpy(as->code + at, &rel, sizeof(uint32_t));
+}
+
+#else
+
+bool jit_supported() {
+    return false;
+}
+
+bool jit_compile(FunctionObj *function, VM *vm) {
+    (void)function;
+    (void)vm;
+    return false;
+}
+
+void jit_free(FunctionObj *function) {
+    function->jit = NULL;
+    function->jit_size = 0;
+}
+
+#endif // __x86_64__ && NAN_BOXING
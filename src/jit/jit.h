@@ -0,0 +1,20 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+#include "common.h"
+#include "object/object.h"
+#include "vm/vm.h"
+
+// calls of a function before it is compiled into machine code
+#define JIT_THRESHOLD 64
+
+// run frame at @param frame_idx until it returns, result is pushed where its callee was
+typedef InterpreterResult (*jit_func)(int frame_idx);
+
+// jit compiles only on x86-64 with nan boxing
+bool jit_supported();
+// compile @param function owned by @param vm into machine code, returns false if it uses instructions jit does not support
+bool jit_compile(FunctionObj *function, VM *vm);
+// release machine code of @param function
+void jit_free(FunctionObj *function);
+
+#endif // clox_jit_h
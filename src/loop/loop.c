@@ -0,0 +1,535 @@
+#include "loop.h"
+#include "memory/memory.h"
+#include "object/object.h"
+// added for epoll_create1
+#include <sys/epoll.h>
+// added for socket
+#include <sys/socket.h>
+// added for sockaddr_in
+#include <netinet/in.h>
+// added for poll
+#include <poll.h>
+// added for read and close
+#include <unistd.h>
+// added for fcntl
+#include <fcntl.h>
+// added for errno
+#include <errno.h>
+// added for fopen
+#include <stdio.h>
+// added for memmove
+#include <string.h>
+// added for clock_gettime and nanosleep
+#include <time.h>
+
+// bytes a read takes at most
+#define READ_MAX 65536
+// events epoll_wait takes at once
+#define EVENTS_MAX 64
+
+typedef enum {
+    WAIT_ACCEPT,
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_CONNECT,
+} WaitType;
+
+// a socket operation blocked on its fd, epoll resumes it
+typedef struct {
+    WaitType type;
+    int fd;
+    FiberObj *fiber;
+    // string being written, bytes of it written so far
+    StringObj *data;
+    int offset;
+    // position in waiters of loop
+    int idx;
+} Waiter;
+
+typedef struct {
+    double deadline;
+    // ties on deadline wake in order of sleep
+    long seq;
+    FiberObj *fiber;
+} Timer;
+
+typedef struct {
+    FiberObj *fiber;
+    Value value;
+} Ready;
+
+struct Loop {
+    int epoll_fd;
+    // fibers to resume with a value, consumed from head
+    Ready *ready;
+    int ready_head;
+    int ready_cnt;
+    int ready_capacity;
+    // min heap by deadline
+    Timer *timers;
+    int timer_cnt;
+    int timer_capacity;
+    long timer_seq;
+    Waiter **waiters;
+    int waiter_cnt;
+    int waiter_capacity;
+};
+
+static Loop* get_loop(VM *vm);
+static void push_ready(FiberObj *fiber, Value value, VM *vm);
+static void push_timer(double deadline, FiberObj *fiber, VM *vm);
+static FiberObj* pop_timer(Loop *loop);
+static bool timer_before(Timer *a, Timer *b);
+static bool wait_io(Waiter *waiter, Value *args, VM *vm);
+static void watch(Waiter *waiter, Loop *loop);
+static void complete(Waiter *waiter, VM *vm);
+static bool try_io(Waiter *waiter, Value *result, VM *vm);
+static bool fd_arg(Value value, int *fd);
+static double now();
+static bool native_spawn(int argc, Value *args, VM *vm);
+static bool native_sleep(int argc, Value *args, VM *vm);
+static bool native_read_file(int argc, Value *args, VM *vm);
+static bool native_write_file(int argc, Value *args, VM *vm);
+static bool native_listen(int argc, Value *args, VM *vm);
+static bool native_accept(int argc, Value *args, VM *vm);
+static bool native_connect(int argc, Value *args, VM *vm);
+static bool native_read(int argc, Value *args, VM *vm);
+static bool native_write(int argc, Value *args, VM *vm);
+static bool native_close(int argc, Value *args, VM *vm);
+
+void define_loop_natives(VM *vm) {
+    define_native("spawn", native_spawn, vm);
+    define_native("sleep", native_sleep, vm);
+    define_native("readFile", native_read_file, vm);
+    define_native("writeFile", native_write_file, vm);
+    define_native("listen", native_listen, vm);
+    define_native("accept", native_accept, vm);
+    define_native("connect", native_connect, vm);
+    define_native("read", native_read, vm);
+    define_native("write", native_write, vm);
+    define_native("close", native_close, vm);
+}
+
+InterpreterResult run_loop(VM *vm) {
+    Loop *loop = vm->loop;
+    if (loop == NULL) return INTERPRET_OK;
+    for (;;) {
+        while (loop->ready_head < loop->ready_cnt) {
+            Ready next = loop->ready[loop->ready_head++];
+            if (loop->ready_head == loop->ready_cnt) loop->ready_head = loop->ready_cnt = 0;
+            // fiber becomes a root again once resume swaps it in, before anything allocates
+            Value result;
+            if (!resume_fiber(next.fiber, next.value, &result, vm)) return INTERPRET_RUNTIME_ERROR;
+            // a plain yield gives way to other fibers
+            if (next.fiber->state == FIBER_SUSPENDED) push_ready(next.fiber, NIL_VALUE, vm);
+        }
+        if (loop->waiter_cnt == 0 && loop->timer_cnt == 0) return INTERPRET_OK;
+
+        int timeout = -1;
+        if (loop->timer_cnt > 0) {
+            double wait = loop->timers[0].deadline - now();
+            // round up, so a timer is due once epoll_wait returns
+            timeout = wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+        }
+        struct epoll_event events[EVENTS_MAX];
+        int event_cnt = epoll_wait(loop->epoll_fd, events, EVENTS_MAX, timeout);
+        for (int i = 0; i < event_cnt; i++) complete((Waiter*)events[i].data.ptr, vm);
+
+        double current = now();
+        while (loop->timer_cnt > 0 && loop->timers[0].deadline <= current) push_ready(pop_timer(loop), NIL_VALUE, vm);
+    }
+}
+
+void mark_loop_roots(VM *vm) {
+    Loop *loop = vm->loop;
+    if (loop == NULL) return;
+    for (int i = loop->ready_head; i < loop->ready_cnt; i++) {
+        mark_obj((Obj*)loop->ready[i].fiber, vm);
+        if (IS_OBJ(loop->ready[i].value)) mark_obj(AS_OBJ(loop->ready[i].value), vm);
+    }
+    for (int i = 0; i < loop->timer_cnt; i++) mark_obj((Obj*)loop->timers[i].fiber, vm);
+    for (int i = 0; i < loop->waiter_cnt; i++) {
+        mark_obj((Obj*)loop->waiters[i]->fiber, vm);
+        mark_obj((Obj*)loop->waiters[i]->data, vm);
+    }
+}
+
+void free_loop(VM *vm) {
+    Loop *loop = vm->loop;
+    if (loop == NULL) return;
+    vm->loop = NULL;
+    close(loop->epoll_fd);
+    for (int i = 0; i < loop->waiter_cnt; i++) FREE(Waiter, loop->waiters[i], vm);
+    FREE_ARRAY(Ready, loop->ready, loop->ready_capacity, vm);
+    FREE_ARRAY(Timer, loop->timers, loop->timer_capacity, vm);
+    FREE_ARRAY(Waiter*, loop->waiters, loop->waiter_capacity, vm);
+    FREE(Loop, loop, vm);
+}
+
+static Loop* get_loop(VM *vm) {
+    if (vm->loop != NULL) return vm->loop;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) return NULL;
+    Loop *loop = ALLOCATE(Loop, 1, vm);
+    loop->epoll_fd = epoll_fd;
+    loop->ready = NULL;
+    loop->ready_head = 0;
+    loop->ready_cnt = 0;
+    loop->ready_capacity = 0;
+    loop->timers = NULL;
+    loop->timer_cnt = 0;
+    loop->timer_capacity = 0;
+    loop->timer_seq = 0;
+    loop->waiters = NULL;
+    loop->waiter_cnt = 0;
+    loop->waiter_capacity = 0;
+    vm->loop = loop;
+    return loop;
+}
+
+static void push_ready(FiberObj *fiber, Value value, VM *vm) {
+    Loop *loop = vm->loop;
+    if (loop->ready_cnt == loop->ready_capacity) {
+        // reclaim consumed head before growing
+        if (loop->ready_head > 0) {
+            memmove(loop->ready, loop->ready + loop->ready_head, sizeof(Ready) * (loop->ready_cnt - loop->ready_head));
+            loop->ready_cnt -= loop->ready_head;
+            loop->ready_head = 0;
+        } else {
+            // growing may trigger gc, fiber and value are not in queue yet
+            push_gc(OBJ_VALUE(fiber), vm);
+            push_gc(value, vm);
+            int capacity = loop->ready_capacity;
+            loop->ready_capacity = GROW_CAPACITY(capacity);
+            loop->ready = GROW_ARRAY(Ready, loop->ready, capacity, loop->ready_capacity, vm);
+            pop_gc(vm);
+            pop_gc(vm);
+        }
+    }
+    loop->ready[loop->ready_cnt++] = (Ready){ .fiber = fiber, .value = value };
+}
+
+static void push_timer(double deadline, FiberObj *fiber, VM *vm) {
+    Loop *loop = vm->loop;
+    if (loop->timer_cnt == loop->timer_capacity) {
+        int capacity = loop->timer_capacity;
+        loop->timer_capacity = GROW_CAPACITY(capacity);
+        loop->timers = GROW_ARRAY(Timer, loop->timers, capacity, loop->timer_capacity, vm);
+    }
+    // sift up
+    Timer timer = { .deadline = deadline, .seq = loop->timer_seq++, .fiber = fiber };
+    int idx = loop->timer_cnt++;
+    while (idx > 0 && timer_before(&timer, &loop->timers[(idx - 1) / 2])) {
+        loop->timers[idx] = loop->timers[(idx - 1) / 2];
+        idx = (idx - 1) / 2;
+    }
+    loop->timers[idx] = timer;
+}
+
+static FiberObj* pop_timer(Loop *loop) {
+    FiberObj *fiber = loop->timers[0].fiber;
+    Timer last = loop->timers[--loop->timer_cnt];
+    // sift down
+    int idx = 0;
+    for (;;) {
+        int child = idx * 2 + 1;
+        if (child >= loop->timer_cnt) break;
+        if (child + 1 < loop->timer_cnt && timer_before(&loop->timers[child + 1], &loop->timers[child])) child++;
+        if (!timer_before(&loop->timers[child], &last)) break;
+        loop->timers[idx] = loop->timers[child];
+        idx = child;
+    }
+    if (loop->timer_cnt > 0) loop->timers[idx] = last;
+    return fiber;
+}
+
+static bool timer_before(Timer *a, Timer *b) {
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+/**
+ * run operation of @param waiter for native at @param args
+ * it parks running fiber on loop if operation would block, or blocks where fiber can not suspend
+ */
+static bool wait_io(Waiter *waiter, Value *args, VM *vm) {
+    Value result;
+    if (try_io(waiter, &result, vm)) {
+        args[-1] = result;
+        return true;
+    }
+    Loop *loop = can_suspend(vm) ? get_loop(vm) : NULL;
+    if (loop == NULL) {
+        short events = waiter->type == WAIT_ACCEPT || waiter->type == WAIT_READ ? POLLIN : POLLOUT;
+        struct pollfd pfd = { .fd = waiter->fd, .events = events };
+        do poll(&pfd, 1, -1); while (!try_io(waiter, &result, vm));
+        args[-1] = result;
+        return true;
+    }
+
+    if (loop->waiter_cnt == loop->waiter_capacity) {
+        int capacity = loop->waiter_capacity;
+        loop->waiter_capacity = GROW_CAPACITY(capacity);
+        loop->waiters = GROW_ARRAY(Waiter*, loop->waiters, capacity, loop->waiter_capacity, vm);
+    }
+    // running fiber and data in args stay reachable while allocating
+    Waiter *parked = ALLOCATE(Waiter, 1, vm);
+    *parked = *waiter;
+    parked->fiber = vm->fiber;
+    parked->idx = loop->waiter_cnt;
+    loop->waiters[loop->waiter_cnt++] = parked;
+    watch(parked, loop);
+    return suspend_fiber(FIBER_WAITING, NIL_VALUE, args, vm);
+}
+
+// one shot, so an fd is watched only while an operation waits on it
+static void watch(Waiter *waiter, Loop *loop) {
+    uint32_t events = waiter->type == WAIT_ACCEPT || waiter->type == WAIT_READ ? EPOLLIN : EPOLLOUT;
+    struct epoll_event event = { .events = events | EPOLLONESHOT, .data.ptr = waiter };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, waiter->fd, &event) < 0 && errno == ENOENT) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, waiter->fd, &event);
+    }
+}
+
+static void complete(Waiter *waiter, VM *vm) {
+    Loop *loop = vm->loop;
+    Value result;
+    // waiter keeps fiber reachable while result is allocated
+    if (!try_io(waiter, &result, vm)) {
+        watch(waiter, loop);
+        return;
+    }
+    FiberObj *fiber = waiter->fiber;
+    push_gc(OBJ_VALUE(fiber), vm);
+    push_gc(result, vm);
+    Waiter *last = loop->waiters[--loop->waiter_cnt];
+    loop->waiters[waiter->idx] = last;
+    last->idx = waiter->idx;
+    FREE(Waiter, waiter, vm);
+    push_ready(fiber, result, vm);
+    pop_gc(vm);
+    pop_gc(vm);
+}
+
+// returns false if operation would block, otherwise stores its result, nil on failure
+static bool try_io(Waiter *waiter, Value *result, VM *vm) {
+    *result = NIL_VALUE;
+    switch (waiter->type) {
+        case WAIT_ACCEPT: {
+            int fd = accept(waiter->fd, NULL, NULL);
+            if (fd < 0) return errno != EAGAIN && errno != EWOULDBLOCK;
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            *result = NUMBER_VALUE(fd);
+            return true;
+        }
+        case WAIT_READ: {
+            static _Thread_local char buffer[READ_MAX];
+            ssize_t cnt = read(waiter->fd, buffer, READ_MAX);
+            if (cnt < 0) return errno != EAGAIN && errno != EWOULDBLOCK;
+            // empty string on end of stream
+            *result = OBJ_VALUE(new_string(buffer, (int)cnt, vm));
+            return true;
+        }
+        case WAIT_WRITE: {
+            while (waiter->offset < waiter->data->length) {
+                ssize_t cnt = write(waiter->fd, waiter->data->str + waiter->offset, waiter->data->length - waiter->offset);
+                if (cnt < 0) return errno != EAGAIN && errno != EWOULDBLOCK;
+                waiter->offset += (int)cnt;
+            }
+            *result = NUMBER_VALUE(waiter->offset);
+            return true;
+        }
+        case WAIT_CONNECT: {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(waiter->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+            if (error == EINPROGRESS || error == EALREADY) return false;
+            if (error != 0) close(waiter->fd);
+            else *result = NUMBER_VALUE(waiter->fd);
+            return true;
+        }
+    }
+    return true;
+}
+
+static bool fd_arg(Value value, int *fd) {
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) != (int)AS_NUMBER(value)) return false;
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// spawn(fn) creates a fiber the loop runs once script is done or running fiber parks
+static bool native_spawn(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        runtime_error(vm, "spawn expects a function of at most 1 parameter.");
+        return false;
+    }
+    if (get_loop(vm) == NULL) {
+        runtime_error(vm, "could not create event loop.");
+        return false;
+    }
+    FiberObj *fiber = new_fiber(AS_CLOSURE(args[0]), vm);
+    // in slot of native, fiber survives the queue growing
+    args[-1] = OBJ_VALUE(fiber);
+    push_ready(fiber, NIL_VALUE, vm);
+    return true;
+}
+
+// sleep(ms) parks running fiber for ms milliseconds, blocks outside of fiber
+static bool native_sleep(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+        runtime_error(vm, "sleep expects milliseconds.");
+        return false;
+    }
+    double ms = AS_NUMBER(args[0]);
+    Loop *loop = can_suspend(vm) ? get_loop(vm) : NULL;
+    if (loop == NULL) {
+        struct timespec ts = { .tv_sec = (time_t)(ms / 1000), .tv_nsec = (long)((ms - (time_t)(ms / 1000) * 1000) * 1e6) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        args[-1] = NIL_VALUE;
+        return true;
+    }
+    push_timer(now() + ms / 1000, vm->fiber, vm);
+    return suspend_fiber(FIBER_WAITING, NIL_VALUE, args, vm);
+}
+
+/**
+ * readFile(path) results in content of file, nil if it can not be read
+ * epoll does not watch regular files, so file is read at once, then running fiber gives way to others
+ */
+static bool native_read_file(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_STRING(args[0])) {
+        runtime_error(vm, "readFile expects a path.");
+        return false;
+    }
+    Value result = NIL_VALUE;
+    FILE *file = fopen(AS_CSTRING(args[0]), "rb");
+    if (file != NULL) {
+        fseek(file, 0L, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0L, SEEK_SET);
+        char *content = ALLOCATE(char, size + 1, vm);
+        size_t read_bytes = fread(content, sizeof(char), size, file);
+        fclose(file);
+        if ((long)read_bytes == size) result = OBJ_VALUE(new_string(content, (int)size, vm));
+        FREE_ARRAY(char, content, size + 1, vm);
+    }
+    Loop *loop = can_suspend(vm) ? get_loop(vm) : NULL;
+    if (loop == NULL) {
+        args[-1] = result;
+        return true;
+    }
+    push_ready(vm->fiber, result, vm);
+    return suspend_fiber(FIBER_WAITING, NIL_VALUE, args, vm);
+}
+
+// writeFile(path, content) results in bytes written, nil on failure, it gives way as readFile does
+static bool native_write_file(int argc, Value *args, VM *vm) {
+    if (argc != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        runtime_error(vm, "writeFile expects a path and a string.");
+        return false;
+    }
+    Value result = NIL_VALUE;
+    FILE *file = fopen(AS_CSTRING(args[0]), "wb");
+    if (file != NULL) {
+        StringObj *content = AS_STRING(args[1]);
+        size_t written = fwrite(content->str, sizeof(char), content->length, file);
+        if (fclose(file) == 0 && (int)written == content->length) result = NUMBER_VALUE(content->length);
+    }
+    Loop *loop = can_suspend(vm) ? get_loop(vm) : NULL;
+    if (loop == NULL) {
+        args[-1] = result;
+        return true;
+    }
+    push_ready(vm->fiber, result, vm);
+    return suspend_fiber(FIBER_WAITING, NIL_VALUE, args, vm);
+}
+
+// listen(port) results in a socket accepting connections on loopback, nil on failure
+static bool native_listen(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) > UINT16_MAX) {
+        runtime_error(vm, "listen expects a port.");
+        return false;
+    }
+    args[-1] = NIL_VALUE;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)AS_NUMBER(args[0])), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return true;
+    }
+    args[-1] = NUMBER_VALUE(fd);
+    return true;
+}
+
+// accept(socket) results in a connection, nil on failure
+static bool native_accept(int argc, Value *args, VM *vm) {
+    Waiter waiter = { .type = WAIT_ACCEPT, .data = NULL, .offset = 0 };
+    if (argc != 1 || !fd_arg(args[0], &waiter.fd)) {
+        runtime_error(vm, "accept expects a socket.");
+        return false;
+    }
+    return wait_io(&waiter, args, vm);
+}
+
+// connect(port) results in a connection to loopback, nil on failure
+static bool native_connect(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) > UINT16_MAX) {
+        runtime_error(vm, "connect expects a port.");
+        return false;
+    }
+    args[-1] = NIL_VALUE;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)AS_NUMBER(args[0])), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        args[-1] = NUMBER_VALUE(fd);
+        return true;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return true;
+    }
+    Waiter waiter = { .type = WAIT_CONNECT, .fd = fd, .data = NULL, .offset = 0 };
+    return wait_io(&waiter, args, vm);
+}
+
+// read(socket) results in bytes available as a string, empty at end of stream, nil on failure
+static bool native_read(int argc, Value *args, VM *vm) {
+    Waiter waiter = { .type = WAIT_READ, .data = NULL, .offset = 0 };
+    if (argc != 1 || !fd_arg(args[0], &waiter.fd)) {
+        runtime_error(vm, "read expects a socket.");
+        return false;
+    }
+    return wait_io(&waiter, args, vm);
+}
+
+// write(socket, string) results in bytes written once all are, nil on failure
+static bool native_write(int argc, Value *args, VM *vm) {
+    Waiter waiter = { .type = WAIT_WRITE, .offset = 0 };
+    if (argc != 2 || !fd_arg(args[0], &waiter.fd) || !IS_STRING(args[1])) {
+        runtime_error(vm, "write expects a socket and a string.");
+        return false;
+    }
+    waiter.data = AS_STRING(args[1]);
+    return wait_io(&waiter, args, vm);
+}
+
+static bool native_close(int argc, Value *args, VM *vm) {
+    int fd;
+    if (argc != 1 || !fd_arg(args[0], &fd)) {
+        runtime_error(vm, "close expects a socket.");
+        return false;
+    }
+    args[-1] = BOOL_VALUE(close(fd) == 0);
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef clox_loop_h
+#define clox_loop_h
+#include "common.h"
+#include "vm/vm.h"
+
+/**
+ * an epoll event loop per vm, it resumes fibers once what they wait for is done
+ * natives doing i/o park running fiber on it, or block if called where a fiber can not suspend
+ */
+
+// natives: spawn, sleep, readFile, writeFile, listen, accept, connect, read, write, close
+void define_loop_natives(VM *vm);
+// run fibers spawned or parked until none is left, returns runtime error of a fiber
+InterpreterResult run_loop(VM *vm);
+// mark fibers and values loop holds
+void mark_loop_roots(VM *vm);
+void free_loop(VM *vm);
+
+#endif // clox_loop_h
@@ -3,25 +3,77 @@
 #include <string.h>
 #include "common.h"
 #include "vm/vm.h"
+#include "optimizer/optimizer.h"
+// added for run_workers
+#include "worker/worker.h"
 
-static void parse_prompt();
-static void parse_file(const char *path);
+static void usage(const char *program);
+static void parse_prompt(CompileOptions *options, VM *vm);
+static int parse_file(const char *path, CompileOptions *options, VM *vm);
+static int parse_batch(const char **paths, int path_cnt, int worker_cnt, CompileOptions *options);
+static char* read_file(const char *path, int *status);
+static int exit_status(InterpreterResult rst);
 
 int main(int argc, const char* argv[]) {
-    if (argc > 2) {
-        fprintf(stderr, "Usage: %s [path]\n", argv[0]);
-        // 64 stands for command line usage error
-        exit(64);
-    } else if (argc == 2) parse_file(argv[1]);
-    else parse_prompt();
-    exit(0);
+    CompileOptions options = { .optimize_level = 0, .register_vm = false, .jit = false, .max_depth = FRAMES_MAX };
+    // 0 means single script mode
+    int worker_cnt = 0;
+    const char **paths = (const char**)malloc(sizeof(const char*) * argc);
+    if (paths == NULL) exit(71);
+    int path_cnt = 0;
+    for (int i = 1; i < argc; i++) {
+        // -O0 ... -On selects optimize level, -O alone is -O1
+        if (strncmp(argv[i], "-O", 2) == 0) {
+            char *end;
+            long level = argv[i][2] == '\0' ? 1 : strtol(argv[i] + 2, &end, 10);
+            if (argv[i][2] != '\0' && (*end != '\0' || level < 0 || level > OPTIMIZE_LEVEL_MAX)) usage(argv[0]);
+            options.optimize_level = (int)level;
+        } else if (strcmp(argv[i], "--register") == 0) options.register_vm = true;
+        else if (strcmp(argv[i], "--jit") == 0) options.jit = true;
+        else if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+            char *end;
+            long depth = strtol(argv[i] + 12, &end, 10);
+            if (argv[i][12] == '\0' || *end != '\0' || depth < 1 || depth > INT32_MAX) usage(argv[0]);
+            options.max_depth = (int)depth;
+        }
+        // --workers N and --workers=N both run paths in batch mode
+        else if (strncmp(argv[i], "--workers", 9) == 0 && (argv[i][9] == '\0' || argv[i][9] == '=')) {
+            const char *num = argv[i][9] == '=' ? argv[i] + 10 : (i + 1 < argc ? argv[++i] : "");
+            char *end;
+            long cnt = strtol(num, &end, 10);
+            if (*num == '\0' || *end != '\0' || cnt < 1 || cnt > 1024) usage(argv[0]);
+            worker_cnt = (int)cnt;
+        }
+        else paths[path_cnt++] = argv[i];
+    }
+    if (worker_cnt == 0 && path_cnt > 1) usage(argv[0]);
+
+    int status = 0;
+    if (worker_cnt > 0) {
+        if (path_cnt == 0) usage(argv[0]);
+        status = parse_batch(paths, path_cnt, worker_cnt, &options);
+    } else {
+        VM vm;
+        init_vm(&vm);
+        if (path_cnt == 1) status = parse_file(paths[0], &options, &vm);
+        else parse_prompt(&options, &vm);
+        free_vm(&vm);
+    }
+    free(paths);
+    exit(status);
 }
 
-static void parse_prompt() {
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-O0|-O1|-O2] [--register] [--jit] [--max-depth=N] [path | --workers N path...]\n", program);
+    // 64 stands for command line usage error
+    exit(64);
+}
+
+static void parse_prompt(CompileOptions *options, VM *vm) {
     char line[1024];
     for (;;) {
         fprintf(stdout, "> ");
-        if (fgets(line, sizeof(line), stdin) != NULL) interpret(line);
+        if (fgets(line, sizeof(line), stdin) != NULL) interpret(line, options, vm);
         else {
             // ctrl + D =>  EOF
             fprintf(stdout, "\n");
@@ -30,13 +82,53 @@ static void parse_prompt() {
     }
 }
 
-static void parse_file(const char *path) {
+// returns exit status of script, exits on its own if file can not be read
+static int parse_file(const char *path, CompileOptions *options, VM *vm) {
+    int status;
+    char *content = read_file(path, &status);
+    if (content == NULL) exit(status);
+
+    InterpreterResult rst = interpret_cached(content, options, vm);
+    free(content);
+    return exit_status(rst);
+}
+
+// returns the worst exit status among scripts, a file can not be read is skipped
+static int parse_batch(const char **paths, int path_cnt, int worker_cnt, CompileOptions *options) {
+    Job *jobs = (Job*)malloc(sizeof(Job) * path_cnt);
+    if (jobs == NULL) exit(71);
+    int job_cnt = 0;
+    int status = 0;
+    for (int i = 0; i < path_cnt; i++) {
+        int read_status;
+        char *content = read_file(paths[i], &read_status);
+        if (content == NULL) {
+            if (read_status > status) status = read_status;
+            continue;
+        }
+        jobs[job_cnt++] = (Job){ .path = paths[i], .source = content, .result = INTERPRET_OK };
+    }
+
+    run_workers(jobs, job_cnt, worker_cnt, options);
+
+    for (int i = 0; i < job_cnt; i++) {
+        int job_status = exit_status(jobs[i].result);
+        if (job_status > status) status = job_status;
+        free((char*)jobs[i].source);
+    }
+    free(jobs);
+    return status;
+}
+
+// returns content of file, or NULL with exit status stored in @param status after reporting why
+static char* read_file(const char *path, int *status) {
     // open in binary mode
     FILE *file = fopen(path, "rb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         // 66 stands for input file is not exist or readable
-        exit(66);
+        *status = 66;
+        return NULL;
     }
 
     // set file position to end of file
@@ -52,7 +144,8 @@ static void parse_file(const char *path) {
         fclose(file);
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
         // 71 stands for system error => out of memory
-        exit(71);
+        *status = 71;
+        return NULL;
     }
 
     // load file into memory
@@ -60,18 +153,22 @@ static void parse_file(const char *path) {
     content[read_bytes] = '\0';
     if ((long)read_bytes != size) {
         fclose(file);
+        free(content);
         fprintf(stderr, "Could not read file \"%s\".\n", path);
         // 74 stands for input/output error
-        exit(74);
+        *status = 74;
+        return NULL;
     }
     
     fclose(file);
+    *status = 0;
+    return content;
+}
 
-    InterpreterResult rst = interpret(content);
-    free(content);
-
+static int exit_status(InterpreterResult rst) {
     // 65 stands for data format error
-    if (rst == INTERPRET_COMPLIE_ERROR) exit(65);
+    if (rst == INTERPRET_COMPLIE_ERROR) return 65;
     // 70 stands for software error => in this case, user lox program error
-    if (rst == INTERPRET_RUNTIME_ERROR) exit(70);
-}
\ No newline at end of file
+    if (rst == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "memory.h"
 #include "vm/vm.h"
 #include "complier/compiler.h"
+#include "loop/loop.h"
 // added for realloc
 #include <stdlib.h>
 #ifdef CLOX_DEBUG_LOG_GC
@@ -9,23 +10,26 @@
 #endif // CLOX_DEBUG_LOG_GC
 #define CLOX_GC_HEAP_GROW_FACTOR 2
 
-static void collect_garbage();
-static void mark_roots();
-static void mark_value(Value *value);
-static void mark_table(Table *table);
-static void traverse_references();
-static void black_object(Obj *obj);
-static void mark_array(ValueArray *array);
-static void sweep();
+static void collect_garbage(VM *vm);
+static void mark_roots(VM *vm);
+static void mark_value(Value *value, VM *vm);
+static void mark_table(Table *table, VM *vm);
+static void traverse_references(VM *vm);
+static void black_object(Obj *obj, VM *vm);
+static void mark_array(ValueArray *array, VM *vm);
+static void sweep(VM *vm);
 static void remove_table_white(Table *table);
+static void close_white_fibers(VM *vm);
+static void reserve_gray(int cnt, VM *vm);
 
-void* reallocate(void *ptr, size_t old_size, size_t new_size) {
-    vm.allocated_bytes += new_size - old_size;
+void* reallocate(void *ptr, size_t old_size, size_t new_size, VM *vm) {
+    vm->allocated_bytes += new_size - old_size;
 
 #ifdef CLOX_DEBUG_STRESS_GC
-    if (new_size > old_size) collect_garbage();
+    if (new_size > old_size) collect_garbage(vm);
 #else
-    if (vm.allocated_bytes > vm.next_gc) collect_garbage();
+    // only growth collects, a free during sweep must not start another gc
+    if (new_size > old_size && vm->allocated_bytes > vm->next_gc) collect_garbage(vm);
 #endif // CLOX_DEBUG_STRESS_GC
 
     if (new_size == 0) {
@@ -39,29 +43,32 @@ void* reallocate(void *ptr, size_t old_size, size_t new_size) {
 }
 
 /// @brief mark and sweep garbage collector
-void collect_garbage() {
+void collect_garbage(VM *vm) {
 #ifdef CLOX_DEBUG_LOG_GC
-    size_t before = vm.allocated_bytes;
+    size_t before = vm->allocated_bytes;
     printf("== clox gc begin ==\n");
 #endif // CLOX_DEBUG_LOG_GC
     // mark all reachable objects
-    mark_roots();
+    mark_roots(vm);
     // traverse from gray stack
-    traverse_references();
+    traverse_references(vm);
     // string table are interned
-    remove_table_white(&vm.strings);
+    remove_table_white(&vm->strings);
+    // upvalues open on stacks about to be freed
+    close_white_fibers(vm);
     // sweep unreachable objects
-    sweep();
+    sweep(vm);
     // update threshold after gc
-    vm.next_gc = vm.allocated_bytes * CLOX_GC_HEAP_GROW_FACTOR;
+    vm->next_gc = vm->allocated_bytes * CLOX_GC_HEAP_GROW_FACTOR;
 #ifdef CLOX_DEBUG_LOG_GC
     printf("== clox gc end == \n");
-    printf("collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.allocated_bytes, before, vm.allocated_bytes, vm.next_gc); 
+    printf("collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->allocated_bytes, before, vm->allocated_bytes, vm->next_gc); 
 #endif // CLOX_DEBUG_LOG_GC
 }
 
-void mark_obj(Obj *obj) {
-    if (obj == NULL) return;
+void mark_obj(Obj *obj, VM *vm) {
+    // shared objects are never collected, nor refer to objects of a vm
+    if (obj == NULL || obj->is_shared) return;
     // erase circular reference
     if (obj->is_marked) return;
     obj->is_marked = true;
@@ -72,46 +79,67 @@ void mark_obj(Obj *obj) {
 #endif // CLOX_DEBUG_LOG_GC
 
     // push object into gray stack
-    vm.gray_stack[vm.gray_count++] = obj;
+    reserve_gray(1, vm);
+    vm->gray_stack[vm->gray_count++] = obj;
 }
 
-static void mark_roots() {
+// room for @param cnt more gray objects, a deep stack or a large list may push any number of them
+static void reserve_gray(int cnt, VM *vm) {
+    if (vm->gray_count + cnt <= vm->gray_capacity) return;
+    while (vm->gray_capacity < vm->gray_count + cnt) vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+    Obj **gray_stack = (Obj**)realloc(vm->gray_stack, sizeof(Obj*) * vm->gray_capacity);
+    // returns on run out of memory
+    if (gray_stack == NULL) exit(1);
+    vm->gray_stack = gray_stack;
+}
+
+static void mark_roots(VM *vm) {
     // objects in stack are roots
-    for (Value *cur = vm.stack; cur < vm.sp; cur++) mark_value(cur);
+    for (Value *cur = vm->stack; cur < vm->sp; cur++) mark_value(cur, vm);
     // objects in globals are roots
-    mark_table(&vm.globals);
+    mark_table(&vm->globals, vm);
     // pointers to closure are roots
-    for (int i = 0; i < vm.frame_cnt; i++) mark_obj((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frame_cnt; i++) mark_obj((Obj*)vm->frames[i].closure, vm);
+    // an open upvalue is closed on return even if no closure refers to it anymore
+    for (int i = 0; i < vm->open_top; i++) mark_obj((Obj*)vm->open_upvalues[i], vm);
     // mark initializer string
-    mark_obj((Obj*)vm.init_string);
+    mark_obj((Obj*)vm->init_string, vm);
+    mark_obj((Obj*)vm->iterate_string, vm);
+    mark_obj((Obj*)vm->iterator_value_string, vm);
+    // running fiber holds state of fibers below it
+    mark_obj((Obj*)vm->fiber, vm);
     // mark roots for compile time
-    mark_compiler_roots();
+    mark_compiler_roots(vm);
+    // fibers parked on event loop
+    mark_loop_roots(vm);
     // objects in gc stack are roots
-    for (int i = 0; i < vm.gc_stack_cnt; i++) mark_value(&vm.gc_stack[i]);
+    for (int i = 0; i < vm->gc_stack_cnt; i++) mark_value(&vm->gc_stack[i], vm);
 }
 
-static void mark_value(Value *value) {
-    if (IS_OBJ(*value)) mark_obj(AS_OBJ(*value));
+static void mark_value(Value *value, VM *vm) {
+    if (IS_OBJ(*value)) mark_obj(AS_OBJ(*value), vm);
 }
 
-static void mark_table(Table *table) {
+static void mark_table(Table *table, VM *vm) {
+    // keys and values may all be gray at once, room is made once instead of growing per entry
+    reserve_gray(table->count * 2, vm);
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;    
-        mark_obj((Obj*)entry->key);
-        mark_value(&entry->value);
+        if (IS_NIL(entry->key)) continue;    
+        mark_value(&entry->key, vm);
+        mark_value(&entry->value, vm);
     }
 }
 
 // dfs traverse
-static void traverse_references() {
-    while (vm.gray_count > 0) {
-        Obj* obj = vm.gray_stack[--vm.gray_count];
-        black_object(obj);
+static void traverse_references(VM *vm) {
+    while (vm->gray_count > 0) {
+        Obj* obj = vm->gray_stack[--vm->gray_count];
+        black_object(obj, vm);
     }
 }
 
-static void black_object(Obj *obj) {
+static void black_object(Obj *obj, VM *vm) {
 #ifdef CLOX_DEBUG_LOG_GC
     printf("%p black ", (void*)obj);
     print_obj(OBJ_VALUE(obj));
@@ -120,57 +148,82 @@ static void black_object(Obj *obj) {
     switch (obj->type) {
         // string obj does not has reference to other objects
         case OBJ_STRING: break;
+        // nor do raw doubles and ranges
+        case OBJ_FLOAT64_ARRAY: break;
+        case OBJ_RANGE: break;
         // native function has name to mark
         case OBJ_NATIVE: {
             NativeObj *native = (NativeObj*)obj;
-            mark_obj((Obj*)native->name);
+            mark_obj((Obj*)native->name, vm);
             break;
         }
         case OBJ_UPVALUE: {
             UpvalueObj *upvalue = (UpvalueObj*)obj;
             // closed may not always valid
-            mark_value(&upvalue->close);
+            mark_value(&upvalue->close, vm);
             break;
         }
         case OBJ_FUNCTION: {
             FunctionObj *function = (FunctionObj*)obj;
-            mark_obj((Obj*)function->name);
-            mark_array(&function->chunk.constant);
+            mark_obj((Obj*)function->name, vm);
+            mark_array(&function->chunk.constant, vm);
             break;
         }
         case OBJ_CLOSURE: {
             ClosureObj *closure = (ClosureObj*)obj;
-            mark_obj((Obj*)closure->function);
-            for (int i = 0; i < closure->upvalue_cnt; i++) mark_obj((Obj*)closure->upvalues[i]);
+            mark_obj((Obj*)closure->function, vm);
+            for (int i = 0; i < closure->upvalue_cnt; i++) mark_obj((Obj*)closure->upvalues[i], vm);
+            for (int i = 0; i < closure->capture_cnt; i++) mark_value(&closure->captures[i], vm);
             break;
         }
         case OBJ_CLASS: {
             ClassObj *klass = (ClassObj*)obj;
-            mark_obj((Obj*)klass->name);
-            mark_table(&klass->methods);
+            mark_obj((Obj*)klass->name, vm);
+            mark_table(&klass->methods, vm);
             break;
         }
         case OBJ_INSTANCE: {
             InstanceObj *instance = (InstanceObj*)obj;
-            mark_obj((Obj*)instance->klass);
-            mark_table(&instance->fields);
+            mark_obj((Obj*)instance->klass, vm);
+            mark_table(&instance->fields, vm);
             break;
         }
         case OBJ_METHOD: {
             MethodObj *method = (MethodObj*)obj;
-            mark_obj((Obj*)method->receiver);
-            mark_obj((Obj*)method->closure);
+            mark_obj((Obj*)method->receiver, vm);
+            mark_obj((Obj*)method->closure, vm);
+            break;
+        }
+        case OBJ_FIBER: {
+            FiberObj *fiber = (FiberObj*)obj;
+            mark_obj((Obj*)fiber->closure, vm);
+            mark_obj((Obj*)fiber->caller, vm);
+            for (Value *cur = fiber->stack; cur < fiber->sp; cur++) mark_value(cur, vm);
+            for (int i = 0; i < fiber->frame_cnt; i++) mark_obj((Obj*)fiber->frames[i].closure, vm);
+            for (int i = 0; i < fiber->open_top; i++) mark_obj((Obj*)fiber->open_upvalues[i], vm);
+            break;
+        }
+        case OBJ_LIST: {
+            ListObj *list = (ListObj*)obj;
+            mark_array(&list->items, vm);
+            break;
+        }
+        case OBJ_MAP: {
+            MapObj *map = (MapObj*)obj;
+            mark_table(&map->table, vm);
             break;
         }
     }
 }
 
-static void mark_array(ValueArray *array) {
-    for (int i = 0; i < array->count; i++) mark_value(&array->values[i]);
+static void mark_array(ValueArray *array, VM *vm) {
+    // elements of a list may all be gray at once
+    reserve_gray(array->count, vm);
+    for (int i = 0; i < array->count; i++) mark_value(&array->values[i], vm);
 }
 
-static void sweep() {
-    Obj *cur = &vm.objs;
+static void sweep(VM *vm) {
+    Obj *cur = &vm->objs;
     while (cur->next != NULL) {
         Obj *next = cur->next;
         if (next->is_marked) {
@@ -179,7 +232,7 @@ static void sweep() {
             continue;
         }
         cur->next = next->next;
-        free_obj(next);
+        free_obj(next, vm);
     }
 }
 
@@ -187,6 +240,25 @@ static void remove_table_white(Table *table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
         // erase dangling pointer
-        if (entry->key != NULL && !entry->key->obj.is_marked) table_remove(entry->key, NULL, table); 
+        if (!IS_NIL(entry->key) && !AS_OBJ(entry->key)->is_marked) table_remove(AS_STRING(entry->key), NULL, table); 
+    }
+}
+
+// a closure may outlive the fiber it captured a local of, so the local moves into its upvalue before stack is freed
+static void close_white_fibers(VM *vm) {
+    FiberObj **cur = &vm->fibers;
+    while (*cur != NULL) {
+        FiberObj *fiber = *cur;
+        if (fiber->obj.is_marked) {
+            cur = &fiber->next_fiber;
+            continue;
+        }
+        for (int i = 0; i < fiber->open_top; i++) {
+            UpvalueObj *upvalue = fiber->open_upvalues[i];
+            if (upvalue == NULL) continue;
+            upvalue->close = *upvalue->location;
+            upvalue->location = &upvalue->close;
+        }
+        *cur = fiber->next_fiber;
     }
-}
\ No newline at end of file
+}
@@ -5,16 +5,17 @@
 #include "value/value.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) << 1)
-#define GROW_ARRAY(type, pointer, old_size, new_size)\
-        (type*)reallocate((type*)(pointer), sizeof(type) * (old_size), sizeof(type) * (new_size))
-#define FREE_ARRAY(type, pointer, old_size)\
-        (type*)reallocate((type*)(pointer), old_size, 0)
-#define ALLOCATE(type, size)\
-        (type*)reallocate(NULL, 0, sizeof(type) * (size))
-#define FREE(type, pointer)\
-        (type*)reallocate((type*)(pointer), sizeof(type), 0)
+// memory is accounted to and collected by @param vm
+#define GROW_ARRAY(type, pointer, old_size, new_size, vm)\
+        (type*)reallocate((type*)(pointer), sizeof(type) * (old_size), sizeof(type) * (new_size), vm)
+#define FREE_ARRAY(type, pointer, old_size, vm)\
+        (type*)reallocate((type*)(pointer), old_size, 0, vm)
+#define ALLOCATE(type, size, vm)\
+        (type*)reallocate(NULL, 0, sizeof(type) * (size), vm)
+#define FREE(type, pointer, vm)\
+        (type*)reallocate((type*)(pointer), sizeof(type), 0, vm)
 
-void* reallocate(void *pointer, size_t old_size, size_t new_size);
-void mark_obj(Obj *obj);
+void* reallocate(void *pointer, size_t old_size, size_t new_size, VM *vm);
+void mark_obj(Obj *obj, VM *vm);
 
 #endif  // clox_memory_h
\ No newline at end of file
@@ -0,0 +1,469 @@
+#include "numeric.h"
+#include "object/object.h"
+#include "memory/memory.h"
+// added for memcpy
+#include <string.h>
+// added for INT_MAX
+#include <limits.h>
+#ifdef __x86_64__
+// added for sse2 and avx2 intrinsics
+#include <immintrin.h>
+#endif
+
+/**
+ * a kernel set per instruction set, picked on every call by cpu of the running machine, scalar loops serve other targets
+ * each kernel handles whole vectors first, then a scalar tail
+ */
+typedef struct {
+    double (*sum)(const double *x, int n);
+    double (*dot)(const double *x, const double *y, int n);
+    void (*scale)(double *x, double k, int n);
+    void (*add)(double *x, const double *y, int n);
+    // max of @param x if @param max is set, otherwise min, n must be positive
+    double (*extreme)(const double *x, int n, bool max);
+} Kernels;
+
+static const Kernels* kernels();
+static double pick(double a, double b, bool max);
+#ifndef __x86_64__
+static double sum_scalar(const double *x, int n);
+static double dot_scalar(const double *x, const double *y, int n);
+static void scale_scalar(double *x, double k, int n);
+static void add_scalar(double *x, const double *y, int n);
+static double extreme_scalar(const double *x, int n, bool max);
+#else
+static double sum_sse2(const double *x, int n);
+static double dot_sse2(const double *x, const double *y, int n);
+static void scale_sse2(double *x, double k, int n);
+static void add_sse2(double *x, const double *y, int n);
+static double extreme_sse2(const double *x, int n, bool max);
+static double sum_avx2(const double *x, int n);
+static double dot_avx2(const double *x, const double *y, int n);
+static void scale_avx2(double *x, double k, int n);
+static void add_avx2(double *x, const double *y, int n);
+static double extreme_avx2(const double *x, int n, bool max);
+#endif
+static void radix_sort(double *x, int n, uint64_t *keys, uint64_t *tmp);
+static bool same_length(Value a, Value b, const char *name, VM *vm);
+static bool native_float64_array(int argc, Value *args, VM *vm);
+static bool native_sum(int argc, Value *args, VM *vm);
+static bool native_dot(int argc, Value *args, VM *vm);
+static bool native_scale(int argc, Value *args, VM *vm);
+static bool native_add(int argc, Value *args, VM *vm);
+static bool native_min(int argc, Value *args, VM *vm);
+static bool native_max(int argc, Value *args, VM *vm);
+static bool native_extreme(int argc, Value *args, bool max, VM *vm);
+static bool native_sort(int argc, Value *args, VM *vm);
+static int popcount(uint64_t x);
+#ifdef __x86_64__
+static int popcount_popcnt(uint64_t x);
+#endif
+static int clz(uint64_t x);
+static int ctz(uint64_t x);
+static bool native_popcount(int argc, Value *args, VM *vm);
+static bool native_clz(int argc, Value *args, VM *vm);
+static bool native_ctz(int argc, Value *args, VM *vm);
+static bool native_bit_count(int argc, Value *args, int (*count)(uint64_t), const char *name, VM *vm);
+
+#ifndef __x86_64__
+static const Kernels scalar_kernels = { sum_scalar, dot_scalar, scale_scalar, add_scalar, extreme_scalar };
+#else
+static const Kernels sse2_kernels = { sum_sse2, dot_sse2, scale_sse2, add_sse2, extreme_sse2 };
+static const Kernels avx2_kernels = { sum_avx2, dot_avx2, scale_avx2, add_avx2, extreme_avx2 };
+#endif
+
+void define_numeric_natives(VM *vm) {
+    define_native("Float64Array", native_float64_array, vm);
+    define_native("sum", native_sum, vm);
+    define_native("dot", native_dot, vm);
+    define_native("scale", native_scale, vm);
+    define_native("add", native_add, vm);
+    define_native("min", native_min, vm);
+    define_native("max", native_max, vm);
+    define_native("sort", native_sort, vm);
+    define_native("popcount", native_popcount, vm);
+    define_native("clz", native_clz, vm);
+    define_native("ctz", native_ctz, vm);
+}
+
+// cpu features are detected by libgcc at startup, asking is a load and a test, no state of our own
+static const Kernels* kernels() {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+    // sse2 is part of x86-64
+    return &sse2_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
+
+static double pick(double a, double b, bool max) {
+    if (max) return b > a ? b : a;
+    return b < a ? b : a;
+}
+
+#ifndef __x86_64__
+static double sum_scalar(const double *x, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += x[i];
+    return sum;
+}
+
+static double dot_scalar(const double *x, const double *y, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+
+static void scale_scalar(double *x, double k, int n) {
+    for (int i = 0; i < n; i++) x[i] *= k;
+}
+
+static void add_scalar(double *x, const double *y, int n) {
+    for (int i = 0; i < n; i++) x[i] += y[i];
+}
+
+static double extreme_scalar(const double *x, int n, bool max) {
+    double rst = x[0];
+    for (int i = 1; i < n; i++) rst = pick(rst, x[i], max);
+    return rst;
+}
+#else
+// two accumulators hide latency of add
+static double sum_sse2(const double *x, int n) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(x + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(x + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1];
+    for (; i < n; i++) sum += x[i];
+    return sum;
+}
+
+static double dot_sse2(const double *x, const double *y, int n) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1];
+    for (; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+
+static void scale_sse2(double *x, double k, int n) {
+    __m128d factor = _mm_set1_pd(k);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), factor));
+    for (; i < n; i++) x[i] *= k;
+}
+
+static void add_sse2(double *x, const double *y, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(x + i, _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    for (; i < n; i++) x[i] += y[i];
+}
+
+static double extreme_sse2(const double *x, int n, bool max) {
+    __m128d acc = _mm_set1_pd(x[0]);
+    int i = 0;
+    if (max) for (; i + 2 <= n; i += 2) acc = _mm_max_pd(acc, _mm_loadu_pd(x + i));
+    else for (; i + 2 <= n; i += 2) acc = _mm_min_pd(acc, _mm_loadu_pd(x + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double rst = pick(lanes[0], lanes[1], max);
+    for (; i < n; i++) rst = pick(rst, x[i], max);
+    return rst;
+}
+
+// four accumulators of four lanes, 16 elements per iteration
+__attribute__((target("avx2")))
+static double sum_avx2(const double *x, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    __m256d acc3 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+        acc2 = _mm256_add_pd(acc2, _mm256_loadu_pd(x + i + 8));
+        acc3 = _mm256_add_pd(acc3, _mm256_loadu_pd(x + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3)));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) sum += x[i];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static double dot_avx2(const double *x, const double *y, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    __m256d acc3 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+        acc2 = _mm256_add_pd(acc2, _mm256_mul_pd(_mm256_loadu_pd(x + i + 8), _mm256_loadu_pd(y + i + 8)));
+        acc3 = _mm256_add_pd(acc3, _mm256_mul_pd(_mm256_loadu_pd(x + i + 12), _mm256_loadu_pd(y + i + 12)));
+    }
+    for (; i + 4 <= n; i += 4) acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3)));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static void scale_avx2(double *x, double k, int n) {
+    __m256d factor = _mm256_set1_pd(k);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), factor));
+    for (; i < n; i++) x[i] *= k;
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(double *x, const double *y, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    for (; i < n; i++) x[i] += y[i];
+}
+
+__attribute__((target("avx2")))
+static double extreme_avx2(const double *x, int n, bool max) {
+    __m256d acc = _mm256_set1_pd(x[0]);
+    int i = 0;
+    if (max) for (; i + 4 <= n; i += 4) acc = _mm256_max_pd(acc, _mm256_loadu_pd(x + i));
+    else for (; i + 4 <= n; i += 4) acc = _mm256_min_pd(acc, _mm256_loadu_pd(x + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double rst = pick(pick(lanes[0], lanes[1], max), pick(lanes[2], lanes[3], max), max);
+    for (; i < n; i++) rst = pick(rst, x[i], max);
+    return rst;
+}
+#endif // __x86_64__
+
+/**
+ * lsd radix sort on bits of doubles, a byte per pass, passes where every key has the same byte are skipped
+ * bits are mapped so unsigned order is numeric order: negatives are flipped, positives get sign bit set
+ * NaNs sort to the ends, -0 before 0
+ */
+static void radix_sort(double *x, int n, uint64_t *keys, uint64_t *tmp) {
+#define SIGN ((uint64_t)1 << 63)
+    for (int i = 0; i < n; i++) {
+        uint64_t bits;
+        memcpy(&bits, &x[i], sizeof(double));
+        keys[i] = bits & SIGN ? ~bits : bits | SIGN;
+    }
+    uint64_t *src = keys;
+    uint64_t *dst = tmp;
+    for (int shift = 0; shift < 64; shift += 8) {
+        int counts[256] = { 0 };
+        for (int i = 0; i < n; i++) counts[(src[i] >> shift) & 0xff]++;
+        if (counts[(src[0] >> shift) & 0xff] == n) continue;
+        int offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            int count = counts[digit];
+            counts[digit] = offset;
+            offset += count;
+        }
+        for (int i = 0; i < n; i++) dst[counts[(src[i] >> shift) & 0xff]++] = src[i];
+        uint64_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    for (int i = 0; i < n; i++) {
+        uint64_t bits = src[i] & SIGN ? src[i] & ~SIGN : ~src[i];
+        memcpy(&x[i], &bits, sizeof(double));
+    }
+#undef SIGN
+}
+
+static bool same_length(Value a, Value b, const char *name, VM *vm) {
+    if (!IS_FLOAT64_ARRAY(a) || !IS_FLOAT64_ARRAY(b)) {
+        runtime_error(vm, "%s expects two float64 arrays.", name);
+        return false;
+    }
+    if (AS_FLOAT64_ARRAY(a)->count != AS_FLOAT64_ARRAY(b)->count) {
+        runtime_error(vm, "%s expects float64 arrays of one length, got %d and %d.", name, AS_FLOAT64_ARRAY(a)->count, AS_FLOAT64_ARRAY(b)->count);
+        return false;
+    }
+    return true;
+}
+
+// Float64Array(n) results in n zeros, Float64Array(list) in a copy of numbers of list
+static bool native_float64_array(int argc, Value *args, VM *vm) {
+    if (argc == 1 && IS_LIST(args[0])) {
+        ValueArray *items = &AS_LIST(args[0])->items;
+        for (int i = 0; i < items->count; i++) {
+            if (IS_NUMBER(items->values[i])) continue;
+            runtime_error(vm, "Float64Array expects a list of numbers.");
+            return false;
+        }
+        Float64ArrayObj *array = new_float64_array(items->count, vm);
+        for (int i = 0; i < items->count; i++) array->data[i] = AS_NUMBER(items->values[i]);
+        args[-1] = OBJ_VALUE(array);
+        return true;
+    }
+    if (argc != 1 || !IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0 && AS_NUMBER(args[0]) <= INT_MAX) || AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0])) {
+        runtime_error(vm, "Float64Array expects a length or a list of numbers.");
+        return false;
+    }
+    args[-1] = OBJ_VALUE(new_float64_array((int)AS_NUMBER(args[0]), vm));
+    return true;
+}
+
+// sum(a) results in sum of elements of a
+static bool native_sum(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_FLOAT64_ARRAY(args[0])) {
+        runtime_error(vm, "sum expects a float64 array.");
+        return false;
+    }
+    Float64ArrayObj *array = AS_FLOAT64_ARRAY(args[0]);
+    args[-1] = NUMBER_VALUE(kernels()->sum(array->data, array->count));
+    return true;
+}
+
+// dot(a, b) results in dot product of a and b
+static bool native_dot(int argc, Value *args, VM *vm) {
+    if (argc != 2) {
+        runtime_error(vm, "dot expects two float64 arrays.");
+        return false;
+    }
+    if (!same_length(args[0], args[1], "dot", vm)) return false;
+    Float64ArrayObj *a = AS_FLOAT64_ARRAY(args[0]);
+    Float64ArrayObj *b = AS_FLOAT64_ARRAY(args[1]);
+    args[-1] = NUMBER_VALUE(kernels()->dot(a->data, b->data, a->count));
+    return true;
+}
+
+// scale(a, k) multiplies every element of a by k in place, results in a
+static bool native_scale(int argc, Value *args, VM *vm) {
+    if (argc != 2 || !IS_FLOAT64_ARRAY(args[0]) || !IS_NUMBER(args[1])) {
+        runtime_error(vm, "scale expects a float64 array and a number.");
+        return false;
+    }
+    Float64ArrayObj *array = AS_FLOAT64_ARRAY(args[0]);
+    kernels()->scale(array->data, AS_NUMBER(args[1]), array->count);
+    args[-1] = args[0];
+    return true;
+}
+
+// add(a, b) adds elements of b to those of a in place, results in a
+static bool native_add(int argc, Value *args, VM *vm) {
+    if (argc != 2) {
+        runtime_error(vm, "add expects two float64 arrays.");
+        return false;
+    }
+    if (!same_length(args[0], args[1], "add", vm)) return false;
+    Float64ArrayObj *a = AS_FLOAT64_ARRAY(args[0]);
+    Float64ArrayObj *b = AS_FLOAT64_ARRAY(args[1]);
+    kernels()->add(a->data, b->data, a->count);
+    args[-1] = args[0];
+    return true;
+}
+
+// min(a) results in the least element of a
+static bool native_min(int argc, Value *args, VM *vm) {
+    return native_extreme(argc, args, false, vm);
+}
+
+// max(a) results in the greatest element of a
+static bool native_max(int argc, Value *args, VM *vm) {
+    return native_extreme(argc, args, true, vm);
+}
+
+static bool native_extreme(int argc, Value *args, bool max, VM *vm) {
+    const char *name = max ? "max" : "min";
+    if (argc != 1 || !IS_FLOAT64_ARRAY(args[0])) {
+        runtime_error(vm, "%s expects a float64 array.", name);
+        return false;
+    }
+    Float64ArrayObj *array = AS_FLOAT64_ARRAY(args[0]);
+    if (array->count == 0) {
+        runtime_error(vm, "%s of an empty float64 array.", name);
+        return false;
+    }
+    args[-1] = NUMBER_VALUE(kernels()->extreme(array->data, array->count, max));
+    return true;
+}
+
+// sort(a) sorts a ascending in place, results in a
+static bool native_sort(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_FLOAT64_ARRAY(args[0])) {
+        runtime_error(vm, "sort expects a float64 array.");
+        return false;
+    }
+    Float64ArrayObj *array = AS_FLOAT64_ARRAY(args[0]);
+    if (array->count > 1) {
+        // array stays in argument slot if gc runs
+        uint64_t *keys = ALLOCATE(uint64_t, 2 * (size_t)array->count, vm);
+        radix_sort(array->data, array->count, keys, keys + array->count);
+        FREE_ARRAY(uint64_t, keys, 2 * (size_t)array->count, vm);
+    }
+    args[-1] = args[0];
+    return true;
+}
+
+// popcnt is not part of baseline x86-64, without it the builtin counts in software
+static int popcount(uint64_t x) {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("popcnt")) return popcount_popcnt(x);
+#endif
+    return __builtin_popcountll(x);
+}
+
+#ifdef __x86_64__
+__attribute__((target("popcnt")))
+static int popcount_popcnt(uint64_t x) {
+    return __builtin_popcountll(x);
+}
+#endif
+
+// bsr and bsf are undefined on zero, which has all 64 bits clear
+static int clz(uint64_t x) {
+    return x == 0 ? 64 : __builtin_clzll(x);
+}
+
+static int ctz(uint64_t x) {
+    return x == 0 ? 64 : __builtin_ctzll(x);
+}
+
+// popcount(n) results in number of set bits of n as 64-bit two's complement
+static bool native_popcount(int argc, Value *args, VM *vm) {
+    return native_bit_count(argc, args, popcount, "popcount", vm);
+}
+
+// clz(n) results in number of leading zero bits of n as 64-bit two's complement, 64 for 0
+static bool native_clz(int argc, Value *args, VM *vm) {
+    return native_bit_count(argc, args, clz, "clz", vm);
+}
+
+// ctz(n) results in number of trailing zero bits of n as 64-bit two's complement, 64 for 0
+static bool native_ctz(int argc, Value *args, VM *vm) {
+    return native_bit_count(argc, args, ctz, "ctz", vm);
+}
+
+static bool native_bit_count(int argc, Value *args, int (*count)(uint64_t), const char *name, VM *vm) {
+    int64_t n;
+    if (argc != 1 || !as_exact_int(args[0], &n)) {
+        runtime_error(vm, "%s expects an integer.", name);
+        return false;
+    }
+    args[-1] = INT_VALUE(count((uint64_t)n));
+    return true;
+}
@@ -0,0 +1,15 @@
+#ifndef clox_numeric_h
+#define clox_numeric_h
+#include "common.h"
+#include "vm/vm.h"
+
+/**
+ * natives over Float64Array, a loop over raw doubles runs in one native call instead of one instruction per element
+ * on x86-64 kernels use avx2 when cpu supports it and sse2 otherwise, other targets run scalar loops
+ * kernels add in a different order than a scalar loop, so sum and dot may differ in last bits between cpus
+ */
+
+// natives: Float64Array, sum, dot, scale, add, min, max, sort, and popcount, clz, ctz on integers
+void define_numeric_natives(VM *vm);
+
+#endif // clox_numeric_h
@@ -1,6 +1,9 @@
 #include "object.h"
 #include "memory/memory.h"
 #include "vm/vm.h"
+#include "jit/jit.h"
+// added for find_shared_string
+#include "shared/shared.h"
 
 // added for memcpy
 #include <string.h>
@@ -9,9 +12,18 @@
 // added for free
 #include <stdlib.h>
 
-static Obj* new_obj(ObjType type, size_t size);
-static StringObj* take_string(const char *str, int length);
+// lists and maps being printed, from innermost one out, one met again is printed as [...] or {...} instead of recursing forever
+typedef struct Printing {
+    Obj *obj;
+    struct Printing *outer;
+} Printing;
+
+static Obj* new_obj(ObjType type, size_t size, VM *vm);
+static StringObj* take_string(const char *str, int length, VM *vm);
 static uint32_t hash_string(const char *str, int length);
+static void print_nested(Value value, Printing *outer);
+static void print_list(ListObj *list, Printing *outer);
+static void print_map(MapObj *map, Printing *outer);
 
 void print_obj(Value value) {
     switch (OBJ_TYPE(value)) {
@@ -53,6 +65,39 @@ void print_obj(Value value) {
             printf("<clox method %s>", method->closure->function->name->str);
             break;
         }
+        case OBJ_FIBER: {
+            printf("<clox fiber>");
+            break;
+        }
+        case OBJ_LIST: {
+            print_list(AS_LIST(value), NULL);
+            break;
+        }
+        case OBJ_MAP: {
+            print_map(AS_MAP(value), NULL);
+            break;
+        }
+        case OBJ_FLOAT64_ARRAY: {
+            Float64ArrayObj *array = AS_FLOAT64_ARRAY(value);
+            printf("Float64Array[");
+            for (int i = 0; i < array->count; i++) {
+                if (i > 0) printf(", ");
+                print_value(NUMBER_VALUE(array->data[i]));
+            }
+            printf("]");
+            break;
+        }
+        case OBJ_RANGE: {
+            RangeObj *range = AS_RANGE(value);
+            printf("range(");
+            print_value(NUMBER_VALUE(range->start));
+            printf(", ");
+            print_value(NUMBER_VALUE(range->end));
+            printf(", ");
+            print_value(NUMBER_VALUE(range->step));
+            printf(")");
+            break;
+        }
     }
 } 
 
@@ -67,176 +112,329 @@ bool objs_equal(Value a, Value b) {
         case OBJ_CLASS:     return AS_CLASS(a) == AS_CLASS(b);
         case OBJ_INSTANCE:  return AS_INSTANCE(a) == AS_INSTANCE(b);
         case OBJ_METHOD:    return AS_METHOD(a) == AS_METHOD(b);
+        case OBJ_FIBER:     return AS_FIBER(a) == AS_FIBER(b);
+        case OBJ_LIST:      return AS_LIST(a) == AS_LIST(b);
+        case OBJ_MAP:       return AS_MAP(a) == AS_MAP(b);
+        case OBJ_FLOAT64_ARRAY: return AS_FLOAT64_ARRAY(a) == AS_FLOAT64_ARRAY(b);
+        case OBJ_RANGE:     return AS_RANGE(a) == AS_RANGE(b);
     }
     return false;
 }
 
-StringObj* new_string(const char *str, int length) {
-    char *heap_str = ALLOCATE(char, length + 1);
+StringObj* new_string(const char *str, int length, VM *vm) {
+    char *heap_str = ALLOCATE(char, length + 1, vm);
     memcpy(heap_str, str, length);
     heap_str[length] = '\0';
-    return take_string(heap_str, length);
+    return take_string(heap_str, length, vm);
 }
 
-Value append_string(Value a, Value b) {
+Value append_string(Value a, Value b, VM *vm) {
     StringObj *a_str = AS_STRING(a);
     StringObj *b_str = AS_STRING(b);
     int length = a_str->length + b_str->length;
-    char *heap_str = ALLOCATE(char, length + 1);
+    char *heap_str = ALLOCATE(char, length + 1, vm);
     memcpy(heap_str, a_str->str, a_str->length);
     memcpy(heap_str + a_str->length, b_str->str, b_str->length);
     heap_str[length] = '\0';
-    return OBJ_VALUE(take_string(heap_str, length));
+    return OBJ_VALUE(take_string(heap_str, length, vm));
 }
 
-FunctionObj* new_function() {
-    FunctionObj *function = (FunctionObj*)new_obj(OBJ_FUNCTION, sizeof(FunctionObj));
+FunctionObj* new_function(VM *vm) {
+    FunctionObj *function = (FunctionObj*)new_obj(OBJ_FUNCTION, sizeof(FunctionObj), vm);
     function->arity = 0;
     function->name = NULL;
     init_chunk(&function->chunk);
     function->upvalue_cnt = 0;
+    function->capture_cnt = 0;
+    function->stack_size = 0;
+    function->registers = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->jit_size = 0;
     return function;
 }
 
-NativeObj* new_native(native_func func, StringObj *name) {
-    NativeObj *native = (NativeObj*)new_obj(OBJ_NATIVE, sizeof(NativeObj));
+NativeObj* new_native(native_func func, StringObj *name, VM *vm) {
+    NativeObj *native = (NativeObj*)new_obj(OBJ_NATIVE, sizeof(NativeObj), vm);
     native->native = func;
     native->name = name;
     return native;
 }
 
-ClosureObj* new_closure(FunctionObj *function) {
+ClosureObj* new_closure(FunctionObj *function, VM *vm) {
     // make sure to allocate upvalues first => upvalues will not be liked to objects list => it cannot be reaped by gc
-    UpvalueObj **upvalues = ALLOCATE(UpvalueObj*, function->upvalue_cnt);
+    UpvalueObj **upvalues = ALLOCATE(UpvalueObj*, function->upvalue_cnt, vm);
     for (int i = 0; i < function->upvalue_cnt; i++) upvalues[i] = NULL; 
-    ClosureObj *closure = (ClosureObj*)new_obj(OBJ_CLOSURE, sizeof(ClosureObj));
+    Value *captures = ALLOCATE(Value, function->capture_cnt, vm);
+    for (int i = 0; i < function->capture_cnt; i++) captures[i] = NIL_VALUE;
+    ClosureObj *closure = (ClosureObj*)new_obj(OBJ_CLOSURE, sizeof(ClosureObj), vm);
     closure->function = function;
     closure->upvalue_cnt = function->upvalue_cnt;
     closure->upvalues = upvalues;
+    closure->capture_cnt = function->capture_cnt;
+    closure->captures = captures;
     return closure;
 }
 
-UpvalueObj* new_upvalue(Value *slot) {
-    UpvalueObj *head = &vm.upvalues;
-    UpvalueObj *cur = head;
-    while (cur->next != NULL && cur->next->location > slot) cur = cur->next;
-    if (cur->next != NULL && cur->next->location == slot) return cur->next;
+UpvalueObj* new_upvalue(Value *slot, VM *vm) {
+    // closures capturing one slot share its upvalue, found by slot instead of a list walk
+    int idx = (int)(slot - vm->stack);
+    if (vm->open_upvalues[idx] != NULL) return vm->open_upvalues[idx];
 
-    UpvalueObj *upvalue = (UpvalueObj*)new_obj(OBJ_UPVALUE, sizeof(UpvalueObj));
+    UpvalueObj *upvalue = (UpvalueObj*)new_obj(OBJ_UPVALUE, sizeof(UpvalueObj), vm);
     upvalue->location = slot;
     upvalue->close = NIL_VALUE;
-    upvalue->next = cur->next;
-    cur->next = upvalue;
+    vm->open_upvalues[idx] = upvalue;
+    if (idx >= vm->open_top) vm->open_top = idx + 1;
     return upvalue;
 }
 
-ClassObj* new_class(StringObj *name) {
-    ClassObj *class = (ClassObj*)new_obj(OBJ_CLASS, sizeof(ClassObj));
+ClassObj* new_class(StringObj *name, VM *vm) {
+    ClassObj *class = (ClassObj*)new_obj(OBJ_CLASS, sizeof(ClassObj), vm);
     class->name = name;
     init_table(&class->methods);
     return class;
 }
 
-InstanceObj* new_instance(ClassObj *klass) {
-    InstanceObj *instance = (InstanceObj*)new_obj(OBJ_INSTANCE, sizeof(InstanceObj));
+InstanceObj* new_instance(ClassObj *klass, VM *vm) {
+    InstanceObj *instance = (InstanceObj*)new_obj(OBJ_INSTANCE, sizeof(InstanceObj), vm);
     instance->klass = klass;
     init_table(&instance->fields);
     return instance;
 }
 
-MethodObj* new_method(InstanceObj *receiver, ClosureObj *method) {
-    MethodObj *obj = (MethodObj*)new_obj(OBJ_METHOD, sizeof(MethodObj));
+MethodObj* new_method(InstanceObj *receiver, ClosureObj *method, VM *vm) {
+    MethodObj *obj = (MethodObj*)new_obj(OBJ_METHOD, sizeof(MethodObj), vm);
     obj->receiver = receiver;
     obj->closure = method;
     return obj;
 }
 
-void free_objs() {
-    Obj *cur = &vm.objs;
+FiberObj* new_fiber(ClosureObj *closure, VM *vm) {
+    // stack and frames start small as those of vm, then grow on calls
+    Value *stack = ALLOCATE(Value, STACK_INIT, vm);
+    CallFrame *frames = ALLOCATE(CallFrame, FRAMES_INIT, vm);
+    UpvalueObj **open_upvalues = ALLOCATE(UpvalueObj*, STACK_INIT, vm);
+    for (int i = 0; i < STACK_INIT; i++) open_upvalues[i] = NULL;
+    FiberObj *fiber = (FiberObj*)new_obj(OBJ_FIBER, sizeof(FiberObj), vm);
+    fiber->closure = closure;
+    fiber->state = FIBER_NEW;
+    fiber->stack = stack;
+    fiber->stack_capacity = STACK_INIT;
+    fiber->sp = stack;
+    fiber->frames = frames;
+    fiber->frame_cnt = 0;
+    fiber->frame_capacity = FRAMES_INIT;
+    fiber->open_upvalues = open_upvalues;
+    fiber->open_top = 0;
+    fiber->caller = NULL;
+    fiber->depth = 0;
+    fiber->transfer = NIL_VALUE;
+    fiber->next_fiber = vm->fibers;
+    vm->fibers = fiber;
+    return fiber;
+}
+
+ListObj* new_list(Value *values, int count, VM *vm) {
+    // elements are copied before list is allocated, so they are still rooted by caller if gc runs
+    Value *items = ALLOCATE(Value, count, vm);
+    if (count > 0) memcpy(items, values, sizeof(Value) * count);
+    ListObj *list = (ListObj*)new_obj(OBJ_LIST, sizeof(ListObj), vm);
+    list->items.values = items;
+    list->items.count = count;
+    list->items.capacity = count;
+    return list;
+}
+
+MapObj* new_map(VM *vm) {
+    MapObj *map = (MapObj*)new_obj(OBJ_MAP, sizeof(MapObj), vm);
+    init_table(&map->table);
+    return map;
+}
+
+Float64ArrayObj* new_float64_array(int count, VM *vm) {
+    double *data = ALLOCATE(double, count, vm);
+    for (int i = 0; i < count; i++) data[i] = 0;
+    Float64ArrayObj *array = (Float64ArrayObj*)new_obj(OBJ_FLOAT64_ARRAY, sizeof(Float64ArrayObj), vm);
+    array->data = data;
+    array->count = count;
+    return array;
+}
+
+RangeObj* new_range(double start, double end, double step, VM *vm) {
+    RangeObj *range = (RangeObj*)new_obj(OBJ_RANGE, sizeof(RangeObj), vm);
+    range->start = start;
+    range->end = end;
+    range->step = step;
+    return range;
+}
+
+void free_objs(VM *vm) {
+    Obj *cur = &vm->objs;
     while (cur->next != NULL) {
         Obj *next = cur->next;
         cur->next = next->next;
-        free_obj(next);
+        free_obj(next, vm);
     }
 }
 
-static Obj* new_obj(ObjType type, size_t size) {
-    Obj *obj = (Obj*)reallocate(NULL, 0, size);
+static Obj* new_obj(ObjType type, size_t size, VM *vm) {
+    Obj *obj = (Obj*)reallocate(NULL, 0, size, vm);
     obj->type = type;
     obj->is_marked = false;
-    obj->next = vm.objs.next;
-    vm.objs.next = obj;
+    obj->is_shared = false;
+    obj->next = vm->objs.next;
+    vm->objs.next = obj;
 #ifdef CLOX_DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)obj, size, type);
 #endif // CLOX_DEBUG_LOG_GC
     return obj;
 }
 
-void free_obj(Obj *obj) {
+void free_obj(Obj *obj, VM *vm) {
 #ifdef CLOX_DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)obj, obj->type);
 #endif // CLOX_DEBUG_LOX_GC
     switch (obj->type) {
         case OBJ_STRING: {
             StringObj *string = (StringObj*)obj;
-            FREE_ARRAY(char, string->str, string->length + 1);
-            FREE(StringObj, obj);
+            FREE_ARRAY(char, string->str, string->length + 1, vm);
+            FREE(StringObj, obj, vm);
             break;
         }
         case OBJ_FUNCTION: {
             FunctionObj *function = (FunctionObj*)obj;
-            free_chunk(&function->chunk);
-            FREE(FunctionObj, obj);
+            free_chunk(&function->chunk, vm);
+            if (function->registers != NULL) {
+                free_register_chunk(function->registers, vm);
+                FREE(RegisterChunk, function->registers, vm);
+            }
+            if (function->jit != NULL) jit_free(function);
+            FREE(FunctionObj, obj, vm);
             break;
         }
         case OBJ_NATIVE: {
-            FREE(NativeObj, obj);
+            FREE(NativeObj, obj, vm);
             break;
         }
         case OBJ_CLOSURE: {
             ClosureObj *closure = (ClosureObj*)obj;
-            FREE_ARRAY(UpvalueObj*, closure->upvalues, closure->upvalue_cnt);
-            FREE(ClosureObj, obj);
+            FREE_ARRAY(UpvalueObj*, closure->upvalues, closure->upvalue_cnt, vm);
+            FREE_ARRAY(Value, closure->captures, closure->capture_cnt, vm);
+            FREE(ClosureObj, obj, vm);
             break;
         }
         case OBJ_UPVALUE: {
-            FREE(UpvalueObj, obj);
+            FREE(UpvalueObj, obj, vm);
             break;
         }
         case OBJ_CLASS: {
             ClassObj *class = (ClassObj*)obj;
-            free_table(&class->methods);
-            FREE(ClassObj, obj);
+            free_table(&class->methods, vm);
+            FREE(ClassObj, obj, vm);
             break;
         }
         case OBJ_INSTANCE: {
             InstanceObj *instance = (InstanceObj*)obj;
-            free_table(&instance->fields);
-            FREE(InstanceObj, obj);
+            free_table(&instance->fields, vm);
+            FREE(InstanceObj, obj, vm);
             break;
         }
         case OBJ_METHOD: {
-            FREE(MethodObj, obj);
+            FREE(MethodObj, obj, vm);
             break;
         }
+        case OBJ_FIBER: {
+            FiberObj *fiber = (FiberObj*)obj;
+            FREE_ARRAY(Value, fiber->stack, fiber->stack_capacity, vm);
+            FREE_ARRAY(UpvalueObj*, fiber->open_upvalues, fiber->stack_capacity, vm);
+            FREE_ARRAY(CallFrame, fiber->frames, fiber->frame_capacity, vm);
+            FREE(FiberObj, obj, vm);
+            break;
+        }
+        case OBJ_LIST: {
+            ListObj *list = (ListObj*)obj;
+            free_value_array(&list->items, vm);
+            FREE(ListObj, obj, vm);
+            break;
+        }
+        case OBJ_MAP: {
+            MapObj *map = (MapObj*)obj;
+            free_table(&map->table, vm);
+            FREE(MapObj, obj, vm);
+            break;
+        }
+        case OBJ_FLOAT64_ARRAY: {
+            Float64ArrayObj *array = (Float64ArrayObj*)obj;
+            FREE_ARRAY(double, array->data, array->count, vm);
+            FREE(Float64ArrayObj, obj, vm);
+            break;
+        }
+        case OBJ_RANGE: {
+            FREE(RangeObj, obj, vm);
+            break;
+        }
+    }
+}
+
+// print an element of a list or map, containers are printed with @param outer as their enclosing ones
+static void print_nested(Value value, Printing *outer) {
+    if (!IS_LIST(value) && !IS_MAP(value)) {
+        print_value(value);
+        return;
+    }
+    for (Printing *printing = outer; printing != NULL; printing = printing->outer) {
+        if (printing->obj == AS_OBJ(value)) {
+            printf(IS_LIST(value) ? "[...]" : "{...}");
+            return;
+        }
+    }
+    if (IS_LIST(value)) print_list(AS_LIST(value), outer);
+    else print_map(AS_MAP(value), outer);
+}
+
+static void print_list(ListObj *list, Printing *outer) {
+    Printing cur = { .obj = (Obj*)list, .outer = outer };
+    printf("[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) printf(", ");
+        print_nested(list->items.values[i], &cur);
+    }
+    printf("]");
+}
+
+static void print_map(MapObj *map, Printing *outer) {
+    Printing cur = { .obj = (Obj*)map, .outer = outer };
+    printf("{");
+    bool first = true;
+    for (int i = table_next(&map->table, 0); i != -1; i = table_next(&map->table, i + 1)) {
+        if (!first) printf(", ");
+        first = false;
+        Entry *entry = &map->table.entries[i];
+        print_nested(entry->key, &cur);
+        printf(": ");
+        print_nested(entry->value, &cur);
     }
+    printf("}");
 }
 
-static StringObj* take_string(const char *str, int length) {
+static StringObj* take_string(const char *str, int length, VM *vm) {
     uint32_t hash = hash_string(str, length);
-    StringObj *interned = table_find_string(str, length, hash, &vm.strings);
+    // strings of frozen bytecode are interned process-wide, vm reuses them instead of its own copy
+    StringObj *interned = find_shared_string(str, length, hash);
+    if (interned == NULL) interned = table_find_string(str, length, hash, &vm->strings);
     if (interned != NULL) {
-        FREE_ARRAY(char, str, length + 1);
+        FREE_ARRAY(char, str, length + 1, vm);
         return interned;
     }
-    StringObj *string = (StringObj*)new_obj(OBJ_STRING, sizeof(StringObj));
+    StringObj *string = (StringObj*)new_obj(OBJ_STRING, sizeof(StringObj), vm);
     string->length = length;
     string->str = str;
     string->hash = hash;
     // table_put may trigger gc
-    push_gc(OBJ_VALUE(string));
-    table_put(string, NIL_VALUE, &vm.strings);
-    pop_gc();
+    push_gc(OBJ_VALUE(string), vm);
+    table_put(string, NIL_VALUE, &vm->strings, vm);
+    pop_gc(vm);
     return string;
 }
 
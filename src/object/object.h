@@ -14,6 +14,11 @@
 #define IS_CLASS(value)     (isObjType(value, OBJ_CLASS))
 #define IS_INSTANCE(value)  (isObjType(value, OBJ_INSTANCE))
 #define IS_METHOD(value)    (isObjType(value, OBJ_METHOD))
+#define IS_FIBER(value)     (isObjType(value, OBJ_FIBER))
+#define IS_LIST(value)      (isObjType(value, OBJ_LIST))
+#define IS_MAP(value)       (isObjType(value, OBJ_MAP))
+#define IS_FLOAT64_ARRAY(value) (isObjType(value, OBJ_FLOAT64_ARRAY))
+#define IS_RANGE(value)     (isObjType(value, OBJ_RANGE))
 
 #define AS_STRING(value)    ((StringObj*)AS_OBJ(value))
 #define AS_CSTRING(value)   (((StringObj*)AS_OBJ(value))->str)
@@ -24,8 +29,14 @@
 #define AS_CLASS(value)     ((ClassObj*)AS_OBJ(value))
 #define AS_INSTANCE(value)  ((InstanceObj*)AS_OBJ(value))
 #define AS_METHOD(value)    ((MethodObj*)AS_OBJ(value))
+#define AS_FIBER(value)     ((FiberObj*)AS_OBJ(value))
+#define AS_LIST(value)      ((ListObj*)AS_OBJ(value))
+#define AS_MAP(value)       ((MapObj*)AS_OBJ(value))
+#define AS_FLOAT64_ARRAY(value) ((Float64ArrayObj*)AS_OBJ(value))
+#define AS_RANGE(value)     ((RangeObj*)AS_OBJ(value))
 
-typedef Value (*native_func)(int argc, Value *args);
+// result is stored into args[-1], slot of native itself, returns false after reporting a runtime error
+typedef bool (*native_func)(int argc, Value *args, VM *vm);
 
 typedef enum {
     OBJ_STRING,
@@ -36,11 +47,18 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_METHOD,
+    OBJ_FIBER,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_FLOAT64_ARRAY,
+    OBJ_RANGE,
 } ObjType;
 
 struct Obj {
     ObjType type;
     bool is_marked;
+    // frozen into shared memory, owned by no vm, see shared/shared.h
+    bool is_shared;
     Obj *next;
 };
 
@@ -56,7 +74,19 @@ struct FunctionObj {
     StringObj *name;
     int arity;
     Chunk chunk;
+    // upvalue descriptors following its closure instruction
     int upvalue_cnt;
+    // values copied into closure by descriptors capturing a value instead of a variable
+    int capture_cnt;
+    // values a frame needs at most, including callee and arguments
+    int stack_size;
+    // translation of chunk for register vm, NULL if it runs on stack vm
+    RegisterChunk *registers;
+    // calls counted towards jit compilation, -1 once compilation is attempted
+    int hotness;
+    // machine code compiled by jit, NULL if it runs on interpreter
+    void *jit;
+    size_t jit_size;
 };
 
 struct NativeObj {
@@ -68,15 +98,18 @@ struct NativeObj {
 struct ClosureObj {
     Obj obj;
     FunctionObj *function;
+    // indexed by descriptor, a descriptor copying a value or accessing a slot in place leaves it NULL
     UpvalueObj **upvalues;
     int upvalue_cnt;
+    // captured variables never assigned, read with no indirection
+    Value *captures;
+    int capture_cnt;
 };
 
 struct UpvalueObj {
     Obj obj;
     Value *location;
     Value close;
-    UpvalueObj *next;
 };
 
 struct ClassObj {
@@ -98,6 +131,71 @@ struct MethodObj {
     ClosureObj *closure;
 };
 
+typedef struct {
+    ClosureObj *closure;
+    uint8_t *pc;
+    Value *slots; 
+} CallFrame;
+
+typedef enum {
+    FIBER_NEW,
+    FIBER_RUNNING,
+    FIBER_SUSPENDED,
+    // parked on event loop, only the loop resumes it
+    FIBER_WAITING,
+    FIBER_DONE,
+} FiberState;
+
+struct FiberObj {
+    Obj obj;
+    // function runs on first resume
+    ClosureObj *closure;
+    FiberState state;
+    // execution state swapped with vm on switch: its own while not running, the one of its resumer while running
+    Value *stack;
+    int stack_capacity;
+    Value *sp;
+    CallFrame *frames;
+    int frame_cnt;
+    int frame_capacity;
+    UpvalueObj **open_upvalues;
+    int open_top;
+    // fiber resumed this one, NULL for script, valid while running
+    FiberObj *caller;
+    // callee_depth of vm at resume
+    int depth;
+    // value passed out by yield
+    Value transfer;
+    FiberObj *next_fiber;
+};
+
+struct ListObj {
+    Obj obj;
+    // elements are stored contiguously, indexing is a bounds check and a load
+    ValueArray items;
+};
+
+struct MapObj {
+    Obj obj;
+    // keyed by any value but nil and NaN
+    Table table;
+};
+
+struct Float64ArrayObj {
+    Obj obj;
+    // raw doubles instead of values, so bulk natives run simd kernels over them, see numeric/numeric.h
+    double *data;
+    int count;
+};
+
+// numbers from start by step, up to but excluding end, only for-in loops walk it
+struct RangeObj {
+    Obj obj;
+    double start;
+    double end;
+    double step;
+};
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 };
@@ -105,18 +203,25 @@ static inline bool isObjType(Value value, ObjType type) {
 void print_obj(Value value);
 bool objs_equal(Value a, Value b);
 
-StringObj *new_string(const char *str, int length);
-Value append_string(Value a, Value b);
-
-FunctionObj *new_function();
-NativeObj *new_native(native_func func, StringObj *name);
-ClosureObj *new_closure(FunctionObj *function);
-UpvalueObj *new_upvalue(Value *slot);
-ClassObj *new_class(StringObj *name);
-InstanceObj *new_instance(ClassObj *klass);
-MethodObj *new_method(InstanceObj *receiver, ClosureObj *closure);
-
-void free_obj(Obj *obj);
-void free_objs();
+StringObj *new_string(const char *str, int length, VM *vm);
+Value append_string(Value a, Value b, VM *vm);
+
+FunctionObj *new_function(VM *vm);
+NativeObj *new_native(native_func func, StringObj *name, VM *vm);
+ClosureObj *new_closure(FunctionObj *function, VM *vm);
+UpvalueObj *new_upvalue(Value *slot, VM *vm);
+ClassObj *new_class(StringObj *name, VM *vm);
+InstanceObj *new_instance(ClassObj *klass, VM *vm);
+MethodObj *new_method(InstanceObj *receiver, ClosureObj *closure, VM *vm);
+FiberObj *new_fiber(ClosureObj *closure, VM *vm);
+// list of @param count values copied from @param values
+ListObj *new_list(Value *values, int count, VM *vm);
+MapObj *new_map(VM *vm);
+// @param count zeros
+Float64ArrayObj *new_float64_array(int count, VM *vm);
+RangeObj *new_range(double start, double end, double step, VM *vm);
+
+void free_obj(Obj *obj, VM *vm);
+void free_objs(VM *vm);
 
 #endif
\ No newline at end of file
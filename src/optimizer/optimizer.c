@@ -0,0 +1,1096 @@
+#include "optimizer.h"
+#include "chunk/chunk.h"
+#include "memory/memory.h"
+#include "vm/vm.h"
+// added for memcpy
+#include <string.h>
+// added for pow
+#include <math.h>
+
+// passes run until nothing changes, bounded in case two passes undo each other
+#define PIPELINE_ROUNDS_MAX 8
+
+/**
+ * ir is a linear list of instructions lifted from chunk
+ * operands are decoded (16-bit variants share the opcode of 8-bit one), jumps refer to instructions
+ * removed instructions stay in list with zero length, a jump to them falls to next live instruction
+ */
+typedef struct {
+    uint8_t op;
+    int operand;    // constant, slot, upvalue index or arg count, -1 for none
+    int arg_cnt;    // arg count of invoke instructions, trailing delta, constant or opcode of in place updates
+    int target;     // index of target instruction of jumps
+    int origin;     // offset in original chunk, upvalue descriptors of closure are copied from there
+    int line;
+    int column;
+    bool is_target;
+    bool removed;
+} Instr;
+
+typedef struct {
+    FunctionObj *function;
+    Instr *instrs;
+    int count;
+    int capacity;
+    // stack depth before each instruction, relative to frame slots
+    int *depths;
+    VM *vm;
+} IR;
+
+// writes to a stack slot observed in whole function
+typedef struct {
+    int writes;     // number of instructions writing the slot
+    bool varying;   // written by a non-constant value, or captured by closure
+    bool captured;  // may be written by closures through upvalue
+    Instr load;     // constant load of all writes if not varying
+    int copy_of;    // all writes copy this slot, -1 for none
+} SlotInfo;
+
+typedef bool (*pass_func)(IR *ir);
+
+typedef struct {
+    const char *name;
+    int level;          // lowest optimize level enabling the pass
+    pass_func pass;
+} Pass;
+
+static bool lift(IR *ir, FunctionObj *function, VM *vm);
+static int decode(Chunk *chunk, int offset, Instr *instr);
+static bool lower(IR *ir);
+static int encoded_length(IR *ir, Instr *instr);
+static void free_ir(IR *ir);
+static bool eliminate_dead_code(IR *ir);
+static bool propagate_constants(IR *ir);
+static bool propagate_copies(IR *ir);
+static void refresh_targets(IR *ir);
+static int live_index(IR *ir, int idx);
+static int next_live(IR *ir, int idx);
+static bool is_jump(uint8_t op);
+static bool is_invoke(uint8_t op);
+static int update_length(uint8_t op);
+static bool is_terminal(uint8_t op);
+static bool is_constant_load(IR *ir, Instr *instr, Value *value);
+static void set_constant_load(IR *ir, Instr *instr, Value value);
+static bool stack_effect(IR *ir, Instr *instr, int *pops, int *pushes);
+static bool compute_depths(IR *ir);
+static SlotInfo* analyze_slots(IR *ir, int *slot_cnt);
+static bool fold_instructions(IR *ir);
+static bool verify_closure(FunctionObj *function, int outer_slots, uint8_t *descriptors, VM *vm);
+static bool verify_operands(IR *ir, Instr *instr, int outer_slots, uint8_t *descriptors, VM *vm);
+static bool verify_descriptors(IR *ir, Instr *instr, uint8_t *descriptors, VM *vm);
+static bool shared_upvalue(uint8_t *descriptors, int idx);
+
+static Pass passes[] = {
+    { "dead code elimination", 1, eliminate_dead_code },
+    { "constant propagation",  2, propagate_constants },
+    { "copy propagation",      2, propagate_copies },
+};
+
+void optimize_function(FunctionObj *function, int level, VM *vm) {
+    if (level <= 0) return;
+    IR ir;
+    if (lift(&ir, function, vm)) {
+        bool changed = false;
+        for (int round = 0; round < PIPELINE_ROUNDS_MAX; round++) {
+            bool round_changed = false;
+            for (size_t i = 0; i < sizeof(passes) / sizeof(Pass); i++) {
+                if (passes[i].level > level) continue;
+                if (passes[i].pass(&ir)) round_changed = true;
+            }
+            if (!round_changed) break;
+            changed = true;
+        }
+        // original chunk is kept if it can not be lowered
+        if (changed) lower(&ir);
+    }
+    free_ir(&ir);
+}
+
+int stack_size(FunctionObj *function, VM *vm) {
+    // each instruction pushes at most one value, so chunk size bounds depth of code analysis rejects
+    int size = function->arity + 1 + function->chunk.count;
+    IR ir;
+    if (lift(&ir, function, vm) && compute_depths(&ir)) {
+        size = function->arity + 1;
+        for (int i = 0; i < ir.count; i++) {
+            if (ir.depths[i] == -1) continue;
+            int pops, pushes;
+            stack_effect(&ir, &ir.instrs[i], &pops, &pushes);
+            // for-iter calls iterator protocol with receiver and state pushed
+            if (ir.instrs[i].op == CLOX_OP_FOR_ITER) pushes = 2;
+            if (ir.depths[i] - pops + pushes > size) size = ir.depths[i] - pops + pushes;
+        }
+    }
+    free_ir(&ir);
+    return size;
+}
+
+bool verify_function(FunctionObj *function, VM *vm) {
+    // script is not created by a closure instruction, so it captures nothing
+    if (function->upvalue_cnt != 0 || function->capture_cnt != 0) return false;
+    return verify_closure(function, 0, NULL, vm);
+}
+
+/**
+ * @param descriptors are upvalue descriptors of closure instruction creating @param function, NULL for script
+ * @param outer_slots is stack size of its enclosing function, the frame outer instructions access
+ */
+static bool verify_closure(FunctionObj *function, int outer_slots, uint8_t *descriptors, VM *vm) {
+    Chunk *chunk = &function->chunk;
+    // stack size is bounded as stack_size bounds it, every function ends with a return
+    if (chunk->count == 0 || function->arity < 0 || function->stack_size <= function->arity) return false;
+    if (function->stack_size > function->arity + 1 + chunk->count) return false;
+    IR ir;
+    bool ok = lift(&ir, function, vm) && compute_depths(&ir) && is_terminal(ir.instrs[ir.count - 1].op);
+    for (int i = 0; ok && i < ir.count; i++) {
+        Instr *instr = &ir.instrs[i];
+        if (ir.depths[i] != -1) {
+            int pops, pushes;
+            stack_effect(&ir, instr, &pops, &pushes);
+            if (instr->op == CLOX_OP_FOR_ITER) pushes = 2;
+            if (ir.depths[i] - pops + pushes > function->stack_size) ok = false;
+        }
+        if (ok) ok = verify_operands(&ir, instr, outer_slots, descriptors, vm);
+    }
+    free_ir(&ir);
+    return ok;
+}
+
+// operands of @param instr refer to constants of right type, slots of frame and upvalues or captures closure holds
+static bool verify_operands(IR *ir, Instr *instr, int outer_slots, uint8_t *descriptors, VM *vm) {
+    FunctionObj *function = ir->function;
+    ValueArray *constants = &function->chunk.constant;
+    int operand = instr->operand;
+    switch (instr->op) {
+        case CLOX_OP_CONSTANT:
+            return operand < constants->count;
+        case CLOX_OP_UPDATE_PROPERTY:
+            // operator is one of arithmetic ones, operand names property as for others below
+            if (instr->arg_cnt < CLOX_OP_ADD || instr->arg_cnt > CLOX_OP_MODULO) return false;
+            // fall through
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_SET_GLOBAL:
+        case CLOX_OP_INC_GLOBAL:
+        case CLOX_OP_CLASS:
+        case CLOX_OP_GET_PROPERTY:
+        case CLOX_OP_SET_PROPERTY:
+        case CLOX_OP_INC_PROPERTY:
+        case CLOX_OP_METHOD:
+        case CLOX_OP_GET_SUPER:
+        case CLOX_OP_INVOKE:
+        case CLOX_OP_INVOKE_SUPER:
+        case CLOX_OP_TAIL_INVOKE:
+        case CLOX_OP_TAIL_INVOKE_SUPER:
+            return operand < constants->count && IS_STRING(constants->values[operand]);
+        case CLOX_OP_ADD_LOCAL_CONST:
+            if (instr->arg_cnt >= constants->count || !IS_NUMBER(constants->values[instr->arg_cnt])) return false;
+            return operand < function->stack_size;
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_INC_LOCAL:
+            return operand < function->stack_size;
+        case CLOX_OP_FOR_ITER:
+            // iterator state and loop variable follow iterable
+            return operand + 2 < function->stack_size;
+        case CLOX_OP_GET_OUTER:
+        case CLOX_OP_SET_OUTER:
+        case CLOX_OP_INC_OUTER:
+            return operand < outer_slots;
+        case CLOX_OP_GET_UPVALUE:
+        case CLOX_OP_SET_UPVALUE:
+        case CLOX_OP_INC_UPVALUE:
+            return operand < function->upvalue_cnt && shared_upvalue(descriptors, operand);
+        case CLOX_OP_GET_CAPTURE:
+            return operand < function->capture_cnt;
+        case CLOX_OP_CLOSURE:
+            return verify_descriptors(ir, instr, descriptors, vm);
+        default:
+            return true;
+    }
+}
+
+// descriptors of closure @param instr refer to slots, upvalues and captures that exist, then function it creates is verified
+static bool verify_descriptors(IR *ir, Instr *instr, uint8_t *descriptors, VM *vm) {
+    FunctionObj *function = ir->function;
+    Chunk *chunk = &function->chunk;
+    // decode checked constant is a function and descriptors fit in chunk
+    FunctionObj *callee = AS_FUNCTION(chunk->constant.values[instr->operand]);
+    uint8_t *callee_descriptors = chunk->code + instr->origin + (chunk->code[instr->origin] == CLOX_OP_CLOSURE_16 ? 3 : 2);
+    int copies = 0;
+    for (int k = 0; k < callee->upvalue_cnt; k++) {
+        uint8_t *descriptor = callee_descriptors + 3 * k;
+        int idx = descriptor[1] | (descriptor[2] << 8);
+        switch (descriptor[0]) {
+            case UPVALUE_COPY_LOCAL:
+                copies++;
+                // fall through
+            case UPVALUE_LOCAL:
+            case UPVALUE_FRAME:
+                if (idx >= function->stack_size) return false;
+                break;
+            case UPVALUE_ENCLOSING:
+                if (idx >= function->upvalue_cnt || !shared_upvalue(descriptors, idx)) return false;
+                break;
+            case UPVALUE_COPY_CAPTURE:
+                if (idx >= function->capture_cnt) return false;
+                copies++;
+                break;
+            default: return false;
+        }
+    }
+    if (copies != callee->capture_cnt) return false;
+    return verify_closure(callee, function->stack_size, callee_descriptors, vm);
+}
+
+// upvalue @param idx of a closure created by @param descriptors is an upvalue object, not a copy or a frame slot
+static bool shared_upvalue(uint8_t *descriptors, int idx) {
+    if (descriptors == NULL) return false;
+    uint8_t kind = descriptors[3 * idx];
+    return kind == UPVALUE_LOCAL || kind == UPVALUE_ENCLOSING;
+}
+
+static bool lift(IR *ir, FunctionObj *function, VM *vm) {
+    Chunk *chunk = &function->chunk;
+    ir->function = function;
+    ir->vm = vm;
+    ir->instrs = NULL;
+    ir->count = 0;
+    ir->capacity = 0;
+    ir->depths = NULL;
+
+    // offset -> instruction index
+    int *index = ALLOCATE(int, chunk->count + 1, ir->vm);
+    for (int i = 0; i <= chunk->count; i++) index[i] = -1;
+
+    bool ok = true;
+    for (int offset = 0; offset < chunk->count;) {
+        if (ir->count + 1 > ir->capacity) {
+            int new_capacity = GROW_CAPACITY(ir->capacity);
+            ir->instrs = GROW_ARRAY(Instr, ir->instrs, ir->capacity, new_capacity, ir->vm);
+            ir->capacity = new_capacity;
+        }
+        Instr *instr = &ir->instrs[ir->count];
+        int length = decode(chunk, offset, instr);
+        if (length <= 0) {
+            ok = false;
+            break;
+        }
+        index[offset] = ir->count++;
+        offset += length;
+    }
+
+    // translate jump offsets into instruction index
+    for (int i = 0; ok && i < ir->count; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (!is_jump(instr->op)) continue;
+        if (instr->target < 0 || instr->target >= chunk->count || index[instr->target] == -1) ok = false;
+        else instr->target = index[instr->target];
+    }
+
+    FREE_ARRAY(int, index, chunk->count + 1, ir->vm);
+    if (ok) refresh_targets(ir);
+    return ok;
+}
+
+// decode instruction at @param offset, returns its length or -1 on unknown instruction
+static int decode(Chunk *chunk, int offset, Instr *instr) {
+    uint8_t *code = chunk->code + offset;
+    instr->operand = -1;
+    instr->arg_cnt = 0;
+    instr->target = -1;
+    instr->origin = offset;
+    instr->is_target = false;
+    instr->removed = false;
+    chunk_location(chunk, offset, &instr->line, &instr->column);
+
+    uint8_t op = code[0];
+    int length = 1;
+    switch (op) {
+        case CLOX_OP_RETURN:
+        case CLOX_OP_TRUE:
+        case CLOX_OP_FALSE:
+        case CLOX_OP_NIL:
+        case CLOX_OP_NEGATE:
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DIVIDE:
+        case CLOX_OP_MODULO:
+        case CLOX_OP_POWER:
+        case CLOX_OP_BIT_AND:
+        case CLOX_OP_BIT_OR:
+        case CLOX_OP_BIT_XOR:
+        case CLOX_OP_SHIFT_LEFT:
+        case CLOX_OP_SHIFT_RIGHT:
+        case CLOX_OP_BIT_NOT:
+        case CLOX_OP_NOT:
+        case CLOX_OP_EQUAL:
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS:
+        case CLOX_OP_PRINT:
+        case CLOX_OP_POP:
+        case CLOX_OP_CLOSE_UPVALUE:
+        case CLOX_OP_INHERIT:
+        case CLOX_OP_GET_INDEX:
+        case CLOX_OP_SET_INDEX:
+            break;
+        case CLOX_OP_CONSTANT:
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_SET_GLOBAL:
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_GET_UPVALUE:
+        case CLOX_OP_SET_UPVALUE:
+        case CLOX_OP_GET_OUTER:
+        case CLOX_OP_SET_OUTER:
+        case CLOX_OP_GET_CAPTURE:
+        case CLOX_OP_CLASS:
+        case CLOX_OP_GET_PROPERTY:
+        case CLOX_OP_SET_PROPERTY:
+        case CLOX_OP_METHOD:
+        case CLOX_OP_GET_SUPER:
+        case CLOX_OP_CALL:
+        case CLOX_OP_TAIL_CALL:
+        case CLOX_OP_CLOSURE:
+        case CLOX_OP_INVOKE:
+        case CLOX_OP_INVOKE_SUPER:
+        case CLOX_OP_TAIL_INVOKE:
+        case CLOX_OP_TAIL_INVOKE_SUPER:
+        case CLOX_OP_LIST:
+        case CLOX_OP_MAP:
+            if (offset + 2 > chunk->count) return -1;
+            instr->operand = code[1];
+            length = 2;
+            break;
+        case CLOX_OP_CONSTANT_16:
+        case CLOX_OP_DEFINE_GLOBAL_16:
+        case CLOX_OP_GET_GLOBAL_16:
+        case CLOX_OP_SET_GLOBAL_16:
+        case CLOX_OP_GET_LOCAL_16:
+        case CLOX_OP_SET_LOCAL_16:
+        case CLOX_OP_GET_UPVALUE_16:
+        case CLOX_OP_SET_UPVALUE_16:
+        case CLOX_OP_GET_OUTER_16:
+        case CLOX_OP_SET_OUTER_16:
+        case CLOX_OP_GET_CAPTURE_16:
+        case CLOX_OP_CLASS_16:
+        case CLOX_OP_GET_PROPERTY_16:
+        case CLOX_OP_SET_PROPERTY_16:
+        case CLOX_OP_METHOD_16:
+        case CLOX_OP_GET_SUPER_16:
+        case CLOX_OP_CLOSURE_16:
+        case CLOX_OP_INVOKE_16:
+        case CLOX_OP_INVOKE_SUPER_16:
+        case CLOX_OP_TAIL_INVOKE_16:
+        case CLOX_OP_TAIL_INVOKE_SUPER_16:
+            // 16-bit variant always follows its 8-bit variant
+            if (offset + 3 > chunk->count) return -1;
+            op--;
+            instr->operand = code[1] | (code[2] << 8);
+            length = 3;
+            break;
+        case CLOX_OP_JUMP:
+        case CLOX_OP_JUMP_IF_FALSE:
+            if (offset + 3 > chunk->count) return -1;
+            instr->target = offset + 3 + (code[1] | (code[2] << 8));
+            length = 3;
+            break;
+        case CLOX_OP_LOOP:
+            if (offset + 3 > chunk->count) return -1;
+            instr->target = offset + 3 - (code[1] | (code[2] << 8));
+            length = 3;
+            break;
+        case CLOX_OP_FOR_ITER:
+            if (offset + 5 > chunk->count) return -1;
+            instr->operand = code[1] | (code[2] << 8);
+            instr->target = offset + 5 - (code[3] | (code[4] << 8));
+            length = 5;
+            break;
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_INC_OUTER:
+        case CLOX_OP_INC_UPVALUE:
+        case CLOX_OP_INC_GLOBAL:
+        case CLOX_OP_INC_PROPERTY:
+        case CLOX_OP_UPDATE_PROPERTY:
+            if (offset + 4 > chunk->count) return -1;
+            instr->operand = code[1] | (code[2] << 8);
+            instr->arg_cnt = code[3];
+            length = 4;
+            break;
+        case CLOX_OP_ADD_LOCAL_CONST:
+            if (offset + 5 > chunk->count) return -1;
+            instr->operand = code[1] | (code[2] << 8);
+            instr->arg_cnt = code[3] | (code[4] << 8);
+            length = 5;
+            break;
+        default:
+            return -1;
+    }
+    instr->op = op;
+
+    if (is_invoke(op)) {
+        if (offset + length + 1 > chunk->count) return -1;
+        instr->arg_cnt = code[length++];
+    }
+    if (op == CLOX_OP_CLOSURE) {
+        // bytecode loaded from cache is decoded as well, so constant is checked
+        if (instr->operand >= chunk->constant.count || !IS_FUNCTION(chunk->constant.values[instr->operand])) return -1;
+        length += 3 * AS_FUNCTION(chunk->constant.values[instr->operand])->upvalue_cnt;
+    }
+    if (offset + length > chunk->count) return -1;
+    return length;
+}
+
+static bool lower(IR *ir) {
+    Chunk *chunk = &ir->function->chunk;
+    // offset of each instruction, a removed instruction shares offset with next live one
+    int *offsets = ALLOCATE(int, ir->count + 1, ir->vm);
+    int offset = 0;
+    for (int i = 0; i < ir->count; i++) {
+        offsets[i] = offset;
+        if (!ir->instrs[i].removed) offset += encoded_length(ir, &ir->instrs[i]);
+    }
+    offsets[ir->count] = offset;
+
+    // conditional jump is forward only and for-iter backward only, any jump is limited to 16-bit distance
+    bool ok = true;
+    for (int i = 0; i < ir->count && ok; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (instr->removed || !is_jump(instr->op)) continue;
+        int distance = offsets[instr->target] - (offsets[i] + encoded_length(ir, instr));
+        if (instr->op == CLOX_OP_JUMP_IF_FALSE && distance < 0) ok = false;
+        if (instr->op == CLOX_OP_FOR_ITER && distance >= 0) ok = false;
+        if (distance > UINT16_MAX || -distance > UINT16_MAX) ok = false;
+    }
+
+    if (ok) {
+        Chunk out;
+        init_chunk(&out);
+        for (int i = 0; i < ir->count; i++) {
+            Instr *instr = &ir->instrs[i];
+            if (instr->removed) continue;
+            int line = instr->line;
+            int column = instr->column;
+            if (instr->op == CLOX_OP_FOR_ITER) {
+                int distance = offsets[i] + 5 - offsets[instr->target];
+                write_chunk(&out, instr->op, line, column, ir->vm);
+                write_chunk(&out, instr->operand & 0xff, line, column, ir->vm);
+                write_chunk(&out, instr->operand >> 8, line, column, ir->vm);
+                write_chunk(&out, distance & 0xff, line, column, ir->vm);
+                write_chunk(&out, (distance >> 8) & 0xff, line, column, ir->vm);
+                continue;
+            }
+            if (update_length(instr->op) != -1) {
+                write_chunk(&out, instr->op, line, column, ir->vm);
+                write_chunk(&out, instr->operand & 0xff, line, column, ir->vm);
+                write_chunk(&out, instr->operand >> 8, line, column, ir->vm);
+                write_chunk(&out, instr->arg_cnt & 0xff, line, column, ir->vm);
+                if (instr->op == CLOX_OP_ADD_LOCAL_CONST) write_chunk(&out, instr->arg_cnt >> 8, line, column, ir->vm);
+                continue;
+            }
+            if (is_jump(instr->op)) {
+                int distance = offsets[instr->target] - (offsets[i] + 3);
+                uint8_t op = instr->op;
+                // a threaded jump may change direction
+                if (op != CLOX_OP_JUMP_IF_FALSE) op = distance < 0 ? CLOX_OP_LOOP : CLOX_OP_JUMP;
+                if (distance < 0) distance = -distance;
+                write_chunk(&out, op, line, column, ir->vm);
+                write_chunk(&out, distance & 0xff, line, column, ir->vm);
+                write_chunk(&out, (distance >> 8) & 0xff, line, column, ir->vm);
+                continue;
+            }
+            bool wide = instr->operand > UINT8_MAX && instr->op != CLOX_OP_CALL;
+            write_chunk(&out, wide ? instr->op + 1 : instr->op, line, column, ir->vm);
+            if (instr->operand != -1) write_chunk(&out, instr->operand & 0xff, line, column, ir->vm);
+            if (wide) write_chunk(&out, instr->operand >> 8, line, column, ir->vm);
+            if (is_invoke(instr->op)) write_chunk(&out, instr->arg_cnt, line, column, ir->vm);
+            if (instr->op == CLOX_OP_CLOSURE) {
+                // upvalue descriptors are copied as is
+                int descriptors = 3 * AS_FUNCTION(chunk->constant.values[instr->operand])->upvalue_cnt;
+                int start = instr->origin + (chunk->code[instr->origin] == CLOX_OP_CLOSURE_16 ? 3 : 2);
+                for (int j = 0; j < descriptors; j++) write_chunk(&out, chunk->code[start + j], line, column, ir->vm);
+            }
+        }
+
+        // constant pool is kept, code and location table are replaced
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, ir->vm);
+        FREE_ARRAY(LineRecord, chunk->lines, chunk->line_capacity, ir->vm);
+        chunk->code = out.code;
+        chunk->count = out.count;
+        chunk->capacity = out.capacity;
+        chunk->lines = out.lines;
+        chunk->line_count = out.line_count;
+        chunk->line_capacity = out.line_capacity;
+        chunk->last_offset = out.last_offset;
+        chunk->last_line = out.last_line;
+        chunk->last_column = out.last_column;
+    }
+
+    FREE_ARRAY(int, offsets, ir->count + 1, ir->vm);
+    return ok;
+}
+
+static int encoded_length(IR *ir, Instr *instr) {
+    if (instr->op == CLOX_OP_FOR_ITER) return 5;
+    if (update_length(instr->op) != -1) return update_length(instr->op);
+    if (is_jump(instr->op)) return 3;
+    int length = 1;
+    if (instr->operand != -1) length += instr->operand > UINT8_MAX && instr->op != CLOX_OP_CALL ? 2 : 1;
+    if (is_invoke(instr->op)) length++;
+    if (instr->op == CLOX_OP_CLOSURE) length += 3 * AS_FUNCTION(ir->function->chunk.constant.values[instr->operand])->upvalue_cnt;
+    return length;
+}
+
+static void free_ir(IR *ir) {
+    FREE_ARRAY(Instr, ir->instrs, ir->capacity, ir->vm);
+    if (ir->depths != NULL) FREE_ARRAY(int, ir->depths, ir->count, ir->vm);
+    ir->instrs = NULL;
+    ir->depths = NULL;
+    ir->count = 0;
+    ir->capacity = 0;
+}
+
+/**
+ * remove unreachable instructions, pushes discarded right away, branches on constants
+ * and jumps to next instruction, jumps to jumps are threaded to final target
+ */
+static bool eliminate_dead_code(IR *ir) {
+    bool changed = false;
+
+    // jump threading
+    for (int i = 0; i < ir->count; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (instr->removed || !is_jump(instr->op)) continue;
+        for (int hop = 0; hop < ir->count; hop++) {
+            Instr *target = &ir->instrs[instr->target];
+            if (target->op != CLOX_OP_JUMP && target->op != CLOX_OP_LOOP) break;
+            if (target->target == instr->target) break;
+            // conditional jump has no backward form, nor for-iter a forward one
+            if (instr->op == CLOX_OP_JUMP_IF_FALSE && target->target <= i) break;
+            if (instr->op == CLOX_OP_FOR_ITER && target->target > i) break;
+            instr->target = target->target;
+            changed = true;
+        }
+    }
+
+    // peepholes on adjacent instructions
+    for (int i = next_live(ir, -1); i < ir->count; i = next_live(ir, i)) {
+        Instr *instr = &ir->instrs[i];
+        int j = next_live(ir, i);
+        if (j >= ir->count) break;
+        Instr *next = &ir->instrs[j];
+        Value value;
+        bool constant = is_constant_load(ir, instr, &value);
+
+        // a value pushed then discarded
+        bool pure = constant || instr->op == CLOX_OP_GET_LOCAL || instr->op == CLOX_OP_GET_UPVALUE || instr->op == CLOX_OP_GET_OUTER ||
+                    instr->op == CLOX_OP_GET_CAPTURE;
+        if (pure && next->op == CLOX_OP_POP && !next->is_target) {
+            instr->removed = next->removed = true;
+            changed = true;
+            continue;
+        }
+
+        // branch on a constant condition
+        if (constant && next->op == CLOX_OP_JUMP_IF_FALSE && !next->is_target) {
+            int k = next_live(ir, j);
+            if (!is_false(value) && k < ir->count && ir->instrs[k].op == CLOX_OP_POP && !ir->instrs[k].is_target) {
+                // never taken, condition is popped on fallthrough
+                instr->removed = next->removed = ir->instrs[k].removed = true;
+                changed = true;
+            } else if (is_false(value)) {
+                // always taken, condition is popped at target
+                next->op = CLOX_OP_JUMP;
+                changed = true;
+            }
+            continue;
+        }
+
+        // jump to next instruction
+        if (instr->op == CLOX_OP_JUMP && live_index(ir, instr->target) == j) {
+            instr->removed = true;
+            changed = true;
+        }
+    }
+    refresh_targets(ir);
+
+    // unreachable instructions
+    bool *reachable = ALLOCATE(bool, ir->count, ir->vm);
+    int *worklist = ALLOCATE(int, ir->count, ir->vm);
+    int worklist_cnt = 0;
+    for (int i = 0; i < ir->count; i++) reachable[i] = false;
+    int entry = next_live(ir, -1);
+    if (entry < ir->count) {
+        reachable[entry] = true;
+        worklist[worklist_cnt++] = entry;
+    }
+    while (worklist_cnt > 0) {
+        int i = worklist[--worklist_cnt];
+        Instr *instr = &ir->instrs[i];
+        int successors[2];
+        int successor_cnt = 0;
+        if (!is_terminal(instr->op)) successors[successor_cnt++] = next_live(ir, i);
+        if (is_jump(instr->op)) successors[successor_cnt++] = instr->target;
+        for (int k = 0; k < successor_cnt; k++) {
+            int s = successors[k];
+            if (s >= ir->count || reachable[s]) continue;
+            reachable[s] = true;
+            worklist[worklist_cnt++] = s;
+        }
+    }
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->instrs[i].removed || reachable[i]) continue;
+        ir->instrs[i].removed = true;
+        changed = true;
+    }
+    FREE_ARRAY(int, worklist, ir->count, ir->vm);
+    FREE_ARRAY(bool, reachable, ir->count, ir->vm);
+
+    refresh_targets(ir);
+    return changed;
+}
+
+// replace loads of a slot with a constant if the slot is only ever written by that constant
+static bool propagate_constants(IR *ir) {
+    int slot_cnt;
+    SlotInfo *slots = analyze_slots(ir, &slot_cnt);
+    if (slots == NULL) return false;
+
+    bool changed = false;
+    for (int i = 0; i < ir->count; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (instr->removed || instr->op != CLOX_OP_GET_LOCAL) continue;
+        SlotInfo *slot = &slots[instr->operand];
+        if (slot->varying || slot->writes == 0) continue;
+        instr->op = slot->load.op;
+        instr->operand = slot->load.operand;
+        changed = true;
+    }
+    FREE_ARRAY(SlotInfo, slots, slot_cnt, ir->vm);
+
+    if (fold_instructions(ir)) changed = true;
+    return changed;
+}
+
+/**
+ * forward a stored value to a load right after the store
+ * and replace loads of a slot holding a copy of another slot, which is never reassigned
+ */
+static bool propagate_copies(IR *ir) {
+    bool changed = false;
+    for (int i = next_live(ir, -1); i < ir->count; i = next_live(ir, i)) {
+        Instr *store = &ir->instrs[i];
+        uint8_t load_op;
+        switch (store->op) {
+            case CLOX_OP_SET_LOCAL:   load_op = CLOX_OP_GET_LOCAL; break;
+            case CLOX_OP_SET_UPVALUE: load_op = CLOX_OP_GET_UPVALUE; break;
+            case CLOX_OP_SET_OUTER:   load_op = CLOX_OP_GET_OUTER; break;
+            case CLOX_OP_SET_GLOBAL:  load_op = CLOX_OP_GET_GLOBAL; break;
+            default: continue;
+        }
+        int j = next_live(ir, i);
+        int k = next_live(ir, j);
+        if (k >= ir->count) break;
+        Instr *pop = &ir->instrs[j];
+        Instr *load = &ir->instrs[k];
+        if (pop->op != CLOX_OP_POP || pop->is_target || load->is_target) continue;
+        if (load->op != load_op || load->operand != store->operand) continue;
+        // stored value is still on stack
+        pop->removed = load->removed = true;
+        changed = true;
+    }
+    if (changed) refresh_targets(ir);
+
+    int slot_cnt;
+    SlotInfo *slots = analyze_slots(ir, &slot_cnt);
+    if (slots == NULL) return changed;
+    for (int i = 0; i < ir->count; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (instr->removed || instr->op != CLOX_OP_GET_LOCAL) continue;
+        SlotInfo *slot = &slots[instr->operand];
+        if (slot->copy_of == -1) continue;
+        SlotInfo *source = &slots[slot->copy_of];
+        // a source written once is never changed while the copy is in scope
+        if (source->writes > 1 || source->captured) continue;
+        instr->operand = slot->copy_of;
+        changed = true;
+    }
+    FREE_ARRAY(SlotInfo, slots, slot_cnt, ir->vm);
+    return changed;
+}
+
+static void refresh_targets(IR *ir) {
+    for (int i = 0; i < ir->count; i++) ir->instrs[i].is_target = false;
+    for (int i = 0; i < ir->count; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (instr->removed || !is_jump(instr->op)) continue;
+        instr->target = live_index(ir, instr->target);
+        if (instr->target < ir->count) ir->instrs[instr->target].is_target = true;
+    }
+}
+
+// first live instruction at or after @param idx
+static int live_index(IR *ir, int idx) {
+    while (idx < ir->count && ir->instrs[idx].removed) idx++;
+    return idx;
+}
+
+// first live instruction after @param idx
+static int next_live(IR *ir, int idx) {
+    return live_index(ir, idx + 1);
+}
+
+static bool is_jump(uint8_t op) {
+    return op == CLOX_OP_JUMP || op == CLOX_OP_JUMP_IF_FALSE || op == CLOX_OP_LOOP || op == CLOX_OP_FOR_ITER;
+}
+
+// invokes carry an argument count after method name
+static bool is_invoke(uint8_t op) {
+    return op == CLOX_OP_INVOKE || op == CLOX_OP_INVOKE_SUPER || op == CLOX_OP_TAIL_INVOKE || op == CLOX_OP_TAIL_INVOKE_SUPER;
+}
+
+// length of in place updates, which have a fixed layout, -1 for other instructions
+static int update_length(uint8_t op) {
+    switch (op) {
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_INC_OUTER:
+        case CLOX_OP_INC_UPVALUE:
+        case CLOX_OP_INC_GLOBAL:
+        case CLOX_OP_INC_PROPERTY:
+        case CLOX_OP_UPDATE_PROPERTY:
+            return 4;
+        case CLOX_OP_ADD_LOCAL_CONST:
+            return 5;
+        default: return -1;
+    }
+}
+
+static bool is_terminal(uint8_t op) {
+    return op == CLOX_OP_RETURN || op == CLOX_OP_JUMP || op == CLOX_OP_LOOP;
+}
+
+static bool is_constant_load(IR *ir, Instr *instr, Value *value) {
+    switch (instr->op) {
+        case CLOX_OP_TRUE: *value = BOOL_VALUE(true); return true;
+        case CLOX_OP_FALSE: *value = BOOL_VALUE(false); return true;
+        case CLOX_OP_NIL: *value = NIL_VALUE; return true;
+        case CLOX_OP_CONSTANT: *value = ir->function->chunk.constant.values[instr->operand]; return true;
+        default: return false;
+    }
+}
+
+// turn @param instr into a load of @param value, a number is appended into constant pool if absent
+static void set_constant_load(IR *ir, Instr *instr, Value value) {
+    instr->operand = -1;
+    if (IS_NIL(value)) instr->op = CLOX_OP_NIL;
+    else if (IS_BOOL(value)) instr->op = AS_BOOL(value) ? CLOX_OP_TRUE : CLOX_OP_FALSE;
+    else {
+        ValueArray *constants = &ir->function->chunk.constant;
+        double number = AS_NUMBER(value);
+        int idx = -1;
+        for (int i = 0; i < constants->count && idx == -1; i++) {
+            if (!IS_NUMBER(constants->values[i])) continue;
+            double other = AS_NUMBER(constants->values[i]);
+            if (memcmp(&number, &other, sizeof(double)) == 0) idx = i;
+        }
+        if (idx == -1) idx = append_constant(&ir->function->chunk, value, ir->vm);
+        instr->op = CLOX_OP_CONSTANT;
+        instr->operand = idx;
+    }
+}
+
+// values popped and pushed by @param instr, returns false if it is not known
+static bool stack_effect(IR *ir, Instr *instr, int *pops, int *pushes) {
+    (void)ir;
+    *pops = 0;
+    *pushes = 0;
+    switch (instr->op) {
+        case CLOX_OP_CONSTANT:
+        case CLOX_OP_TRUE:
+        case CLOX_OP_FALSE:
+        case CLOX_OP_NIL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_GET_UPVALUE:
+        case CLOX_OP_GET_OUTER:
+        case CLOX_OP_GET_CAPTURE:
+        case CLOX_OP_CLOSURE:
+        case CLOX_OP_CLASS:
+            *pushes = 1;
+            return true;
+        case CLOX_OP_NEGATE:
+        case CLOX_OP_NOT:
+        case CLOX_OP_BIT_NOT:
+        case CLOX_OP_GET_PROPERTY:
+        case CLOX_OP_INC_PROPERTY:
+            *pops = 1;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DIVIDE:
+        case CLOX_OP_MODULO:
+        case CLOX_OP_POWER:
+        case CLOX_OP_BIT_AND:
+        case CLOX_OP_BIT_OR:
+        case CLOX_OP_BIT_XOR:
+        case CLOX_OP_SHIFT_LEFT:
+        case CLOX_OP_SHIFT_RIGHT:
+        case CLOX_OP_EQUAL:
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS:
+        case CLOX_OP_SET_PROPERTY:
+        case CLOX_OP_UPDATE_PROPERTY:
+        case CLOX_OP_GET_SUPER:
+        case CLOX_OP_GET_INDEX:
+            *pops = 2;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_RETURN:
+        case CLOX_OP_PRINT:
+        case CLOX_OP_POP:
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_CLOSE_UPVALUE:
+        case CLOX_OP_METHOD:
+        case CLOX_OP_INHERIT:
+            *pops = 1;
+            return true;
+        case CLOX_OP_SET_GLOBAL:
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_SET_UPVALUE:
+        case CLOX_OP_SET_OUTER:
+        case CLOX_OP_JUMP:
+        case CLOX_OP_JUMP_IF_FALSE:
+        case CLOX_OP_LOOP:
+        case CLOX_OP_FOR_ITER:
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_ADD_LOCAL_CONST:
+        case CLOX_OP_INC_OUTER:
+        case CLOX_OP_INC_UPVALUE:
+        case CLOX_OP_INC_GLOBAL:
+            return true;
+        case CLOX_OP_CALL:
+        case CLOX_OP_TAIL_CALL:
+            *pops = instr->operand + 1;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_INVOKE:
+        case CLOX_OP_TAIL_INVOKE:
+            *pops = instr->arg_cnt + 1;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_INVOKE_SUPER:
+        case CLOX_OP_TAIL_INVOKE_SUPER:
+            // receiver, arguments and superclass
+            *pops = instr->arg_cnt + 2;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_LIST:
+            *pops = instr->operand;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_MAP:
+            *pops = 2 * instr->operand;
+            *pushes = 1;
+            return true;
+        case CLOX_OP_SET_INDEX:
+            // list, index and value
+            *pops = 3;
+            *pushes = 1;
+            return true;
+        default: return false;
+    }
+}
+
+// stack depth before each live instruction, returns false on unknown or inconsistent depth
+static bool compute_depths(IR *ir) {
+    if (ir->depths == NULL) ir->depths = ALLOCATE(int, ir->count, ir->vm);
+    for (int i = 0; i < ir->count; i++) ir->depths[i] = -1;
+    int *worklist = ALLOCATE(int, ir->count, ir->vm);
+    int worklist_cnt = 0;
+    bool ok = true;
+
+    // slot 0 holds callee (or receiver), arguments follow
+    int entry = next_live(ir, -1);
+    if (entry < ir->count) {
+        ir->depths[entry] = ir->function->arity + 1;
+        worklist[worklist_cnt++] = entry;
+    }
+    while (ok && worklist_cnt > 0) {
+        int i = worklist[--worklist_cnt];
+        Instr *instr = &ir->instrs[i];
+        int pops, pushes;
+        if (!stack_effect(ir, instr, &pops, &pushes) || ir->depths[i] < pops) {
+            ok = false;
+            break;
+        }
+        int depth = ir->depths[i] - pops + pushes;
+        int successors[2];
+        int successor_cnt = 0;
+        if (!is_terminal(instr->op)) successors[successor_cnt++] = next_live(ir, i);
+        if (is_jump(instr->op)) successors[successor_cnt++] = instr->target;
+        for (int k = 0; k < successor_cnt; k++) {
+            int s = successors[k];
+            if (s >= ir->count) continue;
+            if (ir->depths[s] == -1) {
+                ir->depths[s] = depth;
+                worklist[worklist_cnt++] = s;
+            } else if (ir->depths[s] != depth) ok = false;
+        }
+    }
+    FREE_ARRAY(int, worklist, ir->count, ir->vm);
+    return ok;
+}
+
+/**
+ * collect writes of each stack slot, a value pushed at depth d is written into slot d
+ * parameters and captured slots are varying, as they are written outside of this function
+ */
+static SlotInfo* analyze_slots(IR *ir, int *slot_cnt) {
+    if (!compute_depths(ir)) return NULL;
+    int max_depth = ir->function->arity + 1;
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->depths[i] + 1 > max_depth) max_depth = ir->depths[i] + 1;
+        uint8_t op = ir->instrs[i].op;
+        bool local = op == CLOX_OP_GET_LOCAL || op == CLOX_OP_INC_LOCAL || op == CLOX_OP_ADD_LOCAL_CONST;
+        if (local && ir->instrs[i].operand + 1 > max_depth) max_depth = ir->instrs[i].operand + 1;
+    }
+
+    SlotInfo *slots = ALLOCATE(SlotInfo, max_depth, ir->vm);
+    *slot_cnt = max_depth;
+    for (int i = 0; i < max_depth; i++) {
+        // parameters are written by caller
+        slots[i].writes = i <= ir->function->arity ? 1 : 0;
+        slots[i].varying = i <= ir->function->arity;
+        slots[i].captured = false;
+        slots[i].copy_of = -1;
+    }
+
+    Chunk *chunk = &ir->function->chunk;
+    for (int i = 0; i < ir->count; i++) {
+        Instr *instr = &ir->instrs[i];
+        if (instr->removed || ir->depths[i] == -1) continue;
+        int pops, pushes;
+        stack_effect(ir, instr, &pops, &pushes);
+
+        if (instr->op == CLOX_OP_SET_LOCAL || instr->op == CLOX_OP_INC_LOCAL || instr->op == CLOX_OP_ADD_LOCAL_CONST) {
+            slots[instr->operand].writes++;
+            slots[instr->operand].varying = true;
+            slots[instr->operand].copy_of = -2;
+        } else if (instr->op == CLOX_OP_FOR_ITER) {
+            // iterator state and loop variable
+            for (int k = instr->operand + 1; k <= instr->operand + 2 && k < max_depth; k++) {
+                slots[k].writes++;
+                slots[k].varying = true;
+                slots[k].copy_of = -2;
+            }
+        } else if (instr->op == CLOX_OP_CLOSURE) {
+            int upvalue_cnt = AS_FUNCTION(chunk->constant.values[instr->operand])->upvalue_cnt;
+            int start = instr->origin + (chunk->code[instr->origin] == CLOX_OP_CLOSURE_16 ? 3 : 2);
+            for (int k = 0; k < upvalue_cnt; k++) {
+                uint8_t *descriptor = chunk->code + start + 3 * k;
+                int idx = descriptor[1] | (descriptor[2] << 8);
+                // a copied value is only read once closure is created
+                bool variable = descriptor[0] == UPVALUE_LOCAL || descriptor[0] == UPVALUE_FRAME;
+                if (variable && idx < max_depth) {
+                    slots[idx].varying = true;
+                    slots[idx].captured = true;
+                    slots[idx].copy_of = -2;
+                }
+            }
+        }
+        // a value returned right away is never read from its slot
+        int next = next_live(ir, i);
+        if (pushes == 0 || (next < ir->count && ir->instrs[next].op == CLOX_OP_RETURN)) continue;
+
+        SlotInfo *slot = &slots[ir->depths[i] - pops];
+        Value value;
+        slot->writes++;
+        if (is_constant_load(ir, instr, &value)) {
+            if (slot->writes == 1) slot->load = *instr;
+            else if (slot->load.op != instr->op || slot->load.operand != instr->operand) slot->varying = true;
+        } else slot->varying = true;
+
+        if (instr->op == CLOX_OP_GET_LOCAL && slot->copy_of != -2 && (slot->copy_of == -1 || slot->copy_of == instr->operand) && slot->writes == 1) slot->copy_of = instr->operand;
+        else if (instr->op != CLOX_OP_GET_LOCAL || slot->copy_of != instr->operand) slot->copy_of = -2;
+    }
+    for (int i = 0; i < max_depth; i++) {
+        if (slots[i].copy_of < 0 || i <= ir->function->arity) slots[i].copy_of = -1;
+    }
+    return slots;
+}
+
+// evaluate arithmetic and comparison on constant loads
+static bool fold_instructions(IR *ir) {
+    bool changed = false;
+    for (int i = next_live(ir, -1); i < ir->count; i = next_live(ir, i)) {
+        Instr *a = &ir->instrs[i];
+        Value x;
+        if (!is_constant_load(ir, a, &x)) continue;
+        int j = next_live(ir, i);
+        if (j >= ir->count) break;
+        Instr *b = &ir->instrs[j];
+        if (b->is_target) continue;
+
+        // unary operation
+        if (b->op == CLOX_OP_NOT || (b->op == CLOX_OP_NEGATE && IS_NUMBER(x))) {
+            Value rst;
+            if (b->op == CLOX_OP_NOT) rst = BOOL_VALUE(is_false(x));
+            else if (!negate_int(x, &rst)) rst = NUMBER_VALUE(-AS_NUMBER(x));
+            set_constant_load(ir, a, rst);
+            b->removed = true;
+            changed = true;
+            continue;
+        }
+        // a bitwise operation that fails is left to report its error at runtime
+        if (b->op == CLOX_OP_BIT_NOT) {
+            Value rst;
+            if (bitwise(CLOX_OP_BIT_NOT, x, NIL_VALUE, &rst) == NULL) {
+                set_constant_load(ir, a, rst);
+                b->removed = true;
+                changed = true;
+            }
+            continue;
+        }
+
+        Value y;
+        if (!is_constant_load(ir, b, &y)) continue;
+        int k = next_live(ir, j);
+        if (k >= ir->count) break;
+        Instr *op = &ir->instrs[k];
+        if (op->is_target) continue;
+
+        Value rst;
+        if (op->op == CLOX_OP_EQUAL) rst = BOOL_VALUE(values_equal(x, y));
+        else if (op->op == CLOX_OP_ADD && add_ints(x, y, &rst)) ;
+        else if (op->op == CLOX_OP_SUBTRACT && subtract_ints(x, y, &rst)) ;
+        else if (op->op == CLOX_OP_MULTIPLY && multiply_ints(x, y, &rst)) ;
+        else if (op->op == CLOX_OP_BIT_AND || op->op == CLOX_OP_BIT_OR || op->op == CLOX_OP_BIT_XOR ||
+                 op->op == CLOX_OP_SHIFT_LEFT || op->op == CLOX_OP_SHIFT_RIGHT) {
+            if (bitwise(op->op, x, y, &rst) != NULL) continue;
+        }
+        else if (IS_NUMBER(x) && IS_NUMBER(y)) {
+            double n = AS_NUMBER(x);
+            double m = AS_NUMBER(y);
+            switch (op->op) {
+                case CLOX_OP_ADD:      rst = NUMBER_VALUE(n + m); break;
+                case CLOX_OP_SUBTRACT: rst = NUMBER_VALUE(n - m); break;
+                case CLOX_OP_MULTIPLY: rst = NUMBER_VALUE(n * m); break;
+                case CLOX_OP_DIVIDE:   rst = NUMBER_VALUE(n / m); break;
+                case CLOX_OP_POWER:    rst = NUMBER_VALUE(pow(n, m)); break;
+                case CLOX_OP_GREATER:  rst = BOOL_VALUE(n > m); break;
+                case CLOX_OP_LESS:     rst = BOOL_VALUE(n < m); break;
+                default: continue;
+            }
+        } else continue;
+
+        set_constant_load(ir, a, rst);
+        b->removed = op->removed = true;
+        changed = true;
+    }
+    if (changed) refresh_targets(ir);
+    return changed;
+}
@@ -0,0 +1,15 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+#include "common.h"
+#include "object/object.h"
+
+#define OPTIMIZE_LEVEL_MAX 2
+
+// rewrite bytecode of @param function through passes enabled by @param level (0 disables all passes)
+void optimize_function(FunctionObj *function, int level, VM *vm);
+// values a frame of @param function needs at most, including callee and arguments
+int stack_size(FunctionObj *function, VM *vm);
+// false if bytecode of script @param function (or of functions it creates) may access out of its chunk, constants, frame or closure
+bool verify_function(FunctionObj *function, VM *vm);
+
+#endif // clox_optimizer_h
@@ -0,0 +1,400 @@
+#include "register.h"
+#include "chunk/chunk.h"
+#include "memory/memory.h"
+#include "vm/vm.h"
+// added for va_list
+#include <stdarg.h>
+
+// a forward jump waiting for offset of its target
+typedef struct {
+    int offset;     // offset of jump operand in register code
+    int target;     // offset of target in stack code
+} Patch;
+
+/**
+ * translation walks stack code once, tracking which operand holds each stack slot
+ * a slot loaded from a local or a constant is not copied until it has to be (pending),
+ * so loads fold into operands of the instruction consuming them
+ */
+typedef struct {
+    FunctionObj *function;
+    RegisterChunk *out;
+    // RK operand holding value of each stack slot, slot itself once it is materialized
+    uint8_t operands[REGISTER_MAX];
+    int depth;
+    int max_depth;
+    int origin;         // offset of stack instruction being translated
+    int *offsets;       // stack offset -> register offset, -1 for not translated yet
+    int *depths;        // stack depth at jump targets, -1 for unknown
+    Patch *patches;
+    int patch_cnt;
+    int patch_capacity;
+    bool ok;
+    VM *vm;
+} Translator;
+
+static bool translate(Translator *translator);
+static int instruction_length(Chunk *chunk, int offset);
+static void translate_instruction(Translator *translator, int offset, bool negated);
+static void emit_bytes(Translator *translator, int cnt, ...);
+static void emit_jump(Translator *translator, uint8_t instruction, int target);
+static void push_operand(Translator *translator, uint8_t operand);
+static uint8_t push_register(Translator *translator);
+static void materialize(Translator *translator, int slot);
+static void flush(Translator *translator);
+static void set_target_depth(Translator *translator, int target);
+
+void translate_function(FunctionObj *function, VM *vm) {
+    if (function->registers != NULL) return;
+    // enclosed functions first, each of them is translated on its own
+    for (int i = 0; i < function->chunk.constant.count; i++) {
+        Value constant = function->chunk.constant.values[i];
+        if (IS_FUNCTION(constant)) translate_function(AS_FUNCTION(constant), vm);
+    }
+
+    Translator translator;
+    translator.function = function;
+    translator.vm = vm;
+    translator.out = ALLOCATE(RegisterChunk, 1, vm);
+    init_register_chunk(translator.out);
+    if (translate(&translator)) function->registers = translator.out;
+    else {
+        free_register_chunk(translator.out, vm);
+        FREE(RegisterChunk, translator.out, vm);
+    }
+}
+
+static bool translate(Translator *translator) {
+    Chunk *chunk = &translator->function->chunk;
+    translator->ok = true;
+    translator->depth = translator->function->arity + 1;
+    translator->max_depth = translator->depth;
+    translator->patches = NULL;
+    translator->patch_cnt = 0;
+    translator->patch_capacity = 0;
+    translator->offsets = ALLOCATE(int, chunk->count + 1, translator->vm);
+    translator->depths = ALLOCATE(int, chunk->count + 1, translator->vm);
+    for (int i = 0; i <= chunk->count; i++) {
+        translator->offsets[i] = -1;
+        translator->depths[i] = -1;
+    }
+    for (int i = 0; i < REGISTER_MAX; i++) translator->operands[i] = i;
+    if (translator->depth >= REGISTER_MAX) translator->ok = false;
+
+    // jump targets are where control flow merges, operands are materialized before them
+    bool *targets = ALLOCATE(bool, chunk->count + 1, translator->vm);
+    for (int i = 0; i <= chunk->count; i++) targets[i] = false;
+    for (int offset = 0; translator->ok && offset < chunk->count;) {
+        int length = instruction_length(chunk, offset);
+        if (length <= 0 || offset + length > chunk->count) {
+            translator->ok = false;
+            break;
+        }
+        uint8_t *code = chunk->code + offset;
+        if (*code == CLOX_OP_JUMP || *code == CLOX_OP_JUMP_IF_FALSE || *code == CLOX_OP_LOOP) {
+            int distance = code[1] | (code[2] << 8);
+            int target = *code == CLOX_OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+            if (target < 0 || target > chunk->count) translator->ok = false;
+            else targets[target] = true;
+        }
+        offset += length;
+    }
+
+    for (int offset = 0; translator->ok && offset < chunk->count;) {
+        if (targets[offset]) {
+            flush(translator);
+            // code after return or jump is entered through jumps only
+            if (translator->depths[offset] != -1) translator->depth = translator->depths[offset];
+        }
+        translator->offsets[offset] = translator->out->count;
+        translator->origin = offset;
+        int length = instruction_length(chunk, offset);
+        // comparison fused with a following not consumes both
+        uint8_t next = offset + length < chunk->count ? chunk->code[offset + length] : CLOX_OP_RETURN;
+        bool fused = next == CLOX_OP_NOT && !targets[offset + length] &&
+                     (chunk->code[offset] == CLOX_OP_EQUAL || chunk->code[offset] == CLOX_OP_GREATER || chunk->code[offset] == CLOX_OP_LESS);
+        translate_instruction(translator, offset, fused);
+        offset += fused ? length + 1 : length;
+    }
+    translator->offsets[chunk->count] = translator->out->count;
+
+    for (int i = 0; translator->ok && i < translator->patch_cnt; i++) {
+        Patch *patch = &translator->patches[i];
+        int target = translator->offsets[patch->target];
+        int distance = target - (patch->offset + 2);
+        if (target == -1 || distance < 0 || distance > UINT16_MAX) translator->ok = false;
+        else {
+            translator->out->code[patch->offset] = distance & 0xff;
+            translator->out->code[patch->offset + 1] = distance >> 8;
+        }
+    }
+    translator->out->register_cnt = translator->max_depth;
+
+    FREE_ARRAY(bool, targets, chunk->count + 1, translator->vm);
+    FREE_ARRAY(Patch, translator->patches, translator->patch_capacity, translator->vm);
+    FREE_ARRAY(int, translator->depths, chunk->count + 1, translator->vm);
+    FREE_ARRAY(int, translator->offsets, chunk->count + 1, translator->vm);
+    return translator->ok;
+}
+
+// length of a supported instruction at @param offset, -1 for instructions register vm does not support
+static int instruction_length(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case CLOX_OP_RETURN:
+        case CLOX_OP_TRUE:
+        case CLOX_OP_FALSE:
+        case CLOX_OP_NIL:
+        case CLOX_OP_NEGATE:
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DIVIDE:
+        case CLOX_OP_MODULO:
+        case CLOX_OP_POWER:
+        case CLOX_OP_BIT_AND:
+        case CLOX_OP_BIT_OR:
+        case CLOX_OP_BIT_XOR:
+        case CLOX_OP_SHIFT_LEFT:
+        case CLOX_OP_SHIFT_RIGHT:
+        case CLOX_OP_BIT_NOT:
+        case CLOX_OP_NOT:
+        case CLOX_OP_EQUAL:
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS:
+        case CLOX_OP_PRINT:
+        case CLOX_OP_POP:
+            return 1;
+        case CLOX_OP_CONSTANT:
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_SET_GLOBAL:
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_CALL:
+        case CLOX_OP_TAIL_CALL:
+            return 2;
+        case CLOX_OP_JUMP:
+        case CLOX_OP_JUMP_IF_FALSE:
+        case CLOX_OP_LOOP:
+            return 3;
+        case CLOX_OP_INC_LOCAL:
+            return 4;
+        case CLOX_OP_ADD_LOCAL_CONST:
+            return 5;
+        case CLOX_OP_CLOSURE: {
+            // only closures without upvalues, nothing captures a register
+            if (offset + 1 >= chunk->count) return -1;
+            Value function = chunk->constant.values[chunk->code[offset + 1]];
+            return AS_FUNCTION(function)->upvalue_cnt == 0 ? 2 : -1;
+        }
+        default: return -1;
+    }
+}
+
+// @param negated tells a comparison absorbs a following not
+static void translate_instruction(Translator *translator, int offset, bool negated) {
+    uint8_t *code = translator->function->chunk.code + offset;
+    uint8_t *operands = translator->operands;
+    int top = translator->depth - 1;
+    switch (code[0]) {
+        case CLOX_OP_CONSTANT:
+            if (code[1] < REGISTER_CONSTANT) push_operand(translator, code[1] | REGISTER_CONSTANT);
+            else emit_bytes(translator, 3, REG_OP_LOAD_CONSTANT, push_register(translator), code[1]);
+            break;
+        case CLOX_OP_TRUE:  emit_bytes(translator, 2, REG_OP_LOAD_TRUE, push_register(translator)); break;
+        case CLOX_OP_FALSE: emit_bytes(translator, 2, REG_OP_LOAD_FALSE, push_register(translator)); break;
+        case CLOX_OP_NIL:   emit_bytes(translator, 2, REG_OP_LOAD_NIL, push_register(translator)); break;
+        case CLOX_OP_GET_LOCAL:
+            if (code[1] >= translator->depth) translator->ok = false;
+            // copy of a pending slot is pending as well
+            else push_operand(translator, operands[code[1]]);
+            break;
+        case CLOX_OP_SET_LOCAL: {
+            int slot = code[1];
+            if (slot > top) {
+                translator->ok = false;
+                break;
+            }
+            if (operands[top] == slot) break;
+            // slots still reading old value of local are copied before it is overwritten
+            for (int i = slot + 1; i < translator->depth; i++) {
+                if (operands[i] == slot) materialize(translator, i);
+            }
+            emit_bytes(translator, 3, REG_OP_MOVE, slot, operands[top]);
+            operands[slot] = slot;
+            break;
+        }
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_ADD_LOCAL_CONST: {
+            int slot = code[1] | (code[2] << 8);
+            int constant = code[0] == CLOX_OP_ADD_LOCAL_CONST ? code[3] | (code[4] << 8) : 0;
+            if (slot >= translator->depth || constant >= REGISTER_CONSTANT) {
+                translator->ok = false;
+                break;
+            }
+            // as set local, slots still reading old value are copied first
+            for (int i = slot + 1; i < translator->depth; i++) {
+                if (operands[i] == slot) materialize(translator, i);
+            }
+            materialize(translator, slot);
+            if (code[0] == CLOX_OP_INC_LOCAL) emit_bytes(translator, 3, REG_OP_INCREMENT, slot, code[3]);
+            else emit_bytes(translator, 4, REG_OP_ADD, slot, slot, constant | REGISTER_CONSTANT);
+            break;
+        }
+        case CLOX_OP_GET_GLOBAL:
+            emit_bytes(translator, 3, REG_OP_GET_GLOBAL, push_register(translator), code[1]);
+            break;
+        case CLOX_OP_SET_GLOBAL:
+            emit_bytes(translator, 3, REG_OP_SET_GLOBAL, operands[top], code[1]);
+            break;
+        case CLOX_OP_DEFINE_GLOBAL:
+            emit_bytes(translator, 3, REG_OP_DEFINE_GLOBAL, operands[top], code[1]);
+            translator->depth--;
+            break;
+        case CLOX_OP_CLOSURE:
+            emit_bytes(translator, 3, REG_OP_CLOSURE, push_register(translator), code[1]);
+            break;
+        case CLOX_OP_NEGATE:
+        case CLOX_OP_NOT:
+        case CLOX_OP_BIT_NOT:
+            emit_bytes(translator, 3, code[0] == CLOX_OP_NEGATE ? REG_OP_NEGATE : code[0] == CLOX_OP_NOT ? REG_OP_NOT : REG_OP_BIT_NOT, top, operands[top]);
+            operands[top] = top;
+            break;
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DIVIDE:
+        case CLOX_OP_MODULO:
+        case CLOX_OP_POWER:
+        case CLOX_OP_BIT_AND:
+        case CLOX_OP_BIT_OR:
+        case CLOX_OP_BIT_XOR:
+        case CLOX_OP_SHIFT_LEFT:
+        case CLOX_OP_SHIFT_RIGHT:
+        case CLOX_OP_EQUAL:
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS: {
+            uint8_t instruction;
+            switch (code[0]) {
+                case CLOX_OP_ADD:      instruction = REG_OP_ADD; break;
+                case CLOX_OP_SUBTRACT: instruction = REG_OP_SUBTRACT; break;
+                case CLOX_OP_MULTIPLY: instruction = REG_OP_MULTIPLY; break;
+                case CLOX_OP_DIVIDE:   instruction = REG_OP_DIVIDE; break;
+                case CLOX_OP_MODULO:   instruction = REG_OP_MODULO; break;
+                case CLOX_OP_POWER:    instruction = REG_OP_POWER; break;
+                case CLOX_OP_BIT_AND:  instruction = REG_OP_BIT_AND; break;
+                case CLOX_OP_BIT_OR:   instruction = REG_OP_BIT_OR; break;
+                case CLOX_OP_BIT_XOR:  instruction = REG_OP_BIT_XOR; break;
+                case CLOX_OP_SHIFT_LEFT:  instruction = REG_OP_SHIFT_LEFT; break;
+                case CLOX_OP_SHIFT_RIGHT: instruction = REG_OP_SHIFT_RIGHT; break;
+                case CLOX_OP_EQUAL:    instruction = negated ? REG_OP_NOT_EQUAL : REG_OP_EQUAL; break;
+                case CLOX_OP_GREATER:  instruction = negated ? REG_OP_LESS_EQUAL : REG_OP_GREATER; break;
+                default:               instruction = negated ? REG_OP_GREATER_EQUAL : REG_OP_LESS; break;
+            }
+            emit_bytes(translator, 4, instruction, top - 1, operands[top - 1], operands[top]);
+            operands[top - 1] = top - 1;
+            translator->depth--;
+            break;
+        }
+        case CLOX_OP_PRINT:
+            emit_bytes(translator, 2, REG_OP_PRINT, operands[top]);
+            translator->depth--;
+            break;
+        case CLOX_OP_POP:
+            operands[top] = top;
+            translator->depth--;
+            break;
+        case CLOX_OP_JUMP:
+        case CLOX_OP_JUMP_IF_FALSE: {
+            flush(translator);
+            int target = offset + 3 + (code[1] | (code[2] << 8));
+            set_target_depth(translator, target);
+            if (code[0] == CLOX_OP_JUMP) emit_jump(translator, REG_OP_JUMP, target);
+            else {
+                emit_bytes(translator, 2, REG_OP_JUMP_IF_FALSE, top);
+                emit_jump(translator, 0, target);
+            }
+            break;
+        }
+        case CLOX_OP_LOOP: {
+            flush(translator);
+            int target = translator->offsets[offset + 3 - (code[1] | (code[2] << 8))];
+            int distance = translator->out->count + 3 - target;
+            if (target == -1 || distance > UINT16_MAX) translator->ok = false;
+            else emit_bytes(translator, 3, REG_OP_LOOP, distance & 0xff, distance >> 8);
+            break;
+        }
+        case CLOX_OP_CALL:
+        case CLOX_OP_TAIL_CALL: {
+            // callee and arguments are read from their slots by callee frame
+            flush(translator);
+            int base = translator->depth - code[1] - 1;
+            emit_bytes(translator, 3, code[0] == CLOX_OP_TAIL_CALL ? REG_OP_TAIL_CALL : REG_OP_CALL, base, code[1]);
+            translator->depth = base + 1;
+            break;
+        }
+        case CLOX_OP_RETURN:
+            emit_bytes(translator, 2, REG_OP_RETURN, operands[top]);
+            // stack discipline of compiler is kept for code following return
+            operands[top] = top;
+            translator->depth--;
+            break;
+        default:
+            translator->ok = false;
+            break;
+    }
+    if (translator->depth < 0) translator->ok = false;
+}
+
+static void emit_bytes(Translator *translator, int cnt, ...) {
+    va_list args;
+    va_start(args, cnt);
+    for (int i = 0; i < cnt; i++) write_register_chunk(translator->out, (uint8_t)va_arg(args, int), translator->origin, translator->vm);
+    va_end(args);
+}
+
+// emit @param instruction (0 for operand only) with a placeholder offset patched after translation
+static void emit_jump(Translator *translator, uint8_t instruction, int target) {
+    if (instruction != 0) write_register_chunk(translator->out, instruction, translator->origin, translator->vm);
+    if (translator->patch_cnt + 1 > translator->patch_capacity) {
+        int new_capacity = GROW_CAPACITY(translator->patch_capacity);
+        translator->patches = GROW_ARRAY(Patch, translator->patches, translator->patch_capacity, new_capacity, translator->vm);
+        translator->patch_capacity = new_capacity;
+    }
+    Patch *patch = &translator->patches[translator->patch_cnt++];
+    patch->offset = translator->out->count;
+    patch->target = target;
+    emit_bytes(translator, 2, 0xff, 0xff);
+}
+
+static void push_operand(Translator *translator, uint8_t operand) {
+    if (translator->depth + 1 >= REGISTER_MAX) {
+        translator->ok = false;
+        return;
+    }
+    translator->operands[translator->depth++] = operand;
+    if (translator->depth > translator->max_depth) translator->max_depth = translator->depth;
+}
+
+// push a slot written by the instruction being emitted, returns its register
+static uint8_t push_register(Translator *translator) {
+    uint8_t slot = translator->depth;
+    push_operand(translator, slot);
+    return slot;
+}
+
+static void materialize(Translator *translator, int slot) {
+    if (translator->operands[slot] == slot) return;
+    emit_bytes(translator, 3, REG_OP_MOVE, slot, translator->operands[slot]);
+    translator->operands[slot] = slot;
+}
+
+// copy every pending slot into its register, so that all paths agree on where values are
+static void flush(Translator *translator) {
+    for (int i = 0; i < translator->depth; i++) materialize(translator, i);
+}
+
+static void set_target_depth(Translator *translator, int target) {
+    if (translator->depths[target] == -1) translator->depths[target] = translator->depth;
+    else if (translator->depths[target] != translator->depth) translator->ok = false;
+}
@@ -0,0 +1,10 @@
+#ifndef clox_register_h
+#define clox_register_h
+#include "common.h"
+#include "object/object.h"
+
+// translate stack bytecode of @param function and functions it encloses into register code
+// a function using instructions register vm does not support keeps running on stack vm
+void translate_function(FunctionObj *function, VM *vm);
+
+#endif // clox_register_h
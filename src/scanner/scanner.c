@@ -21,10 +21,11 @@ static bool is_alpha(char c);
 static bool is_alpha_numeric(char c);
 static void add_keyword(const char *keyword, TokenType type, Scanner *scanner);
 static TokenType check_keyword(Scanner *scanner);
-static void free_trie(Trie *trie);
+static void free_trie(Trie *trie, VM *vm);
 
-Scanner* init_scanner(const char *source) {
-    Scanner *scanner = ALLOCATE(Scanner, 1);
+Scanner* init_scanner(const char *source, VM *vm) {
+    Scanner *scanner = ALLOCATE(Scanner, 1, vm);
+    scanner->vm = vm;
     scanner->current = source;
     scanner->start = source;
     scanner->line = 1;
@@ -32,7 +33,7 @@ Scanner* init_scanner(const char *source) {
     scanner->cur_column = 0;
     
     // initialize trie
-    scanner->keywords = ALLOCATE(Trie, 1);
+    scanner->keywords = ALLOCATE(Trie, 1, vm);
     memset(scanner->keywords->children, 0, sizeof(scanner->keywords->children));
     scanner->keywords->type = CLOX_TOKEN_ERROR;
 
@@ -60,8 +61,9 @@ Scanner* init_scanner(const char *source) {
 }
 
 void free_scanner(Scanner *scanner) {
-    free_trie(scanner->keywords);
-    FREE(Scanner, scanner);
+    VM *vm = scanner->vm;
+    free_trie(scanner->keywords, vm);
+    FREE(Scanner, scanner, vm);
 }
 
 Token* scan_token(Scanner *scanner) {
@@ -80,7 +82,10 @@ Token* scan_token(Scanner *scanner) {
         case ')': return create_token(CLOX_TOKEN_RIGHT_PAREN, scanner);
         case '{': return create_token(CLOX_TOKEN_LEFT_BRACE, scanner);
         case '}': return create_token(CLOX_TOKEN_RIGHT_BRACE, scanner);
+        case '[': return create_token(CLOX_TOKEN_LEFT_BRACKET, scanner);
+        case ']': return create_token(CLOX_TOKEN_RIGHT_BRACKET, scanner);
         case ',': return create_token(CLOX_TOKEN_COMMA, scanner);
+        case ':': return create_token(CLOX_TOKEN_COLON, scanner);
         case '.': return create_token(CLOX_TOKEN_DOT, scanner);
         case '-': {
             if (match('-', scanner)) return create_token(CLOX_TOKEN_MINUS_MINUS, scanner);
@@ -100,11 +105,21 @@ Token* scan_token(Scanner *scanner) {
             return create_token(CLOX_TOKEN_STAR, scanner);
         }
         case '%': return create_token(match('=', scanner) ? CLOX_TOKEN_PERCENT_EQUAL : CLOX_TOKEN_PERCENT, scanner);
+        case '&': return create_token(CLOX_TOKEN_AMPERSAND, scanner);
+        case '|': return create_token(CLOX_TOKEN_PIPE, scanner);
+        case '^': return create_token(CLOX_TOKEN_CARET, scanner);
+        case '~': return create_token(CLOX_TOKEN_TILDE, scanner);
         // single or double characters
         case '!': return create_token(match('=', scanner) ? CLOX_TOKEN_BANG_EQUAL : CLOX_TOKEN_BANG, scanner);
         case '=': return create_token(match('=', scanner) ? CLOX_TOKEN_EQUAL_EQUAL : CLOX_TOKEN_EQUAL, scanner);
-        case '>': return create_token(match('=', scanner) ? CLOX_TOKEN_GREATER_EQUAL : CLOX_TOKEN_GREATER, scanner);
-        case '<': return create_token(match('=', scanner) ? CLOX_TOKEN_LESS_EQUAL : CLOX_TOKEN_LESS, scanner);
+        case '>': {
+            if (match('>', scanner)) return create_token(CLOX_TOKEN_GREATER_GREATER, scanner);
+            return create_token(match('=', scanner) ? CLOX_TOKEN_GREATER_EQUAL : CLOX_TOKEN_GREATER, scanner);
+        }
+        case '<': {
+            if (match('<', scanner)) return create_token(CLOX_TOKEN_LESS_LESS, scanner);
+            return create_token(match('=', scanner) ? CLOX_TOKEN_LESS_EQUAL : CLOX_TOKEN_LESS, scanner);
+        }
         // literals: identifier, string, number
         case '"': return string_token(scanner);
         default:
@@ -114,11 +129,18 @@ Token* scan_token(Scanner *scanner) {
     }
 }
 
+Token* peek_token(Scanner *scanner) {
+    Scanner saved = *scanner;
+    Token *token = scan_token(scanner);
+    *scanner = saved;
+    return token;
+}
+
 /**
  * create a token with @param type 
  */
 static Token* create_token(TokenType type, Scanner *scanner) {
-    Token *token = ALLOCATE(Token, 1);
+    Token *token = ALLOCATE(Token, 1, scanner->vm);
     token->type = type;
     token->lexeme = scanner->start;
     token->length = scanner->current - scanner->start;
@@ -131,7 +153,7 @@ static Token* create_token(TokenType type, Scanner *scanner) {
  * create a error typed token with @param message  
  */
 static Token* error_token(const char *message, Scanner *scanner) {
-    Token *token = ALLOCATE(Token, 1);
+    Token *token = ALLOCATE(Token, 1, scanner->vm);
     token->type = CLOX_TOKEN_ERROR;
     token->lexeme = message;
     token->length = strlen(message);
@@ -306,7 +328,7 @@ static void add_keyword(const char *keyword, TokenType type, Scanner *scanner) {
     for (const char *c = keyword; *c != '\0'; c++) {
         int i = *c - 'a';
         if (node->children[i] == NULL) {
-            node->children[i] = ALLOCATE(Trie, 1);
+            node->children[i] = ALLOCATE(Trie, 1, scanner->vm);
             memset(node->children[i]->children, 0, sizeof(node->children[i]->children));
             node->children[i]->type = CLOX_TOKEN_ERROR;
         }
@@ -315,10 +337,10 @@ static void add_keyword(const char *keyword, TokenType type, Scanner *scanner) {
     node->type = type;
 }
 
-static void free_trie(Trie* trie) {
+static void free_trie(Trie* trie, VM *vm) {
     if (trie == NULL) return;
-    for (int i = 0; i < 26; i++) free_trie(trie->children[i]);
-    FREE(Trie, trie);
+    for (int i = 0; i < 26; i++) free_trie(trie->children[i], vm);
+    FREE(Trie, trie, vm);
 }
 
 static TokenType check_keyword(Scanner *scanner) {
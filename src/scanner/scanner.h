@@ -1,14 +1,15 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
+#include "common.h"
 
 typedef enum {
     CLOX_TOKEN_ERROR, 
     /**
      * single-character token
-     * '(', ')', '{', '}'，',', '.', '-', '+', ';', '*', '/'
+     * '(', ')', '{', '}', '[', ']'，',', ':', '.', '-', '+', ';', '*', '/'
      */ 
-    CLOX_TOKEN_LEFT_PAREN, CLOX_TOKEN_RIGHT_PAREN, CLOX_TOKEN_LEFT_BRACE, CLOX_TOKEN_RIGHT_BRACE,
-    CLOX_TOKEN_COMMA, CLOX_TOKEN_DOT, CLOX_TOKEN_MINUS, CLOX_TOKEN_PLUS, CLOX_TOKEN_SEMICOLON, CLOX_TOKEN_SLASH, CLOX_TOKEN_STAR,
+    CLOX_TOKEN_LEFT_PAREN, CLOX_TOKEN_RIGHT_PAREN, CLOX_TOKEN_LEFT_BRACE, CLOX_TOKEN_RIGHT_BRACE, CLOX_TOKEN_LEFT_BRACKET, CLOX_TOKEN_RIGHT_BRACKET,
+    CLOX_TOKEN_COMMA, CLOX_TOKEN_COLON, CLOX_TOKEN_DOT, CLOX_TOKEN_MINUS, CLOX_TOKEN_PLUS, CLOX_TOKEN_SEMICOLON, CLOX_TOKEN_SLASH, CLOX_TOKEN_STAR,
 
     /**
      * single or double characters token
@@ -36,6 +37,12 @@ typedef enum {
     CLOX_TOKEN_PERCENT, CLOX_TOKEN_STAR_STAR, CLOX_TOKEN_PLUS_PLUS, CLOX_TOKEN_MINUS_MINUS, 
     CLOX_TOKEN_PLUS_EQUAL, CLOX_TOKEN_MINUS_EQUAL, CLOX_TOKEN_STAR_EQUAL, CLOX_TOKEN_SLASH_EQUAL, CLOX_TOKEN_PERCENT_EQUAL,
     CLOX_TOKEN_XOR,
+
+    /**
+     * bitwise
+     * '&', '|', '^', '~', '<<', '>>'
+     */
+    CLOX_TOKEN_AMPERSAND, CLOX_TOKEN_PIPE, CLOX_TOKEN_CARET, CLOX_TOKEN_TILDE, CLOX_TOKEN_LESS_LESS, CLOX_TOKEN_GREATER_GREATER,
 } TokenType;
 
 typedef struct {
@@ -62,10 +69,14 @@ typedef struct {
     int cur_column;
     int column;
     Trie *keywords;
+    // tokens and keywords are allocated from it
+    VM *vm;
 } Scanner;
 
-Scanner* init_scanner(const char *source);
+Scanner* init_scanner(const char *source, VM *vm);
 void free_scanner(Scanner *scanner);
 Token* scan_token(Scanner *scanner);
+// token after the one scanned last, scanner is left as it was
+Token* peek_token(Scanner *scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "shared.h"
+// added for malloc
+#include <stdlib.h>
+// added for memcpy
+#include <string.h>
+
+#define POOL_LOAD 0.75
+
+// open addressing set of interned strings, keyed by content
+typedef struct {
+    StringObj **strings;
+    int count;
+    int capacity;
+} StringPool;
+
+static StringPool pool = { .strings = NULL, .count = 0, .capacity = 0 };
+// every frozen object, linked through obj.next
+static Obj *shared_objs = NULL;
+
+static Obj* new_shared_obj(ObjType type, size_t size);
+static StringObj* freeze_string(StringObj *string);
+static void* copy_memory(const void *src, size_t size);
+static void grow_pool();
+static StringObj** find_slot(const char *str, int length, uint32_t hash, StringObj **strings, int capacity);
+
+FunctionObj* freeze_function(FunctionObj *function) {
+    FunctionObj *frozen = (FunctionObj*)new_shared_obj(OBJ_FUNCTION, sizeof(FunctionObj));
+    frozen->name = function->name == NULL ? NULL : freeze_string(function->name);
+    frozen->arity = function->arity;
+    frozen->upvalue_cnt = function->upvalue_cnt;
+    frozen->capture_cnt = function->capture_cnt;
+    frozen->stack_size = function->stack_size;
+
+    Chunk *chunk = &frozen->chunk;
+    *chunk = function->chunk;
+    // capacity shrinks to count, nothing is appended to frozen chunk
+    chunk->code = (uint8_t*)copy_memory(function->chunk.code, sizeof(uint8_t) * chunk->count);
+    chunk->capacity = chunk->count;
+    chunk->lines = (LineRecord*)copy_memory(function->chunk.lines, sizeof(LineRecord) * chunk->line_count);
+    chunk->line_capacity = chunk->line_count;
+    chunk->constant.values = (Value*)copy_memory(function->chunk.constant.values, sizeof(Value) * chunk->constant.count);
+    chunk->constant.capacity = chunk->constant.count;
+    for (int i = 0; i < chunk->constant.count; i++) {
+        Value *constant = &chunk->constant.values[i];
+        if (IS_STRING(*constant)) *constant = OBJ_VALUE(freeze_string(AS_STRING(*constant)));
+        else if (IS_FUNCTION(*constant)) *constant = OBJ_VALUE(freeze_function(AS_FUNCTION(*constant)));
+    }
+
+    // translation for register vm never changes once done, so it is shared as well
+    frozen->registers = NULL;
+    if (function->registers != NULL) {
+        RegisterChunk *registers = (RegisterChunk*)copy_memory(function->registers, sizeof(RegisterChunk));
+        registers->code = (uint8_t*)copy_memory(function->registers->code, sizeof(uint8_t) * registers->count);
+        registers->origins = (int*)copy_memory(function->registers->origins, sizeof(int) * registers->count);
+        registers->capacity = registers->count;
+        frozen->registers = registers;
+    }
+    // machine code refers to stack of one vm, frozen function stays on interpreter
+    frozen->hotness = -1;
+    frozen->jit = NULL;
+    frozen->jit_size = 0;
+    return frozen;
+}
+
+StringObj* find_shared_string(const char *str, int length, uint32_t hash) {
+    if (pool.count == 0) return NULL;
+    return *find_slot(str, length, hash, pool.strings, pool.capacity);
+}
+
+void free_shared() {
+    while (shared_objs != NULL) {
+        Obj *obj = shared_objs;
+        shared_objs = obj->next;
+        if (obj->type == OBJ_STRING) free((char*)((StringObj*)obj)->str);
+        else {
+            FunctionObj *function = (FunctionObj*)obj;
+            free(function->chunk.code);
+            free(function->chunk.lines);
+            free(function->chunk.constant.values);
+            if (function->registers != NULL) {
+                free(function->registers->code);
+                free(function->registers->origins);
+                free(function->registers);
+            }
+        }
+        free(obj);
+    }
+    free(pool.strings);
+    pool.strings = NULL;
+    pool.count = 0;
+    pool.capacity = 0;
+}
+
+static Obj* new_shared_obj(ObjType type, size_t size) {
+    Obj *obj = (Obj*)malloc(size);
+    if (obj == NULL) exit(1);
+    obj->type = type;
+    obj->is_marked = false;
+    obj->is_shared = true;
+    obj->next = shared_objs;
+    shared_objs = obj;
+    return obj;
+}
+
+static StringObj* freeze_string(StringObj *string) {
+    if (pool.count + 1 > pool.capacity * POOL_LOAD) grow_pool();
+    StringObj **slot = find_slot(string->str, string->length, string->hash, pool.strings, pool.capacity);
+    if (*slot != NULL) return *slot;
+
+    StringObj *frozen = (StringObj*)new_shared_obj(OBJ_STRING, sizeof(StringObj));
+    frozen->length = string->length;
+    frozen->str = (const char*)copy_memory(string->str, string->length + 1);
+    frozen->hash = string->hash;
+    *slot = frozen;
+    pool.count++;
+    return frozen;
+}
+
+static void* copy_memory(const void *src, size_t size) {
+    if (size == 0) return NULL;
+    void *dest = malloc(size);
+    if (dest == NULL) exit(1);
+    memcpy(dest, src, size);
+    return dest;
+}
+
+static void grow_pool() {
+    int capacity = pool.capacity < 8 ? 8 : pool.capacity << 1;
+    StringObj **strings = (StringObj**)calloc(capacity, sizeof(StringObj*));
+    if (strings == NULL) exit(1);
+    for (int i = 0; i < pool.capacity; i++) {
+        StringObj *string = pool.strings[i];
+        if (string != NULL) *find_slot(string->str, string->length, string->hash, strings, capacity) = string;
+    }
+    free(pool.strings);
+    pool.strings = strings;
+    pool.capacity = capacity;
+}
+
+// slot holding the string, or the empty slot it belongs to
+static StringObj** find_slot(const char *str, int length, uint32_t hash, StringObj **strings, int capacity) {
+    // capacity is a power of 2
+    uint32_t idx = hash & (capacity - 1);
+    for (;;) {
+        StringObj *string = strings[idx];
+        if (string == NULL) return &strings[idx];
+        if (string->length == length && string->hash == hash && memcmp(string->str, str, length) == 0) return &strings[idx];
+        idx = (idx + 1) & (capacity - 1);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef clox_shared_h
+#define clox_shared_h
+#include "common.h"
+#include "object/object.h"
+
+/**
+ * frozen functions live outside of every vm, no gc marks or sweeps them, so any number of vms can run one copy
+ * their strings are interned in a process-wide pool, which vms look up before their own string table
+ * the pool is written only while freezing, freeze before starting vms which share the result, later reads need no lock
+ */
+
+// copy @param function and every function in its constants into shared memory, returns the frozen copy
+// frozen bytecode is never rewritten: quickening, jit and register translation skip it
+FunctionObj* freeze_function(FunctionObj *function);
+// find string interned in shared pool, NULL if absent
+StringObj* find_shared_string(const char *str, int length, uint32_t hash);
+// release every frozen object, no vm may run them afterwards
+void free_shared();
+
+#endif // clox_shared_h
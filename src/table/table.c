@@ -6,8 +6,21 @@
 
 #define TABLE_LOAD 0.75
 
-static Entry* find_entry_by_hash(StringObj *key, Entry *entries, int size);
-static void rehash_table(Table *table);
+// number keys are normalized, so equal keys are equal bits
+#ifdef NAN_BOXING
+#define KEYS_EQUAL(a, b) ((a) == (b))
+#else
+#define KEYS_EQUAL(a, b) values_equal(a, b)
+#endif // NAN_BOXING
+
+static bool put_entry(Value key, uint32_t hash, Value value, Table *table, VM *vm);
+static bool get_entry(Value key, uint32_t hash, Value *value, Table *table);
+static bool remove_entry(Value key, uint32_t hash, Value *value, Table *table);
+static Entry* find_entry_by_hash(Value key, uint32_t hash, Entry *entries, int size);
+static void rehash_table(Table *table, VM *vm);
+static Value normalize_key(Value key);
+static uint32_t hash_value(Value key);
+static uint32_t hash_bits(uint64_t bits);
 
 
 void init_table(Table *table) {
@@ -16,51 +29,29 @@ void init_table(Table *table) {
     table->entries = NULL;
 }
 
-void free_table(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void free_table(Table *table, VM *vm) {
+    FREE_ARRAY(Entry, table->entries, table->capacity, vm);
     init_table(table);
 }
 
-bool table_put(StringObj *key, Value value, Table *table) {
-    // resize before filling up
-    if (table->count + 1 > (double)table->capacity * TABLE_LOAD) rehash_table(table);
-
-    Entry *entry = find_entry_by_hash(key, table->entries, table->capacity);
-    if (entry == NULL) return false;
-    if (entry->key == NULL) table->count++;
-    entry->key = key;
-    entry->value = value;
-    return true;
+bool table_put(StringObj *key, Value value, Table *table, VM *vm) {
+    return put_entry(OBJ_VALUE(key), key->hash, value, table, vm);
 }
 
 bool table_get(StringObj *key, Value *value, Table *table) {
-    if (table->count == 0) return false;
-
-    Entry *entry = find_entry_by_hash(key, table->entries, table->capacity);
-    if (entry == NULL || entry->key == NULL) return false;
-    if (value != NULL) *value = entry->value;
-    return true;
+    return get_entry(OBJ_VALUE(key), key->hash, value, table);
 }
 
 bool table_remove(StringObj *key, Value *value, Table *table) {
-    if (table->count == 0) return false;
-
-    Entry *entry = find_entry_by_hash(key, table->entries, table->capacity);
-    if (entry == NULL || entry->key == NULL) return false;
-    if (value != NULL) *value = entry->value;
-
-    table->count--;
-    entry->key = NULL;
-    entry->value = BOOL_VALUE(true);
-    return true;
+    return remove_entry(OBJ_VALUE(key), key->hash, value, table);
 }
 
 // add all entries from src to dest
-void table_put_all(Table *dest, Table *src) {
+void table_put_all(Table *dest, Table *src, VM *vm) {
     for (int i = 0; i < src->capacity; i++) {
         Entry *entry = &src->entries[i];
-        if (entry->key == NULL) continue;
-        table_put(entry->key, entry->value, dest);
+        if (IS_NIL(entry->key)) continue;
+        put_entry(entry->key, hash_value(entry->key), entry->value, dest, vm);
     }
 }
 
@@ -70,46 +61,135 @@ StringObj* table_find_string(const char *str, int length, uint32_t hash, Table *
     uint32_t idx = hash & (table->capacity - 1);
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[(idx + i) & (table->capacity - 1)];
-        if (entry->key != NULL) {
-            if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->str, str, length) == 0) return entry->key;
+        if (!IS_NIL(entry->key)) {
+            StringObj *key = AS_STRING(entry->key);
+            if (key->length == length && key->hash == hash && memcmp(key->str, str, length) == 0) return key;
         } else if (IS_NIL(entry->value)) return NULL;
     }
     return NULL;
 }
 
-static Entry* find_entry_by_hash(StringObj *key, Entry *entries, int size) {
+bool is_valid_key(Value key) {
+    return !IS_NIL(key) && !(IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key));
+}
+
+bool table_put_value(Value key, Value value, Table *table, VM *vm) {
+    key = normalize_key(key);
+    return put_entry(key, hash_value(key), value, table, vm);
+}
+
+bool table_get_value(Value key, Value *value, Table *table) {
+    key = normalize_key(key);
+    return get_entry(key, hash_value(key), value, table);
+}
+
+bool table_remove_value(Value key, Value *value, Table *table) {
+    key = normalize_key(key);
+    return remove_entry(key, hash_value(key), value, table);
+}
+
+int table_next(Table *table, int idx) {
+    for (; idx < table->capacity; idx++) {
+        if (!IS_NIL(table->entries[idx].key)) return idx;
+    }
+    return -1;
+}
+
+static bool put_entry(Value key, uint32_t hash, Value value, Table *table, VM *vm) {
+    // resize before filling up
+    if (table->count + 1 > (double)table->capacity * TABLE_LOAD) rehash_table(table, vm);
+
+    Entry *entry = find_entry_by_hash(key, hash, table->entries, table->capacity);
+    if (entry == NULL) return false;
+    if (IS_NIL(entry->key)) table->count++;
+    entry->key = key;
+    entry->value = value;
+    return true;
+}
+
+static bool get_entry(Value key, uint32_t hash, Value *value, Table *table) {
+    if (table->count == 0) return false;
+
+    Entry *entry = find_entry_by_hash(key, hash, table->entries, table->capacity);
+    if (entry == NULL || IS_NIL(entry->key)) return false;
+    if (value != NULL) *value = entry->value;
+    return true;
+}
+
+static bool remove_entry(Value key, uint32_t hash, Value *value, Table *table) {
+    if (table->count == 0) return false;
+
+    Entry *entry = find_entry_by_hash(key, hash, table->entries, table->capacity);
+    if (entry == NULL || IS_NIL(entry->key)) return false;
+    if (value != NULL) *value = entry->value;
+
+    table->count--;
+    entry->key = NIL_VALUE;
+    entry->value = BOOL_VALUE(true);
+    return true;
+}
+
+static Entry* find_entry_by_hash(Value key, uint32_t hash, Entry *entries, int size) {
     // optimize modulo operation by bitwise AND
-    uint32_t idx = key->hash & (size - 1);
+    uint32_t idx = hash & (size - 1);
     Entry *tombstone = NULL;
     for (int i = 0; i < size; i++) {
         Entry *entry = &entries[(idx + i) & (size - 1)];
-        if (entry->key == key) return entry;
-        else if (entry->key == NULL) {
+        if (IS_NIL(entry->key)) {
             if (IS_NIL(entry->value)) return tombstone == NULL ? entry : tombstone;
             else if (tombstone == NULL) tombstone = entry;
-        }
+        } else if (KEYS_EQUAL(entry->key, key)) return entry;
     }
     return tombstone;
 }
 
-static void rehash_table(Table *table) {
+static void rehash_table(Table *table, VM *vm) {
     int new_capacity = GROW_CAPACITY(table->capacity);
-    Entry *new_entries = ALLOCATE(Entry, new_capacity);
+    Entry *new_entries = ALLOCATE(Entry, new_capacity, vm);
     for (int i = 0; i < new_capacity; i++) {
-        new_entries[i].key = NULL;
+        new_entries[i].key = NIL_VALUE;
         new_entries[i].value = NIL_VALUE;
     }
 
     for (int i = 0; i < table->capacity; i++) {
         Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-        Entry *dest = find_entry_by_hash(entry->key, new_entries, new_capacity);
+        if (IS_NIL(entry->key)) continue;
+        Entry *dest = find_entry_by_hash(entry->key, hash_value(entry->key), new_entries, new_capacity);
         dest->key = entry->key;
         dest->value = entry->value;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity, vm);
 
     table->capacity = new_capacity;
     table->entries = new_entries; 
 }
+
+// -0 and 0 are one key
+static Value normalize_key(Value key) {
+    if (IS_NUMBER(key) && AS_NUMBER(key) == 0) return NUMBER_VALUE(0);
+    return key;
+}
+
+static uint32_t hash_value(Value key) {
+    if (IS_STRING(key)) return AS_STRING(key)->hash;
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(double));
+        return hash_bits(bits);
+    }
+    if (IS_BOOL(key)) return AS_BOOL(key) ? 1231 : 1237;
+    // other objects are keyed by identity
+    return hash_bits((uint64_t)(uintptr_t)AS_OBJ(key));
+}
+
+// finalizer of murmur3, spreads every input bit over the low bits masked into an index
+static uint32_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
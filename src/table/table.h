@@ -4,8 +4,9 @@
 #include "common.h"
 #include "value/value.h"
 
+// key is nil for an empty entry (value nil) or a tombstone (value true)
 typedef struct {
-    StringObj* key;
+    Value key;
     Value value;
 } Entry;
 
@@ -16,11 +17,19 @@ typedef struct {
 } Table;
 
 void init_table(Table *table);
-void free_table(Table *table);
-bool table_put(StringObj *key, Value value, Table *table);
+void free_table(Table *table, VM *vm);
+bool table_put(StringObj *key, Value value, Table *table, VM *vm);
 bool table_get(StringObj *key, Value *value, Table *table);
 bool table_remove(StringObj *key, Value *value, Table *table);
-void table_put_all(Table *dest, Table *src);
+void table_put_all(Table *dest, Table *src, VM *vm);
 StringObj* table_find_string(const char *str, int length, uint32_t hash, Table *table);
 
+// keyed by any value but nil and NaN, equal numbers are one key
+bool is_valid_key(Value key);
+bool table_put_value(Value key, Value value, Table *table, VM *vm);
+bool table_get_value(Value key, Value *value, Table *table);
+bool table_remove_value(Value key, Value *value, Table *table);
+// index of first entry in use at or after @param idx, -1 if there is none
+int table_next(Table *table, int idx);
+
 #endif // clox_hash_table_h
\ No newline at end of file
@@ -10,18 +10,18 @@ void init_value_array(ValueArray *array) {
     array->values = NULL;
 }
 
-void write_value_array(ValueArray *array, Value value) {
+void write_value_array(ValueArray *array, Value value, VM *vm) {
     if (array->count + 1 > array->capacity) {
         int new_capacity = GROW_CAPACITY(array->capacity);
-        array->values = GROW_ARRAY(Value, array->values, array->capacity, new_capacity);
+        array->values = GROW_ARRAY(Value, array->values, array->capacity, new_capacity, vm);
         array->capacity = new_capacity;
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-void free_value_array(ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void free_value_array(ValueArray *array, VM *vm) {
+    FREE_ARRAY(Value, array->values, array->capacity, vm);
     init_value_array(array);
 }
 
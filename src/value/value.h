@@ -2,6 +2,9 @@
 #define clox_value_h
 #include "common.h"
 
+// added for signbit
+#include <math.h>
+
 #ifdef NAN_BOXING
 #include <string.h>
 
@@ -10,10 +13,21 @@
 #define TAG_NIL   0x1
 #define TAG_FALSE 0x2
 #define TAG_TRUE  0x3
+// a small integer is a quiet nan of its own, int32 payload in low 32 bits
+#define INT_TAG   ((uint64_t)0x7ffd000000000000)
 
+// a number is either a double or an int, AS_NUMBER reads both as double
 #define NUMBER_VALUE(value) number_to_value(value) 
-#define AS_NUMBER(value)    value_to_number(value)
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define AS_NUMBER(value)    (IS_INT(value) ? (double)AS_INT(value) : value_to_number(value))
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
+
+#define DOUBLE_VALUE(value) number_to_value(value)
+#define AS_DOUBLE(value)    value_to_number(value)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+
+#define INT_VALUE(value)    ((Value)(INT_TAG | (uint32_t)(int32_t)(value)))
+#define AS_INT(value)       ((int32_t)(uint32_t)(value))
+#define IS_INT(value)       (((value) >> 32) == (INT_TAG >> 32))
 
 #define NIL_VALUE           ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define IS_NIL(value)       ((uint64_t)(value) == NIL_VALUE)
@@ -32,6 +46,15 @@
 #define AS_NUMBER(value)    ((value).data.number)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 
+// without nan boxing every number is a double
+#define DOUBLE_VALUE(value) NUMBER_VALUE(value)
+#define AS_DOUBLE(value)    AS_NUMBER(value)
+#define IS_DOUBLE(value)    IS_NUMBER(value)
+
+#define INT_VALUE(value)    NUMBER_VALUE((double)(value))
+#define AS_INT(value)       ((int32_t)AS_NUMBER(value))
+#define IS_INT(value)       false
+
 #define BOOL_VALUE(value)   ((Value){VAL_BOOL, {.boolean = (value)}})
 #define AS_BOOL(value)      ((value).data.boolean)
 #define IS_BOOL(value)      ((value).type == VAL_BOOL)
@@ -53,6 +76,11 @@ typedef struct UpvalueObj UpvalueObj;
 typedef struct ClassObj ClassObj;
 typedef struct InstanceObj InstanceObj;
 typedef struct MethodObj MethodObj;
+typedef struct FiberObj FiberObj;
+typedef struct ListObj ListObj;
+typedef struct MapObj MapObj;
+typedef struct Float64ArrayObj Float64ArrayObj;
+typedef struct RangeObj RangeObj;
 
 typedef enum ValueType {
     VAL_BOOL,
@@ -81,8 +109,8 @@ typedef struct ValueArray {
 } ValueArray;
 
 void init_value_array(ValueArray *array);
-void write_value_array(ValueArray *array, Value value);
-void free_value_array(ValueArray *array);
+void write_value_array(ValueArray *array, Value value, VM *vm);
+void free_value_array(ValueArray *array, VM *vm);
 void print_value(Value value);
 bool is_false(Value value);
 bool values_equal(Value a, Value b);
@@ -110,4 +138,83 @@ static inline double value_to_number(Value value) {
 }
 #endif // NAN_BOXING
 
+// an integral @param number in int32 range is stored as int, except -0 which only a double keeps
+static inline Value canonical_number(double number) {
+    if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number && (number != 0 || !signbit(number))) return INT_VALUE((int32_t)number);
+    return NUMBER_VALUE(number);
+}
+
+/**
+ * int arithmetic, false unless both operands are ints and result is one as well
+ * a result out of int32 range or a negative zero is left to double arithmetic
+ */
+static inline bool add_ints(Value a, Value b, Value *rst) {
+    int32_t n;
+    if (!IS_INT(a) || !IS_INT(b) || __builtin_add_overflow(AS_INT(a), AS_INT(b), &n)) return false;
+    *rst = INT_VALUE(n);
+    return true;
+}
+
+static inline bool subtract_ints(Value a, Value b, Value *rst) {
+    int32_t n;
+    if (!IS_INT(a) || !IS_INT(b) || __builtin_sub_overflow(AS_INT(a), AS_INT(b), &n)) return false;
+    *rst = INT_VALUE(n);
+    return true;
+}
+
+static inline bool multiply_ints(Value a, Value b, Value *rst) {
+    int32_t n;
+    if (!IS_INT(a) || !IS_INT(b) || __builtin_mul_overflow(AS_INT(a), AS_INT(b), &n)) return false;
+    if (n == 0 && (AS_INT(a) < 0 || AS_INT(b) < 0)) return false;
+    *rst = INT_VALUE(n);
+    return true;
+}
+
+static inline bool negate_int(Value a, Value *rst) {
+    if (!IS_INT(a) || AS_INT(a) == 0 || AS_INT(a) == INT32_MIN) return false;
+    *rst = INT_VALUE(-AS_INT(a));
+    return true;
+}
+
+/**
+ * modulo of number operands truncated to integers, sign of result follows dividend as c % does
+ * false if divisor truncates to 0, fmod is exact so operands out of int64 range need no conversion
+ */
+static inline bool modulo_numbers(Value a, Value b, Value *rst) {
+    if (IS_INT(a) && IS_INT(b) && AS_INT(b) > 0) {
+        *rst = INT_VALUE(AS_INT(a) % AS_INT(b));
+        return true;
+    }
+    double y = trunc(AS_NUMBER(b));
+    if (y == 0) return false;
+    // adding 0 turns a -0 remainder into 0, as int modulo gives
+    *rst = canonical_number(fmod(trunc(AS_NUMBER(a)), y) + 0.0);
+    return true;
+}
+
+// an integral number within int64 is an exact integer, bitwise operations work on its two's complement
+static inline bool as_exact_int(Value value, int64_t *n) {
+    if (IS_INT(value)) {
+        *n = AS_INT(value);
+        return true;
+    }
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    if (!(number >= -9223372036854775808.0 && number < 9223372036854775808.0) || number != (double)(int64_t)number) return false;
+    *n = (int64_t)number;
+    return true;
+}
+
+// false if @param n has no double of exactly its value
+static inline bool exact_int_value(int64_t n, Value *rst) {
+    if (n >= INT32_MIN && n <= INT32_MAX) {
+        *rst = INT_VALUE((int32_t)n);
+        return true;
+    }
+    double number = (double)n;
+    if (number >= 9223372036854775808.0 || (int64_t)number != n) return false;
+    *rst = NUMBER_VALUE(number);
+    return true;
+}
+
 #endif  // clox_value_h
\ No newline at end of file
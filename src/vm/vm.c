@@ -3,6 +3,14 @@
 #include "disassemble/disassemble.h"
 #include "complier/compiler.h"
 #include "object/object.h"
+#include "memory/memory.h"
+#include "cache/cache.h"
+#include "register/register.h"
+#include "jit/jit.h"
+// added for run_loop
+#include "loop/loop.h"
+// added for define_numeric_natives
+#include "numeric/numeric.h"
 // added for print constants
 #include <stdio.h>
 // added for wrap format print
@@ -11,90 +19,283 @@
 #include <math.h>
 // added for native function call time
 #include <time.h>
-// added for strlen
+// added for strlen and memmove
 #include <string.h>
+// added for free of gray stack
+#include <stdlib.h>
 
-static void reset_stack();
-static InterpreterResult run();
-static bool bind_method(ClassObj *klass, StringObj *method);
-static bool function_call(Value function, uint8_t arg_cnt);
-static bool invoke(ClosureObj *closure, uint8_t arg_cnt);
-static void close_upvalue(Value *slot);
-static void* read_bytes(int num);
-static void runtime_error(char *format, ...);
-static void push(Value value);
-static Value pop();
-static Value peek(int distance);
-static void define_native(const char *name, native_func native);
-static Value native_clock(int argc, Value *args);
-
-VM vm;
-
-void init_vm() {
-    reset_stack();
-    vm.objs.next = NULL;
-    init_table(&vm.strings);
-    init_table(&vm.globals);
-    define_native("clock", native_clock);
-
-    vm.init_string = new_string("init", 4);
-
-    // vm.gray_stack = NULL;
-    vm.gray_count = 0;
-    // vm.gray_capacity = 0;
-
-    vm.allocated_bytes = 0;
+static void reset_stack(VM *vm);
+static InterpreterResult run(int base, VM *vm);
+static InterpreterResult run_register(int base, VM *vm);
+static InterpreterResult enter_register(int base, VM *vm);
+static InterpreterResult run_callee(VM *vm);
+static void reset_registers(CallFrame *frame, int from, VM *vm);
+static void grow_stack(FunctionObj *function, uint8_t arg_cnt, VM *vm);
+static bool bind_method(ClassObj *klass, StringObj *method, VM *vm);
+static bool function_call(Value function, uint8_t arg_cnt, VM *vm);
+static bool invoke(ClosureObj *closure, uint8_t arg_cnt, VM *vm);
+static bool reuse_frame(ClosureObj *closure, uint8_t arg_cnt, VM *vm);
+static bool method_callee(StringObj *name, uint8_t arg_cnt, Value *callee, VM *vm);
+static void capture_upvalues(ClosureObj *closure, VM *vm);
+static void close_upvalue(Value *slot, VM *vm);
+static void* read_bytes(int num, VM *vm);
+static void push(Value value, VM *vm);
+static Value pop(VM *vm);
+static Value peek(int distance, VM *vm);
+static void swap_fiber(FiberObj *fiber, VM *vm);
+static bool native_clock(int argc, Value *args, VM *vm);
+static bool native_fiber(int argc, Value *args, VM *vm);
+static bool native_resume(int argc, Value *args, VM *vm);
+static bool native_yield(int argc, Value *args, VM *vm);
+static bool native_is_done(int argc, Value *args, VM *vm);
+static bool element_index(Value container, Value index, int *idx, VM *vm);
+static bool native_append(int argc, Value *args, VM *vm);
+static bool native_pop(int argc, Value *args, VM *vm);
+static bool native_len(int argc, Value *args, VM *vm);
+static bool native_keys(int argc, Value *args, VM *vm);
+static bool native_has(int argc, Value *args, VM *vm);
+static bool native_remove(int argc, Value *args, VM *vm);
+static bool native_range(int argc, Value *args, VM *vm);
+static bool next_element(int slot, bool *found, VM *vm);
+static bool call_method(Value receiver, StringObj *name, Value arg, Value *result, VM *vm);
+
+
+void init_vm(VM *vm) {
+    // gc may run on any allocation below, so everything it reads is set first
+    vm->stack = NULL;
+    vm->stack_capacity = 0;
+    vm->open_upvalues = NULL;
+    vm->open_top = 0;
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
+    reset_stack(vm);
+    vm->objs.next = NULL;
+    init_table(&vm->strings);
+    init_table(&vm->globals);
+    vm->init_string = NULL;
+    vm->iterate_string = NULL;
+    vm->iterator_value_string = NULL;
+    vm->compiler = NULL;
+    vm->fiber = NULL;
+    vm->fibers = NULL;
+    vm->callee_depth = 0;
+    vm->loop = NULL;
+
+    vm->gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->allocated_bytes = 0;
     // by default, threshold is 1MB
-    vm.next_gc = 1024 * 1024;
-    vm.gc_stack_cnt = 0;
+    vm->next_gc = 1024 * 1024;
+    vm->gc_stack_cnt = 0;
+    vm->max_depth = FRAMES_MAX;
+    vm->jit = false;
+
+    vm->open_upvalues = GROW_ARRAY(UpvalueObj*, NULL, 0, STACK_INIT, vm);
+    for (int i = 0; i < STACK_INIT; i++) vm->open_upvalues[i] = NULL;
+    vm->stack = GROW_ARRAY(Value, NULL, 0, STACK_INIT, vm);
+    vm->stack_capacity = STACK_INIT;
+    vm->frames = GROW_ARRAY(CallFrame, NULL, 0, FRAMES_INIT, vm);
+    vm->frame_capacity = FRAMES_INIT;
+    reset_stack(vm);
+
+    define_native("clock", native_clock, vm);
+    define_native("fiber", native_fiber, vm);
+    define_native("resume", native_resume, vm);
+    define_native("yield", native_yield, vm);
+    define_native("isDone", native_is_done, vm);
+    define_native("append", native_append, vm);
+    define_native("pop", native_pop, vm);
+    define_native("len", native_len, vm);
+    define_native("keys", native_keys, vm);
+    define_native("has", native_has, vm);
+    define_native("remove", native_remove, vm);
+    define_native("range", native_range, vm);
+    define_loop_natives(vm);
+    define_numeric_natives(vm);
+    vm->init_string = new_string("init", 4, vm);
+    vm->iterate_string = new_string("iterate", 7, vm);
+    vm->iterator_value_string = new_string("iteratorValue", 13, vm);
 }
 
-void free_vm() {
-    vm.init_string = NULL;
-    free_table(&vm.strings);
-    free_table(&vm.globals);
-    free_objs();
+void free_vm(VM *vm) {
+    free_loop(vm);
+    vm->init_string = NULL;
+    vm->iterate_string = NULL;
+    vm->iterator_value_string = NULL;
+    free_table(&vm->strings, vm);
+    free_table(&vm->globals, vm);
+    FREE_ARRAY(Value, vm->stack, vm->stack_capacity, vm);
+    FREE_ARRAY(UpvalueObj*, vm->open_upvalues, vm->stack_capacity, vm);
+    FREE_ARRAY(CallFrame, vm->frames, vm->frame_capacity, vm);
+    vm->stack = NULL;
+    vm->open_upvalues = NULL;
+    vm->open_top = 0;
+    vm->sp = NULL;
+    vm->stack_capacity = 0;
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
+    vm->fiber = NULL;
+    vm->fibers = NULL;
+    free_objs(vm);
+    free(vm->gray_stack);
+    vm->gray_stack = NULL;
+    vm->gray_capacity = 0;
 }
 
-InterpreterResult interpret(const char *source) {
-    init_vm();
-    FunctionObj *function = compile(source);
+InterpreterResult interpret(const char *source, CompileOptions *options, VM *vm) {
+    FunctionObj *function = compile(source, options, vm);
     if (function == NULL) return INTERPRET_COMPLIE_ERROR;
+    return interpret_function(function, options, vm);
+}
+
+InterpreterResult interpret_cached(const char *source, CompileOptions *options, VM *vm) {
+    FunctionObj *function = compile_cached(source, options, vm);
+    if (function == NULL) return INTERPRET_COMPLIE_ERROR;
+    return interpret_function(function, options, vm);
+}
+
+FunctionObj* compile_cached(const char *source, CompileOptions *options, VM *vm) {
+    FunctionObj *function = load_cache(source, options, vm);
+    if (function == NULL) {
+        function = compile(source, options, vm);
+        if (function != NULL) store_cache(source, options, function);
+    }
+    return function;
+}
+
+InterpreterResult interpret_function(FunctionObj *function, CompileOptions *options, VM *vm) {
+    // script of last run leaves its result on stack
+    reset_stack(vm);
     // push function to a gc stack
-    push_gc(OBJ_VALUE(function));
-    ClosureObj *closure = new_closure(function);
-    push(OBJ_VALUE(closure));
-    pop_gc();
-    invoke(closure, 0);
-    InterpreterResult rst = run();
-    free_vm();
-    return rst; 
+    push_gc(OBJ_VALUE(function), vm);
+    // bytecode in cache is always stack code, so translation happens right before execution
+    // frozen function is translated before freezing, if ever
+    if (options->register_vm && !function->obj.is_shared) translate_function(function, vm);
+    vm->jit = options->jit && jit_supported();
+    vm->max_depth = options->max_depth;
+    ClosureObj *closure = new_closure(function, vm);
+    push(OBJ_VALUE(closure), vm);
+    pop_gc(vm);
+    invoke(closure, 0, vm);
+    InterpreterResult rst = function->registers != NULL ? enter_register(0, vm) : run(0, vm);
+    // fibers spawned by script or parked on i/o run once it is done
+    if (rst == INTERPRET_OK) rst = run_loop(vm);
+    return rst;
 }
 
-static void reset_stack() {
-    vm.sp = vm.stack;
-    vm.frame_cnt = 0;
-    vm.upvalues.next = NULL;
+static void reset_stack(VM *vm) {
+    vm->sp = vm->stack;
+    vm->frame_cnt = 0;
+    for (int i = 0; i < vm->open_top; i++) vm->open_upvalues[i] = NULL;
+    vm->open_top = 0;
 }
 
-static InterpreterResult run() {
-    CallFrame *frame = &vm.frames[vm.frame_cnt - 1];
+// run frames on stack vm until frame at @param base returns, 0 runs the whole script
+static InterpreterResult run(int base, VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
 #define PEEK_BYTE()         (*frame->pc)
-#define READ_CONSTANT()     (frame->closure->function->chunk.constant.values[(*(uint8_t*)(read_bytes(1)))])
-#define READ_CONSTANT_16()  (frame->closure->function->chunk.constant.values[(*(uint16_t*)(read_bytes(2)))])
+#define READ_CONSTANT()     (frame->closure->function->chunk.constant.values[(*(uint8_t*)(read_bytes(1, vm)))])
+#define READ_CONSTANT_16()  (frame->closure->function->chunk.constant.values[(*(uint16_t*)(read_bytes(2, vm)))])
 #define BINARY_OP(val_type, op) do {\
-        Value b = pop();\
-        Value a = pop();\
+        Value b = pop(vm);\
+        Value a = pop(vm);\
         if (!IS_NUMBER(a) || !IS_NUMBER(b)) {\
-            runtime_error("operands must be numbers.");\
+            runtime_error(vm, "operands must be numbers.");\
             return INTERPRET_RUNTIME_ERROR;\
         }\
-        push(val_type(AS_NUMBER(a) op AS_NUMBER(b)));\
+        push(val_type(AS_NUMBER(a) op AS_NUMBER(b)), vm);\
+    } while (false)
+// frozen bytecode is shared by vms and never rewritten, it runs generic forms only
+#define QUICKEN(quickened) do {\
+        if (!frame->closure->function->obj.is_shared) *instruction = quickened;\
+    } while (false)
+// generic instruction that just saw two ints or two doubles is rewritten in place to its int or double form
+#define QUICKEN_BINARY_OP(int_quickened, quickened, val_type, op) do {\
+        Value b = peek(0, vm);\
+        Value a = peek(1, vm);\
+        if (IS_INT(a) && IS_INT(b)) QUICKEN(int_quickened);\
+        else if (IS_DOUBLE(a) && IS_DOUBLE(b)) QUICKEN(quickened);\
+        BINARY_OP(val_type, op);\
+    } while (false)
+// as above, ints stay ints unless result does not fit
+#define QUICKEN_ARITHMETIC_OP(ints, int_quickened, quickened, op) do {\
+        Value rst;\
+        if (ints(peek(1, vm), peek(0, vm), &rst)) {\
+            QUICKEN(int_quickened);\
+            vm->sp -= 2;\
+            push(rst, vm);\
+            break;\
+        }\
+        if (IS_DOUBLE(peek(0, vm)) && IS_DOUBLE(peek(1, vm))) QUICKEN(quickened);\
+        BINARY_OP(NUMBER_VALUE, op);\
+    } while (false)
+// guard of a quickened instruction, on a type miss it is rewritten back and executed again as generic
+#define NUMBER_OP(generic, val_type, op) do {\
+        Value b = peek(0, vm);\
+        Value a = peek(1, vm);\
+        if (!IS_DOUBLE(a) || !IS_DOUBLE(b)) {\
+            *instruction = generic;\
+            frame->pc = instruction;\
+            break;\
+        }\
+        vm->sp -= 2;\
+        push(val_type(AS_DOUBLE(a) op AS_DOUBLE(b)), vm);\
+    } while (false)
+// guards of int forms, a result out of int range is a miss as well
+#define INT_ARITHMETIC_OP(generic, ints) do {\
+        Value rst;\
+        if (!ints(peek(1, vm), peek(0, vm), &rst)) {\
+            *instruction = generic;\
+            frame->pc = instruction;\
+            break;\
+        }\
+        vm->sp -= 2;\
+        push(rst, vm);\
+    } while (false)
+#define INT_COMPARISON_OP(generic, op) do {\
+        Value b = peek(0, vm);\
+        Value a = peek(1, vm);\
+        if (!IS_INT(a) || !IS_INT(b)) {\
+            *instruction = generic;\
+            frame->pc = instruction;\
+            break;\
+        }\
+        vm->sp -= 2;\
+        push(BOOL_VALUE(AS_INT(a) op AS_INT(b)), vm);\
+    } while (false)
+// a callee compiled by jit or translated for register vm runs on its own until it returns
+// inside a fiber jit code is skipped, its bytecode stays on this loop so the fiber can yield from it
+#define ENTER_FRAME() do {\
+        frame = &vm->frames[vm->frame_cnt - 1];\
+        FunctionObj *callee = frame->closure->function;\
+        if ((callee->jit != NULL && vm->fiber == NULL) || callee->registers != NULL) {\
+            InterpreterResult rst = run_callee(vm);\
+            if (rst != INTERPRET_OK) return rst;\
+            frame = &vm->frames[vm->frame_cnt - 1];\
+        }\
+    } while (false)
+// callee and arguments replace current frame, which may be the one this loop was entered for
+// natives, classes and arity errors take normal call path, the following return passes result on
+#define TAIL_CALL(callee, arg_cnt) do {\
+        if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != (arg_cnt)) {\
+            if (!function_call((callee), (arg_cnt), vm)) return INTERPRET_RUNTIME_ERROR;\
+            ENTER_FRAME();\
+            break;\
+        }\
+        if (!reuse_frame(AS_CLOSURE(callee), (arg_cnt), vm)) return INTERPRET_RUNTIME_ERROR;\
+        frame = &vm->frames[vm->frame_cnt - 1];\
+        FunctionObj *reused = frame->closure->function;\
+        if ((reused->jit != NULL && vm->fiber == NULL) || reused->registers != NULL) {\
+            InterpreterResult rst = run_callee(vm);\
+            if (rst != INTERPRET_OK || vm->frame_cnt == base) return rst;\
+            frame = &vm->frames[vm->frame_cnt - 1];\
+        }\
     } while (false)
     for (;;) {
 #ifdef CLOX_DEBUG_TRACE_EXECUTION
         printf("stack trace:[");
-        for (Value *slot = vm.stack; slot < vm.sp; slot++) {
+        for (Value *slot = vm->stack; slot < vm->sp; slot++) {
             print_value(*slot);
             printf(" ");
         } 
@@ -102,296 +303,408 @@ static InterpreterResult run() {
         disassemble_instruction(&frame->closure->function->chunk, (int)(frame->pc - frame->closure->function->chunk.code));
 #endif // CLOX_DEBUG_TRACE_EXECUTION
         
-        uint8_t *instruction = read_bytes(1);
+        uint8_t *instruction = read_bytes(1, vm);
         if (instruction == NULL) {
-            runtime_error("running out of file.");
+            runtime_error(vm, "running out of file.");
             return INTERPRET_RUNTIME_ERROR;
         }
         switch (*instruction) {
             case CLOX_OP_RETURN: {
                 // return value
-                Value rst = pop();
-                close_upvalue(frame->slots);
-                vm.frame_cnt--;
-                if (vm.frame_cnt == 0) {
-                    // pop the entry function
-                    pop();
-                    return INTERPRET_OK;
-                }
-                // reset vm stack
-                vm.sp = frame->slots;
-                push(rst);
-                frame = &vm.frames[vm.frame_cnt - 1];
+                Value rst = pop(vm);
+                close_upvalue(frame->slots, vm);
+                vm->frame_cnt--;
+                // reset vm stack, result replaces callee, entry frame leaves it for a fiber to pass on
+                vm->sp = frame->slots;
+                push(rst, vm);
+                if (vm->frame_cnt == base) return INTERPRET_OK;
+                frame = &vm->frames[vm->frame_cnt - 1];
                 break;
             }
             case CLOX_OP_CONSTANT:
-                push(READ_CONSTANT());
+                push(READ_CONSTANT(), vm);
                 break;
             case CLOX_OP_CONSTANT_16:
-                push(READ_CONSTANT_16());
+                push(READ_CONSTANT_16(), vm);
                 break;
             case CLOX_OP_TRUE:
-                push(BOOL_VALUE(true));
+                push(BOOL_VALUE(true), vm);
                 break;
             case CLOX_OP_FALSE:
-                push(BOOL_VALUE(false));
+                push(BOOL_VALUE(false), vm);
                 break;
             case CLOX_OP_NIL:
-                push(NIL_VALUE);
+                push(NIL_VALUE, vm);
                 break;
             case CLOX_OP_NEGATE: {
-                Value value = pop();
+                Value value = pop(vm);
                 if (!IS_NUMBER(value)) {
-                    runtime_error("operand for '-' must be a number.");
+                    runtime_error(vm, "operand for '-' must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VALUE(-AS_NUMBER(value)));
+                Value rst;
+                push(negate_int(value, &rst) ? rst : NUMBER_VALUE(-AS_NUMBER(value)), vm);
                 break;
             }
             case CLOX_OP_ADD: {
-                Value b = pop();
-                Value a = pop();
-                if (IS_STRING(a) && IS_STRING(b)) {
+                Value b = pop(vm);
+                Value a = pop(vm);
+                Value rst;
+                if (add_ints(a, b, &rst)) {
+                    QUICKEN(CLOX_OP_ADD_INT);
+                    push(rst, vm);
+                }
+                else if (IS_STRING(a) && IS_STRING(b)) {
                     // append_string may trigger gc
-                    push_gc(a);
-                    push_gc(b);
-                    push(append_string(a, b));
-                    pop_gc();
-                    pop_gc();
+                    push_gc(a, vm);
+                    push_gc(b, vm);
+                    push(append_string(a, b, vm), vm);
+                    pop_gc(vm);
+                    pop_gc(vm);
+                }
+                else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    if (IS_DOUBLE(a) && IS_DOUBLE(b)) QUICKEN(CLOX_OP_ADD_NUM);
+                    push(NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b)), vm);
                 }
-                else if (IS_NUMBER(a) && IS_NUMBER(b)) push(NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b)));
                 else {
-                    runtime_error("operands must be two numbers or two strings.");
+                    runtime_error(vm, "operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
+            case CLOX_OP_ADD_NUM:
+                NUMBER_OP(CLOX_OP_ADD, NUMBER_VALUE, +);
+                break;
+            case CLOX_OP_ADD_INT:
+                INT_ARITHMETIC_OP(CLOX_OP_ADD, add_ints);
+                break;
             case CLOX_OP_SUBTRACT:
-                BINARY_OP(NUMBER_VALUE, -);
+                QUICKEN_ARITHMETIC_OP(subtract_ints, CLOX_OP_SUBTRACT_INT, CLOX_OP_SUBTRACT_NUM, -);
+                break;
+            case CLOX_OP_SUBTRACT_NUM:
+                NUMBER_OP(CLOX_OP_SUBTRACT, NUMBER_VALUE, -);
+                break;
+            case CLOX_OP_SUBTRACT_INT:
+                INT_ARITHMETIC_OP(CLOX_OP_SUBTRACT, subtract_ints);
                 break;
             case CLOX_OP_MULTIPLY:
-                BINARY_OP(NUMBER_VALUE, *);
+                QUICKEN_ARITHMETIC_OP(multiply_ints, CLOX_OP_MULTIPLY_INT, CLOX_OP_MULTIPLY_NUM, *);
+                break;
+            case CLOX_OP_MULTIPLY_NUM:
+                NUMBER_OP(CLOX_OP_MULTIPLY, NUMBER_VALUE, *);
+                break;
+            case CLOX_OP_MULTIPLY_INT:
+                INT_ARITHMETIC_OP(CLOX_OP_MULTIPLY, multiply_ints);
                 break;
             case CLOX_OP_DIVIDE:
+                // quotient of ints is a double, there is no int form
+                if (IS_DOUBLE(peek(0, vm)) && IS_DOUBLE(peek(1, vm))) QUICKEN(CLOX_OP_DIVIDE_NUM);
                 BINARY_OP(NUMBER_VALUE, /);
                 break;
+            case CLOX_OP_DIVIDE_NUM:
+                NUMBER_OP(CLOX_OP_DIVIDE, NUMBER_VALUE, /);
+                break;
             case CLOX_OP_MODULO: {
-                Value b = pop();
-                Value a = pop();
-                if (!IS_NUMBER(a) || !IS_NUMBER(b)) { 
-                    runtime_error("operands must be numbers.");
+                Value b = pop(vm);
+                Value a = pop(vm);
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtime_error(vm, "operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value rst;
+                if (!modulo_numbers(a, b, &rst)) {
+                    runtime_error(vm, "modulo by zero.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                int64_t x = (int64_t)AS_NUMBER(a);
-                int64_t y = (int64_t)AS_NUMBER(b);
-                push(NUMBER_VALUE(x % y));
+                push(rst, vm);
                 break;
             }
             case CLOX_OP_POWER: {
-                Value b = pop();
-                Value a = pop();
+                Value b = pop(vm);
+                Value a = pop(vm);
                 if (!IS_NUMBER(a) || !IS_NUMBER(b)) { 
-                    runtime_error("operands must be numbers.");
+                    runtime_error(vm, "operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(NUMBER_VALUE(pow(AS_NUMBER(a), AS_NUMBER(b))), vm);
+                break;
+            }
+            case CLOX_OP_BIT_AND:
+            case CLOX_OP_BIT_OR:
+            case CLOX_OP_BIT_XOR:
+            case CLOX_OP_SHIFT_LEFT:
+            case CLOX_OP_SHIFT_RIGHT:
+            case CLOX_OP_BIT_NOT: {
+                Value b = *instruction == CLOX_OP_BIT_NOT ? NIL_VALUE : pop(vm);
+                Value a = pop(vm);
+                Value rst;
+                const char *error = bitwise(*instruction, a, b, &rst);
+                if (error != NULL) {
+                    runtime_error(vm, "%s", error);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VALUE(pow(AS_NUMBER(a), AS_NUMBER(b))));
+                push(rst, vm);
                 break;
             }
             case CLOX_OP_NOT:
-                push(BOOL_VALUE(is_false(pop())));
+                push(BOOL_VALUE(is_false(pop(vm))), vm);
                 break;
             case CLOX_OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
+                Value b = pop(vm);
+                Value a = pop(vm);
                 if (PEEK_BYTE() == CLOX_OP_NOT) {
                     frame->pc++;
-                    push(BOOL_VALUE(!values_equal(a, b)));
-                } else push(BOOL_VALUE(values_equal(a, b))); 
+                    push(BOOL_VALUE(!values_equal(a, b)), vm);
+                } else push(BOOL_VALUE(values_equal(a, b)), vm); 
                 break;
             }
             case CLOX_OP_GREATER:
                 if (PEEK_BYTE() == CLOX_OP_NOT) {
                     frame->pc++;
-                    BINARY_OP(BOOL_VALUE, <=);
-                } else BINARY_OP(BOOL_VALUE, >);
+                    QUICKEN_BINARY_OP(CLOX_OP_GREATER_INT, CLOX_OP_GREATER_NUM, BOOL_VALUE, <=);
+                } else QUICKEN_BINARY_OP(CLOX_OP_GREATER_INT, CLOX_OP_GREATER_NUM, BOOL_VALUE, >);
+                break;
+            case CLOX_OP_GREATER_NUM:
+                // not is consumed only when guard passes, a miss restarts from comparison
+                if (PEEK_BYTE() == CLOX_OP_NOT) {
+                    frame->pc++;
+                    NUMBER_OP(CLOX_OP_GREATER, BOOL_VALUE, <=);
+                } else NUMBER_OP(CLOX_OP_GREATER, BOOL_VALUE, >);
+                break;
+            case CLOX_OP_GREATER_INT:
+                if (PEEK_BYTE() == CLOX_OP_NOT) {
+                    frame->pc++;
+                    INT_COMPARISON_OP(CLOX_OP_GREATER, <=);
+                } else INT_COMPARISON_OP(CLOX_OP_GREATER, >);
                 break;
             case CLOX_OP_LESS:
                 if (PEEK_BYTE() == CLOX_OP_NOT) {
                     frame->pc++;
-                    BINARY_OP(BOOL_VALUE, >=);
-                } else BINARY_OP(BOOL_VALUE, <);
+                    QUICKEN_BINARY_OP(CLOX_OP_LESS_INT, CLOX_OP_LESS_NUM, BOOL_VALUE, >=);
+                } else QUICKEN_BINARY_OP(CLOX_OP_LESS_INT, CLOX_OP_LESS_NUM, BOOL_VALUE, <);
+                break;
+            case CLOX_OP_LESS_NUM:
+                if (PEEK_BYTE() == CLOX_OP_NOT) {
+                    frame->pc++;
+                    NUMBER_OP(CLOX_OP_LESS, BOOL_VALUE, >=);
+                } else NUMBER_OP(CLOX_OP_LESS, BOOL_VALUE, <);
+                break;
+            case CLOX_OP_LESS_INT:
+                if (PEEK_BYTE() == CLOX_OP_NOT) {
+                    frame->pc++;
+                    INT_COMPARISON_OP(CLOX_OP_LESS, >=);
+                } else INT_COMPARISON_OP(CLOX_OP_LESS, <);
                 break;
             case CLOX_OP_PRINT:
-                print_value(pop());
+                print_value(pop(vm));
                 printf("\n");
                 break;
             case CLOX_OP_POP:
-                pop();
+                pop(vm);
                 break;
             case CLOX_OP_DEFINE_GLOBAL:{
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                Value value = pop();
+                Value value = pop(vm);
                 // put a pair may cause a gc
-                push_gc(value);
-                table_put(identifier, value, &vm.globals);
-                pop_gc();
+                push_gc(value, vm);
+                table_put(identifier, value, &vm->globals, vm);
+                pop_gc(vm);
                 break;
             }
             case CLOX_OP_DEFINE_GLOBAL_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                Value value = pop();
-                push_gc(value);
-                table_put(identifier, value, &vm.globals);
-                pop_gc();
+                Value value = pop(vm);
+                push_gc(value, vm);
+                table_put(identifier, value, &vm->globals, vm);
+                pop_gc(vm);
                 break;
             }
             case CLOX_OP_GET_GLOBAL: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
                 Value value;
-                if (!table_get(identifier, &value, &vm.globals)) {
-                    runtime_error("undefined variable '%s'.", identifier->str);
+                if (!table_get(identifier, &value, &vm->globals)) {
+                    runtime_error(vm, "undefined variable '%s'.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                push(value, vm);
                 break;
             }
             case CLOX_OP_GET_GLOBAL_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
                 Value value;
-                if (!table_get(identifier, &value, &vm.globals)) {
-                    runtime_error("undefined variable '%s'.", identifier->str);
+                if (!table_get(identifier, &value, &vm->globals)) {
+                    runtime_error(vm, "undefined variable '%s'.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                push(value, vm);
                 break;
             }
             case CLOX_OP_SET_GLOBAL: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                if (!table_get(identifier, NULL, &vm.globals)) {
-                    runtime_error("undefined variable '%s'.", identifier->str);
+                if (!table_get(identifier, NULL, &vm->globals)) {
+                    runtime_error(vm, "undefined variable '%s'.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                table_put(identifier, peek(0), &vm.globals);
+                table_put(identifier, peek(0, vm), &vm->globals, vm);
                 break;
             }
             case CLOX_OP_SET_GLOBAL_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                if (!table_get(identifier, NULL, &vm.globals)) {
-                    runtime_error("undefined variable '%s'.", identifier->str);
+                if (!table_get(identifier, NULL, &vm->globals)) {
+                    runtime_error(vm, "undefined variable '%s'.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                table_put(identifier, peek(0), &vm.globals);
+                table_put(identifier, peek(0, vm), &vm->globals, vm);
                 break;
             }
             case CLOX_OP_GET_LOCAL: {
-                uint8_t *slot = read_bytes(1);
-                push(frame->slots[*slot]);
+                uint8_t *slot = read_bytes(1, vm);
+                push(frame->slots[*slot], vm);
                 break;
             }
             case CLOX_OP_GET_LOCAL_16: {
-                uint16_t *slot = read_bytes(2);
-                push(frame->slots[*slot]);
+                uint16_t *slot = read_bytes(2, vm);
+                push(frame->slots[*slot], vm);
                 break;
             }
             case CLOX_OP_SET_LOCAL: {
-                uint8_t *slot = read_bytes(1);
-                frame->slots[*slot] = peek(0);
+                uint8_t *slot = read_bytes(1, vm);
+                frame->slots[*slot] = peek(0, vm);
                 break;
             }
             case CLOX_OP_SET_LOCAL_16: {
-                uint16_t *slot = read_bytes(2);
-                frame->slots[*slot] = peek(0);
+                uint16_t *slot = read_bytes(2, vm);
+                frame->slots[*slot] = peek(0, vm);
                 break;
             }
             case CLOX_OP_JUMP_IF_FALSE: {
-                uint16_t *offset = read_bytes(2);
-                if (is_false(peek(0))) frame->pc += *offset;
+                uint16_t *offset = read_bytes(2, vm);
+                Value condition = peek(0, vm);
+                if (IS_BOOL(condition)) QUICKEN(CLOX_OP_JUMP_IF_FALSE_BOOL);
+                if (is_false(condition)) frame->pc += *offset;
+                break;
+            }
+            case CLOX_OP_JUMP_IF_FALSE_BOOL: {
+                Value condition = peek(0, vm);
+                if (!IS_BOOL(condition)) {
+                    *instruction = CLOX_OP_JUMP_IF_FALSE;
+                    frame->pc = instruction;
+                    break;
+                }
+                uint16_t *offset = read_bytes(2, vm);
+                if (!AS_BOOL(condition)) frame->pc += *offset;
                 break;
             }
             case CLOX_OP_JUMP: {
-                uint16_t *offset = read_bytes(2);
+                uint16_t *offset = read_bytes(2, vm);
                 frame->pc += *offset;
                 break;
             }
             case CLOX_OP_LOOP: {
-                uint16_t *offset = read_bytes(2);
+                uint16_t *offset = read_bytes(2, vm);
                 frame->pc -= *offset;
                 break;
             }
             case CLOX_OP_CALL: {
                 // read arg count
-                uint8_t *arg_cnt = read_bytes(1);
+                uint8_t *arg_cnt = read_bytes(1, vm);
                 // invoke a function (add a call frame)
-                if (!function_call(peek(*arg_cnt), *arg_cnt)) return INTERPRET_RUNTIME_ERROR;
-                frame = &vm.frames[vm.frame_cnt - 1];
+                if (!function_call(peek(*arg_cnt, vm), *arg_cnt, vm)) return INTERPRET_RUNTIME_ERROR;
+                ENTER_FRAME();
+                break;
+            }
+            case CLOX_OP_TAIL_CALL: {
+                uint8_t *arg_cnt = read_bytes(1, vm);
+                Value callee = peek(*arg_cnt, vm);
+                TAIL_CALL(callee, *arg_cnt);
                 break;
             }
             case CLOX_OP_CLOSURE: {
                 FunctionObj *function = AS_FUNCTION(READ_CONSTANT()); 
-                ClosureObj *closure = new_closure(function);
+                ClosureObj *closure = new_closure(function, vm);
                 // early push (in case of gc)
-                push(OBJ_VALUE(closure));
-                for (int i = 0; i < closure->upvalue_cnt; i++) {
-                    uint8_t *is_local = read_bytes(1);
-                    uint16_t *idx = read_bytes(2);
-                    if (*is_local) closure->upvalues[i] = new_upvalue(frame->slots + *idx);
-                    else closure->upvalues[i] = frame->closure->upvalues[*idx];
-                }   
+                push(OBJ_VALUE(closure), vm);
+                capture_upvalues(closure, vm);
                 break;
             }
             case CLOX_OP_CLOSURE_16: {
                 FunctionObj *function = AS_FUNCTION(READ_CONSTANT_16());
-                ClosureObj *closure = new_closure(function);
+                ClosureObj *closure = new_closure(function, vm);
                 // early push (in case of gc)
-                push(OBJ_VALUE(closure));
-                for (int i = 0; i < closure->upvalue_cnt; i++) {
-                    uint8_t *is_local = read_bytes(1);
-                    uint16_t *idx = read_bytes(2);
-                    if (*is_local) closure->upvalues[i] = new_upvalue(frame->slots + *idx);
-                    else closure->upvalues[i] = frame->closure->upvalues[*idx];
-                }
+                push(OBJ_VALUE(closure), vm);
+                capture_upvalues(closure, vm);
                 break;
             }
             case CLOX_OP_GET_UPVALUE: {
-                uint8_t *idx = read_bytes(1);
-                push(*frame->closure->upvalues[*idx]->location);
+                uint8_t *idx = read_bytes(1, vm);
+                push(*frame->closure->upvalues[*idx]->location, vm);
                 break;
             }
             case CLOX_OP_GET_UPVALUE_16: {
-                uint16_t *idx = read_bytes(2);
-                push(*frame->closure->upvalues[*idx]->location);
+                uint16_t *idx = read_bytes(2, vm);
+                push(*frame->closure->upvalues[*idx]->location, vm);
                 break;
             }
             case CLOX_OP_SET_UPVALUE: {
-                uint8_t *idx = read_bytes(1);
-                *frame->closure->upvalues[*idx]->location = peek(0);
+                uint8_t *idx = read_bytes(1, vm);
+                *frame->closure->upvalues[*idx]->location = peek(0, vm);
                 break;
             }
             case CLOX_OP_SET_UPVALUE_16: {
-                uint16_t *idx = read_bytes(2);
-                *frame->closure->upvalues[*idx]->location = peek(0);
+                uint16_t *idx = read_bytes(2, vm);
+                *frame->closure->upvalues[*idx]->location = peek(0, vm);
+                break;
+            }
+            case CLOX_OP_GET_CAPTURE: {
+                uint8_t *idx = read_bytes(1, vm);
+                push(frame->closure->captures[*idx], vm);
+                break;
+            }
+            case CLOX_OP_GET_CAPTURE_16: {
+                uint16_t *idx = read_bytes(2, vm);
+                push(frame->closure->captures[*idx], vm);
+                break;
+            }
+            case CLOX_OP_GET_OUTER: {
+                uint8_t *slot = read_bytes(1, vm);
+                push(frame[-1].slots[*slot], vm);
+                break;
+            }
+            case CLOX_OP_GET_OUTER_16: {
+                uint16_t *slot = read_bytes(2, vm);
+                push(frame[-1].slots[*slot], vm);
+                break;
+            }
+            case CLOX_OP_SET_OUTER: {
+                uint8_t *slot = read_bytes(1, vm);
+                frame[-1].slots[*slot] = peek(0, vm);
+                break;
+            }
+            case CLOX_OP_SET_OUTER_16: {
+                uint16_t *slot = read_bytes(2, vm);
+                frame[-1].slots[*slot] = peek(0, vm);
                 break;
             }
             case CLOX_OP_CLOSE_UPVALUE: {
-                close_upvalue(vm.sp - 1);
-                pop();
+                close_upvalue(vm->sp - 1, vm);
+                pop(vm);
                 break;
             }
             case CLOX_OP_CLASS: {
-                ClassObj *klass = new_class(AS_STRING(READ_CONSTANT()));
-                push(OBJ_VALUE(klass));
+                ClassObj *klass = new_class(AS_STRING(READ_CONSTANT()), vm);
+                push(OBJ_VALUE(klass), vm);
                 break;
             }
             case CLOX_OP_CLASS_16: {
-                ClassObj *klass = new_class(AS_STRING(READ_CONSTANT_16()));
-                push(OBJ_VALUE(klass));
+                ClassObj *klass = new_class(AS_STRING(READ_CONSTANT_16()), vm);
+                push(OBJ_VALUE(klass), vm);
                 break;
             }
             case CLOX_OP_GET_PROPERTY: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                Value instance = peek(0);
+                Value instance = peek(0, vm);
                 if (!IS_INSTANCE(instance)) {
-                    runtime_error("only instances have properties.");
+                    runtime_error(vm, "only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 InstanceObj *instance_obj = AS_INSTANCE(instance);
@@ -399,21 +712,21 @@ static InterpreterResult run() {
                 
                 if (table_get(identifier, &value, &instance_obj->fields)) {
                     // discard instance
-                    pop();
-                    push(value);
+                    pop(vm);
+                    push(value, vm);
                     break;
                 }
 
-                if (bind_method(instance_obj->klass, identifier)) break;
+                if (bind_method(instance_obj->klass, identifier, vm)) break;
 
-                runtime_error("undefined property '%s'.", identifier->str);
+                runtime_error(vm, "undefined property '%s'.", identifier->str);
                 return INTERPRET_RUNTIME_ERROR;
             }
             case CLOX_OP_GET_PROPERTY_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                Value instance = peek(0);
+                Value instance = peek(0, vm);
                 if (!IS_INSTANCE(instance)) {
-                    runtime_error("only instances have properties.");
+                    runtime_error(vm, "only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 InstanceObj *instance_obj = AS_INSTANCE(instance);
@@ -421,179 +734,303 @@ static InterpreterResult run() {
 
                 if (table_get(identifier, &value, &instance_obj->fields)) {
                     // discard instance
-                    pop();
-                    push(value);
+                    pop(vm);
+                    push(value, vm);
                     break;
                 }
 
-                if (bind_method(instance_obj->klass, identifier)) break;
+                if (bind_method(instance_obj->klass, identifier, vm)) break;
 
-                runtime_error("undefined property '%s'.", identifier->str);
+                runtime_error(vm, "undefined property '%s'.", identifier->str);
                 return INTERPRET_RUNTIME_ERROR;
             }
             case CLOX_OP_SET_PROPERTY: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                Value instance = peek(1);
+                Value instance = peek(1, vm);
                 if (!IS_INSTANCE(instance)) {
-                    runtime_error("only instances have properties.");
+                    runtime_error(vm, "only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 InstanceObj *instance_obj = AS_INSTANCE(instance);
-                table_put(identifier, peek(0), &instance_obj->fields);
+                table_put(identifier, peek(0, vm), &instance_obj->fields, vm);
                 // pop set value
-                Value value = pop();
+                Value value = pop(vm);
                 // discard instance
-                pop();
+                pop(vm);
                 // push set value
-                push(value);
+                push(value, vm);
                 break;
             }
             case CLOX_OP_SET_PROPERTY_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                Value instance = peek(1);
+                Value instance = peek(1, vm);
                 if (!IS_INSTANCE(instance)) {
-                    runtime_error("only instances have properties.");
+                    runtime_error(vm, "only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 InstanceObj *instance_obj = AS_INSTANCE(instance);
-                table_put(identifier, peek(0), &instance_obj->fields);
+                table_put(identifier, peek(0, vm), &instance_obj->fields, vm);
                 // pop set value
-                Value value = pop();
+                Value value = pop(vm);
                 // discard instance
-                pop();
+                pop(vm);
                 // push set value
-                push(value);
+                push(value, vm);
                 break;
             }
             case CLOX_OP_METHOD: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                Value method = peek(0);
-                Value klass = peek(1);
+                Value method = peek(0, vm);
+                Value klass = peek(1, vm);
                 if (!IS_CLASS(klass)) {
-                    runtime_error("only classes have methods.");
+                    runtime_error(vm, "only classes have methods.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ClassObj *klass_obj = AS_CLASS(klass);
-                table_put(identifier, method, &klass_obj->methods);
+                table_put(identifier, method, &klass_obj->methods, vm);
                 // do not forget to discard method
-                pop();
+                pop(vm);
                 break;
             }
             case CLOX_OP_METHOD_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                Value method = peek(0);
-                Value klass = peek(1);
+                Value method = peek(0, vm);
+                Value klass = peek(1, vm);
                 if (!IS_CLASS(klass)) {
-                    runtime_error("only classes have methods.");
+                    runtime_error(vm, "only classes have methods.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ClassObj *klass_obj = AS_CLASS(klass);
-                table_put(identifier, method, &klass_obj->methods);
+                table_put(identifier, method, &klass_obj->methods, vm);
                 // do not forget to discard method
-                pop();
+                pop(vm);
                 break;
             }
-            case CLOX_OP_INVOKE: {
-                StringObj *identifier = AS_STRING(READ_CONSTANT());
-                uint8_t *arg_cnt = read_bytes(1);
-                Value instance = peek(*arg_cnt);
-                if (!IS_INSTANCE(instance)) {
-                    runtime_error("only instances have methods.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                
+            case CLOX_OP_INVOKE:
+            case CLOX_OP_INVOKE_16:
+            case CLOX_OP_TAIL_INVOKE:
+            case CLOX_OP_TAIL_INVOKE_16: {
+                uint8_t op = *instruction;
+                bool wide = op == CLOX_OP_INVOKE_16 || op == CLOX_OP_TAIL_INVOKE_16;
+                StringObj *identifier = AS_STRING(wide ? READ_CONSTANT_16() : READ_CONSTANT());
+                uint8_t *arg_cnt = read_bytes(1, vm);
                 Value method;
-                InstanceObj *instance_obj = AS_INSTANCE(instance);
-                if (table_get(identifier, &method, &instance_obj->fields)) {
-                    vm.sp[-1 - *arg_cnt] = method;
-                    if (!function_call(method, *arg_cnt)) return INTERPRET_RUNTIME_ERROR;
-                    // if (!IS_CLOSURE(method)) {
-                    //     runtime_error("only methods can be invoked.");
-                    //     return INTERPRET_RUNTIME_ERROR;
-                    // }
-                    // if (!invoke(AS_CLOSURE(method), *arg_cnt)) return INTERPRET_RUNTIME_ERROR;
-                } else {
-                    ClassObj *klass = instance_obj->klass;
-                    if (!table_get(identifier, &method, &klass->methods)) {
-                        runtime_error("undefined property '%s'.", identifier->str);
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    if (!invoke(AS_CLOSURE(method), *arg_cnt)) return INTERPRET_RUNTIME_ERROR;
+                if (!method_callee(identifier, *arg_cnt, &method, vm)) return INTERPRET_RUNTIME_ERROR;
+                if (op == CLOX_OP_TAIL_INVOKE || op == CLOX_OP_TAIL_INVOKE_16) {
+                    TAIL_CALL(method, *arg_cnt);
+                    break;
                 }
-                frame = &vm.frames[vm.frame_cnt - 1];
+                if (!function_call(method, *arg_cnt, vm)) return INTERPRET_RUNTIME_ERROR;
+                ENTER_FRAME();
                 break;
             }
             case CLOX_OP_INHERIT: {
-                Value superclass = peek(1);
+                Value superclass = peek(1, vm);
                 if (!IS_CLASS(superclass)) {
-                    runtime_error("superclass must be a class.");
+                    runtime_error(vm, "superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                Value subclass = peek(0);
+                Value subclass = peek(0, vm);
                 ClassObj *superklass = AS_CLASS(superclass);
                 ClassObj *subklass = AS_CLASS(subclass);
-                table_put_all(&subklass->methods, &superklass->methods);
-                pop(); // pop subclass
+                table_put_all(&subklass->methods, &superklass->methods, vm);
+                pop(vm); // pop subclass
                 break;
             }
             case CLOX_OP_GET_SUPER: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                Value superclass = pop();
+                Value superclass = pop(vm);
                 if (!IS_CLASS(superclass)) {
-                    runtime_error("superclass must be a class.");
+                    runtime_error(vm, "superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ClassObj *superklass = AS_CLASS(superclass);
                 Value method;
                 if (!table_get(identifier, &method, &superklass->methods)) {
-                    runtime_error("undefined property '%s'.", identifier->str);
+                    runtime_error(vm, "undefined property '%s'.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                if (!bind_method(superklass, identifier)) return INTERPRET_RUNTIME_ERROR;
+                if (!bind_method(superklass, identifier, vm)) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
             case CLOX_OP_GET_SUPER_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                Value superclass = pop();
+                Value superclass = pop(vm);
                 if (!IS_CLASS(superclass)) {
-                    runtime_error("superclass must be a class.");
+                    runtime_error(vm, "superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ClassObj *superklass = AS_CLASS(superclass);
                 Value method;
                 if (!table_get(identifier, &method, &superklass->methods)) {
-                    runtime_error("undefined property '%s'.", identifier->str);
+                    runtime_error(vm, "undefined property '%s'.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                if (!bind_method(superklass, identifier)) return INTERPRET_RUNTIME_ERROR;
+                if (!bind_method(superklass, identifier, vm)) return INTERPRET_RUNTIME_ERROR;
             }
             default: break;
             case CLOX_OP_INVOKE_SUPER: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT());
-                uint8_t *arg_cnt = read_bytes(1);
-                ClassObj *superclass = AS_CLASS(pop());
+                uint8_t *arg_cnt = read_bytes(1, vm);
+                ClassObj *superclass = AS_CLASS(pop(vm));
                 Value method;
                 if (!table_get(identifier, &method, &superclass->methods)) {
-                    runtime_error("undefined property '%s' in superclass.", identifier->str);
+                    runtime_error(vm, "undefined property '%s' in superclass.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                invoke(AS_CLOSURE(method), *arg_cnt);
-                frame = &vm.frames[vm.frame_cnt - 1];
+                invoke(AS_CLOSURE(method), *arg_cnt, vm);
+                ENTER_FRAME();
                 break;
             }
             case CLOX_OP_INVOKE_SUPER_16: {
                 StringObj *identifier = AS_STRING(READ_CONSTANT_16());
-                uint8_t *arg_cnt = read_bytes(1);
-                ClassObj *superclass = AS_CLASS(pop());
+                uint8_t *arg_cnt = read_bytes(1, vm);
+                ClassObj *superclass = AS_CLASS(pop(vm));
+                Value method;
+                if (!table_get(identifier, &method, &superclass->methods)) {
+                    runtime_error(vm, "undefined property '%s' in superclass.", identifier->str);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                invoke(AS_CLOSURE(method), *arg_cnt, vm);
+                ENTER_FRAME();
+                break;
+            }
+            case CLOX_OP_TAIL_INVOKE_SUPER:
+            case CLOX_OP_TAIL_INVOKE_SUPER_16: {
+                StringObj *identifier = AS_STRING(*instruction == CLOX_OP_TAIL_INVOKE_SUPER_16 ? READ_CONSTANT_16() : READ_CONSTANT());
+                uint8_t *arg_cnt = read_bytes(1, vm);
+                ClassObj *superclass = AS_CLASS(pop(vm));
                 Value method;
                 if (!table_get(identifier, &method, &superclass->methods)) {
-                    runtime_error("undefined property '%s' in superclass.", identifier->str);
+                    runtime_error(vm, "undefined property '%s' in superclass.", identifier->str);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                invoke(AS_CLOSURE(method), *arg_cnt);
-                frame = &vm.frames[vm.frame_cnt - 1];
+                TAIL_CALL(method, *arg_cnt);
+                break;
+            }
+            case CLOX_OP_LIST: {
+                uint8_t *item_cnt = read_bytes(1, vm);
+                // elements stay on stack until list is allocated
+                Value list = OBJ_VALUE(new_list(vm->sp - *item_cnt, *item_cnt, vm));
+                vm->sp -= *item_cnt;
+                push(list, vm);
+                break;
+            }
+            case CLOX_OP_MAP: {
+                uint8_t *pair_cnt = read_bytes(1, vm);
+                Value *pairs = vm->sp - 2 * *pair_cnt;
+                Value map = OBJ_VALUE(new_map(vm));
+                // table grows while pairs are still on stack
+                push_gc(map, vm);
+                for (int i = 0; i < *pair_cnt; i++) {
+                    if (!is_valid_key(pairs[2 * i])) {
+                        pop_gc(vm);
+                        runtime_error(vm, "map key cannot be nil or NaN.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    table_put_value(pairs[2 * i], pairs[2 * i + 1], &AS_MAP(map)->table, vm);
+                }
+                pop_gc(vm);
+                vm->sp = pairs;
+                push(map, vm);
+                break;
+            }
+            case CLOX_OP_GET_INDEX: {
+                Value item = NIL_VALUE;
+                if (IS_MAP(peek(1, vm))) {
+                    // a missing key results in nil
+                    table_get_value(peek(0, vm), &item, &AS_MAP(peek(1, vm))->table);
+                } else {
+                    int idx;
+                    if (!element_index(peek(1, vm), peek(0, vm), &idx, vm)) return INTERPRET_RUNTIME_ERROR;
+                    Value container = peek(1, vm);
+                    if (IS_LIST(container)) item = AS_LIST(container)->items.values[idx];
+                    else item = NUMBER_VALUE(AS_FLOAT64_ARRAY(container)->data[idx]);
+                }
+                vm->sp -= 2;
+                push(item, vm);
                 break;
             }
+            case CLOX_OP_SET_INDEX: {
+                if (IS_MAP(peek(2, vm))) {
+                    if (!is_valid_key(peek(1, vm))) {
+                        runtime_error(vm, "map key cannot be nil or NaN.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    // key and value stay on stack while table grows
+                    table_put_value(peek(1, vm), peek(0, vm), &AS_MAP(peek(2, vm))->table, vm);
+                } else {
+                    int idx;
+                    if (!element_index(peek(2, vm), peek(1, vm), &idx, vm)) return INTERPRET_RUNTIME_ERROR;
+                    Value container = peek(2, vm);
+                    if (IS_LIST(container)) AS_LIST(container)->items.values[idx] = peek(0, vm);
+                    else if (IS_NUMBER(peek(0, vm))) AS_FLOAT64_ARRAY(container)->data[idx] = AS_NUMBER(peek(0, vm));
+                    else {
+                        runtime_error(vm, "elements of float64 array must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+                Value item = pop(vm);
+                vm->sp -= 2;
+                push(item, vm);
+                break;
+            }
+            case CLOX_OP_FOR_ITER: {
+                uint16_t *slot = read_bytes(2, vm);
+                uint16_t *offset = read_bytes(2, vm);
+                // iterable, iterator state and loop variable, lists and ranges are walked right here
+                Value *iter = frame->slots + *slot;
+                if (IS_LIST(iter[0])) {
+                    ListObj *list = AS_LIST(iter[0]);
+                    int idx = IS_NIL(iter[1]) ? 0 : AS_INT(iter[1]) + 1;
+                    if (idx < list->items.count) {
+                        iter[1] = INT_VALUE(idx);
+                        iter[2] = list->items.values[idx];
+                        frame->pc -= *offset;
+                    }
+                    break;
+                }
+                if (IS_RANGE(iter[0])) {
+                    RangeObj *range = AS_RANGE(iter[0]);
+                    // counted from start, so a fractional step does not accumulate error
+                    double idx = IS_NIL(iter[1]) ? 0 : AS_NUMBER(iter[1]) + 1;
+                    double next = range->start + idx * range->step;
+                    if (range->step > 0 ? next < range->end : next > range->end) {
+                        iter[1] = NUMBER_VALUE(idx);
+                        iter[2] = canonical_number(next);
+                        frame->pc -= *offset;
+                    }
+                    break;
+                }
+                bool found;
+                if (!next_element(*slot, &found, vm)) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frame_cnt - 1];
+                if (found) frame->pc -= *offset;
+                break;
+            }
+            case CLOX_OP_INC_LOCAL: {
+                uint8_t *operands = read_bytes(3, vm);
+                Value *slot = &frame->slots[operands[0] | (operands[1] << 8)];
+                if (add_ints(*slot, INT_VALUE((int8_t)operands[2]), slot)) break;
+                if (!update_variable(vm, instruction)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case CLOX_OP_ADD_LOCAL_CONST: {
+                uint8_t *operands = read_bytes(4, vm);
+                Value *slot = &frame->slots[operands[0] | (operands[1] << 8)];
+                Value constant = frame->closure->function->chunk.constant.values[operands[2] | (operands[3] << 8)];
+                if (add_ints(*slot, constant, slot)) break;
+                if (!update_variable(vm, instruction)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case CLOX_OP_INC_OUTER:
+            case CLOX_OP_INC_UPVALUE:
+            case CLOX_OP_INC_GLOBAL:
+            case CLOX_OP_INC_PROPERTY:
+            case CLOX_OP_UPDATE_PROPERTY:
+                read_bytes(3, vm);
+                if (!update_variable(vm, instruction)) return INTERPRET_RUNTIME_ERROR;
+                break;
         }
     }
 #undef INCREMENT_PC
@@ -601,56 +1038,657 @@ static InterpreterResult run() {
 #undef READ_CONSTANT
 #undef READ_CONSTANT_16
 #undef BINARY_OP
+#undef QUICKEN_BINARY_OP
+#undef QUICKEN
+#undef NUMBER_OP
+#undef QUICKEN_ARITHMETIC_OP
+#undef INT_ARITHMETIC_OP
+#undef INT_COMPARISON_OP
+#undef ENTER_FRAME
+#undef TAIL_CALL
+}
+
+// run frames translated for register vm until frame at @param base returns, 0 runs the whole script
+static InterpreterResult run_register(int base, VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    Value *constants = frame->closure->function->chunk.constant.values;
+#define READ_BYTE()     (*frame->pc++)
+#define READ_SHORT()    (frame->pc += 2, (uint16_t)(frame->pc[-2] | (frame->pc[-1] << 8)))
+#define R(idx)          (frame->slots[idx])
+#define RK(operand)     ((operand) & REGISTER_CONSTANT ? constants[(operand) & ~REGISTER_CONSTANT] : frame->slots[operand])
+#define BINARY_OP(val_type, op) do {\
+        uint8_t dst = READ_BYTE();\
+        uint8_t x = READ_BYTE();\
+        uint8_t y = READ_BYTE();\
+        Value a = RK(x);\
+        Value b = RK(y);\
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {\
+            runtime_error(vm, "operands must be numbers.");\
+            return INTERPRET_RUNTIME_ERROR;\
+        }\
+        R(dst) = val_type(AS_NUMBER(a) op AS_NUMBER(b));\
+    } while (false)
+// ints stay ints unless result does not fit
+#define ARITHMETIC_OP(ints, op) do {\
+        uint8_t dst = READ_BYTE();\
+        uint8_t x = READ_BYTE();\
+        uint8_t y = READ_BYTE();\
+        Value a = RK(x);\
+        Value b = RK(y);\
+        if (ints(a, b, &R(dst))) break;\
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {\
+            runtime_error(vm, "operands must be numbers.");\
+            return INTERPRET_RUNTIME_ERROR;\
+        }\
+        R(dst) = NUMBER_VALUE(AS_NUMBER(a) op AS_NUMBER(b));\
+    } while (false)
+#define BITWISE_OP(instruction) do {\
+        uint8_t dst = READ_BYTE();\
+        uint8_t x = READ_BYTE();\
+        uint8_t y = READ_BYTE();\
+        const char *error = bitwise(instruction, RK(x), RK(y), &R(dst));\
+        if (error != NULL) {\
+            runtime_error(vm, "%s", error);\
+            return INTERPRET_RUNTIME_ERROR;\
+        }\
+    } while (false)
+    for (;;) {
+        switch (READ_BYTE()) {
+            case REG_OP_MOVE: {
+                uint8_t dst = READ_BYTE();
+                uint8_t src = READ_BYTE();
+                R(dst) = RK(src);
+                break;
+            }
+            case REG_OP_LOAD_CONSTANT: {
+                uint8_t dst = READ_BYTE();
+                R(dst) = constants[READ_BYTE()];
+                break;
+            }
+            case REG_OP_LOAD_NIL:
+                R(READ_BYTE()) = NIL_VALUE;
+                break;
+            case REG_OP_LOAD_TRUE:
+                R(READ_BYTE()) = BOOL_VALUE(true);
+                break;
+            case REG_OP_LOAD_FALSE:
+                R(READ_BYTE()) = BOOL_VALUE(false);
+                break;
+            case REG_OP_GET_GLOBAL: {
+                uint8_t dst = READ_BYTE();
+                StringObj *identifier = AS_STRING(constants[READ_BYTE()]);
+                if (!table_get(identifier, &R(dst), &vm->globals)) {
+                    runtime_error(vm, "undefined variable '%s'.", identifier->str);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case REG_OP_SET_GLOBAL: {
+                uint8_t src = READ_BYTE();
+                StringObj *identifier = AS_STRING(constants[READ_BYTE()]);
+                if (!table_get(identifier, NULL, &vm->globals)) {
+                    runtime_error(vm, "undefined variable '%s'.", identifier->str);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                table_put(identifier, RK(src), &vm->globals, vm);
+                break;
+            }
+            case REG_OP_DEFINE_GLOBAL: {
+                uint8_t src = READ_BYTE();
+                StringObj *identifier = AS_STRING(constants[READ_BYTE()]);
+                // value lives in a register or constant pool, both are reachable by gc
+                table_put(identifier, RK(src), &vm->globals, vm);
+                break;
+            }
+            case REG_OP_NEGATE: {
+                uint8_t dst = READ_BYTE();
+                uint8_t src = READ_BYTE();
+                Value value = RK(src);
+                if (!IS_NUMBER(value)) {
+                    runtime_error(vm, "operand for '-' must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!negate_int(value, &R(dst))) R(dst) = NUMBER_VALUE(-AS_NUMBER(value));
+                break;
+            }
+            case REG_OP_NOT: {
+                uint8_t dst = READ_BYTE();
+                uint8_t src = READ_BYTE();
+                R(dst) = BOOL_VALUE(is_false(RK(src)));
+                break;
+            }
+            case REG_OP_BIT_NOT: {
+                uint8_t dst = READ_BYTE();
+                uint8_t src = READ_BYTE();
+                const char *error = bitwise(CLOX_OP_BIT_NOT, RK(src), NIL_VALUE, &R(dst));
+                if (error != NULL) {
+                    runtime_error(vm, "%s", error);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case REG_OP_BIT_AND:
+                BITWISE_OP(CLOX_OP_BIT_AND);
+                break;
+            case REG_OP_BIT_OR:
+                BITWISE_OP(CLOX_OP_BIT_OR);
+                break;
+            case REG_OP_BIT_XOR:
+                BITWISE_OP(CLOX_OP_BIT_XOR);
+                break;
+            case REG_OP_SHIFT_LEFT:
+                BITWISE_OP(CLOX_OP_SHIFT_LEFT);
+                break;
+            case REG_OP_SHIFT_RIGHT:
+                BITWISE_OP(CLOX_OP_SHIFT_RIGHT);
+                break;
+            case REG_OP_INCREMENT: {
+                uint8_t dst = READ_BYTE();
+                Value delta = INT_VALUE((int8_t)READ_BYTE());
+                if (add_ints(R(dst), delta, &R(dst))) ;
+                else if (IS_NUMBER(R(dst))) R(dst) = NUMBER_VALUE(AS_NUMBER(R(dst)) + AS_INT(delta));
+                else {
+                    runtime_error(vm, "operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case REG_OP_ADD: {
+                uint8_t dst = READ_BYTE();
+                uint8_t x = READ_BYTE();
+                uint8_t y = READ_BYTE();
+                Value a = RK(x);
+                Value b = RK(y);
+                if (add_ints(a, b, &R(dst))) ;
+                else if (IS_NUMBER(a) && IS_NUMBER(b)) R(dst) = NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b));
+                // operands are reachable from registers or constant pool while append_string triggers gc
+                else if (IS_STRING(a) && IS_STRING(b)) R(dst) = append_string(a, b, vm);
+                else {
+                    runtime_error(vm, "operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case REG_OP_SUBTRACT:
+                ARITHMETIC_OP(subtract_ints, -);
+                break;
+            case REG_OP_MULTIPLY:
+                ARITHMETIC_OP(multiply_ints, *);
+                break;
+            case REG_OP_DIVIDE:
+                BINARY_OP(NUMBER_VALUE, /);
+                break;
+            case REG_OP_MODULO: {
+                uint8_t dst = READ_BYTE();
+                uint8_t x = READ_BYTE();
+                uint8_t y = READ_BYTE();
+                Value a = RK(x);
+                Value b = RK(y);
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtime_error(vm, "operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!modulo_numbers(a, b, &R(dst))) {
+                    runtime_error(vm, "modulo by zero.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case REG_OP_POWER: {
+                uint8_t dst = READ_BYTE();
+                uint8_t x = READ_BYTE();
+                uint8_t y = READ_BYTE();
+                Value a = RK(x);
+                Value b = RK(y);
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtime_error(vm, "operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                R(dst) = NUMBER_VALUE(pow(AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case REG_OP_EQUAL:
+            case REG_OP_NOT_EQUAL: {
+                bool negated = frame->pc[-1] == REG_OP_NOT_EQUAL;
+                uint8_t dst = READ_BYTE();
+                uint8_t x = READ_BYTE();
+                uint8_t y = READ_BYTE();
+                R(dst) = BOOL_VALUE(values_equal(RK(x), RK(y)) != negated);
+                break;
+            }
+            case REG_OP_GREATER:
+                BINARY_OP(BOOL_VALUE, >);
+                break;
+            case REG_OP_GREATER_EQUAL:
+                BINARY_OP(BOOL_VALUE, >=);
+                break;
+            case REG_OP_LESS:
+                BINARY_OP(BOOL_VALUE, <);
+                break;
+            case REG_OP_LESS_EQUAL:
+                BINARY_OP(BOOL_VALUE, <=);
+                break;
+            case REG_OP_PRINT: {
+                uint8_t src = READ_BYTE();
+                print_value(RK(src));
+                printf("\n");
+                break;
+            }
+            case REG_OP_JUMP: {
+                uint16_t offset = READ_SHORT();
+                frame->pc += offset;
+                break;
+            }
+            case REG_OP_LOOP: {
+                uint16_t offset = READ_SHORT();
+                frame->pc -= offset;
+                break;
+            }
+            case REG_OP_JUMP_IF_FALSE: {
+                uint8_t src = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                if (is_false(RK(src))) frame->pc += offset;
+                break;
+            }
+            case REG_OP_TAIL_CALL: {
+                uint8_t callee = frame->pc[0];
+                uint8_t arg_cnt = frame->pc[1];
+                if (IS_CLOSURE(R(callee)) && AS_CLOSURE(R(callee))->function->arity == arg_cnt) {
+                    frame->pc += 2;
+                    // callee and arguments replace current frame
+                    memmove(frame->slots, frame->slots + callee, sizeof(Value) * (arg_cnt + 1));
+                    vm->sp = frame->slots + arg_cnt + 1;
+                    vm->frame_cnt--;
+                    if (!invoke(AS_CLOSURE(frame->slots[0]), arg_cnt, vm)) return INTERPRET_RUNTIME_ERROR;
+                    frame = &vm->frames[vm->frame_cnt - 1];
+                    if (frame->closure->function->registers != NULL) {
+                        constants = frame->closure->function->chunk.constant.values;
+                        reset_registers(frame, arg_cnt + 1, vm);
+                        break;
+                    }
+                    InterpreterResult rst = run_callee(vm);
+                    if (rst != INTERPRET_OK || vm->frame_cnt == base) return rst;
+                    // caller is a register frame waiting in this loop
+                    Value *result = vm->sp - 1;
+                    frame = &vm->frames[vm->frame_cnt - 1];
+                    constants = frame->closure->function->chunk.constant.values;
+                    reset_registers(frame, result - frame->slots + 1, vm);
+                    break;
+                }
+                // natives, classes and arity errors take normal call path, the following return passes result on
+            }
+            // fall through
+            case REG_OP_CALL: {
+                uint8_t callee = READ_BYTE();
+                uint8_t arg_cnt = READ_BYTE();
+                int frame_cnt = vm->frame_cnt;
+                // callee frame takes callee and arguments as its first slots
+                vm->sp = frame->slots + callee + arg_cnt + 1;
+                if (!function_call(R(callee), arg_cnt, vm)) return INTERPRET_RUNTIME_ERROR;
+                if (vm->frame_cnt > frame_cnt) {
+                    if (vm->frames[vm->frame_cnt - 1].closure->function->registers != NULL) {
+                        frame = &vm->frames[vm->frame_cnt - 1];
+                        constants = frame->closure->function->chunk.constant.values;
+                        reset_registers(frame, frame->closure->function->arity + 1, vm);
+                        break;
+                    }
+                    InterpreterResult rst = run_callee(vm);
+                    if (rst != INTERPRET_OK) return rst;
+                    // frames may have moved during the call
+                    frame = &vm->frames[frame_cnt - 1];
+                }
+                // result is in callee register
+                reset_registers(frame, callee + 1, vm);
+                break;
+            }
+            case REG_OP_CLOSURE: {
+                uint8_t dst = READ_BYTE();
+                FunctionObj *function = AS_FUNCTION(constants[READ_BYTE()]);
+                R(dst) = OBJ_VALUE(new_closure(function, vm));
+                break;
+            }
+            case REG_OP_RETURN: {
+                uint8_t src = READ_BYTE();
+                Value rst = RK(src);
+                vm->frame_cnt--;
+                vm->sp = frame->slots;
+                push(rst, vm);
+                if (vm->frame_cnt == base) return INTERPRET_OK;
+                // caller is a register frame waiting in this loop
+                Value *result = vm->sp - 1;
+                frame = &vm->frames[vm->frame_cnt - 1];
+                constants = frame->closure->function->chunk.constant.values;
+                reset_registers(frame, result - frame->slots + 1, vm);
+                break;
+            }
+        }
+    }
+#undef READ_BYTE
+#undef READ_SHORT
+#undef R
+#undef RK
+#undef BINARY_OP
+#undef ARITHMETIC_OP
+#undef BITWISE_OP
+}
+
+// run frame just pushed by a call on register vm, registers past its arguments start cleared
+static InterpreterResult enter_register(int base, VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    reset_registers(frame, frame->closure->function->arity + 1, vm);
+    return run_register(base, vm);
+}
+
+// run frame pushed by a call until it returns, on the backend its function is prepared for
+static InterpreterResult run_callee(VM *vm) {
+    int frame_cnt = vm->frame_cnt;
+    InterpreterResult rst;
+    if (vm->callee_depth == CALLEE_DEPTH_MAX) {
+        // callee never started, trace begins at its caller as for a frame limit overflow
+        vm->frame_cnt--;
+        runtime_error(vm, "stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm->callee_depth++;
+    do {
+        FunctionObj *function = vm->frames[frame_cnt - 1].closure->function;
+        if (function->jit != NULL) rst = ((jit_func)function->jit)(frame_cnt - 1);
+        else if (function->registers != NULL) rst = enter_register(frame_cnt - 1, vm);
+        else rst = run(frame_cnt - 1, vm);
+        // compiled code exits leaving a frame replaced by tail call, it runs in next round
+    } while (rst == INTERPRET_OK && vm->frame_cnt == frame_cnt);
+    vm->callee_depth--;
+    return rst;
+}
+
+// registers from @param from may hold values of returned frames, they are cleared before gc can see them
+static void reset_registers(CallFrame *frame, int from, VM *vm) {
+    Value *end = frame->slots + frame->closure->function->registers->register_cnt;
+    for (Value *slot = frame->slots + from; slot < end; slot++) *slot = NIL_VALUE;
+    vm->sp = end;
 }
 
-void push_gc(Value value) {
-    if (vm.gc_stack_cnt == UINT8_COUNT) {
-        runtime_error("gc stack overflow.");
+void push_gc(Value value, VM *vm) {
+    if (vm->gc_stack_cnt == UINT8_COUNT) {
+        runtime_error(vm, "gc stack overflow.");
         return;
     }
-    vm.gc_stack[vm.gc_stack_cnt++] = value;
+    vm->gc_stack[vm->gc_stack_cnt++] = value;
+}
+
+Value pop_gc(VM *vm) {
+    return vm->gc_stack[--vm->gc_stack_cnt];
+}
+
+const char* bitwise(uint8_t instruction, Value a, Value b, Value *rst) {
+    int64_t x;
+    int64_t y = 0;
+    if (!as_exact_int(a, &x)) return instruction == CLOX_OP_BIT_NOT ? "operand for '~' must be an integer." : "operands must be integers.";
+    if (instruction != CLOX_OP_BIT_NOT && !as_exact_int(b, &y)) return "operands must be integers.";
+    int64_t n;
+    switch (instruction) {
+        case CLOX_OP_BIT_AND: n = x & y; break;
+        case CLOX_OP_BIT_OR:  n = x | y; break;
+        case CLOX_OP_BIT_XOR: n = x ^ y; break;
+        case CLOX_OP_BIT_NOT: n = ~x; break;
+        default:
+            if (y < 0 || y > 63) return "shift count must be in [0, 63].";
+            // bits shifted out on the left are dropped, shift right keeps sign
+            n = instruction == CLOX_OP_SHIFT_LEFT ? (int64_t)((uint64_t)x << y) : x >> y;
+            break;
+    }
+    if (!exact_int_value(n, rst)) return "result of bitwise operation is not exact as a number.";
+    return NULL;
+}
+
+bool update_variable(VM *vm, uint8_t *instruction) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    Value *constants = frame->closure->function->chunk.constant.values;
+    uint8_t op = instruction[0];
+    int idx = instruction[1] | (instruction[2] << 8);
+    StringObj *name = op == CLOX_OP_INC_GLOBAL || op == CLOX_OP_INC_PROPERTY || op == CLOX_OP_UPDATE_PROPERTY ? AS_STRING(constants[idx]) : NULL;
+    Table *table = NULL;
+    Value value;
+    switch (op) {
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_ADD_LOCAL_CONST:
+            value = frame->slots[idx];
+            break;
+        case CLOX_OP_INC_OUTER:
+            value = frame[-1].slots[idx];
+            break;
+        case CLOX_OP_INC_UPVALUE:
+            value = *frame->closure->upvalues[idx]->location;
+            break;
+        case CLOX_OP_INC_GLOBAL:
+            table = &vm->globals;
+            if (!table_get(name, &value, table)) {
+                runtime_error(vm, "undefined variable '%s'.", name->str);
+                return false;
+            }
+            break;
+        default: {
+            Value instance = peek(op == CLOX_OP_UPDATE_PROPERTY ? 1 : 0, vm);
+            if (!IS_INSTANCE(instance)) {
+                runtime_error(vm, "only instances have properties.");
+                return false;
+            }
+            // a method is never updated in place, only fields are
+            table = &AS_INSTANCE(instance)->fields;
+            if (!table_get(name, &value, table)) {
+                runtime_error(vm, "undefined property '%s'.", name->str);
+                return false;
+            }
+            break;
+        }
+    }
+
+    // both operands and result stay on stack while adding strings or putting a field may trigger gc
+    if (op == CLOX_OP_UPDATE_PROPERTY) {
+        Value operand = peek(0, vm);
+        vm->sp[-1] = value;
+        push(operand, vm);
+    } else {
+        Value delta = op == CLOX_OP_ADD_LOCAL_CONST ? constants[instruction[3] | (instruction[4] << 8)] : INT_VALUE((int8_t)instruction[3]);
+        // x++ and x-- of a string are no concatenation
+        if (op != CLOX_OP_ADD_LOCAL_CONST && !IS_NUMBER(value)) {
+            runtime_error(vm, "operands must be numbers.");
+            return false;
+        }
+        push(value, vm);
+        push(delta, vm);
+    }
+    if (!jit_binary(vm, op == CLOX_OP_UPDATE_PROPERTY ? instruction[3] : CLOX_OP_ADD, false)) return false;
+    Value rst = peek(0, vm);
+    switch (op) {
+        case CLOX_OP_INC_LOCAL:
+        case CLOX_OP_ADD_LOCAL_CONST:
+            frame->slots[idx] = rst;
+            break;
+        case CLOX_OP_INC_OUTER:
+            frame[-1].slots[idx] = rst;
+            break;
+        case CLOX_OP_INC_UPVALUE:
+            *frame->closure->upvalues[idx]->location = rst;
+            break;
+        default:
+            table_put(name, rst, table, vm);
+            break;
+    }
+    // instance is replaced by old value of a postfix update, or new value of a compound assignment
+    if (op == CLOX_OP_INC_PROPERTY) vm->sp[-2] = value;
+    else if (op == CLOX_OP_UPDATE_PROPERTY) vm->sp[-2] = rst;
+    pop(vm);
+    return true;
+}
+
+bool jit_binary(VM *vm, uint8_t instruction, bool negated) {
+    Value b = peek(0, vm);
+    Value a = peek(1, vm);
+    Value rst;
+    if (instruction == CLOX_OP_BIT_AND || instruction == CLOX_OP_BIT_OR || instruction == CLOX_OP_BIT_XOR ||
+        instruction == CLOX_OP_SHIFT_LEFT || instruction == CLOX_OP_SHIFT_RIGHT) {
+        const char *error = bitwise(instruction, a, b, &rst);
+        if (error != NULL) {
+            runtime_error(vm, "%s", error);
+            return false;
+        }
+    }
+    else if (instruction == CLOX_OP_EQUAL) rst = BOOL_VALUE(values_equal(a, b) != negated);
+    // operands stay in stack while append_string may trigger gc
+    else if (instruction == CLOX_OP_ADD && IS_STRING(a) && IS_STRING(b)) rst = append_string(a, b, vm);
+    else if (instruction == CLOX_OP_ADD && add_ints(a, b, &rst)) ;
+    else if (instruction == CLOX_OP_SUBTRACT && subtract_ints(a, b, &rst)) ;
+    else if (instruction == CLOX_OP_MULTIPLY && multiply_ints(a, b, &rst)) ;
+    else if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        runtime_error(vm, instruction == CLOX_OP_ADD ? "operands must be two numbers or two strings." : "operands must be numbers.");
+        return false;
+    } else {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (instruction) {
+            case CLOX_OP_ADD:      rst = NUMBER_VALUE(x + y); break;
+            case CLOX_OP_SUBTRACT: rst = NUMBER_VALUE(x - y); break;
+            case CLOX_OP_MULTIPLY: rst = NUMBER_VALUE(x * y); break;
+            case CLOX_OP_DIVIDE:   rst = NUMBER_VALUE(x / y); break;
+            case CLOX_OP_MODULO:
+                if (!modulo_numbers(a, b, &rst)) {
+                    runtime_error(vm, "modulo by zero.");
+                    return false;
+                }
+                break;
+            case CLOX_OP_POWER:    rst = NUMBER_VALUE(pow(x, y)); break;
+            case CLOX_OP_GREATER:  rst = BOOL_VALUE(negated ? x <= y : x > y); break;
+            default:               rst = BOOL_VALUE(negated ? x >= y : x < y); break;
+        }
+    }
+    vm->sp -= 2;
+    push(rst, vm);
+    return true;
+}
+
+bool jit_unary(VM *vm, uint8_t instruction) {
+    Value value = pop(vm);
+    if (instruction == CLOX_OP_NOT) push(BOOL_VALUE(is_false(value)), vm);
+    else if (instruction == CLOX_OP_BIT_NOT) {
+        Value rst;
+        const char *error = bitwise(instruction, value, NIL_VALUE, &rst);
+        if (error != NULL) {
+            runtime_error(vm, "%s", error);
+            return false;
+        }
+        push(rst, vm);
+    } else if (IS_NUMBER(value)) {
+        Value rst;
+        push(negate_int(value, &rst) ? rst : NUMBER_VALUE(-AS_NUMBER(value)), vm);
+    } else {
+        runtime_error(vm, "operand for '-' must be a number.");
+        return false;
+    }
+    return true;
+}
+
+void jit_print(VM *vm) {
+    print_value(pop(vm));
+    printf("\n");
+}
+
+bool jit_global(VM *vm, uint8_t instruction, StringObj *identifier) {
+    if (instruction == CLOX_OP_DEFINE_GLOBAL) {
+        // value stays in stack while put a pair may cause a gc
+        table_put(identifier, peek(0, vm), &vm->globals, vm);
+        pop(vm);
+        return true;
+    }
+    Value value;
+    if (!table_get(identifier, &value, &vm->globals)) {
+        runtime_error(vm, "undefined variable '%s'.", identifier->str);
+        return false;
+    }
+    if (instruction == CLOX_OP_GET_GLOBAL) push(value, vm);
+    else table_put(identifier, peek(0, vm), &vm->globals, vm);
+    return true;
+}
+
+void jit_upvalue(VM *vm, uint8_t instruction, int idx) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    switch (instruction) {
+        case CLOX_OP_GET_UPVALUE: push(*frame->closure->upvalues[idx]->location, vm); break;
+        case CLOX_OP_SET_UPVALUE: *frame->closure->upvalues[idx]->location = peek(0, vm); break;
+        case CLOX_OP_GET_OUTER: push(frame[-1].slots[idx], vm); break;
+        case CLOX_OP_GET_CAPTURE: push(frame->closure->captures[idx], vm); break;
+        case CLOX_OP_SET_OUTER: frame[-1].slots[idx] = peek(0, vm); break;
+        default:
+            close_upvalue(vm->sp - 1, vm);
+            pop(vm);
+            break;
+    }
+}
+
+bool jit_call(VM *vm, uint8_t arg_cnt) {
+    int frame_cnt = vm->frame_cnt;
+    if (!function_call(peek(arg_cnt, vm), arg_cnt, vm)) return false;
+    // natives and classes without initializer are done already
+    if (vm->frame_cnt > frame_cnt) return run_callee(vm) == INTERPRET_OK;
+    return true;
+}
+
+bool jit_tail_call(VM *vm, uint8_t arg_cnt) {
+    Value callee = peek(arg_cnt, vm);
+    // natives, classes and arity errors are called normally, then returned from on behalf of compiled code
+    if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != arg_cnt) {
+        if (!jit_call(vm, arg_cnt)) return false;
+        jit_return(vm);
+        return true;
+    }
+    // run_callee dispatches callee once compiled code exits
+    return reuse_frame(AS_CLOSURE(callee), arg_cnt, vm);
 }
 
-Value pop_gc() {
-    return vm.gc_stack[--vm.gc_stack_cnt];
+void jit_return(VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    Value rst = pop(vm);
+    close_upvalue(frame->slots, vm);
+    vm->frame_cnt--;
+    vm->sp = frame->slots;
+    if (vm->frame_cnt > 0) push(rst, vm);
 }
 
-static bool bind_method(ClassObj *klass, StringObj *method) {
+static bool bind_method(ClassObj *klass, StringObj *method, VM *vm) {
     Value method_value;
     if (!table_get(method, &method_value, &klass->methods)) return false;
-    MethodObj *method_obj = new_method(AS_INSTANCE(peek(0)), AS_CLOSURE(method_value));
+    MethodObj *method_obj = new_method(AS_INSTANCE(peek(0, vm)), AS_CLOSURE(method_value), vm);
     // discard instance
-    pop();
-    push(OBJ_VALUE(method_obj)); 
+    pop(vm);
+    push(OBJ_VALUE(method_obj), vm); 
     return true;
 }
 
-static bool function_call(Value function, uint8_t arg_cnt) {
+static bool function_call(Value function, uint8_t arg_cnt, VM *vm) {
     if (!IS_OBJ(function)) {
-        runtime_error("can only call functions and classes.");
+        runtime_error(vm, "can only call functions and classes.");
         return false;
     }
     switch(OBJ_TYPE(function)) {
         case OBJ_NATIVE: {
-            NativeObj *native = AS_NATIVE(function);
-            Value rst = native->native(arg_cnt, vm.sp - arg_cnt);
-            // discard arguments and native function name
-            vm.sp -= arg_cnt + 1;
-            push(rst);
+            Value *args = vm->sp - arg_cnt;
+            if (!AS_NATIVE(function)->native(arg_cnt, args, vm)) return false;
+            // discard arguments, result is in slot of native
+            vm->sp = args;
             return true;
         }
-        case OBJ_CLOSURE: return invoke(AS_CLOSURE(function), arg_cnt);
+        case OBJ_CLOSURE: return invoke(AS_CLOSURE(function), arg_cnt, vm);
         case OBJ_CLASS: {
             ClassObj *klass = AS_CLASS(function);
             // overwrite klass slot into instance slot
-            vm.sp[-arg_cnt - 1] = OBJ_VALUE(new_instance(klass));
+            vm->sp[-arg_cnt - 1] = OBJ_VALUE(new_instance(klass, vm));
             Value initializer;
-            if (table_get(vm.init_string, &initializer, &klass->methods)) return invoke(AS_CLOSURE(initializer), arg_cnt);
+            if (table_get(vm->init_string, &initializer, &klass->methods)) return invoke(AS_CLOSURE(initializer), arg_cnt, vm);
             else if (arg_cnt != 0) {
                 // lox do not force user to define a initializer
                 // but if user do not define a initializer
                 // then user can not pass ANY arguments to class 
-                runtime_error("expected 0 arguments but got %d.", arg_cnt);
+                runtime_error(vm, "expected 0 arguments but got %d.", arg_cnt);
                 return false;
             }
             return true;
@@ -659,8 +1697,8 @@ static bool function_call(Value function, uint8_t arg_cnt) {
             MethodObj *method = AS_METHOD(function);
             // overwrite function slot into receiver slot
 
-            vm.sp[-arg_cnt - 1] = (Value)method->receiver;
-            return invoke(method->closure, arg_cnt);
+            vm->sp[-arg_cnt - 1] = (Value)method->receiver;
+            return invoke(method->closure, arg_cnt, vm);
         }
         default: break;
     }
@@ -668,35 +1706,128 @@ static bool function_call(Value function, uint8_t arg_cnt) {
 }
 
 // all function in clox will be wrapped as closure at runtime
-static bool invoke(ClosureObj *closure, uint8_t arg_cnt) {
-    if (vm.frame_cnt == FRAMES_MAX) {
-        runtime_error("stack overflow.");
+static bool invoke(ClosureObj *closure, uint8_t arg_cnt, VM *vm) {
+    if (vm->frame_cnt == vm->max_depth) {
+        runtime_error(vm, "stack overflow.");
         return false;
     }
     if (closure->function->arity != arg_cnt) {
-        runtime_error("expected %d arguments but got %d.", closure->function->arity, arg_cnt);
+        runtime_error(vm, "expected %d arguments but got %d.", closure->function->arity, arg_cnt);
         return false;
     }
-    CallFrame *frame = &vm.frames[vm.frame_cnt++];
+    FunctionObj *function = closure->function;
+    if (vm->jit && function->hotness >= 0 && function->registers == NULL && ++function->hotness >= JIT_THRESHOLD) {
+        // compilation is attempted once, a function jit does not support stays on interpreter
+        function->hotness = -1;
+        push_gc(OBJ_VALUE(function), vm);
+        jit_compile(function, vm);
+        pop_gc(vm);
+    }
+    grow_stack(function, arg_cnt, vm);
+    CallFrame *frame = &vm->frames[vm->frame_cnt++];
     frame->closure = closure;
-    frame->pc = closure->function->chunk.code;
-    frame->slots = vm.sp - arg_cnt - 1;
+    RegisterChunk *registers = closure->function->registers;
+    frame->pc = registers != NULL ? registers->code : closure->function->chunk.code;
+    frame->slots = vm->sp - arg_cnt - 1;
+    return true;
+}
+
+// callee and arguments on top of stack replace current frame
+static bool reuse_frame(ClosureObj *closure, uint8_t arg_cnt, VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    Value *args = vm->sp - arg_cnt - 1;
+    close_upvalue(frame->slots, vm);
+    memmove(frame->slots, args, sizeof(Value) * (arg_cnt + 1));
+    vm->sp = frame->slots + arg_cnt + 1;
+    vm->frame_cnt--;
+    return invoke(closure, arg_cnt, vm);
+}
+
+// method @param name of receiver below @param arg_cnt arguments, a field holding a callable takes place of receiver
+static bool method_callee(StringObj *name, uint8_t arg_cnt, Value *callee, VM *vm) {
+    Value instance = peek(arg_cnt, vm);
+    if (!IS_INSTANCE(instance)) {
+        runtime_error(vm, "only instances have methods.");
+        return false;
+    }
+    InstanceObj *instance_obj = AS_INSTANCE(instance);
+    if (table_get(name, callee, &instance_obj->fields)) {
+        vm->sp[-1 - arg_cnt] = *callee;
+        return true;
+    }
+    if (!table_get(name, callee, &instance_obj->klass->methods)) {
+        runtime_error(vm, "undefined property '%s'.", name->str);
+        return false;
+    }
     return true;
 }
 
-static void close_upvalue(Value *slot) {
-    UpvalueObj *head = &vm.upvalues;
-    UpvalueObj *cur = head;
-    while (cur->next != NULL && cur->next->location >= slot) {
-        UpvalueObj *next = cur->next;
-        next->close = *next->location;
-        next->location = &next->close;
-        cur->next = next->next;
+/**
+ * make room for a frame of @param function, its callee and arguments are on top of stack
+ * frames and stack only grow here, so pointers into them stay valid between calls
+ */
+static void grow_stack(FunctionObj *function, uint8_t arg_cnt, VM *vm) {
+    if (vm->frame_cnt == vm->frame_capacity) {
+        int capacity = vm->frame_capacity;
+        vm->frame_capacity = GROW_CAPACITY(capacity);
+        vm->frames = GROW_ARRAY(CallFrame, vm->frames, capacity, vm->frame_capacity, vm);
+    }
+
+    int size = function->stack_size;
+    if (function->registers != NULL && function->registers->register_cnt > size) size = function->registers->register_cnt;
+    int needed = (int)(vm->sp - vm->stack) - arg_cnt - 1 + size;
+    if (needed <= vm->stack_capacity) return;
+    int capacity = vm->stack_capacity;
+    int grown = capacity;
+    while (grown < needed) grown = GROW_CAPACITY(grown);
+    // side table grows first, gc during growth of stack still sees locations into old one
+    vm->open_upvalues = GROW_ARRAY(UpvalueObj*, vm->open_upvalues, capacity, grown, vm);
+    for (int i = capacity; i < grown; i++) vm->open_upvalues[i] = NULL;
+    Value *old = vm->stack;
+    vm->stack = GROW_ARRAY(Value, vm->stack, capacity, grown, vm);
+    vm->stack_capacity = grown;
+    if (vm->stack == old) return;
+    // rebase pointers into moved stack
+    vm->sp = vm->stack + (vm->sp - old);
+    for (int i = 0; i < vm->frame_cnt; i++) vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old);
+    for (int i = 0; i < vm->open_top; i++) {
+        if (vm->open_upvalues[i] != NULL) vm->open_upvalues[i]->location = vm->stack + i;
+    }
+}
+
+// fill @param closure by upvalue descriptors following closure instruction of current frame
+static void capture_upvalues(ClosureObj *closure, VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+    int captured = 0;
+    for (int i = 0; i < closure->upvalue_cnt; i++) {
+        uint8_t *kind = read_bytes(1, vm);
+        uint16_t *idx = read_bytes(2, vm);
+        switch (*kind) {
+            case UPVALUE_LOCAL: closure->upvalues[i] = new_upvalue(frame->slots + *idx, vm); break;
+            case UPVALUE_ENCLOSING: closure->upvalues[i] = frame->closure->upvalues[*idx]; break;
+            case UPVALUE_COPY_LOCAL: closure->captures[captured++] = frame->slots[*idx]; break;
+            case UPVALUE_COPY_CAPTURE: closure->captures[captured++] = frame->closure->captures[*idx]; break;
+            // a slot accessed in place leaves upvalue empty
+            default: break;
+        }
     }
 }
 
-static void* read_bytes(int num) {
-    CallFrame *frame = &vm.frames[vm.frame_cnt - 1];
+// close upvalues open on @param slot and above, a frame returning with none open above it costs one comparison
+static void close_upvalue(Value *slot, VM *vm) {
+    int base = (int)(slot - vm->stack);
+    for (int i = base; i < vm->open_top; i++) {
+        UpvalueObj *upvalue = vm->open_upvalues[i];
+        if (upvalue == NULL) continue;
+        upvalue->close = *upvalue->location;
+        upvalue->location = &upvalue->close;
+        vm->open_upvalues[i] = NULL;
+    }
+    if (base < vm->open_top) vm->open_top = base;
+}
+
+static void* read_bytes(int num, VM *vm) {
+    CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
     Chunk *source = &frame->closure->function->chunk;
     void *rst = frame->pc;
     frame->pc += num;
@@ -707,55 +1838,388 @@ static void* read_bytes(int num) {
     return rst;
 }
 
-static void runtime_error(char *format, ...) {
+void runtime_error(VM *vm, char *format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputc('\n', stderr);
 
-    for (int i = vm.frame_cnt - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
+    for (int i = vm->frame_cnt - 1; i >= 0; i--) {
+        CallFrame *frame = &vm->frames[i];
         FunctionObj *function = frame->closure->function;
         // vm will increse pc after read an instruction
-        int offset = frame->pc - function->chunk.code - 1;
-        int line = function->chunk.line_info[offset];
-        int column = function->chunk.column_info[offset];
+        int offset;
+        // register code maps back to stack code it is translated from
+        if (function->registers != NULL) offset = function->registers->origins[frame->pc - function->registers->code - 1];
+        else offset = frame->pc - function->chunk.code - 1;
+        int line, column;
+        chunk_location(&function->chunk, offset, &line, &column);
         fprintf(stderr, "[line %d, column %d] in ", line, column);
         if (function->name == NULL) fprintf(stderr, "script\n"); 
         else fprintf(stderr, "%s\n", function->name->str);
     }
 
-    reset_stack();
+    // a closure may outlive a failed fiber, so its captured locals are moved off stack
+    close_upvalue(vm->stack, vm);
+    reset_stack(vm);
 }
 
-static void push(Value value) {
-    *vm.sp = value;
-    vm.sp++;
+static void push(Value value, VM *vm) {
+    *vm->sp = value;
+    vm->sp++;
 }
 
-static Value pop() {
-    vm.sp--;
-    return *vm.sp; 
+static Value pop(VM *vm) {
+    vm->sp--;
+    return *vm->sp; 
 }
 
-static Value peek(int distance) {
-    return vm.sp[-1 - distance];
+static Value peek(int distance, VM *vm) {
+    return vm->sp[-1 - distance];
 }
 
 // define a native unlikely trigger gc (as it starts before running vm), but i reserve the push&pop operations
-static void define_native(const char *name, native_func native) {
-    StringObj *native_name = new_string(name, strlen(name));
+void define_native(const char *name, native_func native, VM *vm) {
+    StringObj *native_name = new_string(name, strlen(name), vm);
     // new native may trigger gc 
-    push_gc(OBJ_VALUE(native_name));
-    Value native_function = OBJ_VALUE(new_native(native, native_name));
+    push_gc(OBJ_VALUE(native_name), vm);
+    Value native_function = OBJ_VALUE(new_native(native, native_name, vm));
     // table put may trigger gc
-    push_gc(native_function); 
-    table_put(native_name, native_function, &vm.globals);
-    pop_gc();
-    pop_gc();
+    push_gc(native_function, vm); 
+    table_put(native_name, native_function, &vm->globals, vm);
+    pop_gc(vm);
+    pop_gc(vm);
+}
+
+// exchange execution state of vm with the one saved in @param fiber, so a switch touches no value or frame
+static void swap_fiber(FiberObj *fiber, VM *vm) {
+#define SWAP(type, a, b) do { type tmp = a; a = b; b = tmp; } while (false)
+    SWAP(Value*, vm->stack, fiber->stack);
+    SWAP(int, vm->stack_capacity, fiber->stack_capacity);
+    SWAP(Value*, vm->sp, fiber->sp);
+    SWAP(CallFrame*, vm->frames, fiber->frames);
+    SWAP(int, vm->frame_cnt, fiber->frame_cnt);
+    SWAP(int, vm->frame_capacity, fiber->frame_capacity);
+    SWAP(UpvalueObj**, vm->open_upvalues, fiber->open_upvalues);
+    SWAP(int, vm->open_top, fiber->open_top);
+#undef SWAP
+}
+
+/**
+ * frames below a suspension never span two loops, so they continue on the loop of top frame
+ * @param result may point into stack of resumer, which stays put while fiber runs
+ */
+bool resume_fiber(FiberObj *fiber, Value value, Value *result, VM *vm) {
+    bool fresh = fiber->state == FIBER_NEW;
+    fiber->state = FIBER_RUNNING;
+    fiber->caller = vm->fiber;
+    fiber->depth = vm->callee_depth;
+    swap_fiber(fiber, vm);
+    vm->fiber = fiber;
+
+    InterpreterResult rst;
+    if (fresh) {
+        ClosureObj *closure = fiber->closure;
+        push(OBJ_VALUE(closure), vm);
+        if (closure->function->arity == 1) push(value, vm);
+        invoke(closure, closure->function->arity, vm);
+        rst = closure->function->registers != NULL ? enter_register(0, vm) : run(0, vm);
+    } else {
+        // value is result of the native fiber is suspended in
+        vm->sp[-1] = value;
+        CallFrame *frame = &vm->frames[vm->frame_cnt - 1];
+        if (frame->closure->function->registers != NULL) {
+            reset_registers(frame, vm->sp - frame->slots, vm);
+            rst = run_register(0, vm);
+        } else rst = run(0, vm);
+    }
+
+    bool suspended = fiber->state == FIBER_SUSPENDED || fiber->state == FIBER_WAITING;
+    Value out = NIL_VALUE;
+    if (suspended) out = fiber->transfer;
+    else {
+        if (rst == INTERPRET_OK) out = vm->sp[-1];
+        fiber->state = FIBER_DONE;
+    }
+    fiber->transfer = NIL_VALUE;
+    swap_fiber(fiber, vm);
+    vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    if (rst != INTERPRET_OK && !suspended) return false;
+    *result = out;
+    return true;
+}
+
+// a suspension under a frame run by run_callee would leave that frame without an interpreter loop to continue in
+bool can_suspend(VM *vm) {
+    return vm->fiber != NULL && vm->callee_depth == vm->fiber->depth;
+}
+
+bool suspend_fiber(FiberState state, Value value, Value *args, VM *vm) {
+    vm->fiber->transfer = value;
+    vm->fiber->state = state;
+    // stack is left as after call returns, result is filled in on resume
+    vm->sp = args;
+    // resume tells it from an error by state
+    return false;
+}
+
+static bool native_clock(int argc, Value *args, VM *vm) {
+    args[-1] = NUMBER_VALUE((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// fiber(fn) creates a fiber running fn on first resume, fn takes the value of that resume if it has a parameter
+static bool native_fiber(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        runtime_error(vm, "fiber expects a function of at most 1 parameter.");
+        return false;
+    }
+    args[-1] = OBJ_VALUE(new_fiber(AS_CLOSURE(args[0]), vm));
+    return true;
+}
+
+// resume(fiber, value) results in the value fiber yields or returns, value is the result of the yield fiber is suspended at
+static bool native_resume(int argc, Value *args, VM *vm) {
+    if (argc < 1 || argc > 2 || !IS_FIBER(args[0])) {
+        runtime_error(vm, "resume expects a fiber and an optional value.");
+        return false;
+    }
+    FiberObj *fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_RUNNING) {
+        runtime_error(vm, "cannot resume a running fiber.");
+        return false;
+    }
+    if (fiber->state == FIBER_WAITING) {
+        runtime_error(vm, "cannot resume a fiber waiting on event loop.");
+        return false;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtime_error(vm, "cannot resume a finished fiber.");
+        return false;
+    }
+    // error in fiber is reported already, it goes on in resumer
+    return resume_fiber(fiber, argc == 2 ? args[1] : NIL_VALUE, &args[-1], vm);
+}
+
+// yield(value) suspends running fiber, resume running it results in value
+static bool native_yield(int argc, Value *args, VM *vm) {
+    if (argc > 1) {
+        runtime_error(vm, "yield expects an optional value.");
+        return false;
+    }
+    if (vm->fiber == NULL) {
+        runtime_error(vm, "can only yield inside a fiber.");
+        return false;
+    }
+    if (!can_suspend(vm)) {
+        runtime_error(vm, "cannot yield across a call between interpreter and register vm or jit code.");
+        return false;
+    }
+    return suspend_fiber(FIBER_SUSPENDED, argc == 1 ? args[0] : NIL_VALUE, args, vm);
+}
+
+static bool native_is_done(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_FIBER(args[0])) {
+        runtime_error(vm, "isDone expects a fiber.");
+        return false;
+    }
+    args[-1] = BOOL_VALUE(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+// check @param container is a list or float64 array and @param index an integer in its bounds, which is stored into @param idx
+static bool element_index(Value container, Value index, int *idx, VM *vm) {
+    int count;
+    if (IS_LIST(container)) count = AS_LIST(container)->items.count;
+    else if (IS_FLOAT64_ARRAY(container)) count = AS_FLOAT64_ARRAY(container)->count;
+    else {
+        runtime_error(vm, "only lists, maps and float64 arrays can be indexed.");
+        return false;
+    }
+    if (IS_INT(index) && AS_INT(index) >= 0 && AS_INT(index) < count) {
+        *idx = AS_INT(index);
+        return true;
+    }
+    if (!IS_NUMBER(index)) {
+        runtime_error(vm, "index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < count)) {
+        runtime_error(vm, "index %g out of range [0, %d).", number, count);
+        return false;
+    }
+    if (number != (int)number) {
+        runtime_error(vm, "index %g is not an integer.", number);
+        return false;
+    }
+    *idx = (int)number;
+    return true;
+}
+
+// append(list, value) adds value to the end of list
+static bool native_append(int argc, Value *args, VM *vm) {
+    if (argc != 2 || !IS_LIST(args[0])) {
+        runtime_error(vm, "append expects a list and a value.");
+        return false;
+    }
+    // list and value stay in argument slots while buffer grows
+    write_value_array(&AS_LIST(args[0])->items, args[1], vm);
+    args[-1] = NIL_VALUE;
+    return true;
+}
+
+// pop(list) removes the last element of list and results in it
+static bool native_pop(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_LIST(args[0])) {
+        runtime_error(vm, "pop expects a list.");
+        return false;
+    }
+    ValueArray *items = &AS_LIST(args[0])->items;
+    if (items->count == 0) {
+        runtime_error(vm, "pop from an empty list.");
+        return false;
+    }
+    args[-1] = items->values[--items->count];
+    return true;
+}
+
+// len(value) results in number of elements of a list or float64 array, entries of a map or characters of a string
+static bool native_len(int argc, Value *args, VM *vm) {
+    if (argc == 1 && IS_LIST(args[0])) args[-1] = INT_VALUE(AS_LIST(args[0])->items.count);
+    else if (argc == 1 && IS_MAP(args[0])) args[-1] = INT_VALUE(AS_MAP(args[0])->table.count);
+    else if (argc == 1 && IS_FLOAT64_ARRAY(args[0])) args[-1] = INT_VALUE(AS_FLOAT64_ARRAY(args[0])->count);
+    else if (argc == 1 && IS_STRING(args[0])) args[-1] = INT_VALUE(AS_STRING(args[0])->length);
+    else {
+        runtime_error(vm, "len expects a list, a map, a float64 array or a string.");
+        return false;
+    }
+    return true;
+}
+
+// keys(map) results in a list of keys of map, in no particular order
+static bool native_keys(int argc, Value *args, VM *vm) {
+    if (argc != 1 || !IS_MAP(args[0])) {
+        runtime_error(vm, "keys expects a map.");
+        return false;
+    }
+    Table *table = &AS_MAP(args[0])->table;
+    ListObj *list = new_list(NULL, 0, vm);
+    // in slot of native, list survives its buffer growing
+    args[-1] = OBJ_VALUE(list);
+    for (int i = table_next(table, 0); i != -1; i = table_next(table, i + 1)) {
+        write_value_array(&list->items, table->entries[i].key, vm);
+    }
+    return true;
+}
+
+// has(map, key) results in whether key is in map
+static bool native_has(int argc, Value *args, VM *vm) {
+    if (argc != 2 || !IS_MAP(args[0])) {
+        runtime_error(vm, "has expects a map and a key.");
+        return false;
+    }
+    args[-1] = BOOL_VALUE(table_get_value(args[1], NULL, &AS_MAP(args[0])->table));
+    return true;
+}
+
+// remove(map, key) removes key from map and results in its value, nil if it is not there
+static bool native_remove(int argc, Value *args, VM *vm) {
+    if (argc != 2 || !IS_MAP(args[0])) {
+        runtime_error(vm, "remove expects a map and a key.");
+        return false;
+    }
+    Value value = NIL_VALUE;
+    table_remove_value(args[1], &value, &AS_MAP(args[0])->table);
+    args[-1] = value;
+    return true;
+}
+
+// range(end), range(start, end) or range(start, end, step), start defaults to 0 and step to 1
+static bool native_range(int argc, Value *args, VM *vm) {
+    bool numbers = argc >= 1 && argc <= 3;
+    for (int i = 0; numbers && i < argc; i++) numbers = IS_NUMBER(args[i]);
+    if (!numbers) {
+        runtime_error(vm, "range expects 1 to 3 numbers.");
+        return false;
+    }
+    double start = argc == 1 ? 0 : AS_NUMBER(args[0]);
+    double end = argc == 1 ? AS_NUMBER(args[0]) : AS_NUMBER(args[1]);
+    double step = argc == 3 ? AS_NUMBER(args[2]) : 1;
+    if (step == 0 || step != step) {
+        runtime_error(vm, "range step must be a non-zero number.");
+        return false;
+    }
+    args[-1] = OBJ_VALUE(new_range(start, end, step, vm));
+    return true;
 }
 
-static Value native_clock(int argc, Value *args) {
-    return NUMBER_VALUE((double)clock() / CLOCKS_PER_SEC);
-}
\ No newline at end of file
+/**
+ * advance iterator of the for-in loop whose iterable is at @param slot of current frame,
+ * @param found tells if loop variable is set to next element, returns false after reporting a runtime error
+ */
+static bool next_element(int slot, bool *found, VM *vm) {
+    Value *iter = vm->frames[vm->frame_cnt - 1].slots + slot;
+    Value iterable = iter[0];
+    *found = false;
+    if (IS_FLOAT64_ARRAY(iterable)) {
+        Float64ArrayObj *array = AS_FLOAT64_ARRAY(iterable);
+        int idx = IS_NIL(iter[1]) ? 0 : AS_INT(iter[1]) + 1;
+        if (idx >= array->count) return true;
+        iter[1] = INT_VALUE(idx);
+        iter[2] = NUMBER_VALUE(array->data[idx]);
+    } else if (IS_MAP(iterable)) {
+        // keys of a map, state is index of entry
+        Table *table = &AS_MAP(iterable)->table;
+        int idx = table_next(table, IS_NIL(iter[1]) ? 0 : AS_INT(iter[1]) + 1);
+        if (idx == -1) return true;
+        iter[1] = INT_VALUE(idx);
+        iter[2] = table->entries[idx].key;
+    } else if (IS_FIBER(iterable)) {
+        // values a fiber yields, the one it returns ends the loop
+        FiberObj *fiber = AS_FIBER(iterable);
+        if (fiber->state == FIBER_DONE) return true;
+        if (fiber->state == FIBER_RUNNING || fiber->state == FIBER_WAITING) {
+            runtime_error(vm, "cannot iterate a running fiber or one waiting on event loop.");
+            return false;
+        }
+        Value element;
+        if (!resume_fiber(fiber, NIL_VALUE, &element, vm)) return false;
+        if (fiber->state == FIBER_DONE) return true;
+        // stack of this frame stays put while fiber runs
+        iter[2] = element;
+    } else if (IS_INSTANCE(iterable)) {
+        // iterate(state) results in next state, false or nil once done, and iteratorValue(state) in element of it
+        Value state;
+        if (!call_method(iterable, vm->iterate_string, iter[1], &state, vm)) return false;
+        // stack may be moved by the call
+        iter = vm->frames[vm->frame_cnt - 1].slots + slot;
+        iter[1] = state;
+        if (is_false(state)) return true;
+        Value element;
+        if (!call_method(iterable, vm->iterator_value_string, state, &element, vm)) return false;
+        iter = vm->frames[vm->frame_cnt - 1].slots + slot;
+        iter[2] = element;
+    } else {
+        runtime_error(vm, "only lists, maps, float64 arrays, ranges, fibers and instances can be iterated.");
+        return false;
+    }
+    *found = true;
+    return true;
+}
+
+// call method @param name of instance @param receiver with one argument until it returns
+static bool call_method(Value receiver, StringObj *name, Value arg, Value *result, VM *vm) {
+    Value method;
+    if (!table_get(name, &method, &AS_INSTANCE(receiver)->klass->methods)) {
+        runtime_error(vm, "undefined method '%s' of iterator protocol.", name->str);
+        return false;
+    }
+    push(receiver, vm);
+    push(arg, vm);
+    if (!invoke(AS_CLOSURE(method), 1, vm) || run_callee(vm) != INTERPRET_OK) return false;
+    *result = pop(vm);
+    return true;
+}
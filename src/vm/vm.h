@@ -3,42 +3,68 @@
 #include "chunk/chunk.h"
 #include "object/object.h"
 #include "table/table.h"
+#include "complier/compiler.h"
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+// default limit of call depth
 #define FRAMES_MAX (UINT8_COUNT)
 #define MAX_STACK ((FRAMES_MAX) * (UINT8_COUNT))
+// limit of run_callee nesting, each level holds c frames of compiled code or an interpreter loop
+// so it bounds native stack regardless of call depth
+#define CALLEE_DEPTH_MAX 2048
+// initial capacity of frames and stack, both grow on calls
+#define FRAMES_INIT 8
+#define STACK_INIT 64
 
-typedef struct {
-    ClosureObj *closure;
-    uint8_t *pc;
-    Value *slots; 
-} CallFrame;
+// event loop, see loop/loop.h
+typedef struct Loop Loop;
 
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+struct VM {
+    CallFrame *frames;
     int frame_cnt;
-    Value stack[MAX_STACK];
+    int frame_capacity;
+    // calls deeper than it are stack overflow
+    int max_depth;
+    Value *stack;
+    int stack_capacity;
     Value *sp;
     // a linked list with dummy head
     Obj objs;
     Table strings;
     Table globals;
-    // a linked list with dummy head
-    UpvalueObj upvalues;
+    // parallel to stack, upvalue open on each slot, NULL if there is none
+    UpvalueObj **open_upvalues;
+    // no upvalue is open on a slot at or above it
+    int open_top;
     // class initializer name 
     StringObj *init_string;
+    // method names of iterator protocol of for-in loops
+    StringObj *iterate_string;
+    StringObj *iterator_value_string;
 
-    // gray stack for traversal
-    Obj* gray_stack[MAX_STACK];
+    // gray stack for traversal, grown by plain realloc so growing it never starts another gc
+    Obj **gray_stack;
     int gray_count;
-    // int gray_capacity;
+    int gray_capacity;
     // fields trigger gc
     size_t allocated_bytes;
     size_t next_gc;
     // a temporary stack for gc
     Value gc_stack[UINT8_COUNT];
     int gc_stack_cnt;
-} VM;
+    // compile hot functions into machine code
+    bool jit;
+    // compilation in progress, NULL if none
+    Compiler *compiler;
+    // fiber running now, NULL for script itself
+    FiberObj *fiber;
+    // all fibers alive, linked by next_fiber
+    FiberObj *fibers;
+    // nesting of run_callee, a fiber yields only at the nesting it was resumed at
+    int callee_depth;
+    // created by first native needs it, NULL before
+    Loop *loop;
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -47,14 +73,50 @@ typedef enum {
     INTERPRET_DEBUG,
 } InterpreterResult;
 
-extern VM vm;
-
-void init_vm();
-void free_vm();
-InterpreterResult interpret(const char *source);
+// instances share nothing, so any number of them may live in one process
+void init_vm(VM *vm);
+void free_vm(VM *vm);
+// compile and run @param source on @param vm, globals of earlier runs stay visible
+InterpreterResult interpret(const char *source, CompileOptions *options, VM *vm);
+// same as interpret, but reuse compiled bytecode from cache directory if source is unchanged
+InterpreterResult interpret_cached(const char *source, CompileOptions *options, VM *vm);
+// compile @param source, or load it from cache directory if unchanged, returns NULL on compile error
+FunctionObj* compile_cached(const char *source, CompileOptions *options, VM *vm);
+// run script @param function on @param vm, it may be owned by vm or frozen by freeze_function
+InterpreterResult interpret_function(FunctionObj *function, CompileOptions *options, VM *vm);
+// report a runtime error with trace of frames, a native calls it before returning false
+void runtime_error(VM *vm, char *format, ...);
+// make @param native a global named @param name
+void define_native(const char *name, native_func native, VM *vm);
+// run @param fiber from where it stopped with @param value, until it yields, waits or returns
+// the value it passes out is stored into @param result, returns false on runtime error in fiber
+bool resume_fiber(FiberObj *fiber, Value value, Value *result, VM *vm);
+// a native called inside a fiber at the nesting it was resumed at can suspend it
+bool can_suspend(VM *vm);
+// suspend running fiber in @param state passing @param value to its resumer, for native at @param args to return
+// the value it is resumed with becomes result of the native call, false it returns unwinds interpreter loop without error
+bool suspend_fiber(FiberState state, Value value, Value *args, VM *vm);
 // push a value into gc stack
-void push_gc(Value value);
+void push_gc(Value value, VM *vm);
 // pop a value from gc stack
-Value pop_gc();
+Value pop_gc(VM *vm);
+
+// evaluate bitwise @param instruction on exact integers (@param b is ignored by BIT_NOT), returns NULL or message of the error
+const char* bitwise(uint8_t instruction, Value a, Value b, Value *rst);
+// run in place update @param instruction (INC_LOCAL and the like) on current frame for interpreter and jit alike
+// its value is added as a generic add does, returns false on runtime error
+bool update_variable(VM *vm, uint8_t *instruction);
+
+// entry points of jit compiled code, each runs one instruction on current frame
+// vm comes first so compiled code passes it in the same register to every helper
+// the ones returning bool return false on runtime error
+bool jit_binary(VM *vm, uint8_t instruction, bool negated);
+bool jit_unary(VM *vm, uint8_t instruction);
+void jit_print(VM *vm);
+bool jit_global(VM *vm, uint8_t instruction, StringObj *identifier);
+void jit_upvalue(VM *vm, uint8_t instruction, int idx);
+bool jit_call(VM *vm, uint8_t arg_cnt);
+bool jit_tail_call(VM *vm, uint8_t arg_cnt);
+void jit_return(VM *vm);
 
 #endif // clox_vm_h
\ No newline at end of file
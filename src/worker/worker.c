@@ -0,0 +1,114 @@
+#include "worker.h"
+// added for pthread_create
+#include <pthread.h>
+// added for atomic_fetch_add
+#include <stdatomic.h>
+// added for malloc
+#include <stdlib.h>
+// added for fprintf
+#include <stdio.h>
+// added for clock_gettime
+#include <time.h>
+// added for strcmp
+#include <string.h>
+// added for freeze_function
+#include "shared/shared.h"
+// added for translate_function
+#include "register/register.h"
+
+/**
+ * jobs are a fixed array, a worker claims next one by bumping an atomic index, so taking a job never locks
+ * scripts share nothing but options and frozen bytecode
+ */
+typedef struct {
+    Job *jobs;
+    int job_cnt;
+    atomic_int next;
+    CompileOptions *options;
+} JobQueue;
+
+static void freeze_jobs(Job *jobs, int job_cnt, CompileOptions *options);
+static void* work(void *arg);
+static double now();
+
+void run_workers(Job *jobs, int job_cnt, int worker_cnt, CompileOptions *options) {
+    JobQueue queue = { .jobs = jobs, .job_cnt = job_cnt, .options = options };
+    atomic_init(&queue.next, 0);
+    if (worker_cnt > job_cnt) worker_cnt = job_cnt;
+    if (worker_cnt < 1) worker_cnt = 1;
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * worker_cnt);
+    if (threads == NULL) exit(71);
+
+    double start = now();
+    // jit code is bound to one vm, so with jit each worker compiles its own copy instead
+    bool share = !options->jit;
+    if (share) freeze_jobs(jobs, job_cnt, options);
+    int started = 0;
+    // caller is a worker too, it also takes over jobs of threads failed to start
+    while (started < worker_cnt - 1 && pthread_create(&threads[started], NULL, work, &queue) == 0) started++;
+    work(&queue);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+    free(threads);
+    if (share) free_shared();
+
+    int failed = 0;
+    for (int i = 0; i < job_cnt; i++) if (jobs[i].result != INTERPRET_OK) failed++;
+    fprintf(stderr, "%d scripts (%d failed) on %d workers in %.3fs, %.1f scripts/s\n",
+            job_cnt, failed, started + 1, elapsed, elapsed > 0 ? job_cnt / elapsed : 0.0);
+}
+
+// compile every distinct source once on a vm of caller, then freeze it so all workers run one copy
+static void freeze_jobs(Job *jobs, int job_cnt, CompileOptions *options) {
+    VM *vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL) exit(71);
+    init_vm(vm);
+    for (int i = 0; i < job_cnt; i++) {
+        Job *job = &jobs[i];
+        job->function = NULL;
+        job->result = INTERPRET_OK;
+        for (int j = 0; j < i && job->function == NULL; j++) {
+            if (jobs[j].function != NULL && strcmp(jobs[j].source, job->source) == 0) job->function = jobs[j].function;
+        }
+        if (job->function != NULL) continue;
+
+        FunctionObj *function = compile_cached(job->source, options, vm);
+        if (function == NULL) {
+            job->result = INTERPRET_COMPLIE_ERROR;
+            continue;
+        }
+        push_gc(OBJ_VALUE(function), vm);
+        if (options->register_vm) translate_function(function, vm);
+        job->function = freeze_function(function);
+        pop_gc(vm);
+    }
+    // strings interned by this vm are not in the pool, it must not outlive freezing
+    free_vm(vm);
+    free(vm);
+}
+
+static void* work(void *arg) {
+    JobQueue *queue = (JobQueue*)arg;
+    VM *vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL) exit(71);
+    for (;;) {
+        int idx = atomic_fetch_add(&queue->next, 1);
+        if (idx >= queue->job_cnt) break;
+        Job *job = &queue->jobs[idx];
+        // compile error of a frozen job is reported while freezing
+        if (job->result != INTERPRET_OK) continue;
+        // a fresh vm per script, so scripts never see globals of each other
+        init_vm(vm);
+        if (job->function != NULL) job->result = interpret_function(job->function, queue->options, vm);
+        else job->result = interpret_cached(job->source, queue->options, vm);
+        free_vm(vm);
+    }
+    free(vm);
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
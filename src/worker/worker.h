@@ -0,0 +1,18 @@
+#ifndef clox_worker_h
+#define clox_worker_h
+#include "common.h"
+#include "vm/vm.h"
+
+// a script of batch mode
+typedef struct {
+    const char *path;
+    const char *source;
+    // frozen bytecode of source shared by workers, NULL if every worker compiles its own copy
+    FunctionObj *function;
+    InterpreterResult result;
+} Job;
+
+// run @param jobs on a pool of @param worker_cnt threads, each owning its own vm, then report throughput to stderr
+void run_workers(Job *jobs, int job_cnt, int worker_cnt, CompileOptions *options);
+
+#endif // clox_worker_h